@@ -26,6 +26,7 @@
 #include <iostream>
 #endif
 #include <float.h>
+#include <string.h>
 #include "log/log.h"
 #include <malloc.h>
 
@@ -55,46 +56,348 @@ template<typename T> void db_FreeImage(T **im, int h)
   delete [] im;
 }
 
+/*The float response of the vector kernels matches that of the C ones only
+where the C code does its float arithmetic in SSE registers, the default
+ABI on x86-64 alone*/
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define DB_X86_SIMD
+#endif
+
+/*Row kernels of the Harris strength pipeline. The C versions are the
+reference; the SIMD versions compute every term in 32-bit integers exactly
+like them (including the wrap-around of the determinant), so the strength
+is bit-exact*/
+
+/*Products of the derivatives Ix=(p[c-1]-p[c+1])>>1 and Iy=(up[c]-dn[c])>>1*/
+static void db_IxIyRow_C(const unsigned char *up,const unsigned char *p,const unsigned char *dn,
+                         int *ix2,int *iy2,int *ixy,int n)
+{
+    int Ix,Iy;
+
+    for(int c=0;c<n;c++)
+    {
+        Ix=(p[c-1]-p[c+1])>>1;
+        Iy=(up[c]-dn[c])>>1;
+
+        ix2[c]=Ix*Ix;
+        iy2[c]=Iy*Iy;
+        ixy[c]=Ix*Iy;
+    }
+}
+
+/*d = 1 4 6 4 1 filter of the rows r0..r4*/
+static void db_Filter14641V_C(int *d,const int *r0,const int *r1,const int *r2,const int *r3,const int *r4,int n)
+{
+    for(int c=0;c<n;c++)
+        d[c]=r0[c]+(r1[c]<<2)+(r2[c]<<2)+(r2[c]<<1)+(r3[c]<<2)+r4[c];
+}
+
+/*In place horizontal 1 4 6 4 1 filter of g, the output is shifted two steps
+and of length n*/
+static void db_Filter14641H_C(int *g,int n)
+{
+    for(int c=0;c<n;c++)
+        g[c]=g[c]+(g[c+1]<<2)+(g[c+2]<<2)+(g[c+2]<<1)+(g[c+3]<<2)+g[c+4];
+}
+
+static void db_HarrisResponseRow_C(float *s,const int *gxx,const int *gxy,const int *gyy,int n)
+{
+    int Gxx,Gxy,Gyy,det,trc;
+
+    for(int c=0;c<n;c++)
+    {
+        Gxx=gxx[c];
+        Gxy=gxy[c];
+        Gyy=gyy[c];
+
+        det=(Gxx*Gyy-Gxy*Gxy)*SCALE_FACTOR;
+        trc=Gxx+Gyy;
+        s[c]=det-K*trc*trc*SCALE_FACTOR;
+    }
+}
+
+#ifdef DB_X86_SIMD
+
+/*Sign extend the 16-bit lanes of v into two vectors of 32-bit lanes*/
+#define DB_WIDEN16_SSE2(v,lo,hi) \
+    lo=_mm_srai_epi32(_mm_unpacklo_epi16(v,v),16); \
+    hi=_mm_srai_epi32(_mm_unpackhi_epi16(v,v),16);
+
+__attribute__((target("sse2")))
+static void db_IxIyRow_SSE2(const unsigned char *up,const unsigned char *p,const unsigned char *dn,
+                            int *ix2,int *iy2,int *ixy,int n)
+{
+    const __m128i zero=_mm_setzero_si128();
+    int c;
+
+    /*|Ix|,|Iy|<=128 so the products fit in 16 bits*/
+    for(c=0;c+8<=n;c+=8)
+    {
+        __m128i l=_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (p+c-1)),zero);
+        __m128i r=_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (p+c+1)),zero);
+        __m128i u=_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (up+c)),zero);
+        __m128i d=_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (dn+c)),zero);
+        __m128i ix=_mm_srai_epi16(_mm_sub_epi16(l,r),1);
+        __m128i iy=_mm_srai_epi16(_mm_sub_epi16(u,d),1);
+
+        __m128i lo,hi;
+        DB_WIDEN16_SSE2(_mm_mullo_epi16(ix,ix),lo,hi)
+        _mm_storeu_si128((__m128i*) (ix2+c),lo);
+        _mm_storeu_si128((__m128i*) (ix2+c+4),hi);
+        DB_WIDEN16_SSE2(_mm_mullo_epi16(iy,iy),lo,hi)
+        _mm_storeu_si128((__m128i*) (iy2+c),lo);
+        _mm_storeu_si128((__m128i*) (iy2+c+4),hi);
+        DB_WIDEN16_SSE2(_mm_mullo_epi16(ix,iy),lo,hi)
+        _mm_storeu_si128((__m128i*) (ixy+c),lo);
+        _mm_storeu_si128((__m128i*) (ixy+c+4),hi);
+    }
+
+    db_IxIyRow_C(up+c,p+c,dn+c,ix2+c,iy2+c,ixy+c,n-c);
+}
+
+#undef DB_WIDEN16_SSE2
+
+__attribute__((target("sse2")))
+static void db_Filter14641V_SSE2(int *d,const int *r0,const int *r1,const int *r2,const int *r3,const int *r4,int n)
+{
+    int c;
+
+    for(c=0;c+4<=n;c+=4)
+    {
+        __m128i a=_mm_loadu_si128((const __m128i*) (r0+c));
+        __m128i b=_mm_loadu_si128((const __m128i*) (r1+c));
+        __m128i m=_mm_loadu_si128((const __m128i*) (r2+c));
+        __m128i e=_mm_loadu_si128((const __m128i*) (r3+c));
+        __m128i f=_mm_loadu_si128((const __m128i*) (r4+c));
+
+        __m128i sum=_mm_add_epi32(a,f);
+        sum=_mm_add_epi32(sum,_mm_slli_epi32(_mm_add_epi32(_mm_add_epi32(b,e),m),2));
+        sum=_mm_add_epi32(sum,_mm_slli_epi32(m,1));
+        _mm_storeu_si128((__m128i*) (d+c),sum);
+    }
+
+    db_Filter14641V_C(d+c,r0+c,r1+c,r2+c,r3+c,r4+c,n-c);
+}
+
+/*All taps are loaded before the store, and a store only overwrites entries
+the later iterations no longer read*/
+__attribute__((target("sse2")))
+static void db_Filter14641H_SSE2(int *g,int n)
+{
+    int c;
+
+    for(c=0;c+4<=n;c+=4)
+    {
+        __m128i a=_mm_loadu_si128((const __m128i*) (g+c));
+        __m128i b=_mm_loadu_si128((const __m128i*) (g+c+1));
+        __m128i m=_mm_loadu_si128((const __m128i*) (g+c+2));
+        __m128i e=_mm_loadu_si128((const __m128i*) (g+c+3));
+        __m128i f=_mm_loadu_si128((const __m128i*) (g+c+4));
+
+        __m128i sum=_mm_add_epi32(a,f);
+        sum=_mm_add_epi32(sum,_mm_slli_epi32(_mm_add_epi32(_mm_add_epi32(b,e),m),2));
+        sum=_mm_add_epi32(sum,_mm_slli_epi32(m,1));
+        _mm_storeu_si128((__m128i*) (g+c),sum);
+    }
+
+    db_Filter14641H_C(g+c,n-c);
+}
+
+/*Low 32 bits of the products of the 32-bit lanes (pmulld is SSE4.1)*/
+__attribute__((target("sse2")))
+static inline __m128i db_MulLo32_SSE2(__m128i a,__m128i b)
+{
+    __m128i even=_mm_mul_epu32(a,b);
+    __m128i odd=_mm_mul_epu32(_mm_srli_epi64(a,32),_mm_srli_epi64(b,32));
+    return(_mm_unpacklo_epi32(_mm_shuffle_epi32(even,_MM_SHUFFLE(0,0,2,0)),
+                              _mm_shuffle_epi32(odd,_MM_SHUFFLE(0,0,2,0))));
+}
+
+__attribute__((target("sse2")))
+static void db_HarrisResponseRow_SSE2(float *s,const int *gxx,const int *gxy,const int *gyy,int n)
+{
+    const __m128i scale=_mm_set1_epi32(SCALE_FACTOR);
+    const __m128i kscale=_mm_set1_epi32(K*SCALE_FACTOR);
+    int c;
+
+    for(c=0;c+4<=n;c+=4)
+    {
+        __m128i xx=_mm_loadu_si128((const __m128i*) (gxx+c));
+        __m128i xy=_mm_loadu_si128((const __m128i*) (gxy+c));
+        __m128i yy=_mm_loadu_si128((const __m128i*) (gyy+c));
+
+        __m128i det=_mm_sub_epi32(db_MulLo32_SSE2(xx,yy),db_MulLo32_SSE2(xy,xy));
+        __m128i trc=_mm_add_epi32(xx,yy);
+        __m128i r=_mm_sub_epi32(db_MulLo32_SSE2(det,scale),
+                                db_MulLo32_SSE2(db_MulLo32_SSE2(trc,trc),kscale));
+        _mm_storeu_ps(s+c,_mm_cvtepi32_ps(r));
+    }
+
+    db_HarrisResponseRow_C(s+c,gxx+c,gxy+c,gyy+c,n-c);
+}
+
+/*The AVX2 versions hand their tail to the SSE2 ones after clearing the
+upper halves of the ymm registers, avoiding the AVX to SSE transition
+penalty*/
+__attribute__((target("avx2")))
+static void db_IxIyRow_AVX2(const unsigned char *up,const unsigned char *p,const unsigned char *dn,
+                            int *ix2,int *iy2,int *ixy,int n)
+{
+    int c;
+
+    for(c=0;c+16<=n;c+=16)
+    {
+        __m256i l=_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (p+c-1)));
+        __m256i r=_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (p+c+1)));
+        __m256i u=_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (up+c)));
+        __m256i d=_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (dn+c)));
+        __m256i ix=_mm256_srai_epi16(_mm256_sub_epi16(l,r),1);
+        __m256i iy=_mm256_srai_epi16(_mm256_sub_epi16(u,d),1);
+
+        __m256i v=_mm256_mullo_epi16(ix,ix);
+        _mm256_storeu_si256((__m256i*) (ix2+c),_mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)));
+        _mm256_storeu_si256((__m256i*) (ix2+c+8),_mm256_cvtepi16_epi32(_mm256_extracti128_si256(v,1)));
+        v=_mm256_mullo_epi16(iy,iy);
+        _mm256_storeu_si256((__m256i*) (iy2+c),_mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)));
+        _mm256_storeu_si256((__m256i*) (iy2+c+8),_mm256_cvtepi16_epi32(_mm256_extracti128_si256(v,1)));
+        v=_mm256_mullo_epi16(ix,iy);
+        _mm256_storeu_si256((__m256i*) (ixy+c),_mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)));
+        _mm256_storeu_si256((__m256i*) (ixy+c+8),_mm256_cvtepi16_epi32(_mm256_extracti128_si256(v,1)));
+    }
+
+    _mm256_zeroupper();
+    db_IxIyRow_SSE2(up+c,p+c,dn+c,ix2+c,iy2+c,ixy+c,n-c);
+}
+
+__attribute__((target("avx2")))
+static void db_Filter14641V_AVX2(int *d,const int *r0,const int *r1,const int *r2,const int *r3,const int *r4,int n)
+{
+    int c;
+
+    for(c=0;c+8<=n;c+=8)
+    {
+        __m256i a=_mm256_loadu_si256((const __m256i*) (r0+c));
+        __m256i b=_mm256_loadu_si256((const __m256i*) (r1+c));
+        __m256i m=_mm256_loadu_si256((const __m256i*) (r2+c));
+        __m256i e=_mm256_loadu_si256((const __m256i*) (r3+c));
+        __m256i f=_mm256_loadu_si256((const __m256i*) (r4+c));
+
+        __m256i sum=_mm256_add_epi32(a,f);
+        sum=_mm256_add_epi32(sum,_mm256_slli_epi32(_mm256_add_epi32(_mm256_add_epi32(b,e),m),2));
+        sum=_mm256_add_epi32(sum,_mm256_slli_epi32(m,1));
+        _mm256_storeu_si256((__m256i*) (d+c),sum);
+    }
+
+    _mm256_zeroupper();
+    db_Filter14641V_SSE2(d+c,r0+c,r1+c,r2+c,r3+c,r4+c,n-c);
+}
+
+__attribute__((target("avx2")))
+static void db_Filter14641H_AVX2(int *g,int n)
+{
+    int c;
+
+    for(c=0;c+8<=n;c+=8)
+    {
+        __m256i a=_mm256_loadu_si256((const __m256i*) (g+c));
+        __m256i b=_mm256_loadu_si256((const __m256i*) (g+c+1));
+        __m256i m=_mm256_loadu_si256((const __m256i*) (g+c+2));
+        __m256i e=_mm256_loadu_si256((const __m256i*) (g+c+3));
+        __m256i f=_mm256_loadu_si256((const __m256i*) (g+c+4));
+
+        __m256i sum=_mm256_add_epi32(a,f);
+        sum=_mm256_add_epi32(sum,_mm256_slli_epi32(_mm256_add_epi32(_mm256_add_epi32(b,e),m),2));
+        sum=_mm256_add_epi32(sum,_mm256_slli_epi32(m,1));
+        _mm256_storeu_si256((__m256i*) (g+c),sum);
+    }
+
+    _mm256_zeroupper();
+    db_Filter14641H_SSE2(g+c,n-c);
+}
+
+__attribute__((target("avx2")))
+static void db_HarrisResponseRow_AVX2(float *s,const int *gxx,const int *gxy,const int *gyy,int n)
+{
+    const __m256i scale=_mm256_set1_epi32(SCALE_FACTOR);
+    const __m256i kscale=_mm256_set1_epi32(K*SCALE_FACTOR);
+    int c;
+
+    for(c=0;c+8<=n;c+=8)
+    {
+        __m256i xx=_mm256_loadu_si256((const __m256i*) (gxx+c));
+        __m256i xy=_mm256_loadu_si256((const __m256i*) (gxy+c));
+        __m256i yy=_mm256_loadu_si256((const __m256i*) (gyy+c));
+
+        __m256i det=_mm256_sub_epi32(_mm256_mullo_epi32(xx,yy),_mm256_mullo_epi32(xy,xy));
+        __m256i trc=_mm256_add_epi32(xx,yy);
+        __m256i r=_mm256_sub_epi32(_mm256_mullo_epi32(det,scale),
+                                   _mm256_mullo_epi32(_mm256_mullo_epi32(trc,trc),kscale));
+        _mm256_storeu_ps(s+c,_mm256_cvtepi32_ps(r));
+    }
+
+    _mm256_zeroupper();
+    db_HarrisResponseRow_SSE2(s+c,gxx+c,gxy+c,gyy+c,n-c);
+}
+
+#endif /*DB_X86_SIMD*/
+
+/*Row kernels of the Harris strength, selected by CPU features*/
+struct db_HarrisKernels
+{
+    void (*ixIyRow)(const unsigned char *up,const unsigned char *p,const unsigned char *dn,
+                    int *ix2,int *iy2,int *ixy,int n);
+    void (*filter14641V)(int *d,const int *r0,const int *r1,const int *r2,const int *r3,const int *r4,int n);
+    void (*filter14641H)(int *g,int n);
+    void (*harrisResponseRow)(float *s,const int *gxx,const int *gxy,const int *gyy,int n);
+};
+
+static const db_HarrisKernels db_harris_kernels_C=
+    { db_IxIyRow_C,db_Filter14641V_C,db_Filter14641H_C,db_HarrisResponseRow_C };
+#ifdef DB_X86_SIMD
+static const db_HarrisKernels db_harris_kernels_SSE2=
+    { db_IxIyRow_SSE2,db_Filter14641V_SSE2,db_Filter14641H_SSE2,db_HarrisResponseRow_SSE2 };
+static const db_HarrisKernels db_harris_kernels_AVX2=
+    { db_IxIyRow_AVX2,db_Filter14641V_AVX2,db_Filter14641H_AVX2,db_HarrisResponseRow_AVX2 };
+#endif
+
+static const db_HarrisKernels *db_SelectHarrisKernels()
+{
+#ifdef DB_X86_SIMD
+    if(__builtin_cpu_supports("avx2")) return(&db_harris_kernels_AVX2);
+    if(__builtin_cpu_supports("sse2")) return(&db_harris_kernels_SSE2);
+#endif
+    return(&db_harris_kernels_C);
+}
+
 /*Compute derivatives Ix,Iy for a subrow of img with upper left (i,j) and width 128
 Memory references occur one pixel outside the subrow*/
 inline void db_CornerDetector_u::db_IxIyRow_u(const unsigned char * const *img,int i,int j,int nc)
 {
-  int Ix,Iy;
-
-  for(int c = 0; c < nc; c++) {
-    Ix=(img[i][j+c-1]-img[i][j+c+1])>>1;
-    Iy=(img[i-1][j+c]-img[i+1][j+c])>>1;
-
 #ifdef DEBUG
-    m_ix[i][c] = Ix;
-    m_iy[i][c] = Iy;
-#endif
-    m_ix2[i][c] = Ix*Ix;
-    m_iy2[i][c] = Iy*Iy;
-    m_ixy[i][c] = Ix*Iy;
+  for(int c = 0; c < nc; c++) {
+    m_ix[i][c] = (img[i][j+c-1]-img[i][j+c+1])>>1;
+    m_iy[i][c] = (img[i-1][j+c]-img[i+1][j+c])>>1;
   }
+#endif
+  m_kernels->ixIyRow(img[i-1]+j,img[i]+j,img[i+1]+j,m_ix2[i],m_iy2[i],m_ixy[i],nc);
 }
 
 /*Filter vertically five rows of derivatives of length 128 into gxx,gxy,gyy*/
 inline void db_CornerDetector_u::db_gxx_gxy_gyy_row_s(int i, int nc)
 {
-  for(int c = 0; c < nc; c++) {
-    /* Filter vertically */
-    m_gx2[i][c] = m_ix2[i-2][c] + (m_ix2[i-1][c]<<2) + (m_ix2[i][c]<<2) + (m_ix2[i][c]<<1) + (m_ix2[i+1][c]<<2) + m_ix2[i+2][c];
-    m_gxy[i][c] = m_ixy[i-2][c] + (m_ixy[i-1][c]<<2) + (m_ixy[i][c]<<2) + (m_ixy[i][c]<<1) + (m_ixy[i+1][c]<<2) + m_ixy[i+2][c];
-    m_gy2[i][c] = m_iy2[i-2][c] + (m_iy2[i-1][c]<<2) + (m_iy2[i][c]<<2) + (m_iy2[i][c]<<1) + (m_iy2[i+1][c]<<2) + m_iy2[i+2][c];
-  }
+  m_kernels->filter14641V(m_gx2[i],m_ix2[i-2],m_ix2[i-1],m_ix2[i],m_ix2[i+1],m_ix2[i+2],nc);
+  m_kernels->filter14641V(m_gxy[i],m_ixy[i-2],m_ixy[i-1],m_ixy[i],m_ixy[i+1],m_ixy[i+2],nc);
+  m_kernels->filter14641V(m_gy2[i],m_iy2[i-2],m_iy2[i-1],m_iy2[i],m_iy2[i+1],m_iy2[i+2],nc);
 }
 
 /*Filter g of length 128 in place with 14641. Output is shifted two steps
 and of length 124*/
 inline void db_CornerDetector_u::db_Filter14641_128_i(int i, int nc)
 {
-  for(int c = 0; c < nc - 4; c++) {
-    m_gx2[i][c] = m_gx2[i][c] + (m_gx2[i][c+1]<<2) + (m_gx2[i][c+2]<<2) + (m_gx2[i][c+2]<<1) + (m_gx2[i][c+3]<<2) + m_gx2[i][c+4];
-    m_gxy[i][c] = m_gxy[i][c] + (m_gxy[i][c+1]<<2) + (m_gxy[i][c+2]<<2) + (m_gxy[i][c+2]<<1) + (m_gxy[i][c+3]<<2) + m_gxy[i][c+4];
-    m_gy2[i][c] = m_gy2[i][c] + (m_gy2[i][c+1]<<2) + (m_gy2[i][c+2]<<2) + (m_gy2[i][c+2]<<1) + (m_gy2[i][c+3]<<2) + m_gy2[i][c+4];
-  }
+  m_kernels->filter14641H(m_gx2[i],nc-4);
+  m_kernels->filter14641H(m_gxy[i],nc-4);
+  m_kernels->filter14641H(m_gy2[i],nc-4);
 }
 
 /*Filter horizontally the three rows gxx,gxy,gyy of length 128 into the strength subrow s
@@ -102,17 +405,7 @@ of length 124. gxx,gxy and gyy are assumed to be starting at (i,j-2) if s[i][j]
 s should be 16 byte aligned*/
 inline void db_CornerDetector_u::db_HarrisStrength_row_s(float *s, int i, int nc)
 {
-  int Gxx,Gxy,Gyy,det,trc;
-
-  for(int c = 0; c < nc - 4; c++) {
-    Gxx=(int)m_gx2[i][c];
-    Gxy=(int)m_gxy[i][c];
-    Gyy=(int)m_gy2[i][c];
-
-    det=(Gxx*Gyy-Gxy*Gxy)*SCALE_FACTOR;
-    trc=Gxx+Gyy;
-    s[c]=det-K*trc*trc*SCALE_FACTOR;
-  }
+  m_kernels->harrisResponseRow(s,m_gx2[i],m_gxy[i],m_gy2[i],nc-4);
 }
 
 /*Compute the Harris corner strength of the chunk [left,top,left+123,bottom] of img and
@@ -157,6 +450,82 @@ void db_CornerDetector_u::db_HarrisStrength_u(float **s, const unsigned char * c
   db_HarrisStrengthChunk_u(s, img, x, 3, h-4, last);
 }
 
+/*Work shared by the threads of db_HarrisStrengthThreaded_u and
+db_ExtractCornersThreaded. Task t covers the rows first+(last-first+1)*t/nr_tasks
+up to the first row of task t+1, or block t of the extraction*/
+struct db_CornerTask
+{
+    db_CornerDetector_u *cd;
+    const unsigned char * const *img;
+    float **s;
+    int left,nc;
+    int first,last,nr_tasks;
+
+    int x0,y0,x1,y1,nr_bx;
+    float threshold;
+    float *x_coord,*y_coord;
+};
+
+inline void db_TaskRows(const db_CornerTask *t,int task,int &top,int &bottom)
+{
+    int n=t->last-t->first+1;
+    top=t->first+(int)(((long)n*task)/t->nr_tasks);
+    bottom=t->first+(int)(((long)n*(task+1))/t->nr_tasks)-1;
+}
+
+void db_CornerDetector_u::db_IxIyTask(void *arg,int task,int /*thread*/)
+{
+    db_CornerTask *t=(db_CornerTask*) arg;
+    int top,bottom;
+    db_TaskRows(t,task,top,bottom);
+
+    for(int i=top;i<=bottom;i++) t->cd->db_IxIyRow_u(t->img,i,t->left-2,t->nc);
+}
+
+void db_CornerDetector_u::db_HarrisStrengthTask(void *arg,int task,int /*thread*/)
+{
+    db_CornerTask *t=(db_CornerTask*) arg;
+    int top,bottom;
+    db_TaskRows(t,task,top,bottom);
+
+    for(int i=top;i<=bottom;i++)
+    {
+        t->cd->db_gxx_gxy_gyy_row_s(i,t->nc);
+        t->cd->db_Filter14641_128_i(i,t->nc);
+        t->cd->db_HarrisStrength_row_s(t->s[i]+t->left,i,t->nc);
+    }
+}
+
+/*Same as db_HarrisStrength_u, with the rows split across m_pool. The
+derivatives of all rows are computed before any of them is filtered, as the
+filter of a row reads the derivatives two rows up and down*/
+void db_CornerDetector_u::db_HarrisStrengthThreaded_u(float **s,const unsigned char * const *img,int w,int h)
+{
+    int top=3;
+    int bottom=h-4;
+    db_CornerTask t;
+
+    t.cd=this;
+    t.img=img;
+    t.s=s;
+    t.left=3;
+    t.nc=w-4-t.left+1;
+
+    /*Bands of at least 8 rows, a few per thread to even out the load*/
+    t.first=top-2;
+    t.last=bottom+2;
+    t.nr_tasks=db_mini(4*m_pool.GetNrThreads(),db_maxi(1,(t.last-t.first+1)/8));
+    m_pool.Run(t.nr_tasks,db_IxIyTask,&t);
+
+    db_HarrisStrength_row_s(s[top]+t.left,top,t.nc);
+    db_HarrisStrength_row_s(s[top+1]+t.left,top+1,t.nc);
+
+    t.first=top+2;
+    t.last=bottom;
+    t.nr_tasks=db_mini(4*m_pool.GetNrThreads(),db_maxi(1,(t.last-t.first+1)/8));
+    m_pool.Run(t.nr_tasks,db_HarrisStrengthTask,&t);
+}
+
 inline float db_Max_128Aligned16_f(float *v)
 {
 
@@ -395,21 +764,26 @@ inline void db_SubPixel(float **strength, const float xd, const float yd, float
     return;
 }
 
-/*Extract corners from the image part from (left,top) to (right,bottom).
-Store in x and y, extracting at most satnr corners in each block of size (bw,bh).
-The pointer temp_d should point to at least 5*bw*bh positions.
-area_factor holds how many corners max to extract per 10000 pixels*/
-void db_ExtractCornersSaturated(float **strength,int left,int top,int right,int bottom,
-                                int bw,int bh,unsigned long area_factor,
-                                float threshold,float *temp_d,
-                                float *x_coord,float *y_coord,int *nr_corners)
+/*Maximum number of corners extracted from a block of size (bw,bh), see
+db_ExtractCornersFromBlock*/
+inline unsigned long db_BlockSaturation(int left,int top,int right,int bottom,unsigned long area_factor)
+{
+    unsigned long area=(right-left+1)*(bottom-top+1);
+    return((area*area_factor)/10000);
+}
+
+/*Extract the strongest corners of the block (left,top) to (right,bottom), at most
+db_BlockSaturation of them, into x_coord and y_coord and return their number.
+The pointer temp_d should point to at least 5*bw*bh positions*/
+inline int db_ExtractCornersFromBlock(float **strength,int left,int top,int right,int bottom,
+                                      int bw,int bh,unsigned long area_factor,
+                                      float threshold,float *temp_d,
+                                      float *x_coord,float *y_coord)
 {
     float *x_temp,*y_temp,*s_temp,*select_temp;
     float loc_thresh;
-    unsigned long bwbh,area,saturation;
-    int x,next_x,last_x;
-    int y,next_y,last_y;
-    int nr,nr_points,i,stop;
+    unsigned long bwbh,saturation;
+    int nr,nr_points,i;
 
     bwbh=bw*bh;
     x_temp=temp_d;
@@ -417,6 +791,36 @@ void db_ExtractCornersSaturated(float **strength,int left,int top,int right,int
     s_temp=y_temp+bwbh;
     select_temp=s_temp+bwbh;
 
+    saturation=db_BlockSaturation(left,top,right,bottom,area_factor);
+    nr=db_CornersFromChunk(strength,left,top,right,bottom,threshold,x_temp,y_temp,s_temp);
+    nr_points=0;
+    if(nr)
+    {
+        if(((unsigned long)nr)>saturation) loc_thresh=db_LeanQuickSelect(s_temp,nr,nr-saturation,select_temp);
+        else loc_thresh=threshold;
+
+        for(i=0;(i<nr)&&(((unsigned long)nr_points)<saturation);i++)
+        {
+            if(s_temp[i]>=loc_thresh)
+            {
+                #ifdef DB_SUB_PIXEL
+                       db_SubPixel(strength, x_temp[i], y_temp[i], x_coord[nr_points], y_coord[nr_points]);
+                #else
+                       x_coord[nr_points]=x_temp[i];
+                       y_coord[nr_points]=y_temp[i];
+                #endif
+
+                nr_points++;
+            }
+        }
+    }
+    return(nr_points);
+}
+
+/*Region corners are extracted from, given the region (left,top) to (right,bottom)
+asked for*/
+inline void db_CornerRegion(int &left,int &top,int &right,int &bottom)
+{
 #ifdef DB_SUB_PIXEL
     // subpixel processing may sometimes push the corner ourside the real border
     // increasing border size:
@@ -425,6 +829,36 @@ void db_ExtractCornersSaturated(float **strength,int left,int top,int right,int
     bottom--;
     right--;
 #endif /*DB_SUB_PIXEL*/
+}
+
+/*Number of blocks of size (bw,bh) the image part from (left,top) to (right,bottom)
+is split into for corner extraction*/
+inline int db_NrCornerBlocks(int left,int top,int right,int bottom,int bw,int bh,int *nr_bx)
+{
+    db_CornerRegion(left,top,right,bottom);
+    if(right<left || bottom<top)
+    {
+        *nr_bx=0;
+        return(0);
+    }
+    *nr_bx=(right-left+bw)/bw;
+    return((*nr_bx)*((bottom-top+bh)/bh));
+}
+
+/*Extract corners from the image part from (left,top) to (right,bottom).
+Store in x and y, extracting at most satnr corners in each block of size (bw,bh).
+The pointer temp_d should point to at least 5*bw*bh positions.
+area_factor holds how many corners max to extract per 10000 pixels*/
+void db_ExtractCornersSaturated(float **strength,int left,int top,int right,int bottom,
+                                int bw,int bh,unsigned long area_factor,
+                                float threshold,float *temp_d,
+                                float *x_coord,float *y_coord,int *nr_corners)
+{
+    int x,next_x,last_x;
+    int y,next_y,last_y;
+    int nr_points;
+
+    db_CornerRegion(left,top,right,bottom);
 
     nr_points=0;
     for(y=top;y<=bottom;y=next_y)
@@ -438,38 +872,70 @@ void db_ExtractCornersSaturated(float **strength,int left,int top,int right,int
             last_x=next_x-1;
             if(last_x>right) last_x=right;
 
-            area=(last_x-x+1)*(last_y-y+1);
-            saturation=(area*area_factor)/10000;
-            nr=db_CornersFromChunk(strength,x,y,last_x,last_y,threshold,x_temp,y_temp,s_temp);
-            if(nr)
-            {
-                if(((unsigned long)nr)>saturation) loc_thresh=db_LeanQuickSelect(s_temp,nr,nr-saturation,select_temp);
-                else loc_thresh=threshold;
-
-                stop=nr_points+saturation;
-                for(i=0;(i<nr)&&(nr_points<stop);i++)
-                {
-                    if(s_temp[i]>=loc_thresh)
-                    {
-                        #ifdef DB_SUB_PIXEL
-                               db_SubPixel(strength, x_temp[i], y_temp[i], x_coord[nr_points], y_coord[nr_points]);
-                        #else
-                               x_coord[nr_points]=x_temp[i];
-                               y_coord[nr_points]=y_temp[i];
-                        #endif
-
-                        nr_points++;
-                    }
-                }
-            }
+            nr_points+=db_ExtractCornersFromBlock(strength,x,y,last_x,last_y,bw,bh,area_factor,
+                threshold,temp_d,x_coord+nr_points,y_coord+nr_points);
         }
     }
     *nr_corners=nr_points;
 }
 
+void db_CornerDetector_u::db_ExtractBlockTask(void *arg,int task,int thread)
+{
+    db_CornerTask *t=(db_CornerTask*) arg;
+    db_CornerDetector_u *cd=t->cd;
+
+    int x=t->x0+(task%t->nr_bx)*cd->m_bw;
+    int y=t->y0+(task/t->nr_bx)*cd->m_bh;
+    int last_x=db_mini(x+cd->m_bw-1,t->x1);
+    int last_y=db_mini(y+cd->m_bh-1,t->y1);
+    int offset=cd->m_block_offset[task];
+
+    cd->m_block_nr[task]=db_ExtractCornersFromBlock(t->s,x,y,last_x,last_y,cd->m_bw,cd->m_bh,
+        cd->m_area_factor,t->threshold,cd->m_temp_d+5*cd->m_bw*cd->m_bh*thread,
+        t->x_coord+offset,t->y_coord+offset);
+}
+
+/*Same as db_ExtractCornersSaturated over the image part DetectCorners uses,
+with the blocks split across m_pool. Each block stores its corners at an
+offset it cannot overflow, and the blocks are then compacted in the order
+db_ExtractCornersSaturated visits them*/
+void db_CornerDetector_u::db_ExtractCornersThreaded(float **strength,float threshold,
+                                                   float *x_coord,float *y_coord,int *nr_corners)
+{
+    db_CornerTask t;
+    int b,nr_points;
+
+    t.cd=this;
+    t.s=strength;
+    t.threshold=threshold;
+    t.x_coord=x_coord;
+    t.y_coord=y_coord;
+    t.x0=BORDER;
+    t.y0=BORDER;
+    t.x1=m_w-BORDER-1;
+    t.y1=m_h-BORDER-1;
+    db_CornerRegion(t.x0,t.y0,t.x1,t.y1);
+    db_NrCornerBlocks(BORDER,BORDER,m_w-BORDER-1,m_h-BORDER-1,m_bw,m_bh,&t.nr_bx);
+
+    m_pool.Run(m_nr_blocks,db_ExtractBlockTask,&t);
+
+    nr_points=0;
+    for(b=0;b<m_nr_blocks;b++)
+    {
+        if(m_block_offset[b]!=nr_points)
+        {
+            memmove(x_coord+nr_points,x_coord+m_block_offset[b],m_block_nr[b]*sizeof(float));
+            memmove(y_coord+nr_points,y_coord+m_block_offset[b],m_block_nr[b]*sizeof(float));
+        }
+        nr_points+=m_block_nr[b];
+    }
+    *nr_corners=nr_points;
+}
+
 db_CornerDetector_u::db_CornerDetector_u()
 {
     m_w=0; m_h=0;
+    m_kernels=db_SelectHarrisKernels();
 }
 
 db_CornerDetector_u::~db_CornerDetector_u()
@@ -479,6 +945,9 @@ db_CornerDetector_u::~db_CornerDetector_u()
 
 db_CornerDetector_u::db_CornerDetector_u(const db_CornerDetector_u& cd)
 {
+    m_w=0; m_h=0;
+    m_kernels=db_SelectHarrisKernels();
+    m_pool.SetNrThreads(cd.m_pool.GetNrThreads());
     Start(cd.m_w, cd.m_h, cd.m_bw, cd.m_bh, cd.m_area_factor,
         cd.m_a_thresh, cd.m_r_thresh);
 }
@@ -489,17 +958,33 @@ db_CornerDetector_u& db_CornerDetector_u::operator=(const db_CornerDetector_u& c
 
     Clean();
 
+    m_pool.SetNrThreads(cd.m_pool.GetNrThreads());
     Start(cd.m_w, cd.m_h, cd.m_bw, cd.m_bh, cd.m_area_factor,
         cd.m_a_thresh, cd.m_r_thresh);
 
     return *this;
 }
 
+void db_CornerDetector_u::SetNrThreads(int nr_threads)
+{
+    int old_nr_threads=m_pool.GetNrThreads();
+    m_pool.SetNrThreads(nr_threads);
+
+    /*Scratch is per thread*/
+    if(m_w!=0 && m_pool.GetNrThreads()!=old_nr_threads)
+    {
+        delete [] m_temp_d;
+        m_temp_d=new float[5*m_bw*m_bh*m_pool.GetNrThreads()];
+    }
+}
+
 void db_CornerDetector_u::Clean()
 {
     if(m_w!=0)
     {
         delete [] m_temp_d;
+        delete [] m_block_offset;
+        delete [] m_block_nr;
         db_FreeImage(m_strength, m_h);
 #ifdef DEBUG
 	db_FreeImage(m_ix, m_h);
@@ -550,7 +1035,23 @@ unsigned long db_CornerDetector_u::Start(int im_width,int im_height,
     m_a_thresh=absolute_threshold;
     m_max_nr=db_maxl(1,1+(m_w*m_h*m_area_factor)/10000);
 
-    m_temp_d=new float[5*m_bw*m_bh];
+    m_temp_d=new float[5*m_bw*m_bh*m_pool.GetNrThreads()];
+
+    /*Corners of block b go to m_block_offset[b], after the most the earlier
+    blocks can hold. These add up to at most m_max_nr*/
+    int x0=BORDER,y0=BORDER,x1=m_w-BORDER-1,y1=m_h-BORDER-1,nr_bx;
+    m_nr_blocks=db_NrCornerBlocks(x0,y0,x1,y1,m_bw,m_bh,&nr_bx);
+    m_block_offset=new int[db_maxi(1,m_nr_blocks)];
+    m_block_nr=new int[db_maxi(1,m_nr_blocks)];
+    db_CornerRegion(x0,y0,x1,y1);
+    unsigned long offset=0;
+    for(int b=0;b<m_nr_blocks;b++)
+    {
+        int x=x0+(b%nr_bx)*m_bw;
+        int y=y0+(b/nr_bx)*m_bh;
+        m_block_offset[b]=(int) offset;
+        offset+=db_BlockSaturation(x,y,db_mini(x+m_bw-1,x1),db_mini(y+m_bh-1,y1),m_area_factor);
+    }
     m_strength = db_AllocImage<float>(m_w, m_h);
 #ifdef DEBUG
     m_ix = db_AllocImage<int>(m_w, m_h);
@@ -571,7 +1072,8 @@ void db_CornerDetector_u::DetectCorners(const unsigned char * const *img,float *
 {
     float max_val,threshold;
 
-    db_HarrisStrength_u(m_strength,img,m_w,m_h);
+    if(m_pool.GetNrThreads()>1) db_HarrisStrengthThreaded_u(m_strength,img,m_w,m_h);
+    else db_HarrisStrength_u(m_strength,img,m_w,m_h);
 
 
     if(m_r_thresh)
@@ -581,7 +1083,8 @@ void db_CornerDetector_u::DetectCorners(const unsigned char * const *img,float *
     }
     else threshold= (float) m_a_thresh;
 
-    db_ExtractCornersSaturated(m_strength,BORDER,BORDER,m_w-BORDER-1,m_h-BORDER-1,m_bw,m_bh,m_area_factor,threshold*SCALE_FACTOR,
+    if(m_pool.GetNrThreads()>1) db_ExtractCornersThreaded(m_strength,threshold*SCALE_FACTOR,x_coord,y_coord,nr_corners);
+    else db_ExtractCornersSaturated(m_strength,BORDER,BORDER,m_w-BORDER-1,m_h-BORDER-1,m_bw,m_bh,m_area_factor,threshold*SCALE_FACTOR,
         m_temp_d,x_coord,y_coord,nr_corners);
 
     LOGV("Detected corners: %d", *nr_corners);
@@ -27,8 +27,11 @@
  */
 #include "db_utilities.h"
 #include "db_utilities_constants.h"
+#include "db_utilities_threads.h"
 #include <stdlib.h> //for NULL
 
+struct db_HarrisKernels;
+
 /*!
  * \class db_CornerDetector_u
  * \ingroup FeatureDetection
@@ -91,6 +94,13 @@ public:
      Set relative feature threshold
      */
     virtual void SetRelativeThreshold(float r_thresh) { m_r_thresh = r_thresh; };
+    /*!
+     Set the number of threads DetectCorners() splits the strength computation
+     and the extraction of the corner blocks across. 1 (default) runs on the
+     calling thread, 0 uses one thread per online CPU. The corners detected
+     do not depend on it.
+     */
+    virtual void SetNrThreads(int nr_threads);
 
     /*!
      Extract corners from a pre-computed strength image.
@@ -120,13 +130,32 @@ protected:
     inline void db_HarrisStrength_row_s(float *s, int i, int nc);
     inline void db_Filter14641_128_i(int i, int nc);
 
+    void db_HarrisStrengthThreaded_u(float **s, const unsigned char * const *img,
+                     int w, int h);
+    void db_ExtractCornersThreaded(float **strength, float threshold,
+                   float *x_coord, float *y_coord, int *nr_corners);
+    static void db_IxIyTask(void *arg, int task, int thread);
+    static void db_HarrisStrengthTask(void *arg, int task, int thread);
+    static void db_ExtractBlockTask(void *arg, int task, int thread);
+
+    /*Row kernels for this CPU*/
+    const db_HarrisKernels *m_kernels;
+
     int m_w, m_h, m_bw, m_bh;
     /*Area factor holds the maximum number of corners to detect
     per 10000 pixels*/
     unsigned long m_area_factor,m_max_nr;
     float m_a_thresh,m_r_thresh;
+    /*Scratch of 5*m_bw*m_bh floats per thread*/
     float *m_temp_d;
 
+    /*Threads and, for each corner block, where its corners are stored
+    before they are compacted in block order*/
+    db_ThreadPool m_pool;
+    int m_nr_blocks;
+    int *m_block_offset;
+    int *m_block_nr;
+
 #ifdef DEBUG
     int **m_ix;
     int **m_iy;
@@ -26,12 +26,10 @@
 #include <iostream>
 #endif
 
-
-int AffineWarpPoint_NN_LUT_x[11][11];
-int AffineWarpPoint_NN_LUT_y[11][11];
-
-float AffineWarpPoint_BL_LUT_x[11][11];
-float AffineWarpPoint_BL_LUT_y[11][11];
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define DB_X86_SIMD
+#endif
 
 
 inline float db_SignedSquareNormCorr7x7_u(unsigned char **f_img,unsigned char **g_img,int x_f,int y_f,int x_g,int y_g)
@@ -1132,12 +1130,13 @@ void AffineWarpPointOffset(float &r_w,float &c_w,float Hinv[9],int r,int c)
 Prewarp the patches with given affine transform. For a given homogeneous point "x", "H*x" is
 the warped point and for any displacement "d" in the warped image resulting in point "y", the
 corresponding point in the original image is given by "Hinv*y", which can be simplified for affine H.
+The displacements "Hinv*y" of the patch samples are read from lut.
 If "affine" is 1, then nearest neighbor method is used, else if it is 2, then
 bilinear method is used.
  */
 inline void db_SignedSquareNormCorr11x11_PreAlign_AffinePatchWarp_u(short *patch,const unsigned char * const *f_img,
                                                                     int xi,int yi,float *sum,float *recip,
-                                                                    const float Hinv[9],int affine)
+                                                                    const db_AffineWarpLUT_u *lut,int affine)
 {
     float den;
     short f;
@@ -1150,7 +1149,7 @@ inline void db_SignedSquareNormCorr11x11_PreAlign_AffinePatchWarp_u(short *patch
     {
         for (int r=0;r<11;r++){
             for (int c=0;c<11;c++){
-                f=f_img[yi+AffineWarpPoint_NN_LUT_y[r][c]][xi+AffineWarpPoint_NN_LUT_x[r][c]];
+                f=f_img[yi+lut->nn_y[r][c]][xi+lut->nn_x[r][c]];
                 f2sum+=f*f;
                 fsum+=f;
                 (*patch++)=f;
@@ -1161,8 +1160,8 @@ inline void db_SignedSquareNormCorr11x11_PreAlign_AffinePatchWarp_u(short *patch
     {
         for (int r=0;r<11;r++){
             for (int c=0;c<11;c++){
-                f=db_BilinearInterpolation(yi+AffineWarpPoint_BL_LUT_y[r][c]
-                ,xi+AffineWarpPoint_BL_LUT_x[r][c],f_img);
+                f=db_BilinearInterpolation(yi+lut->bl_y[r][c]
+                ,xi+lut->bl_x[r][c],f_img);
                 f2sum+=f*f;
                 fsum+=f;
                 (*patch++)=f;
@@ -1263,11 +1262,156 @@ inline float db_SignedSquareNormCorr11x11_Post_u(unsigned char **f_img,unsigned
     return(-fg_corr*fg_corr*f_recip_g_recip);
 }
 
+/*Dot products of the patch layouts. The layouts are padded with zeros to a
+multiple of 16 shorts (32, 128 or 512), the products are exact in 32 bits
+so all versions give the same sums. Only 4-byte alignment is guaranteed for
+the 5x5 layouts, so the loads are unaligned*/
+static int db_PatchDot_C(const short *f,const short *g,int len)
+{
+    int back=0;
+    for(int i=0;i<len;i++) back+=f[i]*g[i];
+    return(back);
+}
+
+/*Dot products of f with each of the nr patches g[i]*/
+static void db_PatchDotBatch_C(int *fg,const short *f,const short * const *g,int nr,int len)
+{
+    for(int i=0;i<nr;i++) fg[i]=db_PatchDot_C(f,g[i],len);
+}
+
+#ifdef DB_X86_SIMD
+
+__attribute__((target("sse2")))
+static inline int db_HorizontalSum_SSE2(__m128i v)
+{
+    v=_mm_add_epi32(v,_mm_shuffle_epi32(v,_MM_SHUFFLE(1,0,3,2)));
+    v=_mm_add_epi32(v,_mm_shuffle_epi32(v,_MM_SHUFFLE(2,3,0,1)));
+    return(_mm_cvtsi128_si32(v));
+}
+
+__attribute__((target("sse2")))
+static int db_PatchDot_SSE2(const short *f,const short *g,int len)
+{
+    __m128i acc0=_mm_setzero_si128(),acc1=_mm_setzero_si128();
+
+    for(int i=0;i<len;i+=16)
+    {
+        acc0=_mm_add_epi32(acc0,_mm_madd_epi16(_mm_loadu_si128((const __m128i*) (f+i)),_mm_loadu_si128((const __m128i*) (g+i))));
+        acc1=_mm_add_epi32(acc1,_mm_madd_epi16(_mm_loadu_si128((const __m128i*) (f+i+8)),_mm_loadu_si128((const __m128i*) (g+i+8))));
+    }
+    return(db_HorizontalSum_SSE2(_mm_add_epi32(acc0,acc1)));
+}
+
+/*Two candidates per pass share the loads of f*/
+__attribute__((target("sse2")))
+static void db_PatchDotBatch_SSE2(int *fg,const short *f,const short * const *g,int nr,int len)
+{
+    int i;
+
+    for(i=0;i+2<=nr;i+=2)
+    {
+        const short *g0=g[i],*g1=g[i+1];
+        __m128i acc0=_mm_setzero_si128(),acc1=_mm_setzero_si128();
+
+        for(int k=0;k<len;k+=8)
+        {
+            __m128i vf=_mm_loadu_si128((const __m128i*) (f+k));
+            acc0=_mm_add_epi32(acc0,_mm_madd_epi16(vf,_mm_loadu_si128((const __m128i*) (g0+k))));
+            acc1=_mm_add_epi32(acc1,_mm_madd_epi16(vf,_mm_loadu_si128((const __m128i*) (g1+k))));
+        }
+        fg[i]=db_HorizontalSum_SSE2(acc0);
+        fg[i+1]=db_HorizontalSum_SSE2(acc1);
+    }
+    if(i<nr) fg[i]=db_PatchDot_SSE2(f,g[i],len);
+}
+
+__attribute__((target("avx2")))
+static inline int db_HorizontalSum_AVX2(__m256i v)
+{
+    __m128i h=_mm_add_epi32(_mm256_castsi256_si128(v),_mm256_extracti128_si256(v,1));
+    h=_mm_add_epi32(h,_mm_shuffle_epi32(h,_MM_SHUFFLE(1,0,3,2)));
+    h=_mm_add_epi32(h,_mm_shuffle_epi32(h,_MM_SHUFFLE(2,3,0,1)));
+    return(_mm_cvtsi128_si32(h));
+}
+
+__attribute__((target("avx2")))
+static int db_PatchDot_AVX2(const short *f,const short *g,int len)
+{
+    __m256i acc0=_mm256_setzero_si256(),acc1=_mm256_setzero_si256();
+    int i;
+
+    for(i=0;i+32<=len;i+=32)
+    {
+        acc0=_mm256_add_epi32(acc0,_mm256_madd_epi16(_mm256_loadu_si256((const __m256i*) (f+i)),_mm256_loadu_si256((const __m256i*) (g+i))));
+        acc1=_mm256_add_epi32(acc1,_mm256_madd_epi16(_mm256_loadu_si256((const __m256i*) (f+i+16)),_mm256_loadu_si256((const __m256i*) (g+i+16))));
+    }
+    if(i<len)
+        acc0=_mm256_add_epi32(acc0,_mm256_madd_epi16(_mm256_loadu_si256((const __m256i*) (f+i)),_mm256_loadu_si256((const __m256i*) (g+i))));
+
+    int back=db_HorizontalSum_AVX2(_mm256_add_epi32(acc0,acc1));
+    _mm256_zeroupper();
+    return(back);
+}
+
+__attribute__((target("avx2")))
+static void db_PatchDotBatch_AVX2(int *fg,const short *f,const short * const *g,int nr,int len)
+{
+    int i;
+
+    for(i=0;i+2<=nr;i+=2)
+    {
+        const short *g0=g[i],*g1=g[i+1];
+        __m256i acc0=_mm256_setzero_si256(),acc1=_mm256_setzero_si256();
+
+        for(int k=0;k<len;k+=16)
+        {
+            __m256i vf=_mm256_loadu_si256((const __m256i*) (f+k));
+            acc0=_mm256_add_epi32(acc0,_mm256_madd_epi16(vf,_mm256_loadu_si256((const __m256i*) (g0+k))));
+            acc1=_mm256_add_epi32(acc1,_mm256_madd_epi16(vf,_mm256_loadu_si256((const __m256i*) (g1+k))));
+        }
+        fg[i]=db_HorizontalSum_AVX2(acc0);
+        fg[i+1]=db_HorizontalSum_AVX2(acc1);
+    }
+    _mm256_zeroupper();
+    if(i<nr) fg[i]=db_PatchDot_AVX2(f,g[i],len);
+}
+
+#endif /*DB_X86_SIMD*/
+
+/*Patch dot product kernels, selected by CPU features*/
+struct db_PatchDotKernels
+{
+    int (*dot)(const short *f,const short *g,int len);
+    void (*dotBatch)(int *fg,const short *f,const short * const *g,int nr,int len);
+};
+
+static const db_PatchDotKernels db_patch_dot_kernels_C=
+    { db_PatchDot_C,db_PatchDotBatch_C };
+#ifdef DB_X86_SIMD
+static const db_PatchDotKernels db_patch_dot_kernels_SSE2=
+    { db_PatchDot_SSE2,db_PatchDotBatch_SSE2 };
+static const db_PatchDotKernels db_patch_dot_kernels_AVX2=
+    { db_PatchDot_AVX2,db_PatchDotBatch_AVX2 };
+#endif
+
+static const db_PatchDotKernels *db_SelectPatchDotKernels()
+{
+#ifdef DB_X86_SIMD
+    /*May run before the constructors of libgcc*/
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return(&db_patch_dot_kernels_AVX2);
+    if(__builtin_cpu_supports("sse2")) return(&db_patch_dot_kernels_SSE2);
+#endif
+    return(&db_patch_dot_kernels_C);
+}
+
+static const db_PatchDotKernels *db_patch_dot_kernels=db_SelectPatchDotKernels();
+
 float db_SignedSquareNormCorr21x21Aligned_Post_s(const short *f_patch,const short *g_patch,float fsum_gsum,float f_recip_g_recip)
 {
     float fgsum,fg_corr;
 
-    fgsum= (float) db_ScalarProduct512_s(f_patch,g_patch);
+    fgsum= (float) db_patch_dot_kernels->dot(f_patch,g_patch,512);
 
     fg_corr=441.0f*fgsum-fsum_gsum;
     if(fg_corr>=0.0) return(fg_corr*fg_corr*f_recip_g_recip);
@@ -1279,7 +1423,7 @@ float db_SignedSquareNormCorr11x11Aligned_Post_s(const short *f_patch,const shor
 {
     float fgsum,fg_corr;
 
-    fgsum= (float) db_ScalarProduct128_s(f_patch,g_patch);
+    fgsum= (float) db_patch_dot_kernels->dot(f_patch,g_patch,128);
 
     fg_corr=121.0f*fgsum-fsum_gsum;
     if(fg_corr>=0.0) return(fg_corr*fg_corr*f_recip_g_recip);
@@ -1290,13 +1434,56 @@ float db_SignedSquareNormCorr5x5Aligned_Post_s(const short *f_patch,const short
 {
     float fgsum,fg_corr;
 
-    fgsum= (float) db_ScalarProduct32_s(f_patch,g_patch);
+    fgsum= (float) db_patch_dot_kernels->dot(f_patch,g_patch,32);
 
     fg_corr=25.0f*fgsum-fsum_gsum;
     if(fg_corr>=0.0) return(fg_corr*fg_corr*f_recip_g_recip);
     return(-fg_corr*fg_corr*f_recip_g_recip);
 }
 
+/*Batched *_Post_s: score pir_l against the nr points pir_r[i], n is the
+number of pixels of the patch and len the length of its layout*/
+static void db_SignedSquareNormCorrAlignedBatch_Post_s(float *scores,const db_PointInfo_u *pir_l,
+                                                      const db_PointInfo_u * const *pir_r,int nr,int len,float n)
+{
+    const short *g_patch[DB_MATCH_BATCH];
+    int fg[DB_MATCH_BATCH];
+    int i,m;
+    float fgsum,fg_corr,fsum_gsum,f_recip_g_recip;
+
+    for(;nr>0;nr-=m,pir_r+=m,scores+=m)
+    {
+        m=db_mini(nr,DB_MATCH_BATCH);
+        for(i=0;i<m;i++) g_patch[i]=pir_r[i]->patch;
+        db_patch_dot_kernels->dotBatch(fg,pir_l->patch,g_patch,m,len);
+
+        for(i=0;i<m;i++)
+        {
+            fsum_gsum=(pir_l->sum)*(pir_r[i]->sum);
+            f_recip_g_recip=(pir_l->recip)*(pir_r[i]->recip);
+            fgsum= (float) fg[i];
+            fg_corr=n*fgsum-fsum_gsum;
+            if(fg_corr>=0.0) scores[i]=fg_corr*fg_corr*f_recip_g_recip;
+            else scores[i]= -fg_corr*fg_corr*f_recip_g_recip;
+        }
+    }
+}
+
+void db_SignedSquareNormCorr21x21AlignedBatch_Post_s(float *scores,const db_PointInfo_u *pir_l,const db_PointInfo_u * const *pir_r,int nr)
+{
+    db_SignedSquareNormCorrAlignedBatch_Post_s(scores,pir_l,pir_r,nr,512,441.0f);
+}
+
+void db_SignedSquareNormCorr11x11AlignedBatch_Post_s(float *scores,const db_PointInfo_u *pir_l,const db_PointInfo_u * const *pir_r,int nr)
+{
+    db_SignedSquareNormCorrAlignedBatch_Post_s(scores,pir_l,pir_r,nr,128,121.0f);
+}
+
+void db_SignedSquareNormCorr5x5AlignedBatch_Post_s(float *scores,const db_PointInfo_u *pir_l,const db_PointInfo_u * const *pir_r,int nr)
+{
+    db_SignedSquareNormCorrAlignedBatch_Post_s(scores,pir_l,pir_r,nr,32,25.0f);
+}
+
 
 inline float db_SignedSquareNormCorr15x15_u(unsigned char **f_img,unsigned char **g_img,int x_f,int y_f,int x_g,int y_g)
 {
@@ -1710,7 +1897,7 @@ short* db_FillBucketsPrewarped_u(short *patch_space,const unsigned char * const
 
 short* db_FillBucketsPrewarpedAffine_u(short *patch_space,const unsigned char * const *f_img,db_Bucket_u **bp,
                                  int bw,int bh,int nr_h,int nr_v,int bd,const float *x,const float *y,
-                                 int nr_corners,const float H[9],const float Hinv[9],const int warpboundsp[4],
+                                 int nr_corners,const float H[9],const db_AffineWarpLUT_u *lut,const int warpboundsp[4],
                                  int affine)
 {
     int i,xi,yi,xpos,ypos,nr,wxi,wyi;
@@ -1750,7 +1937,7 @@ short* db_FillBucketsPrewarpedAffine_u(short *patch_space,const unsigned char *
                     pir->patch=patch_space;
                     br->nr=nr+1;
 
-                    db_SignedSquareNormCorr11x11_PreAlign_AffinePatchWarp_u(patch_space,f_img,xi,yi,&(pir->sum),&(pir->recip),Hinv,affine);
+                    db_SignedSquareNormCorr11x11_PreAlign_AffinePatchWarp_u(patch_space,f_img,xi,yi,&(pir->sum),&(pir->recip),lut,affine);
                     patch_space+=128;
                 }
             }
@@ -1759,76 +1946,87 @@ short* db_FillBucketsPrewarpedAffine_u(short *patch_space,const unsigned char *
     return(patch_space);
 }
 
-inline void db_MatchPointPair_u(db_PointInfo_u *pir_l,db_PointInfo_u *pir_r,
-                            unsigned long kA,unsigned long kB, unsigned int rect_window,bool use_smaller_matching_window, int use_21)
+/*Check if a candidate pair is within the disparity window*/
+inline bool db_MatchWindow_u(const db_PointInfo_u *pir_l,const db_PointInfo_u *pir_r,
+                            unsigned long kA,unsigned long kB, unsigned int rect_window)
 {
     int xm,ym;
-    float score;
-    bool compute_score;
-
 
     if( rect_window )
-        compute_score = ((unsigned)db_absi(pir_l->x - pir_r->x)<kA && (unsigned)db_absi(pir_l->y - pir_r->y)<kB);
-    else
-    {   /*Check if disparity is within the maximum disparity
-        with the formula xm^2*256+ym^2*kA<kB
-        where kA=256*w^2/h^2
-        and   kB=256*max_disp^2*w^2*/
-        xm= pir_l->x - pir_r->x;
-        ym= pir_l->y - pir_r->y;
-        compute_score = ((xm*xm)<<8)+ym*ym*kA < kB;
-    }
+        return((unsigned)db_absi(pir_l->x - pir_r->x)<kA && (unsigned)db_absi(pir_l->y - pir_r->y)<kB);
+
+    /*Check if disparity is within the maximum disparity
+    with the formula xm^2*256+ym^2*kA<kB
+    where kA=256*w^2/h^2
+    and   kB=256*max_disp^2*w^2*/
+    xm= pir_l->x - pir_r->x;
+    ym= pir_l->y - pir_r->y;
+    return(((xm*xm)<<8)+ym*ym*kA < kB);
+}
+
+/*Score pir_l against the points of b_r from *p_r on that are within the
+disparity window, at most DB_MATCH_BATCH of them. Their indices in b_r go to
+idx and their scores to score. Return how many were scored and advance *p_r
+past the points looked at*/
+inline int db_MatchPointAgainstBucketBatch_u(float *score,int *idx,int *p_r,const db_PointInfo_u *pir_l,const db_Bucket_u *b_r,
+                                       unsigned long kA,unsigned long kB,int rect_window, bool use_smaller_matching_window, int use_21)
+{
+    const db_PointInfo_u *cand[DB_MATCH_BATCH];
+    const db_PointInfo_u *pir_r=b_r->ptr;
+    int i,m,nr;
 
-    if ( compute_score )
+    nr=b_r->nr;
+    for(i= *p_r,m=0;i<nr && m<DB_MATCH_BATCH;i++)
     {
-        if(use_21)
+        if(db_MatchWindow_u(pir_l,pir_r+i,kA,kB,rect_window))
         {
-            score=db_SignedSquareNormCorr21x21Aligned_Post_s(pir_l->patch,pir_r->patch,
-                (pir_l->sum)*(pir_r->sum),
-                (pir_l->recip)*(pir_r->recip));
-        }
-        else
-        {
-        /*Correlate*/
-        if(!use_smaller_matching_window)
-        {
-            score=db_SignedSquareNormCorr11x11Aligned_Post_s(pir_l->patch,pir_r->patch,
-                (pir_l->sum)*(pir_r->sum),
-                (pir_l->recip)*(pir_r->recip));
-        }
-        else
-        {
-            score=db_SignedSquareNormCorr5x5Aligned_Post_s(pir_l->patch,pir_r->patch,
-                (pir_l->sum)*(pir_r->sum),
-                (pir_l->recip)*(pir_r->recip));
-        }
+            idx[m]=i;
+            cand[m]=pir_r+i;
+            m++;
         }
+    }
+    *p_r=i;
 
-        if((!(pir_l->pir)) || (score>pir_l->s))
-        {
-            /*Update left corner*/
-            pir_l->s=score;
-            pir_l->pir=pir_r;
-        }
-        if((!(pir_r->pir)) || (score>pir_r->s))
-        {
-            /*Update right corner*/
-            pir_r->s=score;
-            pir_r->pir=pir_l;
-        }
+    if(m)
+    {
+        if(use_21)
+            db_SignedSquareNormCorr21x21AlignedBatch_Post_s(score,pir_l,cand,m);
+        else if(!use_smaller_matching_window)
+            db_SignedSquareNormCorr11x11AlignedBatch_Post_s(score,pir_l,cand,m);
+        else
+            db_SignedSquareNormCorr5x5AlignedBatch_Post_s(score,pir_l,cand,m);
     }
+    return(m);
 }
 
 inline void db_MatchPointAgainstBucket_u(db_PointInfo_u *pir_l,db_Bucket_u *b_r,
                                        unsigned long kA,unsigned long kB,int rect_window, bool use_smaller_matching_window, int use_21)
 {
-    int p_r,nr;
+    int p_r,m,k;
+    int idx[DB_MATCH_BATCH];
+    float score[DB_MATCH_BATCH];
     db_PointInfo_u *pir_r;
 
-    nr=b_r->nr;
-    pir_r=b_r->ptr;
-
-    for(p_r=0;p_r<nr;p_r++) db_MatchPointPair_u(pir_l,pir_r+p_r,kA,kB, rect_window, use_smaller_matching_window, use_21);
+    for(p_r=0;p_r<b_r->nr;)
+    {
+        m=db_MatchPointAgainstBucketBatch_u(score,idx,&p_r,pir_l,b_r,kA,kB,rect_window,use_smaller_matching_window,use_21);
+        for(k=0;k<m;k++)
+        {
+            pir_r=b_r->ptr+idx[k];
+            if((!(pir_l->pir)) || (score[k]>pir_l->s))
+            {
+                /*Update left corner*/
+                pir_l->s=score[k];
+                pir_l->pir=pir_r;
+            }
+            if((!(pir_r->pir)) || (score[k]>pir_r->s))
+            {
+                /*Update right corner*/
+                pir_r->s=score[k];
+                pir_r->pir=pir_l;
+            }
+        }
+    }
 }
 
 void db_MatchBuckets_u(db_Bucket_u **bp_l,db_Bucket_u **bp_r,int nr_h,int nr_v,
@@ -1858,7 +2056,87 @@ void db_MatchBuckets_u(db_Bucket_u **bp_l,db_Bucket_u **bp_r,int nr_h,int nr_v,
     }
 }
 
-void db_CollectMatches_u(db_Bucket_u **bp_l,int nr_h,int nr_v,unsigned long target,int *id_l,int *id_r,int *nr_matches)
+struct db_RightMatch_u
+{
+    float s;
+    db_PointInfo_u *pir;
+};
+
+/*Threaded db_MatchBuckets_u(). Each task scores one row of left buckets. The
+left points of the row are only touched by that task, the right points are
+shared with the rows above and below, so a task records the best left
+candidate of each right point in its own slice of right_best (one entry per
+right point of the three bucket rows it looks at). The slices are then folded
+into the right points in row order, which gives the same winners, ties
+included, as the serial scan*/
+struct db_MatchBucketsTask_u
+{
+    db_Bucket_u **bp_l;
+    db_Bucket_u **bp_r;
+    int nr_h,bd;
+    unsigned long kA,kB;
+    int rect_window;
+    bool use_smaller_matching_window;
+    int use_21;
+    db_RightMatch_u *right_best;
+
+    static void Run(void *arg,int task,int thread);
+};
+
+inline int db_RightMatchRowSize_u(int nr_h,int bd)
+{
+    return(3*(nr_h+2)*bd);
+}
+
+void db_MatchBucketsTask_u::Run(void *arg,int task,int /*thread*/)
+{
+    const db_MatchBucketsTask_u *t=(const db_MatchBucketsTask_u*) arg;
+    int i,j,k,a,b,p_r,br_nr,m,q;
+    int row_size=db_RightMatchRowSize_u(t->nr_h,t->bd);
+    int idx[DB_MATCH_BATCH];
+    float score[DB_MATCH_BATCH];
+    db_Bucket_u *br,*b_r;
+    db_PointInfo_u *pir_l;
+    db_RightMatch_u *best,*rm;
+
+    i=task;
+    best=t->right_best+i*row_size;
+    for(k=0;k<row_size;k++) best[k].pir=0;
+
+    for(j=0;j<t->nr_h;j++)
+    {
+        br=&t->bp_l[i][j];
+        br_nr=br->nr;
+        for(k=0;k<br_nr;k++)
+        {
+            pir_l=br->ptr+k;
+            for(a=i-1;a<=i+1;a++) for(b=j-1;b<=j+1;b++)
+            {
+                b_r=&t->bp_r[a][b];
+                rm=best+((a-i+1)*(t->nr_h+2)+b+1)*t->bd;
+                for(p_r=0;p_r<b_r->nr;)
+                {
+                    m=db_MatchPointAgainstBucketBatch_u(score,idx,&p_r,pir_l,b_r,t->kA,t->kB,t->rect_window,t->use_smaller_matching_window,t->use_21);
+                    for(q=0;q<m;q++)
+                    {
+                        if((!(pir_l->pir)) || (score[q]>pir_l->s))
+                        {
+                            pir_l->s=score[q];
+                            pir_l->pir=b_r->ptr+idx[q];
+                        }
+                        if((!(rm[idx[q]].pir)) || (score[q]>rm[idx[q]].s))
+                        {
+                            rm[idx[q]].s=score[q];
+                            rm[idx[q]].pir=pir_l;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void db_CollectMatches_u(db_Bucket_u **bp_l,int nr_h,int nr_v,unsigned long target,int *id_l,int *id_r,int *nr_matches,float *scores)
 {
     int i,j,k,br_nr;
     unsigned long count;
@@ -1886,6 +2164,7 @@ void db_CollectMatches_u(db_Bucket_u **bp_l,int nr_h,int nr_v,unsigned long targ
                     {
                         id_l[count]=pir->id;
                         id_r[count]=pir2->id;
+                        if(scores) scores[count]=pir->s;
                         count++;
                     }
                 }
@@ -1902,16 +2181,21 @@ db_Matcher_u::db_Matcher_u()
     m_bw=m_bh=m_nr_h=m_nr_v=m_bd=m_target=0;
     m_bp_l=m_bp_r=0;
     m_patch_space=m_aligned_patch_space=0;
+    m_right_best=0;
 }
 
 db_Matcher_u::db_Matcher_u(const db_Matcher_u& cm)
 {
+    m_w=0; m_h=0;
+    m_right_best=0;
+    m_pool.SetNrThreads(cm.m_pool.GetNrThreads());
     Init(cm.m_w, cm.m_h, cm.m_max_disparity, cm.m_target, cm.m_max_disparity_v);
 }
 
 db_Matcher_u& db_Matcher_u::operator= (const db_Matcher_u& cm)
 {
     if ( this == &cm ) return *this;
+    m_pool.SetNrThreads(cm.m_pool.GetNrThreads());
     Init(cm.m_w, cm.m_h, cm.m_max_disparity, cm.m_target, cm.m_max_disparity_v);
     return *this;
 }
@@ -1932,9 +2216,57 @@ void db_Matcher_u::Clean()
         /*Free space for patch layouts*/
         delete [] m_patch_space;
     }
+    delete [] m_right_best;
+    m_right_best=0;
     m_w=0; m_h=0;
 }
 
+void db_Matcher_u::SetNrThreads(int nr_threads)
+{
+    m_pool.SetNrThreads(nr_threads);
+}
+
+void db_Matcher_u::MatchBucketsThreaded()
+{
+    int i,a,b,p_r,nr;
+    int row_size=db_RightMatchRowSize_u(m_nr_h,m_bd);
+    db_Bucket_u *b_r;
+    db_PointInfo_u *pir_r;
+    db_RightMatch_u *rm;
+    db_MatchBucketsTask_u task;
+
+    if(!m_right_best) m_right_best=new db_RightMatch_u [m_nr_v*row_size];
+
+    task.bp_l=m_bp_l;
+    task.bp_r=m_bp_r;
+    task.nr_h=m_nr_h;
+    task.bd=m_bd;
+    task.kA=m_kA;
+    task.kB=m_kB;
+    task.rect_window=m_rect_window;
+    task.use_smaller_matching_window=m_use_smaller_matching_window;
+    task.use_21=m_use_21;
+    task.right_best=m_right_best;
+    m_pool.Run(m_nr_v,db_MatchBucketsTask_u::Run,&task);
+
+    /*Fold the rows into the right points in scan order*/
+    for(i=0;i<m_nr_v;i++) for(a=i-1;a<=i+1;a++) for(b= -1;b<=m_nr_h;b++)
+    {
+        b_r=&m_bp_r[a][b];
+        nr=b_r->nr;
+        rm=m_right_best+i*row_size+((a-i+1)*(m_nr_h+2)+b+1)*m_bd;
+        for(p_r=0;p_r<nr;p_r++) if(rm[p_r].pir)
+        {
+            pir_r=b_r->ptr+p_r;
+            if((!(pir_r->pir)) || (rm[p_r].s>pir_r->s))
+            {
+                pir_r->s=rm[p_r].s;
+                pir_r->pir=rm[p_r].pir;
+            }
+        }
+    }
+}
+
 
 unsigned long db_Matcher_u::Init(int im_width,int im_height,float max_disparity,int target_nr_corners,
                                  float max_disparity_v, bool use_smaller_matching_window, int use_21)
@@ -2007,7 +2339,7 @@ unsigned long db_Matcher_u::Init(int im_width,int im_height,float max_disparity,
 
 void db_Matcher_u::Match(const unsigned char * const *l_img,const unsigned char * const *r_img,
         const float *x_l,const float *y_l,int nr_l,const float *x_r,const float *y_r,int nr_r,
-        int *id_l,int *id_r,int *nr_matches,const float H[9],int affine)
+        int *id_l,int *id_r,int *nr_matches,const float H[9],int affine,float *scores)
 {
     short *ps;
 
@@ -2035,17 +2367,17 @@ void db_Matcher_u::Match(const unsigned char * const *l_img,const unsigned char
             for (int r=-5;r<=5;r++){
                 for (int c=-5;c<=5;c++){
                     AffineWarpPointOffset(r_w,c_w,Hinv,r,c);
-                    AffineWarpPoint_BL_LUT_y[r+5][c+5]=r_w;
-                    AffineWarpPoint_BL_LUT_x[r+5][c+5]=c_w;
+                    m_affine_lut.bl_y[r+5][c+5]=r_w;
+                    m_affine_lut.bl_x[r+5][c+5]=c_w;
 
-                    AffineWarpPoint_NN_LUT_y[r+5][c+5]=db_roundi(r_w);
-                    AffineWarpPoint_NN_LUT_x[r+5][c+5]=db_roundi(c_w);
+                    m_affine_lut.nn_y[r+5][c+5]=db_roundi(r_w);
+                    m_affine_lut.nn_x[r+5][c+5]=db_roundi(c_w);
 
                 }
             }
 
             db_FillBucketsPrewarpedAffine_u(ps,r_img,m_bp_r,m_bw,m_bh,m_nr_h,m_nr_v,m_bd,
-                x_r,y_r,nr_r,H,Hinv,warpbounds,affine);
+                x_r,y_r,nr_r,H,&m_affine_lut,warpbounds,affine);
         }
         else
             db_FillBucketsPrewarped_u(ps,r_img,m_bp_r,m_bw,m_bh,m_nr_h,m_nr_v,m_bd,x_r,y_r,nr_r,H);
@@ -2053,10 +2385,13 @@ void db_Matcher_u::Match(const unsigned char * const *l_img,const unsigned char
 
 
     /*Compute all the necessary match scores*/
-    db_MatchBuckets_u(m_bp_l,m_bp_r,m_nr_h,m_nr_v,m_kA,m_kB, m_rect_window,m_use_smaller_matching_window,m_use_21);
+    if(m_pool.GetNrThreads()>1 && m_nr_v>1)
+        MatchBucketsThreaded();
+    else
+        db_MatchBuckets_u(m_bp_l,m_bp_r,m_nr_h,m_nr_v,m_kA,m_kB, m_rect_window,m_use_smaller_matching_window,m_use_21);
 
     /*Collect the correspondences*/
-    db_CollectMatches_u(m_bp_l,m_nr_h,m_nr_v,m_target,id_l,id_r,nr_matches);
+    db_CollectMatches_u(m_bp_l,m_nr_h,m_nr_v,m_target,id_l,id_r,nr_matches,scores);
 }
 
 int db_Matcher_u::IsAllocated()
@@ -27,6 +27,7 @@
  */
 #include "db_utilities.h"
 #include "db_utilities_constants.h"
+#include "db_utilities_threads.h"
 
 void db_SignedSquareNormCorr21x21_PreAlign_u(short *patch,const unsigned char * const *f_img,int x_f,int y_f,float *sum,float *recip);
 void db_SignedSquareNormCorr11x11_PreAlign_u(short *patch,const unsigned char * const *f_img,int x_f,int y_f,float *sum,float *recip);
@@ -60,6 +61,38 @@ public:
     int nr;
 };
 
+/*!
+ * Number of candidates the batched correlations score per pass.
+ */
+#define DB_MATCH_BATCH 16
+
+/*!
+ * \ingroup FeatureMatching
+ * Score the 21x21 patch of pir_l against the patches of the nr points pir_r[i],
+ * scores[i] is the same as db_SignedSquareNormCorr21x21Aligned_Post_s() of the pair.
+ */
+void db_SignedSquareNormCorr21x21AlignedBatch_Post_s(float *scores,const db_PointInfo_u *pir_l,const db_PointInfo_u * const *pir_r,int nr);
+/*!
+ * \ingroup FeatureMatching
+ * Score the 11x11 patch of pir_l against the patches of the nr points pir_r[i],
+ * scores[i] is the same as db_SignedSquareNormCorr11x11Aligned_Post_s() of the pair.
+ */
+void db_SignedSquareNormCorr11x11AlignedBatch_Post_s(float *scores,const db_PointInfo_u *pir_l,const db_PointInfo_u * const *pir_r,int nr);
+
+struct db_RightMatch_u;
+
+/*!
+ * \ingroup FeatureMatching
+ * Offsets, in the original image, of the 11x11 patch samples of a point
+ * prewarped with an affine transform: rounded for nearest neighbor and
+ * exact for bilinear interpolation.
+ */
+struct db_AffineWarpLUT_u
+{
+    int nn_x[11][11],nn_y[11][11];
+    float bl_x[11][11],bl_y[11][11];
+};
+
 /*!
  * \class db_Matcher_u
  * \ingroup FeatureMatching
@@ -138,10 +171,11 @@ public:
      * \param H         image homography (prewarp) to be applied to right image features
      * \param affine    prewarp the 11x11 patches by given affine transform. 0 means no warping,
                         1 means nearest neighbor, 2 means bilinear warping.
+     * \param scores    if not NULL, correlation score of each match (size target_nr_corners)
      */
     virtual void Match(const unsigned char * const *l_img,const unsigned char * const *r_img,
         const float *x_l,const float *y_l,int nr_l,const float *x_r,const float *y_r,int nr_r,
-        int *id_l,int *id_r,int *nr_matches,const float H[9]=0,int affine=0);
+        int *id_l,int *id_r,int *nr_matches,const float H[9]=0,int affine=0,float *scores=0);
 
     /*!
      * Checks if Init() was called.
@@ -149,8 +183,17 @@ public:
      */
     int IsAllocated();
 
+    /*!
+     * Set the number of threads Match() splits the scoring of the bucket rows
+     * across. 1 (default) runs on the calling thread, 0 uses one thread per
+     * online CPU. The matches found do not depend on it.
+     * \param nr_threads   number of threads
+     */
+    virtual void SetNrThreads(int nr_threads);
+
 protected:
     virtual void Clean();
+    void MatchBucketsThreaded();
 
 
     int m_w,m_h,m_bw,m_bh,m_nr_h,m_nr_v,m_bd,m_target;
@@ -163,6 +206,12 @@ protected:
     int m_rect_window;
     bool m_use_smaller_matching_window;
     int m_use_21;
+
+    db_ThreadPool m_pool;
+    /*Best left candidate of every right point seen from each left bucket row*/
+    db_RightMatch_u *m_right_best;
+    /*Patch offsets of the affine prewarp, see Match()*/
+    db_AffineWarpLUT_u m_affine_lut;
 };
 
 
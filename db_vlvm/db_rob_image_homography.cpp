@@ -27,6 +27,16 @@
 *****************************************************************/
 
 #include "db_image_homography.h"
+#include "db_utilities_threads.h"
+#include <algorithm>
+#include <float.h>
+
+/*The vector Cauchy cost matches the float arithmetic of the C loop only
+where that is done in SSE registers, the default ABI on x86-64 alone*/
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define DB_X86_SIMD
+#endif
 
 #ifdef _VERBOSE_
 #include <iostream>
@@ -620,6 +630,202 @@ void db_RobCamRotation_Polish_Generic(float H[9],int point_count,int homography_
         }
     }
 }
+/*Cauchy factors e[k]=db_ExpCauchyInhomogenousHomographyError() of the points
+(x[k],y[k]) -> (xp[k],yp[k]) under H, with the points in separate coordinate
+arrays. The SIMD versions do the same float operations in the same order
+(the divisions and the final addition are correctly rounded either way), so
+the factors are bit-exact*/
+static void db_HomographyCauchyFactors_C(float *e,const float H[9],const float *x,const float *y,
+                                         const float *xp,const float *yp,int n,float one_over_scale2)
+{
+    float p[2],pp[2];
+
+    for(int k=0;k<n;k++)
+    {
+        p[0]=x[k]; p[1]=y[k];
+        pp[0]=xp[k]; pp[1]=yp[k];
+        e[k]=db_ExpCauchyInhomogenousHomographyError(pp,H,p,one_over_scale2);
+    }
+}
+
+#ifdef DB_X86_SIMD
+
+__attribute__((target("sse2")))
+static void db_HomographyCauchyFactors_SSE2(float *e,const float H[9],const float *x,const float *y,
+                                            const float *xp,const float *yp,int n,float one_over_scale2)
+{
+    const __m128 zero=_mm_setzero_ps(),one=_mm_set1_ps(1.0f),o=_mm_set1_ps(one_over_scale2);
+    const __m128 h0=_mm_set1_ps(H[0]),h1=_mm_set1_ps(H[1]),h2=_mm_set1_ps(H[2]);
+    const __m128 h3=_mm_set1_ps(H[3]),h4=_mm_set1_ps(H[4]),h5=_mm_set1_ps(H[5]);
+    const __m128 h6=_mm_set1_ps(H[6]),h7=_mm_set1_ps(H[7]),h8=_mm_set1_ps(H[8]);
+    int k;
+
+    for(k=0;k+4<=n;k+=4)
+    {
+        __m128 vx=_mm_loadu_ps(x+k),vy=_mm_loadu_ps(y+k);
+        __m128 x0=_mm_add_ps(_mm_add_ps(_mm_mul_ps(h0,vx),_mm_mul_ps(h1,vy)),h2);
+        __m128 x1=_mm_add_ps(_mm_add_ps(_mm_mul_ps(h3,vx),_mm_mul_ps(h4,vy)),h5);
+        __m128 x2=_mm_add_ps(_mm_add_ps(_mm_mul_ps(h6,vx),_mm_mul_ps(h7,vy)),h8);
+        __m128 is_zero=_mm_cmpeq_ps(x2,zero);
+        __m128 mult=_mm_div_ps(one,_mm_or_ps(_mm_and_ps(is_zero,one),_mm_andnot_ps(is_zero,x2)));
+        __m128 dx=_mm_sub_ps(_mm_loadu_ps(xp+k),_mm_mul_ps(x0,mult));
+        __m128 dy=_mm_sub_ps(_mm_loadu_ps(yp+k),_mm_mul_ps(x1,mult));
+        __m128 sd=_mm_add_ps(_mm_mul_ps(dx,dx),_mm_mul_ps(dy,dy));
+        _mm_storeu_ps(e+k,_mm_add_ps(one,_mm_mul_ps(sd,o)));
+    }
+    db_HomographyCauchyFactors_C(e+k,H,x+k,y+k,xp+k,yp+k,n-k,one_over_scale2);
+}
+
+__attribute__((target("avx2")))
+static void db_HomographyCauchyFactors_AVX2(float *e,const float H[9],const float *x,const float *y,
+                                            const float *xp,const float *yp,int n,float one_over_scale2)
+{
+    const __m256 zero=_mm256_setzero_ps(),one=_mm256_set1_ps(1.0f),o=_mm256_set1_ps(one_over_scale2);
+    const __m256 h0=_mm256_set1_ps(H[0]),h1=_mm256_set1_ps(H[1]),h2=_mm256_set1_ps(H[2]);
+    const __m256 h3=_mm256_set1_ps(H[3]),h4=_mm256_set1_ps(H[4]),h5=_mm256_set1_ps(H[5]);
+    const __m256 h6=_mm256_set1_ps(H[6]),h7=_mm256_set1_ps(H[7]),h8=_mm256_set1_ps(H[8]);
+    int k;
+
+    for(k=0;k+8<=n;k+=8)
+    {
+        __m256 vx=_mm256_loadu_ps(x+k),vy=_mm256_loadu_ps(y+k);
+        __m256 x0=_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h0,vx),_mm256_mul_ps(h1,vy)),h2);
+        __m256 x1=_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h3,vx),_mm256_mul_ps(h4,vy)),h5);
+        __m256 x2=_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(h6,vx),_mm256_mul_ps(h7,vy)),h8);
+        __m256 mult=_mm256_div_ps(one,_mm256_blendv_ps(x2,one,_mm256_cmp_ps(x2,zero,_CMP_EQ_OQ)));
+        __m256 dx=_mm256_sub_ps(_mm256_loadu_ps(xp+k),_mm256_mul_ps(x0,mult));
+        __m256 dy=_mm256_sub_ps(_mm256_loadu_ps(yp+k),_mm256_mul_ps(x1,mult));
+        __m256 sd=_mm256_add_ps(_mm256_mul_ps(dx,dx),_mm256_mul_ps(dy,dy));
+        _mm256_storeu_ps(e+k,_mm256_add_ps(one,_mm256_mul_ps(sd,o)));
+    }
+    _mm256_zeroupper();
+    db_HomographyCauchyFactors_SSE2(e+k,H,x+k,y+k,xp+k,yp+k,n-k,one_over_scale2);
+}
+
+#endif /*DB_X86_SIMD*/
+
+typedef void (*db_HomographyCauchyFactors)(float *e,const float H[9],const float *x,const float *y,
+                                           const float *xp,const float *yp,int n,float one_over_scale2);
+
+static db_HomographyCauchyFactors db_SelectHomographyCauchyFactors()
+{
+#ifdef DB_X86_SIMD
+    if(__builtin_cpu_supports("avx2")) return(db_HomographyCauchyFactors_AVX2);
+    if(__builtin_cpu_supports("sse2")) return(db_HomographyCauchyFactors_SSE2);
+#endif
+    return(db_HomographyCauchyFactors_C);
+}
+
+/*Points whose Cauchy factors are computed per pass, a multiple of the ten
+factors that share a logarithm*/
+#define DB_HYP_COST_BLOCK 40
+/*Hypotheses per task*/
+#define DB_HYP_TASK_SIZE 16
+
+/*Add the cost of the points first..last to the hypotheses hyp_perm[0..nr_hyp-1].
+The factors are multiplied ten at a time from first, exactly as the serial
+cost loop did, so each cost does not depend on how the hypotheses are split
+among the tasks*/
+struct db_HypothesisCostTask
+{
+    db_HomographyCauchyFactors factors;
+    const float *hyp_H_array;
+    const int *hyp_perm;
+    float *hyp_cost_array;
+    int nr_hyp;
+    const float *x,*y,*xp,*yp;
+    int first,last;
+    float one_over_scale2;
+
+    static void Run(void *arg,int task,int thread);
+};
+
+void db_HypothesisCostTask::Run(void *arg,int task,int /*thread*/)
+{
+    const db_HypothesisCostTask *t=(const db_HypothesisCostTask*) arg;
+    float e[DB_HYP_COST_BLOCK];
+    float acc;
+    int j,b,n,k,last_j;
+
+    last_j=db_mini((task+1)*DB_HYP_TASK_SIZE,t->nr_hyp);
+    for(j=task*DB_HYP_TASK_SIZE;j<last_j;j++)
+    {
+        const float *hyp_point=t->hyp_H_array+9*t->hyp_perm[j];
+
+        for(b=t->first;b<=t->last;b+=DB_HYP_COST_BLOCK)
+        {
+            n=db_mini(DB_HYP_COST_BLOCK,t->last-b+1);
+            t->factors(e,hyp_point,t->x+b,t->y+b,t->xp+b,t->yp+b,n,t->one_over_scale2);
+            for(k=0;k<n;)
+            {
+                /*Take log of product of ten reprojection
+                errors to reduce nr of expensive log operations*/
+                if(k+10<=n)
+                {
+                    acc=e[k];
+                    acc*=e[k+1]; acc*=e[k+2]; acc*=e[k+3]; acc*=e[k+4];
+                    acc*=e[k+5]; acc*=e[k+6]; acc*=e[k+7]; acc*=e[k+8]; acc*=e[k+9];
+                    k+=10;
+                }
+                else
+                {
+                    for(acc=1.0;k<n;k++) acc*=e[k];
+                }
+                t->hyp_cost_array[j]+=logf(acc);
+            }
+        }
+    }
+}
+
+/*Hypotheses drawn between two checks of the adaptive termination*/
+#define DB_ADAPTIVE_SAMPLES_BATCH 16
+/*Smallest number of best scored matches guided samples are drawn from*/
+#define DB_GUIDED_SAMPLING_MIN_POOL 16
+
+/*Order of the matches for guided sampling: best score first, ties by index*/
+struct db_MatchScoreOrder
+{
+    const float *score;
+    bool operator()(int a,int b) const
+    {
+        if(score[a]!=score[b]) return(score[a]>score[b]);
+        return(a<b);
+    }
+};
+
+/*Number of points the i-th sample is drawn from. Guided sampling draws the
+first samples from the best scored matches only, and widens the pool
+linearly to all of them by the last sample*/
+inline int db_RobImageHomographySamplePool(int i,int nr_samples,int point_count,bool guided)
+{
+    if(!guided) return(point_count);
+    return(db_mini(point_count,DB_GUIDED_SAMPLING_MIN_POOL+(point_count*i)/nr_samples));
+}
+
+/*Number of samples of sample_size points needed to draw one without
+outliers with probability confidence, given the fraction of inliers*/
+inline float db_RansacNrSamples(float inlier_fraction,int sample_size,float confidence)
+{
+    float p=powf(inlier_fraction,(float)sample_size);
+    if(p>=1.0f) return(1.0f);
+    if(p<=0.0f || confidence>=1.0f) return(FLT_MAX);
+    return(logf(1.0f-confidence)/logf(1.0f-p));
+}
+
+/*Number of the points 0..point_count-1 that H maps within
+DB_OUTLIER_THRESHOLD, as in db_RobImageHomography_Statistics()*/
+inline int db_RobImageHomographyInliers(const float H[9],int point_count,const float *x_i,const float *xp_i,float one_over_scale2)
+{
+    int c,i;
+    float t2=DB_OUTLIER_THRESHOLD*DB_OUTLIER_THRESHOLD;
+
+    for(i=0,c=0;c<point_count;c++)
+    {
+        i+=(db_SquaredInhomogenousHomographyError(xp_i+(c<<1),H,x_i+(c<<1))*one_over_scale2<=t2)?1:0;
+    }
+    return(i);
+}
+
 void db_RobImageHomography(
                               /*Best homography*/
                               float H[9],
@@ -664,7 +870,10 @@ void db_RobImageHomography(
                               // raw image coordinates
                               float *im_raw, float *im_raw_p,
                               // final matches
-                              int *finalNumE)
+                              int *finalNumE,
+                              db_ThreadPool *pool,
+                              float confidence,
+                              const float *match_scores)
 {
     /*Random seed*/
     int r_seed;
@@ -672,12 +881,8 @@ void db_RobImageHomography(
     int point_count_new;
     /*Counters*/
     int i,j,c,point_count,hyp_count;
-    int last_hyp,new_last_hyp,last_corr;
+    int last_hyp,new_last_hyp,last_corr,nr_ties;
     int pos,point_pos,last_point;
-    /*Accumulator*/
-    float acc;
-    /*Hypothesis pointer*/
-    float *hyp_point;
     /*Random sample*/
     int s[4];
     /*Pivot for hypothesis pruning*/
@@ -689,8 +894,6 @@ void db_RobImageHomography(
     /*One over the squared scale of
     Cauchy distribution*/
     float one_over_scale2;
-    /*temporary pointers*/
-    float *x_i_temp,*xp_i_temp;
     /*Temporary space for inverse calibration matrices*/
     float K_inv[9];
     float Kp_inv[9];
@@ -722,6 +925,15 @@ void db_RobImageHomography(
     /*Temporary space for quick-select
     2*nr_samples*/
     float *temp_select;
+    /*Coordinate arrays of the points for the hypothesis scoring*/
+    float *x_s,*y_s,*xp_s,*yp_s;
+    db_HypothesisCostTask cost_task;
+    /*Samples drawn so far and in the current batch*/
+    int first_sample,last_sample,first_hyp;
+    /*Guided and adaptive sampling*/
+    bool guided;
+    int nr_test_points,best_inliers;
+    db_MatchScoreOrder score_order;
 
     /*Get inverse calibration matrices*/
     db_InvertCalibrationMatrix(K_inv,K);
@@ -742,7 +954,8 @@ void db_RobImageHomography(
     point_perm=temp_i;
 
     /*Prepare a randomly permuted subset of size
-    point_count from the input points*/
+    point_count from the input points, or with guided
+    sampling the point_count best scored ones, best first*/
 
     point_count=db_mini(nr_points,(int)(chunk_size*logf((float)nr_samples)/M_LN2));
 
@@ -750,11 +963,22 @@ void db_RobImageHomography(
 
     for(i=0;i<nr_points;i++) point_perm[i]=i;
 
+    guided=(match_scores!=NULL);
+    if(guided)
+    {
+        score_order.score=match_scores;
+        std::sort(point_perm,point_perm+nr_points,score_order);
+    }
+
     for(last_point=nr_points-1,i=0;i<point_count;i++,last_point--)
     {
-        pos=db_RandomInt(r_seed,last_point);
-        point_pos=point_perm[pos];
-        point_perm[pos]=point_perm[last_point];
+        if(guided) point_pos=point_perm[i];
+        else
+        {
+            pos=db_RandomInt(r_seed,last_point);
+            point_pos=point_perm[pos];
+            point_perm[pos]=point_perm[last_point];
+        }
 
         /*Normalize image points with calibration
         matrices and move them to x_h and xp_h*/
@@ -776,154 +1000,177 @@ void db_RobImageHomography(
     }
 
 
-    /*Generate Hypotheses*/
+    /*Generate Hypotheses. In the adaptive mode they are drawn in
+    batches, until the best inlier fraction seen on the first chunk of
+    points says enough samples have been drawn to have one without
+    outliers with the requested confidence*/
     hyp_count=0;
-    switch(homography_type)
+    best_inliers=0;
+    nr_test_points=db_mini(chunk_size,point_count);
+    for(first_sample=0;first_sample<nr_samples;first_sample=last_sample)
     {
-    case DB_HOMOGRAPHY_TYPE_SIMILARITY:
-    case DB_HOMOGRAPHY_TYPE_SIMILARITY_U:
-    case DB_HOMOGRAPHY_TYPE_TRANSLATION:
-    case DB_HOMOGRAPHY_TYPE_ROTATION:
-    case DB_HOMOGRAPHY_TYPE_ROTATION_U:
-    case DB_HOMOGRAPHY_TYPE_SCALING:
-    case DB_HOMOGRAPHY_TYPE_S_T:
-    case DB_HOMOGRAPHY_TYPE_R_T:
-    case DB_HOMOGRAPHY_TYPE_R_S:
+        last_sample=(confidence>0.0f)?db_mini(first_sample+DB_ADAPTIVE_SAMPLES_BATCH,nr_samples):nr_samples;
+        first_hyp=hyp_count;
 
         switch(homography_type)
         {
         case DB_HOMOGRAPHY_TYPE_SIMILARITY:
-            orientation_preserving=1;
-            allow_scaling=1;
-            allow_rotation=1;
-            allow_translation=1;
-            sample_size=2;
-            break;
         case DB_HOMOGRAPHY_TYPE_SIMILARITY_U:
-            orientation_preserving=0;
-            allow_scaling=1;
-            allow_rotation=1;
-            allow_translation=1;
-            sample_size=3;
-            break;
         case DB_HOMOGRAPHY_TYPE_TRANSLATION:
-            orientation_preserving=1;
-            allow_scaling=0;
-            allow_rotation=0;
-            allow_translation=1;
-            sample_size=1;
-            break;
         case DB_HOMOGRAPHY_TYPE_ROTATION:
-            orientation_preserving=1;
-            allow_scaling=0;
-            allow_rotation=1;
-            allow_translation=0;
-            sample_size=1;
-            break;
         case DB_HOMOGRAPHY_TYPE_ROTATION_U:
-            orientation_preserving=0;
-            allow_scaling=0;
-            allow_rotation=1;
-            allow_translation=0;
-            sample_size=2;
-            break;
         case DB_HOMOGRAPHY_TYPE_SCALING:
-            orientation_preserving=1;
-            allow_scaling=1;
-            allow_rotation=0;
-            allow_translation=0;
-            sample_size=1;
-            break;
         case DB_HOMOGRAPHY_TYPE_S_T:
-            orientation_preserving=1;
-            allow_scaling=1;
-            allow_rotation=0;
-            allow_translation=1;
-            sample_size=2;
-            break;
         case DB_HOMOGRAPHY_TYPE_R_T:
-            orientation_preserving=1;
-            allow_scaling=0;
-            allow_rotation=1;
-            allow_translation=1;
-            sample_size=2;
-            break;
         case DB_HOMOGRAPHY_TYPE_R_S:
-            orientation_preserving=1;
-            allow_scaling=1;
-            allow_rotation=0;
-            allow_translation=0;
-            sample_size=1;
+
+            switch(homography_type)
+            {
+            case DB_HOMOGRAPHY_TYPE_SIMILARITY:
+                orientation_preserving=1;
+                allow_scaling=1;
+                allow_rotation=1;
+                allow_translation=1;
+                sample_size=2;
+                break;
+            case DB_HOMOGRAPHY_TYPE_SIMILARITY_U:
+                orientation_preserving=0;
+                allow_scaling=1;
+                allow_rotation=1;
+                allow_translation=1;
+                sample_size=3;
+                break;
+            case DB_HOMOGRAPHY_TYPE_TRANSLATION:
+                orientation_preserving=1;
+                allow_scaling=0;
+                allow_rotation=0;
+                allow_translation=1;
+                sample_size=1;
+                break;
+            case DB_HOMOGRAPHY_TYPE_ROTATION:
+                orientation_preserving=1;
+                allow_scaling=0;
+                allow_rotation=1;
+                allow_translation=0;
+                sample_size=1;
+                break;
+            case DB_HOMOGRAPHY_TYPE_ROTATION_U:
+                orientation_preserving=0;
+                allow_scaling=0;
+                allow_rotation=1;
+                allow_translation=0;
+                sample_size=2;
+                break;
+            case DB_HOMOGRAPHY_TYPE_SCALING:
+                orientation_preserving=1;
+                allow_scaling=1;
+                allow_rotation=0;
+                allow_translation=0;
+                sample_size=1;
+                break;
+            case DB_HOMOGRAPHY_TYPE_S_T:
+                orientation_preserving=1;
+                allow_scaling=1;
+                allow_rotation=0;
+                allow_translation=1;
+                sample_size=2;
+                break;
+            case DB_HOMOGRAPHY_TYPE_R_T:
+                orientation_preserving=1;
+                allow_scaling=0;
+                allow_rotation=1;
+                allow_translation=1;
+                sample_size=2;
+                break;
+            case DB_HOMOGRAPHY_TYPE_R_S:
+                orientation_preserving=1;
+                allow_scaling=1;
+                allow_rotation=0;
+                allow_translation=0;
+                sample_size=1;
+                break;
+            }
+
+            if(point_count>=sample_size) for(i=first_sample;i<last_sample;i++)
+            {
+                db_RandomSample(s,3,db_RobImageHomographySamplePool(i,nr_samples,point_count,guided),r_seed);
+                X[0]= &x_i[s[0]<<1];
+                X[1]= &x_i[s[1]<<1];
+                X[2]= &x_i[s[2]<<1];
+                Xp[0]= &xp_i[s[0]<<1];
+                Xp[1]= &xp_i[s[1]<<1];
+                Xp[2]= &xp_i[s[2]<<1];
+                db_StitchSimilarity2D(&hyp_H_array[9*hyp_count],Xp,X,sample_size,orientation_preserving,
+                                      allow_scaling,allow_rotation,allow_translation);
+                hyp_count++;
+            }
             break;
-        }
 
-        if(point_count>=sample_size) for(i=0;i<nr_samples;i++)
-        {
-            db_RandomSample(s,3,point_count,r_seed);
-            X[0]= &x_i[s[0]<<1];
-            X[1]= &x_i[s[1]<<1];
-            X[2]= &x_i[s[2]<<1];
-            Xp[0]= &xp_i[s[0]<<1];
-            Xp[1]= &xp_i[s[1]<<1];
-            Xp[2]= &xp_i[s[2]<<1];
-            db_StitchSimilarity2D(&hyp_H_array[9*hyp_count],Xp,X,sample_size,orientation_preserving,
-                                  allow_scaling,allow_rotation,allow_translation);
-            hyp_count++;
-        }
-        break;
+        case DB_HOMOGRAPHY_TYPE_CAMROTATION:
+            sample_size=2;
+            if(point_count>=2) for(i=first_sample;i<last_sample;i++)
+            {
+                db_RandomSample(s,2,db_RobImageHomographySamplePool(i,nr_samples,point_count,guided),r_seed);
+                db_StitchCameraRotation_2Points(&hyp_H_array[9*hyp_count],
+                                          &x_h[3*s[0]],&x_h[3*s[1]],
+                                          &xp_h[3*s[0]],&xp_h[3*s[1]]);
+                hyp_count++;
+            }
+            break;
 
-    case DB_HOMOGRAPHY_TYPE_CAMROTATION:
-        if(point_count>=2) for(i=0;i<nr_samples;i++)
-        {
-            db_RandomSample(s,2,point_count,r_seed);
-            db_StitchCameraRotation_2Points(&hyp_H_array[9*hyp_count],
-                                      &x_h[3*s[0]],&x_h[3*s[1]],
-                                      &xp_h[3*s[0]],&xp_h[3*s[1]]);
-            hyp_count++;
-        }
-        break;
+        case DB_HOMOGRAPHY_TYPE_CAMROTATION_F:
+            sample_size=3;
+            if(point_count>=3) for(i=first_sample;i<last_sample;i++)
+            {
+                db_RandomSample(s,3,db_RobImageHomographySamplePool(i,nr_samples,point_count,guided),r_seed);
+                hyp_count+=db_StitchRotationCommonFocalLength_3Points(&hyp_H_array[9*hyp_count],
+                                          &x_h[3*s[0]],&x_h[3*s[1]],&x_h[3*s[2]],
+                                          &xp_h[3*s[0]],&xp_h[3*s[1]],&xp_h[3*s[2]]);
+            }
+            break;
 
-    case DB_HOMOGRAPHY_TYPE_CAMROTATION_F:
-        if(point_count>=3) for(i=0;i<nr_samples;i++)
-        {
-            db_RandomSample(s,3,point_count,r_seed);
-            hyp_count+=db_StitchRotationCommonFocalLength_3Points(&hyp_H_array[9*hyp_count],
-                                      &x_h[3*s[0]],&x_h[3*s[1]],&x_h[3*s[2]],
-                                      &xp_h[3*s[0]],&xp_h[3*s[1]],&xp_h[3*s[2]]);
-        }
-        break;
+        case DB_HOMOGRAPHY_TYPE_CAMROTATION_F_UD:
+            sample_size=3;
+            if(point_count>=3) for(i=first_sample;i<last_sample;i++)
+            {
+                db_RandomSample(s,3,db_RobImageHomographySamplePool(i,nr_samples,point_count,guided),r_seed);
+                hyp_count+=db_StitchRotationCommonFocalLength_3Points(&hyp_H_array[9*hyp_count],
+                                          &x_h[3*s[0]],&x_h[3*s[1]],&x_h[3*s[2]],
+                                          &xp_h[3*s[0]],&xp_h[3*s[1]],&xp_h[3*s[2]],NULL,0);
+            }
+            break;
 
-    case DB_HOMOGRAPHY_TYPE_CAMROTATION_F_UD:
-        if(point_count>=3) for(i=0;i<nr_samples;i++)
-        {
-            db_RandomSample(s,3,point_count,r_seed);
-            hyp_count+=db_StitchRotationCommonFocalLength_3Points(&hyp_H_array[9*hyp_count],
-                                      &x_h[3*s[0]],&x_h[3*s[1]],&x_h[3*s[2]],
-                                      &xp_h[3*s[0]],&xp_h[3*s[1]],&xp_h[3*s[2]],NULL,0);
-        }
-        break;
+        case DB_HOMOGRAPHY_TYPE_AFFINE:
+            sample_size=3;
+            if(point_count>=3) for(i=first_sample;i<last_sample;i++)
+            {
+                db_RandomSample(s,3,db_RobImageHomographySamplePool(i,nr_samples,point_count,guided),r_seed);
+                db_StitchAffine2D_3Points(&hyp_H_array[9*hyp_count],
+                                          &x_h[3*s[0]],&x_h[3*s[1]],&x_h[3*s[2]],
+                                          &xp_h[3*s[0]],&xp_h[3*s[1]],&xp_h[3*s[2]]);
+                hyp_count++;
+            }
+            break;
 
-    case DB_HOMOGRAPHY_TYPE_AFFINE:
-        if(point_count>=3) for(i=0;i<nr_samples;i++)
-        {
-            db_RandomSample(s,3,point_count,r_seed);
-            db_StitchAffine2D_3Points(&hyp_H_array[9*hyp_count],
-                                      &x_h[3*s[0]],&x_h[3*s[1]],&x_h[3*s[2]],
-                                      &xp_h[3*s[0]],&xp_h[3*s[1]],&xp_h[3*s[2]]);
-            hyp_count++;
+        case DB_HOMOGRAPHY_TYPE_PROJECTIVE:
+        default:
+            sample_size=4;
+            if(point_count>=4) for(i=first_sample;i<last_sample;i++)
+            {
+                db_RandomSample(s,4,db_RobImageHomographySamplePool(i,nr_samples,point_count,guided),r_seed);
+                db_StitchProjective2D_4Points(&hyp_H_array[9*hyp_count],
+                                          &x_h[3*s[0]],&x_h[3*s[1]],&x_h[3*s[2]],&x_h[3*s[3]],
+                                          &xp_h[3*s[0]],&xp_h[3*s[1]],&xp_h[3*s[2]],&xp_h[3*s[3]]);
+                hyp_count++;
+            }
         }
-        break;
 
-    case DB_HOMOGRAPHY_TYPE_PROJECTIVE:
-    default:
-        if(point_count>=4) for(i=0;i<nr_samples;i++)
+        if(confidence<=0.0f || first_hyp==hyp_count) break;
+        for(j=first_hyp;j<hyp_count;j++)
         {
-            db_RandomSample(s,4,point_count,r_seed);
-            db_StitchProjective2D_4Points(&hyp_H_array[9*hyp_count],
-                                      &x_h[3*s[0]],&x_h[3*s[1]],&x_h[3*s[2]],&x_h[3*s[3]],
-                                      &xp_h[3*s[0]],&xp_h[3*s[1]],&xp_h[3*s[2]],&xp_h[3*s[3]]);
-            hyp_count++;
+            best_inliers=db_maxi(best_inliers,db_RobImageHomographyInliers(hyp_H_array+9*j,nr_test_points,x_i,xp_i,one_over_scale2));
         }
+        if((float)last_sample>=db_RansacNrSamples(((float)best_inliers)/((float)nr_test_points),sample_size,confidence)) break;
     }
 
     if(hyp_count)
@@ -936,51 +1183,50 @@ void db_RobImageHomography(
             hyp_perm[i]=i;
             hyp_cost_array[i]=0.0;
         }
+        /*The homogenous coordinates are not needed any more, lay
+        out the points there one coordinate per array*/
+        x_s=x_h;
+        y_s=x_h+point_count;
+        xp_s=x_h+2*point_count;
+        yp_s=x_h+3*point_count;
+        for(c=0;c<point_count;c++)
+        {
+            x_s[c]=x_i[c<<1];
+            y_s[c]=x_i[(c<<1)+1];
+            xp_s[c]=xp_i[c<<1];
+            yp_s[c]=xp_i[(c<<1)+1];
+        }
+        cost_task.factors=db_SelectHomographyCauchyFactors();
+        cost_task.hyp_H_array=hyp_H_array;
+        cost_task.hyp_perm=hyp_perm;
+        cost_task.hyp_cost_array=hyp_cost_array;
+        cost_task.x=x_s;
+        cost_task.y=y_s;
+        cost_task.xp=xp_s;
+        cost_task.yp=yp_s;
+        cost_task.one_over_scale2=one_over_scale2;
+
         for(i=0,last_hyp=hyp_count-1;(last_hyp>0) && (i<point_count);i+=chunk_size)
         {
             /*Update cost with the next chunk*/
             last_corr=db_mini(i+chunk_size-1,point_count-1);
-            for(j=0;j<=last_hyp;j++)
-            {
-                hyp_point=hyp_H_array+9*hyp_perm[j];
-                for(c=i;c<=last_corr;)
-                {
-                    /*Take log of product of ten reprojection
-                    errors to reduce nr of expensive log operations*/
-                    if(c+9<=last_corr)
-                    {
-                        x_i_temp=x_i+(c<<1);
-                        xp_i_temp=xp_i+(c<<1);
-
-                        acc=db_ExpCauchyInhomogenousHomographyError(xp_i_temp,hyp_point,x_i_temp,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+2,hyp_point,x_i_temp+2,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+4,hyp_point,x_i_temp+4,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+6,hyp_point,x_i_temp+6,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+8,hyp_point,x_i_temp+8,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+10,hyp_point,x_i_temp+10,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+12,hyp_point,x_i_temp+12,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+14,hyp_point,x_i_temp+14,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+16,hyp_point,x_i_temp+16,one_over_scale2);
-                        acc*=db_ExpCauchyInhomogenousHomographyError(xp_i_temp+18,hyp_point,x_i_temp+18,one_over_scale2);
-                        c+=10;
-                    }
-                    else
-                    {
-                        for(acc=1.0;c<=last_corr;c++)
-                        {
-                            acc*=db_ExpCauchyInhomogenousHomographyError(xp_i+(c<<1),hyp_point,x_i+(c<<1),one_over_scale2);
-                        }
-                    }
-                    hyp_cost_array[j]+=logf(acc);
-                }
-            }
+            cost_task.nr_hyp=last_hyp+1;
+            cost_task.first=i;
+            cost_task.last=last_corr;
+            j=(last_hyp+DB_HYP_TASK_SIZE)/DB_HYP_TASK_SIZE;
+            if(pool) pool->Run(j,db_HypothesisCostTask::Run,&cost_task);
+            else for(c=0;c<j;c++) db_HypothesisCostTask::Run(&cost_task,c,0);
             if (chunk_size<point_count){
                 /*Prune out half of the hypotheses*/
                 new_last_hyp=(last_hyp+1)/2-1;
                 pivot=db_LeanQuickSelect(hyp_cost_array,last_hyp+1,new_last_hyp,temp_select);
+                /*Keep all costs below the pivot and only as many equal
+                to it as there is room for (several can be equal when
+                the cost of bad hypotheses overflows)*/
+                for(j=0,nr_ties=new_last_hyp+1;j<=last_hyp;j++) if(hyp_cost_array[j]<pivot) nr_ties--;
                 for(j=0,c=0;(j<=last_hyp) && (c<=new_last_hyp);j++)
                 {
-                    if(hyp_cost_array[j]<=pivot)
+                    if(hyp_cost_array[j]<pivot || (hyp_cost_array[j]==pivot && nr_ties-- >0))
                     {
                         hyp_cost_array[c]=hyp_cost_array[j];
                         hyp_perm[c]=hyp_perm[j];
@@ -25,6 +25,7 @@
 
 #include <stdlib.h> // for NULL
 
+class db_ThreadPool;
 
 /*****************************************************************
 *    Lean and mean begins here                                   *
@@ -83,6 +84,15 @@ Calibration matrices:
  \param scale           Cauchy scale coefficient (see db_ExpCauchyReprojectionError() )
  \param nr_samples      number of times to compute a hypothesis
  \param chunk_size      size of cost chunks
+ \param pool            threads to score the hypotheses on, NULL - calling thread only.
+                        The result does not depend on it.
+ \param confidence      0 - always draw nr_samples hypotheses. Otherwise stop drawing them once
+                        an outlier free sample has been drawn with this probability, judging from
+                        the best inlier fraction so far. The hypotheses drawn are the first ones of
+                        the full schedule.
+ \param match_scores    NULL - sample the points uniformly. Otherwise a score per point, higher
+                        meaning a more reliable match: the best scored points are used, and the
+                        first samples are drawn from the best of them only.
 */
 void db_RobImageHomography(
                               /*Best homography*/
@@ -127,7 +137,10 @@ void db_RobImageHomography(
                               // raw image coordinates
                               float *im_raw=NULL, float *im_raw_p=NULL,
                               // final matches
-                              int *final_NumE=0);
+                              int *final_NumE=0,
+                              db_ThreadPool *pool=NULL,
+                              float confidence=0.0f,
+                              const float *match_scores=NULL);
 
 float db_RobImageHomography_Cost(float H[9],int point_count,float *x_i,
                                                 float *xp_i,float one_over_scale2);
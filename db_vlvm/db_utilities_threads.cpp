@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "db_utilities_threads.h"
+#include <unistd.h>
+#include <stdlib.h>
+
+/*****************************************************************
+*    Lean and mean begins here                                   *
+*****************************************************************/
+
+struct db_ThreadPoolWorker
+{
+    db_ThreadPool *pool;
+    int thread;
+};
+
+db_ThreadPool::db_ThreadPool()
+{
+    m_nr_threads=1;
+    m_nr_workers=0;
+    m_workers=0;
+    m_generation=0;
+    m_quit=false;
+    m_func=0;
+    m_arg=0;
+    m_nr_tasks=0;
+    m_next_task=0;
+    m_busy=0;
+    pthread_mutex_init(&m_mutex,NULL);
+    pthread_cond_init(&m_work_cond,NULL);
+    pthread_cond_init(&m_done_cond,NULL);
+}
+
+db_ThreadPool::~db_ThreadPool()
+{
+    Stop();
+    pthread_cond_destroy(&m_done_cond);
+    pthread_cond_destroy(&m_work_cond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void db_ThreadPool::SetNrThreads(int nr_threads)
+{
+    if(nr_threads<=0) nr_threads=(int) sysconf(_SC_NPROCESSORS_ONLN);
+    if(nr_threads<1) nr_threads=1;
+    if(nr_threads==m_nr_threads) return;
+
+    Stop();
+    m_nr_threads=nr_threads;
+}
+
+void db_ThreadPool::Stop()
+{
+    if(m_nr_workers)
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_quit=true;
+        pthread_cond_broadcast(&m_work_cond);
+        pthread_mutex_unlock(&m_mutex);
+
+        for(int k=0;k<m_nr_workers;k++) pthread_join(m_workers[k],NULL);
+    }
+    delete [] m_workers;
+    m_workers=0;
+    m_nr_workers=0;
+    m_quit=false;
+}
+
+/*Run the tasks of the current batch until there are none left. Called with
+m_mutex held, returns with it held*/
+void db_ThreadPool::Work(int thread)
+{
+    while(m_next_task<m_nr_tasks)
+    {
+        int task=m_next_task++;
+        m_busy++;
+        pthread_mutex_unlock(&m_mutex);
+
+        m_func(m_arg,task,thread);
+
+        pthread_mutex_lock(&m_mutex);
+        if(--m_busy==0 && m_next_task>=m_nr_tasks) pthread_cond_broadcast(&m_done_cond);
+    }
+}
+
+void *db_ThreadPool::WorkerThread(void *arg)
+{
+    db_ThreadPoolWorker *w=(db_ThreadPoolWorker*) arg;
+    db_ThreadPool *pool=w->pool;
+    int thread=w->thread;
+    delete w;
+
+    unsigned long generation=0;
+    pthread_mutex_lock(&pool->m_mutex);
+    for(;;)
+    {
+        while(!pool->m_quit && pool->m_generation==generation)
+            pthread_cond_wait(&pool->m_work_cond,&pool->m_mutex);
+        if(pool->m_quit) break;
+
+        generation=pool->m_generation;
+        pool->Work(thread);
+    }
+    pthread_mutex_unlock(&pool->m_mutex);
+    return(NULL);
+}
+
+void db_ThreadPool::Run(int nr_tasks,Task func,void *arg)
+{
+    if(nr_tasks<=0) return;
+
+    /*Nothing to share: run on the calling thread*/
+    if(m_nr_threads==1 || nr_tasks==1)
+    {
+        for(int task=0;task<nr_tasks;task++) func(arg,task,0);
+        return;
+    }
+
+    if(!m_workers)
+    {
+        m_workers=new pthread_t[m_nr_threads-1];
+        for(int k=0;k<m_nr_threads-1;k++)
+        {
+            db_ThreadPoolWorker *w=new db_ThreadPoolWorker;
+            w->pool=this;
+            w->thread=k+1;
+            if(pthread_create(&m_workers[m_nr_workers],NULL,WorkerThread,w)!=0)
+            {
+                /*Go on with the workers we have*/
+                delete w;
+                break;
+            }
+            m_nr_workers++;
+        }
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_func=func;
+    m_arg=arg;
+    m_nr_tasks=nr_tasks;
+    m_next_task=0;
+    m_generation++;
+    pthread_cond_broadcast(&m_work_cond);
+
+    Work(0);
+    while(m_busy) pthread_cond_wait(&m_done_cond,&m_mutex);
+    pthread_mutex_unlock(&m_mutex);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DB_UTILITIES_THREADS
+#define DB_UTILITIES_THREADS
+
+#include <pthread.h>
+
+/*****************************************************************
+*    Lean and mean begins here                                   *
+*****************************************************************/
+
+/*!
+ * \defgroup LMThreads (LM) Thread Utilities
+ */
+/*\{*/
+
+/*!
+ * \class db_ThreadPool
+ * \ingroup LMThreads
+ * \brief Fixed set of worker threads running numbered tasks.
+ *
+ * Run() calls a task function once for every task number, on the calling
+ * thread and on the workers, and returns when all of them are done. Which
+ * thread runs a task is not defined, so a task should only write results
+ * indexed by its task number (or scratch indexed by its thread number) for
+ * the outcome not to depend on the number of threads.
+ */
+class db_ThreadPool
+{
+public:
+    /*!
+     * Task function: arg as passed to Run(), the task number and the
+     * number of the thread running it, in [0,GetNrThreads()).
+     */
+    typedef void (*Task)(void *arg,int task,int thread);
+
+    db_ThreadPool();
+    ~db_ThreadPool();
+
+    /*!
+     * Set the number of threads, including the calling one. 1 (default)
+     * runs everything on the calling thread, 0 uses one thread per online
+     * CPU. Workers are started on the first Run() that needs them.
+     */
+    void SetNrThreads(int nr_threads);
+    /*!
+     * Number of threads Run() may use, at least 1.
+     */
+    int GetNrThreads() const { return(m_nr_threads); }
+
+    /*!
+     * Run func(arg,task,thread) for task=0..nr_tasks-1 and wait for all of them.
+     */
+    void Run(int nr_tasks,Task func,void *arg);
+
+protected:
+    /*Not copyable*/
+    db_ThreadPool(const db_ThreadPool&);
+    db_ThreadPool& operator=(const db_ThreadPool&);
+
+    void Stop();
+    void Work(int thread);
+    static void *WorkerThread(void *arg);
+
+    int m_nr_threads;
+    int m_nr_workers;
+    pthread_t *m_workers;
+
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_work_cond;
+    pthread_cond_t m_done_cond;
+    unsigned long m_generation;
+    bool m_quit;
+
+    // Current batch of tasks
+    Task m_func;
+    void *m_arg;
+    int m_nr_tasks;
+    int m_next_task;
+    int m_busy;
+};
+
+/*\}*/
+
+#endif /* DB_UTILITIES_THREADS */
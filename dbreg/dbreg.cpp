@@ -18,6 +18,7 @@
 #include "dbreg.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 
 #if PROFILE
@@ -41,6 +42,7 @@ db_FrameToReferenceRegistration::db_FrameToReferenceRegistration() :
 
   m_match_index_ref = NULL;
   m_match_index_ins = NULL;
+  m_match_scores = NULL;
 
   m_inlier_indices = NULL;
 
@@ -73,6 +75,23 @@ db_FrameToReferenceRegistration::~db_FrameToReferenceRegistration()
   Clean();
 }
 
+void db_FrameToReferenceRegistration::AppendProfile(const char *format, ...)
+{
+  if ( !profile_string )
+    return;
+
+  // Never write past the end, whatever the line: registrations running on
+  // other threads keep their own strings.
+  size_t used = strlen(profile_string);
+  if ( used + 1 >= DB_PROFILE_STRING_SIZE )
+    return;
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(profile_string + used, DB_PROFILE_STRING_SIZE - used, format, args);
+  va_end(args);
+}
+
 void db_FrameToReferenceRegistration::Clean()
 {
   if ( m_reference_image )
@@ -99,6 +118,7 @@ void db_FrameToReferenceRegistration::Clean()
 
   delete [] m_match_index_ref;
   delete [] m_match_index_ins;
+  delete [] m_match_scores;
 
   delete [] m_temp_float;
   delete [] m_temp_int;
@@ -128,6 +148,7 @@ void db_FrameToReferenceRegistration::Clean()
 
   m_match_index_ref = NULL;
   m_match_index_ins = NULL;
+  m_match_scores = NULL;
 
   m_inlier_indices = NULL;
 
@@ -156,7 +177,9 @@ void db_FrameToReferenceRegistration::Init(int width, int height,
                        float cm_max_disparity,
                            bool   cm_use_smaller_matching_window,
                        int    cd_nr_horz_blocks,
-                       int    cd_nr_vert_blocks
+                       int    cd_nr_vert_blocks,
+                       float  ransac_confidence,
+                       bool   guided_sampling
                        )
 {
   Clean();
@@ -171,7 +194,8 @@ void db_FrameToReferenceRegistration::Init(int width, int height,
 
   m_quarter_resolution = quarter_resolution;
 
-  profile_string = new char[10240];
+  profile_string = new char[DB_PROFILE_STRING_SIZE];
+  profile_string[0] = '\0';
 
   if (m_quarter_resolution == true)
   {
@@ -193,6 +217,8 @@ void db_FrameToReferenceRegistration::Init(int width, int height,
   m_scale = 2/(m_K[0]+m_K[4]);
   m_nr_samples = nr_samples;
   m_chunk_size = chunk_size;
+  m_ransac_confidence = ransac_confidence;
+  m_guided_sampling = guided_sampling;
 
   float outlier_t1 = 5.0;
 
@@ -221,9 +247,10 @@ void db_FrameToReferenceRegistration::Init(int width, int height,
   // allocate space for match indices:
   m_match_index_ref = new int [m_max_nr_matches];
   m_match_index_ins = new int [m_max_nr_matches];
+  m_match_scores = new float [m_max_nr_matches];
 
-  m_temp_float = new float [12*DB_DEFAULT_NR_SAMPLES+10*m_max_nr_matches];
-  m_temp_int = new int [db_maxi(DB_DEFAULT_NR_SAMPLES,m_max_nr_matches)];
+  m_temp_float = new float [12*m_nr_samples+10*m_max_nr_matches];
+  m_temp_int = new int [db_maxi(m_nr_samples,m_max_nr_matches)];
 
   // allocate space for homogenous image points:
   m_corners_ref = new float [3*m_max_nr_corners];
@@ -354,11 +381,9 @@ int db_FrameToReferenceRegistration::AddFrame(const unsigned char * const * im,
 
   // @jke - Adding code to time the functions.  TODO: Remove after test
 #if PROFILE
-  float iTimer1, iTimer2;
-  char str[255];
-  strcpy(profile_string,"\n");
-  sprintf(str,"[%dx%d] %p\n",m_im_width,m_im_height,im);
-  strcat(profile_string, str);
+  double iTimer1, iTimer2;
+  profile_string[0] = '\0';
+  AppendProfile("\n[%dx%d] %p\n",m_im_width,m_im_height,im);
 #endif
 
   // @jke - Adding code to time the functions.  TODO: Remove after test
@@ -369,9 +394,8 @@ int db_FrameToReferenceRegistration::AddFrame(const unsigned char * const * im,
   // @jke - Adding code to time the functions.  TODO: Remove after test
 # if PROFILE
   iTimer2 = now_ms();
-  float elapsedTimeCorner = iTimer2 - iTimer1;
-  sprintf(str,"Corner Detection [%d corners] = %g ms\n",m_nr_corners_ins, elapsedTimeCorner);
-  strcat(profile_string, str);
+  double elapsedTimeCorner = iTimer2 - iTimer1;
+  AppendProfile("Corner Detection [%d corners] = %g ms\n",m_nr_corners_ins, elapsedTimeCorner);
 #endif
 
   // @jke - Adding code to time the functions.  TODO: Remove after test
@@ -381,17 +405,16 @@ int db_FrameToReferenceRegistration::AddFrame(const unsigned char * const * im,
     if(prewarp)
   m_cm.Match(m_reference_image,imptr,m_x_corners_ref,m_y_corners_ref,m_nr_corners_ref,
          m_x_corners_ins,m_y_corners_ins,m_nr_corners_ins,
-         m_match_index_ref,m_match_index_ins,&m_nr_matches,H,0);
+         m_match_index_ref,m_match_index_ins,&m_nr_matches,H,0,m_match_scores);
     else
   m_cm.Match(m_reference_image,imptr,m_x_corners_ref,m_y_corners_ref,m_nr_corners_ref,
          m_x_corners_ins,m_y_corners_ins,m_nr_corners_ins,
-         m_match_index_ref,m_match_index_ins,&m_nr_matches);
+         m_match_index_ref,m_match_index_ins,&m_nr_matches,0,0,m_match_scores);
   // @jke - Adding code to time the functions.  TODO: Remove after test
 # if PROFILE
   iTimer2 = now_ms();
-  float elapsedTimeMatch = iTimer2 - iTimer1;
-  sprintf(str,"Matching [%d] = %g ms\n",m_nr_matches,elapsedTimeMatch);
-  strcat(profile_string, str);
+  double elapsedTimeMatch = iTimer2 - iTimer1;
+  AppendProfile("Matching [%d] = %g ms\n",m_nr_matches,elapsedTimeMatch);
 #endif
 
 
@@ -415,13 +438,13 @@ int db_FrameToReferenceRegistration::AddFrame(const unsigned char * const * im,
   // perform the alignment:
   db_RobImageHomography(m_H_ref_to_ins, m_corners_ref, m_corners_ins, m_nr_matches, m_K, m_K, m_temp_float, m_temp_int,
             m_homography_type,NULL,m_max_iterations,m_max_nr_matches,m_scale,
-            m_nr_samples, m_chunk_size);
+            m_nr_samples, m_chunk_size, 0, NULL, NULL, NULL, NULL, NULL, &m_pool,
+            m_ransac_confidence, m_guided_sampling ? m_match_scores : NULL);
   // @jke - Adding code to time the functions.  TODO: Remove after test
 # if PROFILE
   iTimer2 = now_ms();
-  float elapsedTimeHomography = iTimer2 - iTimer1;
-  sprintf(str,"Homography = %g ms\n",elapsedTimeHomography);
-  strcat(profile_string, str);
+  double elapsedTimeHomography = iTimer2 - iTimer1;
+  AppendProfile("Homography = %g ms\n",elapsedTimeHomography);
 #endif
 
 
@@ -444,8 +467,7 @@ int db_FrameToReferenceRegistration::AddFrame(const unsigned char * const * im,
   }
 
 #if PROFILE
-  sprintf(str,"#Inliers = %d \n",m_num_inlier_indices);
-  strcat(profile_string, str);
+  AppendProfile("#Inliers = %d \n",m_num_inlier_indices);
 #endif
 /*
   ///// CHECK IF CURRENT TRANSFORMATION GOOD OR BAD ////
@@ -548,7 +570,8 @@ void db_FrameToReferenceRegistration::EstimateSecondaryModel(float H[9])
   // perform the alignment:
   db_RobImageHomography(m_H_ref_to_ins, m_corners_ref, m_corners_ins, m_nr_matches, m_K, m_K, m_temp_float, m_temp_int,
             m_homography_type,NULL,m_max_iterations,m_max_nr_matches,m_scale,
-            m_nr_samples, m_chunk_size);
+            m_nr_samples, m_chunk_size, 0, NULL, NULL, NULL, NULL, NULL, &m_pool,
+            m_ransac_confidence, m_guided_sampling ? m_match_scores : NULL);
 
   db_Copy9(H,m_H_ref_to_ins);
 }
@@ -578,6 +601,7 @@ void db_FrameToReferenceRegistration::SelectOutliers()
       int offset = 3*nr_outliers++;
       db_Copy3(m_corners_ref+offset,m_corners_ref+k);
       db_Copy3(m_corners_ins+offset,m_corners_ins+k);
+      m_match_scores[nr_outliers-1] = m_match_scores[c];
     }
     }
 
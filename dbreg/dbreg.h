@@ -20,6 +20,9 @@
 // @jke - the next few lines are for extracting timing data.  TODO: Remove after test
 #define PROFILE 0
 
+// Size of the per-registration profile_string buffer
+#define DB_PROFILE_STRING_SIZE 10240
+
 #include "dbstabsmooth.h"
 
 #include "db_vlvm/db_feature_detection.h"
@@ -140,6 +143,8 @@ public:
      * \param cm_use_smaller_matching_window    if set to true, uses a correlation window of 5x5 instead of the default 11x11
      * \param cd_nr_horz_blocks     the number of horizontal blocks for the corner detector to partition the image
      * \param cd_nr_vert_blocks     the number of vertical blocks for the corner detector to partition the image
+     * \param ransac_confidence     0 to always draw nr_samples homography hypotheses, otherwise stop drawing them once one without outliers has been drawn with this probability (e.g. 0.99)
+     * \param guided_sampling       whether to draw the homography hypotheses from the best correlated matches first
     */
     void Init(int width, int height,
           int       homography_type = DB_HOMOGRAPHY_TYPE_DEFAULT,
@@ -156,7 +161,9 @@ public:
           float cm_max_disparity = 0.2,
           bool   cm_use_smaller_matching_window = false,
           int    cd_nr_horz_blocks = 5,
-          int    cd_nr_vert_blocks = 5);
+          int    cd_nr_vert_blocks = 5,
+          float  ransac_confidence = 0.0f,
+          bool   guided_sampling = false);
 
     /*!
      * Reset the transformation type that is being use to perform alignment. Use this to change the alignment type at run time.
@@ -170,6 +177,12 @@ public:
     */
     void ResetSmoothing(bool enable) { m_do_motion_smoothing = enable; }
 
+    /*!
+     * Set the number of threads used to detect and match the corners of each frame and to score the homography hypotheses. 1 (default) runs on the calling thread, 0 uses one thread per online CPU. The alignment does not depend on it.
+     * \param nr_threads   number of threads
+    */
+    void SetNrThreads(int nr_threads) { m_cd.SetNrThreads(nr_threads); m_cm.SetNrThreads(nr_threads); m_pool.SetNrThreads(nr_threads); }
+
     /*!
      * Align an inspection image to an existing reference image, update the reference image if due and perform motion smoothing if enabled.
      * \param im                new inspection image
@@ -282,6 +295,8 @@ public:
 
 protected:
     void Clean();
+    // Append a printf-style line to profile_string, truncating when it is full
+    void AppendProfile(const char *format, ...);
     void GenerateQuarterResImage(const unsigned char* const * im);
 
     int     m_im_width;
@@ -293,6 +308,8 @@ protected:
     float  m_scale;
     int     m_nr_samples;
     int     m_chunk_size;
+    float  m_ransac_confidence;
+    bool   m_guided_sampling;
     float  m_outlier_t2;
 
     // Whether to fit a linear model to just the inliers at the end
@@ -312,6 +329,9 @@ protected:
     db_CornerDetector_u m_cd;
     db_Matcher_u        m_cm;
 
+    // threads scoring the homography hypotheses:
+    db_ThreadPool       m_pool;
+
     // length of corner arrays:
     unsigned long m_max_nr_corners;
 
@@ -333,6 +353,9 @@ protected:
     int * m_match_index_ins;
     int   m_nr_matches;
 
+    // correlation scores of the matches, for guided sampling:
+    float * m_match_scores;
+
     // pointer to internal copy of the reference image:
     unsigned char ** m_reference_image;
 
@@ -558,14 +581,14 @@ inline float SquaredInhomogenousHomographyError(float y[3],float H[9],float x[3]
 #if PROFILE
 
 /* return current time in milliseconds */
-static float
+static double
 now_ms(void)
 {
     //struct timespec res;
     struct timeval res;
     //clock_gettime(CLOCK_REALTIME, &res);
     gettimeofday(&res, NULL);
-    return 1000.0*res.tv_sec + (float)res.tv_usec/1e3;
+    return 1000.0*res.tv_sec + (double)res.tv_usec/1e3;
 }
 
 #endif
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/time.h>
 #include <db_utilities_camera.h>
 
 #include "mosaic/AlignFeatures.h"
@@ -36,36 +37,62 @@ extern "C" {
 
 #include "mosaic_renderer_jni.h"
 
-char buffer[1024];
-
 const int MAX_FRAMES = 100;
 
-static double mTx;
-
-int tWidth[NR];
-int tHeight[NR];
-
-ImageType tImage[NR][MAX_FRAMES];// = {{ImageUtils::IMAGE_TYPE_NOIMAGE}}; // YVU24 format image
-Mosaic *mosaic[NR] = {NULL,NULL};
-ImageType resultYVU = ImageUtils::IMAGE_TYPE_NOIMAGE;
-ImageType resultBGR = ImageUtils::IMAGE_TYPE_NOIMAGE;
-float gTRS[11]; // 9 elements of the transformation, 1 for frame-number, 1 for alignment error code.
-// Variables to keep track of the mosaic computation progress for both LR & HR.
-float gProgress[NR];
-// Variables to be able to cancel the mosaic computation when the GUI says so.
-bool gCancelComputation[NR];
-
-int c;
-int width=0, height=0;
-int mosaicWidth=0, mosaicHeight=0;
-
-//int blendingType = Blend::BLEND_TYPE_FULL;
-//int blendingType = Blend::BLEND_TYPE_CYLPAN;
-int blendingType = Blend::BLEND_TYPE_HORZ;
-int stripType = Blend::STRIP_TYPE_THIN;
-bool high_res = false;
-bool quarter_res[NR] = {false,false};
-float thresh_still[NR] = {5.0f,0.0f};
+// State of a panorama capture. The Java Mosaic class drives a single
+// capture, so the entry points below all work on gContext; everything else
+// only touches the context it is handed.
+class MosaicContext
+{
+public:
+    MosaicContext()
+    {
+        for (int i = 0; i < NR; i++)
+        {
+            tWidth[i] = tHeight[i] = 0;
+            for (int k = 0; k < MAX_FRAMES; k++)
+                tImage[i][k] = ImageUtils::IMAGE_TYPE_NOIMAGE;
+            mosaic[i] = NULL;
+            gProgress[i] = 0.0f;
+            gCancelComputation[i] = false;
+            quarter_res[i] = false;
+        }
+        resultYVU = ImageUtils::IMAGE_TYPE_NOIMAGE;
+        mosaicWidth = mosaicHeight = 0;
+        //blendingType = Blend::BLEND_TYPE_FULL;
+        //blendingType = Blend::BLEND_TYPE_CYLPAN;
+        blendingType = Blend::BLEND_TYPE_HORZ;
+        stripType = Blend::STRIP_TYPE_THIN;
+        thresh_still[LR] = 5.0f;
+        thresh_still[HR] = 0.0f;
+        frame_number_HR = frame_number_LR = 0;
+    }
+
+    int tWidth[NR];
+    int tHeight[NR];
+
+    ImageType tImage[NR][MAX_FRAMES]; // YVU24 format image
+    Mosaic *mosaic[NR];
+    ImageType resultYVU;
+    float gTRS[11]; // 9 elements of the transformation, 1 for frame-number, 1 for alignment error code.
+    // Variables to keep track of the mosaic computation progress for both LR & HR.
+    float gProgress[NR];
+    // Variables to be able to cancel the mosaic computation when the GUI says so.
+    bool gCancelComputation[NR];
+
+    int mosaicWidth, mosaicHeight;
+
+    int blendingType;
+    int stripType;
+    bool quarter_res[NR];
+    float thresh_still[NR];
+
+    // Frames captured so far
+    int frame_number_HR;
+    int frame_number_LR;
+};
+
+static MosaicContext gContext;
 
 /* return current time in milliseconds*/
 
@@ -81,36 +108,25 @@ now_ms(void)
 }
 #endif
 
-
-static int frame_number_HR = 0;
-static int frame_number_LR = 0;
-
-int Init(int mID, int nmax)
+int Init(MosaicContext &ctx, int mID, int nmax)
 {
         double  t0, t1, time_c;
 
-        if(mosaic[mID]!=NULL)
-        {
-                delete mosaic[mID];
-                mosaic[mID] = NULL;
-        }
-
-        mosaic[mID] = new Mosaic();
+        // The mosaic of the previous capture is initialized again, which
+        // recycles its frame slots and blending memory
+        if(ctx.mosaic[mID]==NULL)
+                ctx.mosaic[mID] = new Mosaic();
 
         t0 = now_ms();
 
         // When processing higher than 720x480 video, process low-res at
         // quarter resolution
-        if(tWidth[LR]>180)
-            quarter_res[LR] = true;
+        if(ctx.tWidth[LR]>180)
+            ctx.quarter_res[LR] = true;
 
 
-        // Check for initialization and if not, initialize
-        if (!mosaic[mID]->isInitialized())
-        {
-                mosaic[mID]->initialize(blendingType, stripType, tWidth[mID], tHeight[mID],
-                        nmax, quarter_res[mID], thresh_still[mID]);
-        }
+        ctx.mosaic[mID]->initialize(ctx.blendingType, ctx.stripType, ctx.tWidth[mID], ctx.tHeight[mID],
+                nmax, ctx.quarter_res[mID], ctx.thresh_still[mID]);
 
         t1 = now_ms();
         time_c = t1 - t0;
@@ -163,14 +179,14 @@ void GenerateQuarterResImagePlanar(ImageType im, int input_w, int input_h,
     }
 }
 
-int AddFrame(int mID, int k, float* trs1d)
+int AddFrame(MosaicContext &ctx, int mID, int k, float* trs1d)
 {
     double  t0, t1, time_c;
-    double trs[3][3];
+    float trs[3][3];
 
-    int ret_code = mosaic[mID]->addFrame(tImage[mID][k]);
+    int ret_code = ctx.mosaic[mID]->addFrame(ctx.tImage[mID][k]);
 
-    mosaic[mID]->getAligner()->getLastTRS(trs);
+    ctx.mosaic[mID]->getAligner()->getLastTRS(trs);
 
     if(trs1d!=NULL)
     {
@@ -189,19 +205,19 @@ int AddFrame(int mID, int k, float* trs1d)
     return ret_code;
 }
 
-int Finalize(int mID)
+int Finalize(MosaicContext &ctx, int mID)
 {
     double  t0, t1, time_c;
 
     t0 = now_ms();
     // Create the mosaic
-    int ret = mosaic[mID]->createMosaic(gProgress[mID], gCancelComputation[mID]);
+    int ret = ctx.mosaic[mID]->createMosaic(ctx.gProgress[mID], ctx.gCancelComputation[mID]);
     t1 = now_ms();
     time_c = t1 - t0;
     LOGV("CreateMosaic: %g ms",time_c);
 
     // Get back the result
-    resultYVU = mosaic[mID]->getMosaic(mosaicWidth, mosaicHeight);
+    ctx.resultYVU = ctx.mosaic[mID]->getMosaic(ctx.mosaicWidth, ctx.mosaicHeight);
 
     return ret;
 }
@@ -277,6 +293,10 @@ void YUV420toYVU24_NEW(ImageType yvu24, ImageType yuv420sp, int width,
 JNIEXPORT void JNICALL Java_com_android_camera_Mosaic_allocateMosaicMemory(
         JNIEnv* env, jobject thiz, jint width, jint height)
 {
+    MosaicContext &ctx = gContext;
+    int *tWidth = ctx.tWidth;
+    int *tHeight = ctx.tHeight;
+
     tWidth[HR] = width;
     tHeight[HR] = height;
     tWidth[LR] = int(width / H2L_FACTOR);
@@ -284,9 +304,9 @@ JNIEXPORT void JNICALL Java_com_android_camera_Mosaic_allocateMosaicMemory(
 
     for(int i=0; i<MAX_FRAMES; i++)
     {
-            tImage[LR][i] = ImageUtils::allocateImage(tWidth[LR], tHeight[LR],
+            ctx.tImage[LR][i] = ImageUtils::allocateImage(tWidth[LR], tHeight[LR],
                     ImageUtils::IMAGE_TYPE_NUM_CHANNELS);
-            tImage[HR][i] = ImageUtils::allocateImage(tWidth[HR], tHeight[HR],
+            ctx.tImage[HR][i] = ImageUtils::allocateImage(tWidth[HR], tHeight[HR],
                     ImageUtils::IMAGE_TYPE_NUM_CHANNELS);
     }
 
@@ -296,10 +316,20 @@ JNIEXPORT void JNICALL Java_com_android_camera_Mosaic_allocateMosaicMemory(
 JNIEXPORT void JNICALL Java_com_android_camera_Mosaic_freeMosaicMemory(
         JNIEnv* env, jobject thiz)
 {
+    MosaicContext &ctx = gContext;
+
     for(int i = 0; i < MAX_FRAMES; i++)
     {
-        ImageUtils::freeImage(tImage[LR][i]);
-        ImageUtils::freeImage(tImage[HR][i]);
+        ImageUtils::freeImage(ctx.tImage[LR][i]);
+        ImageUtils::freeImage(ctx.tImage[HR][i]);
+        ctx.tImage[LR][i] = ctx.tImage[HR][i] = ImageUtils::IMAGE_TYPE_NOIMAGE;
+    }
+
+    // Along with the memory they kept for the next capture
+    for(int i = 0; i < NR; i++)
+    {
+        delete ctx.mosaic[i];
+        ctx.mosaic[i] = NULL;
     }
 
     FreeTextureMemory();
@@ -342,8 +372,6 @@ void decodeYUV444SP(unsigned char* rgb, unsigned char* yuv420sp, int width,
     }
 }
 
-static int count = 0;
-
 void ConvertYVUAiToPlanarYVU(unsigned char *planar, unsigned char *in, int width,
         int height)
 {
@@ -364,28 +392,30 @@ void ConvertYVUAiToPlanarYVU(unsigned char *planar, unsigned char *in, int width
 JNIEXPORT jfloatArray JNICALL Java_com_android_camera_Mosaic_setSourceImageFromGPU(
         JNIEnv* env, jobject thiz)
 {
+    MosaicContext &ctx = gContext;
+    int &frame_number_HR = ctx.frame_number_HR;
+    int &frame_number_LR = ctx.frame_number_LR;
+    float *gTRS = ctx.gTRS;
     double  t0, t1, time_c;
     t0 = now_ms();
     int ret_code = Mosaic::MOSAIC_RET_OK;
 
     if(frame_number_HR<MAX_FRAMES && frame_number_LR<MAX_FRAMES)
     {
-        double last_tx = mTx;
-
         sem_wait(&gPreviewImage_semaphore);
-        ConvertYVUAiToPlanarYVU(tImage[LR][frame_number_LR], gPreviewImage[LR],
-                tWidth[LR], tHeight[LR]);
+        ConvertYVUAiToPlanarYVU(ctx.tImage[LR][frame_number_LR], gPreviewImage[LR],
+                ctx.tWidth[LR], ctx.tHeight[LR]);
 
         sem_post(&gPreviewImage_semaphore);
 
-        ret_code = AddFrame(LR, frame_number_LR, gTRS);
+        ret_code = AddFrame(ctx, LR, frame_number_LR, gTRS);
 
         if(ret_code == Mosaic::MOSAIC_RET_OK || ret_code == Mosaic::MOSAIC_RET_FEW_INLIERS)
         {
             // Copy into HR buffer only if this is a valid frame
             sem_wait(&gPreviewImage_semaphore);
-            ConvertYVUAiToPlanarYVU(tImage[HR][frame_number_HR], gPreviewImage[HR],
-                    tWidth[HR], tHeight[HR]);
+            ConvertYVUAiToPlanarYVU(ctx.tImage[HR][frame_number_HR], gPreviewImage[HR],
+                    ctx.tWidth[HR], ctx.tHeight[HR]);
             sem_post(&gPreviewImage_semaphore);
 
             frame_number_LR++;
@@ -416,6 +446,10 @@ JNIEXPORT jfloatArray JNICALL Java_com_android_camera_Mosaic_setSourceImageFromG
 JNIEXPORT jfloatArray JNICALL Java_com_android_camera_Mosaic_setSourceImage(
         JNIEnv* env, jobject thiz, jbyteArray photo_data)
 {
+    MosaicContext &ctx = gContext;
+    int &frame_number_HR = ctx.frame_number_HR;
+    int &frame_number_LR = ctx.frame_number_LR;
+    float *gTRS = ctx.gTRS;
     double  t0, t1, time_c;
     t0 = now_ms();
 
@@ -425,24 +459,22 @@ JNIEXPORT jfloatArray JNICALL Java_com_android_camera_Mosaic_setSourceImage(
     {
         jbyte *pixels = env->GetByteArrayElements(photo_data, 0);
 
-        YUV420toYVU24_NEW(tImage[HR][frame_number_HR], (ImageType)pixels,
-                tWidth[HR], tHeight[HR]);
+        YUV420toYVU24_NEW(ctx.tImage[HR][frame_number_HR], (ImageType)pixels,
+                ctx.tWidth[HR], ctx.tHeight[HR]);
 
         env->ReleaseByteArrayElements(photo_data, pixels, 0);
 
-        double last_tx = mTx;
-
         t0 = now_ms();
-        GenerateQuarterResImagePlanar(tImage[HR][frame_number_HR], tWidth[HR],
-                tHeight[HR], tImage[LR][frame_number_LR]);
+        GenerateQuarterResImagePlanar(ctx.tImage[HR][frame_number_HR], ctx.tWidth[HR],
+                ctx.tHeight[HR], ctx.tImage[LR][frame_number_LR]);
 
 
         sem_wait(&gPreviewImage_semaphore);
-        decodeYUV444SP(gPreviewImage[LR], tImage[LR][frame_number_LR],
+        decodeYUV444SP(gPreviewImage[LR], ctx.tImage[LR][frame_number_LR],
                 gPreviewImageWidth[LR], gPreviewImageHeight[LR]);
         sem_post(&gPreviewImage_semaphore);
 
-        ret_code = AddFrame(LR, frame_number_LR, gTRS);
+        ret_code = AddFrame(ctx, LR, frame_number_LR, gTRS);
 
         if(ret_code == Mosaic::MOSAIC_RET_OK || ret_code == Mosaic::MOSAIC_RET_FEW_INLIERS)
         {
@@ -473,33 +505,38 @@ JNIEXPORT jfloatArray JNICALL Java_com_android_camera_Mosaic_setSourceImage(
 JNIEXPORT void JNICALL Java_com_android_camera_Mosaic_setBlendingType(
         JNIEnv* env, jobject thiz, jint type)
 {
-    blendingType = int(type);
+    gContext.blendingType = int(type);
 }
 
 JNIEXPORT void JNICALL Java_com_android_camera_Mosaic_setStripType(
         JNIEnv* env, jobject thiz, jint type)
 {
-    stripType = int(type);
+    gContext.stripType = int(type);
 }
 
 JNIEXPORT void JNICALL Java_com_android_camera_Mosaic_reset(
         JNIEnv* env, jobject thiz)
 {
-    frame_number_HR = 0;
-    frame_number_LR = 0;
+    MosaicContext &ctx = gContext;
+
+    ctx.frame_number_HR = 0;
+    ctx.frame_number_LR = 0;
 
-    gProgress[LR] = 0.0;
-    gProgress[HR] = 0.0;
+    ctx.gProgress[LR] = 0.0;
+    ctx.gProgress[HR] = 0.0;
 
-    gCancelComputation[LR] = false;
-    gCancelComputation[HR] = false;
+    ctx.gCancelComputation[LR] = false;
+    ctx.gCancelComputation[HR] = false;
 
-    Init(LR,MAX_FRAMES);
+    Init(ctx, LR, MAX_FRAMES);
 }
 
 JNIEXPORT jint JNICALL Java_com_android_camera_Mosaic_reportProgress(
         JNIEnv* env, jobject thiz, jboolean hires, jboolean cancel_computation)
 {
+    bool *gCancelComputation = gContext.gCancelComputation;
+    float *gProgress = gContext.gProgress;
+
     if(bool(hires))
         gCancelComputation[HR] = cancel_computation;
     else
@@ -514,7 +551,11 @@ JNIEXPORT jint JNICALL Java_com_android_camera_Mosaic_reportProgress(
 JNIEXPORT jint JNICALL Java_com_android_camera_Mosaic_createMosaic(
         JNIEnv* env, jobject thiz, jboolean value)
 {
-    high_res = bool(value);
+    MosaicContext &ctx = gContext;
+    int frame_number_HR = ctx.frame_number_HR;
+    bool *gCancelComputation = ctx.gCancelComputation;
+    float *gProgress = ctx.gProgress;
+    bool high_res = bool(value);
 
     int ret;
 
@@ -526,13 +567,13 @@ JNIEXPORT jint JNICALL Java_com_android_camera_Mosaic_createMosaic(
         gProgress[HR] = 0.0;
         t0 = now_ms();
 
-        Init(HR, frame_number_HR);
+        Init(ctx, HR, frame_number_HR);
 
         for(int k = 0; k < frame_number_HR; k++)
         {
             if (gCancelComputation[HR])
                 break;
-            AddFrame(HR, k, NULL);
+            AddFrame(ctx, HR, k, NULL);
             gProgress[HR] += TIME_PERCENT_ALIGN/frame_number_HR;
         }
 
@@ -548,19 +589,17 @@ JNIEXPORT jint JNICALL Java_com_android_camera_Mosaic_createMosaic(
             time_c = t1 - t0;
             LOGV("AlignAll - %d frames [HR]: %g ms", frame_number_HR, time_c);
 
-            ret = Finalize(HR);
+            ret = Finalize(ctx, HR);
 
             gProgress[HR] = 100.0;
         }
-
-        high_res = false;
     }
     else
     {
         LOGV("createMosaic() - Low-Res Mode");
         gProgress[LR] = TIME_PERCENT_ALIGN;
 
-        ret = Finalize(LR);
+        ret = Finalize(ctx, LR);
 
         gProgress[LR] = 100.0;
     }
@@ -571,15 +610,16 @@ JNIEXPORT jint JNICALL Java_com_android_camera_Mosaic_createMosaic(
 JNIEXPORT jintArray JNICALL Java_com_android_camera_Mosaic_getFinalMosaic(
         JNIEnv* env, jobject thiz)
 {
+    MosaicContext &ctx = gContext;
     int y,x;
-    int width = mosaicWidth;
-    int height = mosaicHeight;
+    int width = ctx.mosaicWidth;
+    int height = ctx.mosaicHeight;
     int imageSize = width * height;
 
     // Convert back to RGB24
-    resultBGR = ImageUtils::allocateImage(mosaicWidth, mosaicHeight,
+    ImageType resultBGR = ImageUtils::allocateImage(width, height,
             ImageUtils::IMAGE_TYPE_NUM_CHANNELS);
-    ImageUtils::yvu2bgr(resultBGR, resultYVU, mosaicWidth, mosaicHeight);
+    ImageUtils::yvu2bgr(resultBGR, ctx.resultYVU, width, height);
 
     LOGV("MosBytes: %d, W = %d, H = %d", imageSize, width, height);
 
@@ -616,6 +656,10 @@ JNIEXPORT jintArray JNICALL Java_com_android_camera_Mosaic_getFinalMosaic(
 JNIEXPORT jbyteArray JNICALL Java_com_android_camera_Mosaic_getFinalMosaicNV21(
         JNIEnv* env, jobject thiz)
 {
+    MosaicContext &ctx = gContext;
+    int mosaicWidth = ctx.mosaicWidth;
+    int mosaicHeight = ctx.mosaicHeight;
+    ImageType resultYVU = ctx.resultYVU;
     int y,x;
     int width;
     int height;
@@ -625,17 +669,18 @@ JNIEXPORT jbyteArray JNICALL Java_com_android_camera_Mosaic_getFinalMosaicNV21(
 
     int imageSize = 1.5*width * height;
 
-    // Convert YVU to NV21 format in-place
+    // Interleave the 4:2:0 V and U planes into NV21. The U plane is read
+    // after the V plane has overwritten it, so keep a copy of it.
+    int csize = (mosaicWidth/2) * (mosaicHeight/2);
     ImageType V = resultYVU+mosaicWidth*mosaicHeight;
-    ImageType U = V+mosaicWidth*mosaicHeight;
-    for(int j=0; j<mosaicHeight/2; j++)
+    ImageType U = new ImageTypeBase[csize];
+    memcpy(U, V+csize, csize);
+    for(int k=csize-1; k>=0; k--)
     {
-        for(int i=0; i<mosaicWidth; i+=2)
-        {
-            V[j*mosaicWidth+i] = V[(2*j)*mosaicWidth+i];        // V
-            V[j*mosaicWidth+i+1] = U[(2*j)*mosaicWidth+i];        // U
-        }
+        V[2*k] = V[k];                  // V
+        V[2*k+1] = U[k];                // U
     }
+    delete[] U;
 
     LOGV("MosBytes: %d, W = %d, H = %d", imageSize, width, height);
 
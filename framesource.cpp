@@ -0,0 +1,114 @@
+#include "framesource.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <iostream>
+
+FrameSource::FrameSource() :
+  m_data(0),
+  m_size(0),
+  m_frameSize(0),
+  m_frames(0) {
+
+}
+
+FrameSource::~FrameSource() {
+  close();
+}
+
+bool FrameSource::open(const char *path, size_t frameSize) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd == -1) {
+    perror("open");
+    return false;
+  }
+
+  struct stat buf;
+  if (fstat(fd, &buf) != 0) {
+    perror("fstat");
+    ::close(fd);
+    return false;
+  }
+
+  if (frameSize == 0 || (size_t) buf.st_size < frameSize) {
+    std::cerr << "input holds no whole frame" << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  size_t frames = (size_t) buf.st_size / frameSize;
+  size_t size = frames * frameSize;
+
+  // The mapping keeps the file open
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  m_data = (unsigned char *) data;
+  m_size = size;
+  m_frameSize = frameSize;
+  m_frames = (int) frames;
+
+  // Frames are mostly used in order, once while aligning and once more
+  // while blending: read ahead aggressively and drop pages behind.
+  advise(0, m_size, MADV_SEQUENTIAL);
+
+  return true;
+}
+
+void FrameSource::close() {
+  if (m_data) {
+    munmap(m_data, m_size);
+  }
+
+  m_data = 0;
+  m_size = 0;
+  m_frameSize = 0;
+  m_frames = 0;
+}
+
+unsigned char *FrameSource::frame(int n) {
+  if (n < 0 || n >= m_frames) {
+    return 0;
+  }
+
+  if (n + 1 < m_frames) {
+    advise((n + 1) * m_frameSize, m_frameSize, MADV_WILLNEED);
+  }
+
+  return m_data + n * m_frameSize;
+}
+
+void FrameSource::release(int n) {
+  if (n < 0 || n >= m_frames) {
+    return;
+  }
+
+  // Only the pages entirely within the frame, the others are shared with
+  // its neighbours
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  size_t start = ((n * m_frameSize + page - 1) / page) * page;
+  size_t end = ((n + 1) * m_frameSize / page) * page;
+
+  if (end > start) {
+    madvise(m_data + start, end - start, MADV_DONTNEED);
+  }
+}
+
+// madvise() over [offset, offset + length), widened to whole pages
+void FrameSource::advise(size_t offset, size_t length, int advice) {
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  size_t start = (offset / page) * page;
+  size_t end = offset + length;
+
+  madvise(m_data + start, end - start, advice);
+}
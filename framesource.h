@@ -0,0 +1,38 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stddef.h>
+
+// Raw frames of a capture dump, all of the same size. The file is mapped
+// rather than read: frame() points straight into it, so frames are handed
+// to the stitcher without being copied and the kernel decides which of them
+// stay in memory. Frames are read-only and valid until the source is closed.
+class FrameSource {
+public:
+  FrameSource();
+  ~FrameSource();
+
+  // Maps path, which must hold at least one whole frame. Trailing bytes
+  // that do not make up a frame are ignored.
+  bool open(const char *path, size_t frameSize);
+  void close();
+
+  int frames() const { return m_frames; }
+
+  // Returns frame n and lets the kernel start reading the next one.
+  unsigned char *frame(int n);
+
+  // Tells the kernel frame n is not needed anymore. Its pages are read
+  // again from the file if it is used after all.
+  void release(int n);
+
+private:
+  void advise(size_t offset, size_t length, int advice);
+
+  unsigned char *m_data;
+  size_t m_size;
+  size_t m_frameSize;
+  int m_frames;
+};
+
+#endif /* FRAME_SOURCE_H */
@@ -36,6 +36,7 @@ Align::Align()
   frame_number = 0;
   num_frames_captured = 0;
   reference_frame_index = 0;
+  still = false;
   db_Identity3x3(Hcurr);
   db_Identity3x3(Hprev);
 }
@@ -71,6 +72,7 @@ int Align::initialize(int width, int height, bool _quarter_res, float _thresh_st
   frame_number = 0;
   num_frames_captured = 0;
   reference_frame_index = 0;
+  still = false;
   db_Identity3x3(Hcurr);
   db_Identity3x3(Hprev);
 
@@ -90,12 +92,25 @@ int Align::initialize(int width, int height, bool _quarter_res, float _thresh_st
     return ALIGN_RET_ERROR;
 }
 
+void Align::setNumThreads(int numThreads)
+{
+  reg.SetNrThreads(numThreads);
+}
+
 int Align::addFrame(ImageType imageGray)
+{
+  return addFrame(imageGray, width);
+}
+
+int Align::addFrame(ImageType imageGray, int stride)
 {
   int ret_code = ALIGN_RET_OK;
+  still = false;
 
  // Obtain a vector of pointers to rows in image and pass in to dbreg
-  ImageType *m_rows = ImageUtils::imageTypeToRowPointers(imageGray, width, height);
+  ImageType *m_rows = ImageUtils::imageTypeToRowPointers(imageGray, width, height, stride);
+  if (m_rows == NULL)
+    return ALIGN_RET_ERROR;
 
   if (frame_number == 0)
   {
@@ -145,6 +160,7 @@ int Align::addFrame(ImageType imageGray)
 
     if(fabsf(Hcurr[2])<thresh_still && fabsf(Hcurr[5])<thresh_still)  // Still camera
     {
+        still = true;
         delete[] m_rows;
         return ALIGN_RET_ERROR;
     }
@@ -62,9 +62,20 @@ public:
   // Add a frame.  Note: The alignment computation is performed
   // in this function
   int addFrame(ImageType image);
+  // Same, with rows of the image stride bytes apart. A stride below the
+  // width returns ALIGN_RET_ERROR
+  int addFrame(ImageType image, int stride);
 
   // Obtain the TRS matrix from the last two frames
   int getLastTRS(float trs[3][3]);
+
+  // Whether the last frame was dropped for the camera not having moved
+  // more than thresh_still since the reference frame
+  bool isStill() const { return still; }
+
+  // Number of threads used for feature detection, see
+  // db_FrameToReferenceRegistration::SetNrThreads
+  void setNumThreads(int numThreads);
   char* getRegProfileString();
 
 protected:
@@ -84,6 +95,7 @@ protected:
 
   bool quarter_res;     // Whether to process at quarter resolution
   float thresh_still;   // Translation threshold in pixels to detect still camera
+  bool still;           // Whether the last frame was dropped as still
 };
 
 
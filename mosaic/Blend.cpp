@@ -19,6 +19,7 @@
 // $Id: Blend.cpp,v 1.22 2011/06/24 04:22:14 mbansal Exp $
 
 #include <string.h>
+#include <unistd.h>
 
 #include "Interp.h"
 #include "Blend.h"
@@ -32,43 +33,85 @@
 #include <arm_neon.h>
 #endif
 
-Blend::Blend()
+// Arguments of an additional blending thread
+typedef struct {
+    Blend *blend;
+    FramePyramids *fpyr;
+    PyramidWorkspace *work;
+} MergeThreadArgs;
+
+Blend::Blend(FramePool *pool)
 {
   imgMos = 0;
+  m_pool = pool;
+  m_Triangulator.setPool(pool);
+  m_AllSites = NULL;
+  m_pFrameYPyr = m_pFrameUPyr = m_pFrameVPyr = NULL;
+  m_pMosaicYPyr = m_pMosaicUPyr = m_pMosaicVPyr = NULL;
   m_wb.blendingType = BLEND_TYPE_NONE;
+  m_engine = BLEND_ENGINE_PYRAMID;
+  m_accY = m_accU = m_accV = m_accW = NULL;
+  m_numThreads = 1;
+  m_projTolerance = PROJECTION_TOLERANCE_DEFAULT;
+  m_incremental = false;
+  m_tileSize = 0;
+  m_haveRelevant = false;
+  m_prepareBudget = 0;
+  m_preparedBytes = 0;
+  m_pendingNext = 0;
+  m_prepareBusy = false;
+  m_prepareQuit = false;
+  m_prepareStarted = false;
+  pthread_mutex_init(&m_prepareMutex, NULL);
+  pthread_cond_init(&m_prepareCond, NULL);
 }
 
 Blend::~Blend()
 {
-    if (m_pFrameVPyr) free(m_pFrameVPyr);
-    if (m_pFrameUPyr) free(m_pFrameUPyr);
-    if (m_pFrameYPyr) free(m_pFrameYPyr);
+    StopPreparing();
+    ReleasePreparedFrames();
+    pthread_cond_destroy(&m_prepareCond);
+    pthread_mutex_destroy(&m_prepareMutex);
+    for (int k = 0; k < (int) m_workspaces.size(); k++)
+        delete m_workspaces[k];
+    PyramidShort::freePyramid(m_pFrameVPyr, m_pool);
+    PyramidShort::freePyramid(m_pFrameUPyr, m_pool);
+    PyramidShort::freePyramid(m_pFrameYPyr, m_pool);
     if (imgMos) delete imgMos;
 }
 
-int Blend::initialize(int blendingType, int stripType, int frame_width, int frame_height)
+int Blend::initialize(int blendingType, int stripType, int frame_width, int frame_height, int engine)
 {
     this->width = frame_width;
     this->height = frame_height;
     this->m_wb.blendingType = blendingType;
     this->m_wb.stripType = stripType;
+    this->m_engine = engine;
 
     m_wb.blendRange = m_wb.blendRangeUV = BLEND_RANGE_DEFAULT;
     m_wb.nlevs = m_wb.blendRange;
-    m_wb.nlevsC = m_wb.blendRangeUV;
+    // The chroma is blended at its native half resolution: chroma level k
+    // lines up with luma level k + 1, so the coarsest chroma level is the
+    // same as if the chroma pyramids started at full resolution
+    m_wb.nlevsC = m_wb.blendRangeUV - 1;
 
-    if (m_wb.nlevs <= 0) m_wb.nlevs = 1; // Need levels for YUV processing
-    if (m_wb.nlevsC > m_wb.nlevs) m_wb.nlevsC = m_wb.nlevs;
+    if (m_wb.nlevs < 2) m_wb.nlevs = 2; // Need levels for YUV processing
+    if (m_wb.nlevsC > m_wb.nlevs - 1) m_wb.nlevsC = m_wb.nlevs - 1;
+    if (m_wb.nlevsC < 1) m_wb.nlevsC = 1;
 
     m_wb.roundoffOverlap = 1.5;
 
-    m_pFrameYPyr = NULL;
-    m_pFrameUPyr = NULL;
-    m_pFrameVPyr = NULL;
+    StopPreparing();
+    ReleasePreparedFrames();
+
+    // The blender may be initialized again for the next panorama
+    PyramidShort::freePyramid(m_pFrameVPyr, m_pool);
+    PyramidShort::freePyramid(m_pFrameUPyr, m_pool);
+    PyramidShort::freePyramid(m_pFrameYPyr, m_pool);
 
-    m_pFrameYPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevs, (unsigned short) width, (unsigned short) height, BORDER);
-    m_pFrameUPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, (unsigned short) (width), (unsigned short) (height), BORDER);
-    m_pFrameVPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, (unsigned short) (width), (unsigned short) (height), BORDER);
+    m_pFrameYPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevs, width, height, BORDER, m_pool);
+    m_pFrameUPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, width >> 1, height >> 1, BORDER, m_pool);
+    m_pFrameVPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, width >> 1, height >> 1, BORDER, m_pool);
 
     if (!m_pFrameYPyr || !m_pFrameUPyr || !m_pFrameVPyr)
     {
@@ -76,9 +119,232 @@ int Blend::initialize(int blendingType, int stripType, int frame_width, int fram
         return BLEND_RET_ERROR_MEMORY;
     }
 
+    // Scratch for decomposing frames; the calling thread's grows to the
+    // mosaic tiles it collapses the first time it meets them
+    if (m_workspaces.empty())
+        m_workspaces.push_back(new PyramidWorkspace());
+    if (!m_workspaces[0]->reserve(width, height, BORDER) ||
+            !m_prepareWorkspace.reserve(width, height, BORDER))
+    {
+        LOGE("Error: Could not allocate pyramid scratch for blending");
+        return BLEND_RET_ERROR_MEMORY;
+    }
+
+    return BLEND_RET_OK;
+}
+
+void Blend::setNumThreads(int numThreads)
+{
+    m_numThreads = numThreads;
+}
+
+void Blend::setProjectionTolerance(float tolerance)
+{
+    m_projTolerance = tolerance;
+}
+
+void Blend::setIncremental(bool incremental)
+{
+    m_incremental = incremental;
+}
+
+void Blend::setIncrementalBudget(size_t bytes)
+{
+    m_prepareBudget = bytes;
+}
+
+size_t Blend::framePyramidBytes()
+{
+    return PyramidShort::packedSize(m_wb.nlevs, width, height, BORDER) +
+            2 * PyramidShort::packedSize(m_wb.nlevsC, width >> 1, height >> 1, BORDER);
+}
+
+void Blend::setTileSize(int size)
+{
+    m_tileSize = size;
+}
+
+int Blend::addFrame(MosaicFrame *mb)
+{
+    if (!m_incremental || m_engine != BLEND_ENGINE_PYRAMID)
+        return BLEND_RET_OK;
+
+    // The mosaic geometry (cylinder parameters, extents and Voronoi sites)
+    // depends on the last frame, so nothing can be warped before runBlend.
+    // The Laplacian decomposition of a frame only depends on its pixels.
+    if (m_wb.stripType == STRIP_TYPE_WIDE)
+    {
+        // Same test as SelectRelevantFrames. The frame that ends up last is
+        // always blended; if it was skipped here it is decomposed by runBlend.
+        float midX = mb->width / 2.0;
+        float midY = mb->height / 2.0;
+        float z = ProjZ(mb->trs, midX, midY, 1.0);
+        float currX = ProjX(mb->trs, midX, midY, z, 1.0);
+        float currY = ProjY(mb->trs, midX, midY, z, 1.0);
+
+        if (m_haveRelevant)
+        {
+            if (fabsf(currX - m_lastRelevantX) <= STRIP_SEPARATION_THRESHOLD_PXLS &&
+                    fabsf(currY - m_lastRelevantY) <= STRIP_SEPARATION_THRESHOLD_PXLS)
+                return BLEND_RET_OK;
+        }
+
+        m_haveRelevant = true;
+        m_lastRelevantX = currX;
+        m_lastRelevantY = currY;
+    }
+
+    size_t bytes = framePyramidBytes();
+
+    pthread_mutex_lock(&m_prepareMutex);
+    if (m_prepareBudget > 0 && m_preparedBytes + bytes > m_prepareBudget)
+    {
+        // runBlend decomposes the frame itself
+        pthread_mutex_unlock(&m_prepareMutex);
+        LOGV("Incremental blending budget reached, deferring frame");
+        return BLEND_RET_OK;
+    }
+
+    if (!m_prepareStarted)
+    {
+        m_prepareQuit = false;
+        if (pthread_create(&m_prepareThread, NULL, PrepareThread, this) != 0)
+        {
+            pthread_mutex_unlock(&m_prepareMutex);
+            LOGE("Error: Could not start the incremental blending thread");
+            return BLEND_RET_ERROR;
+        }
+        m_prepareStarted = true;
+    }
+
+    m_preparedBytes += bytes;
+    m_pendingFrames.push_back(mb);
+    pthread_cond_broadcast(&m_prepareCond);
+    pthread_mutex_unlock(&m_prepareMutex);
+
+    return BLEND_RET_OK;
+}
+
+void *Blend::PrepareThread(void *arg)
+{
+    ((Blend *) arg)->PrepareFrames();
+    return NULL;
+}
+
+// Decomposes the frames queued by addFrame, in order, until StopPreparing
+void Blend::PrepareFrames()
+{
+    size_t bytes = framePyramidBytes();
+
+    pthread_mutex_lock(&m_prepareMutex);
+    while (true)
+    {
+        while (!m_prepareQuit && m_pendingNext >= (int) m_pendingFrames.size())
+            pthread_cond_wait(&m_prepareCond, &m_prepareMutex);
+        if (m_prepareQuit)
+            break;
+
+        MosaicFrame *mb = m_pendingFrames[m_pendingNext++];
+        m_prepareBusy = true;
+        pthread_mutex_unlock(&m_prepareMutex);
+
+        FramePyramids fpyr;
+        int ret = AllocateFramePyramids(fpyr);
+        if (ret != BLEND_RET_OK)
+            LOGE("Error: Could not allocate pyramids for incremental blending");
+        else
+            ret = FillFramePyramid(mb, fpyr, m_prepareWorkspace);
+
+        pthread_mutex_lock(&m_prepareMutex);
+        if (ret == BLEND_RET_OK)
+        {
+            m_preparedFrames.push_back(mb);
+            m_preparedPyr.push_back(fpyr);
+        }
+        else
+        {
+            // runBlend decomposes the frame itself
+            FreeFramePyramids(fpyr);
+            m_preparedBytes -= bytes;
+        }
+        m_prepareBusy = false;
+        pthread_cond_broadcast(&m_prepareCond);
+    }
+    pthread_mutex_unlock(&m_prepareMutex);
+}
+
+// Waits for the frames queued by addFrame to be decomposed
+void Blend::WaitForPreparedFrames()
+{
+    pthread_mutex_lock(&m_prepareMutex);
+    while (m_prepareBusy || m_pendingNext < (int) m_pendingFrames.size())
+        pthread_cond_wait(&m_prepareCond, &m_prepareMutex);
+    pthread_mutex_unlock(&m_prepareMutex);
+}
+
+// Stops the background thread, dropping the frames it has not started on
+void Blend::StopPreparing()
+{
+    if (!m_prepareStarted)
+        return;
+
+    pthread_mutex_lock(&m_prepareMutex);
+    m_prepareQuit = true;
+    pthread_cond_broadcast(&m_prepareCond);
+    pthread_mutex_unlock(&m_prepareMutex);
+
+    pthread_join(m_prepareThread, NULL);
+    m_prepareStarted = false;
+}
+
+FramePyramids *Blend::FindPreparedFrame(MosaicFrame *mb)
+{
+    for (int k = 0; k < (int) m_preparedFrames.size(); k++)
+    {
+        if (m_preparedFrames[k] == mb)
+            return &m_preparedPyr[k];
+    }
+
+    return NULL;
+}
+
+// Frees the pyramids built ahead of runBlend. The background thread must be
+// idle or stopped.
+void Blend::ReleasePreparedFrames()
+{
+    for (int k = 0; k < (int) m_preparedPyr.size(); k++)
+        FreeFramePyramids(m_preparedPyr[k]);
+    m_preparedPyr.clear();
+    m_preparedFrames.clear();
+    m_pendingFrames.clear();
+    m_pendingNext = 0;
+    m_preparedBytes = 0;
+    m_haveRelevant = false;
+}
+
+int Blend::AllocateFramePyramids(FramePyramids &fpyr)
+{
+    fpyr.Y = PyramidShort::allocatePyramidPacked(m_wb.nlevs, width, height, BORDER, m_pool);
+    fpyr.U = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, width >> 1, height >> 1, BORDER, m_pool);
+    fpyr.V = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, width >> 1, height >> 1, BORDER, m_pool);
+    fpyr.x0 = fpyr.y0 = 0;
+    if (!fpyr.Y || !fpyr.U || !fpyr.V)
+    {
+        FreeFramePyramids(fpyr);
+        return BLEND_RET_ERROR_MEMORY;
+    }
+
     return BLEND_RET_OK;
 }
 
+void Blend::FreeFramePyramids(FramePyramids &fpyr)
+{
+    PyramidShort::freePyramid(fpyr.V, m_pool);
+    PyramidShort::freePyramid(fpyr.U, m_pool);
+    PyramidShort::freePyramid(fpyr.Y, m_pool);
+    fpyr.Y = fpyr.U = fpyr.V = NULL;
+}
+
 inline float max(float a, float b) { return a > b ? a : b; }
 inline float min(float a, float b) { return a < b ? a : b; }
 
@@ -111,6 +377,9 @@ int Blend::runBlend(MosaicFrame **oframes, MosaicFrame **rframes,
 
     MosaicFrame **frames;
 
+    // Let the background thread finish the frames it was handed
+    WaitForPreparedFrames();
+
     // For THIN strip mode, accept all frames for blending
     if (m_wb.stripType == STRIP_TYPE_THIN)
     {
@@ -218,8 +487,8 @@ int Blend::runBlend(MosaicFrame **oframes, MosaicFrame **rframes,
     fullRect.top = (int) floorf(global_rect.bot);  // min-y
     fullRect.right = (int) ceilf(global_rect.rgt); // max-x
     fullRect.bottom = (int) ceilf(global_rect.top);// max-y
-    Mwidth = (unsigned short) (fullRect.right - fullRect.left + 1);
-    Mheight = (unsigned short) (fullRect.bottom - fullRect.top + 1);
+    Mwidth = fullRect.right - fullRect.left + 1;
+    Mheight = fullRect.bottom - fullRect.top + 1;
 
     int xLeftMost, xRightMost;
     int yTopMost, yBottomMost;
@@ -240,8 +509,8 @@ int Blend::runBlend(MosaicFrame **oframes, MosaicFrame **rframes,
     }
 
     // Make sure image width is multiple of 4
-    Mwidth = (unsigned short) ((Mwidth + 3) & ~3);
-    Mheight = (unsigned short) ((Mheight + 3) & ~3);    // Round up.
+    Mwidth = (Mwidth + 3) & ~3;
+    Mheight = (Mheight + 3) & ~3;    // Round up.
 
     ret = MosaicSizeCheck(LIMIT_SIZE_MULTIPLIER, LIMIT_HEIGHT_MULTIPLIER);
     if (ret != BLEND_RET_OK)
@@ -293,6 +562,7 @@ int Blend::runBlend(MosaicFrame **oframes, MosaicFrame **rframes,
 
     imageMosaicYVU = imgMos->data;
 
+    ReleasePreparedFrames();
 
     if (m_wb.blendingType == BLEND_TYPE_HORZ)
     {
@@ -313,7 +583,10 @@ int Blend::MosaicSizeCheck(float sizeMultiplier, float heightMultiplier) {
         return BLEND_RET_ERROR;
     }
 
-   if ((Mwidth * Mheight) > (width * height * sizeMultiplier)) {
+   // The area limit bounds the memory of the mosaic pyramids, which tiling
+   // already does
+   if (m_tileSize <= 0 &&
+           ((float) Mwidth * Mheight) > (width * height * sizeMultiplier)) {
          return BLEND_RET_ERROR;
    }
 
@@ -329,58 +602,92 @@ int Blend::MosaicSizeCheck(float sizeMultiplier, float heightMultiplier) {
    return BLEND_RET_OK;
 }
 
-int Blend::FillFramePyramid(MosaicFrame *mb)
+// Lays the frame, or the window of it if there is one, into level 0 of the
+// frame pyramids. The pyramids are allocated for the whole frame, so they
+// can be laid out again for any part of it.
+void Blend::LoadFrame(MosaicFrame *mb, FramePyramids &fpyr, MosaicRect *window)
 {
-    ImageType mbY, mbU, mbV;
-    // Lay this image, centered into the temporary buffer
-    mbY = mb->image;
-    mbU = mb->getU();
-    mbV = mb->getV();
+    int x0 = 0, y0 = 0, x1 = width, y1 = height;
+    if (window != NULL)
+    {
+        x0 = window->left;
+        y0 = window->top;
+        x1 = window->right;
+        y1 = window->bottom;
+    }
+
+    // The chroma pyramids are half resolution; x0 and y0 are even
+    int cx0 = x0 >> 1, cy0 = y0 >> 1;
+    int cw = (x1 - x0) >> 1, ch = (y1 - y0) >> 1;
+
+    if (fpyr.Y->width != x1 - x0 || fpyr.Y->height != y1 - y0)
+    {
+        fpyr.Y = PyramidShort::layoutPyramidPacked(fpyr.Y, m_wb.nlevs, x1 - x0, y1 - y0, BORDER);
+        fpyr.U = PyramidShort::layoutPyramidPacked(fpyr.U, m_wb.nlevsC, cw, ch, BORDER);
+        fpyr.V = PyramidShort::layoutPyramidPacked(fpyr.V, m_wb.nlevsC, cw, ch, BORDER);
+    }
+    fpyr.x0 = x0;
+    fpyr.y0 = y0;
+
+    // Lay this image, centered into the temporary buffer, reading the planes
+    // where the frame descriptor says they are
+    const FrameDescriptor &desc = mb->desc;
+    int step = desc.uvStep;
 
-    for(int h=0; h<height; h++) {
-        ImageTypeShort yptr = m_pFrameYPyr->ptr[h];
-        ImageTypeShort uptr = m_pFrameUPyr->ptr[h];
-        ImageTypeShort vptr = m_pFrameVPyr->ptr[h];
+    for(int h=y0; h<y1; h++) {
+        ImageTypeShort yptr = fpyr.Y->ptr[h - y0] - x0;
+        ImageType mbY = desc.y + (size_t) desc.yStride * h;
 
 #ifdef __arm__
 	// Y
-	for (int w = 0; w < width; w += 8) {
-	  uint8x8_t y = vld1_u8(&mbY[width * h + w]);
+	int start = x0;
+	for (int w = x0; w + 8 <= x1; w += 8) {
+	  uint8x8_t y = vld1_u8(&mbY[w]);
 	  uint16x8_t ys = vshll_n_u8(y, 3);
 	  vst1q_u16 ((unsigned short *)&yptr[w], ys);
+	  start = w + 8;
 	}
 
 	// leftover
-	int start = (width >> 3) << 3;
-	for (int w = start; w < width; w++) {
-	  yptr[w] = (short) (mbY[width * h + w] << 3);
+	for (int w = start; w < x1; w++) {
+	  yptr[w] = (short) (mbY[w] << 3);
 	}
-
-	// U and V
-	// TODO:
-        for(int w=0; w<width; w++) {
-	  uptr[w] = (short) (mbU[(h / 2) * (width / 2) + (w / 2)] << 3);
-	  vptr[w] = (short) (mbV[(h / 2) * (width / 2) + (w / 2)] << 3);
-        }
 #else
-        for(int w=0; w<width; w++) {
-            yptr[w] = (short) (mbY[width * h + w] << 3);
-            uptr[w] = (short) (mbU[(h / 2) * (width / 2) + (w / 2)] << 3);
-            vptr[w] = (short) (mbV[(h / 2) * (width / 2) + (w / 2)] << 3);
+        for(int w=x0; w<x1; w++) {
+            yptr[w] = (short) (mbY[w] << 3);
         }
 #endif
     }
 
+    // U and V at their own resolution
+    for(int h=cy0; h<cy0+ch; h++) {
+        ImageTypeShort uptr = fpyr.U->ptr[h - cy0] - cx0;
+        ImageTypeShort vptr = fpyr.V->ptr[h - cy0] - cx0;
+        ImageType mbU = desc.u + (size_t) desc.uvStride * h;
+        ImageType mbV = desc.v + (size_t) desc.uvStride * h;
+
+        for(int w=cx0; w<cx0+cw; w++) {
+            uptr[w] = (short) (mbU[w * step] << 3);
+            vptr[w] = (short) (mbV[w * step] << 3);
+        }
+    }
+}
+
+int Blend::FillFramePyramid(MosaicFrame *mb, FramePyramids &fpyr, PyramidWorkspace &work, MosaicRect *window)
+{
+    // Only decompose the window of the frame if there is one
+    LoadFrame(mb, fpyr, window);
+
     // Spread the image through the border
 #if 0
-    PyramidShort::BorderSpread(m_pFrameYPyr, BORDER, BORDER, BORDER, BORDER);
-    PyramidShort::BorderSpread(m_pFrameUPyr, BORDER, BORDER, BORDER, BORDER);
-    PyramidShort::BorderSpread(m_pFrameVPyr, BORDER, BORDER, BORDER, BORDER);
+    PyramidShort::BorderSpread(fpyr.Y, BORDER, BORDER, BORDER, BORDER);
+    PyramidShort::BorderSpread(fpyr.U, BORDER, BORDER, BORDER, BORDER);
+    PyramidShort::BorderSpread(fpyr.V, BORDER, BORDER, BORDER, BORDER);
 #endif
     // Generate Laplacian pyramids
-    if (!PyramidShort::BorderReduce(m_pFrameYPyr, m_wb.nlevs) || !PyramidShort::BorderExpand(m_pFrameYPyr, m_wb.nlevs, -1) ||
-            !PyramidShort::BorderReduce(m_pFrameUPyr, m_wb.nlevsC) || !PyramidShort::BorderExpand(m_pFrameUPyr, m_wb.nlevsC, -1) ||
-            !PyramidShort::BorderReduce(m_pFrameVPyr, m_wb.nlevsC) || !PyramidShort::BorderExpand(m_pFrameVPyr, m_wb.nlevsC, -1))
+    if (!PyramidShort::BorderReduce(fpyr.Y, m_wb.nlevs, &work) || !PyramidShort::BorderExpand(fpyr.Y, m_wb.nlevs, -1, &work) ||
+            !PyramidShort::BorderReduce(fpyr.U, m_wb.nlevsC, &work) || !PyramidShort::BorderExpand(fpyr.U, m_wb.nlevsC, -1, &work) ||
+            !PyramidShort::BorderReduce(fpyr.V, m_wb.nlevsC, &work) || !PyramidShort::BorderExpand(fpyr.V, m_wb.nlevsC, -1, &work))
     {
         LOGE("Error: Could not generate Laplacian pyramids");
         return BLEND_RET_ERROR;
@@ -399,29 +706,32 @@ int Blend::DoMergeAndBlend(MosaicFrame **frames, int nsite,
     m_pMosaicUPyr = NULL;
     m_pMosaicVPyr = NULL;
 
-    m_pMosaicYPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevs,(unsigned short)rect.Width(),(unsigned short)rect.Height(),BORDER);
-    m_pMosaicUPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC,(unsigned short)rect.Width(),(unsigned short)rect.Height(),BORDER);
-    m_pMosaicVPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC,(unsigned short)rect.Width(),(unsigned short)rect.Height(),BORDER);
-    if (!m_pMosaicYPyr || !m_pMosaicUPyr || !m_pMosaicVPyr)
-    {
-      LOGE("Error: Could not allocate pyramids for blending");
-      return BLEND_RET_ERROR_MEMORY;
-    }
-
     MosaicFrame *mb;
 
     CSite *esite = m_AllSites + nsite;
     int site_idx;
 
     // First go through each frame and for each mosaic pixel determine which frame it should come from
+    LabelMap *labels = new LabelMap(Mwidth, Mheight, m_wb.stripType == STRIP_TYPE_WIDE);
+    if (labels == NULL || labels->label == NULL ||
+            (m_wb.stripType == STRIP_TYPE_WIDE && (labels->fade == NULL || labels->weight == NULL)))
+    {
+        LOGE("Error: Could not allocate the frame assignment");
+        delete labels;
+        return BLEND_RET_ERROR_MEMORY;
+    }
+
+    m_spans.clear();
+    m_spanIndex.clear();
+    m_spanTop.clear();
+    m_spanIndex.push_back(0);
+
     site_idx = 0;
     for(CSite *csite = m_AllSites; csite < esite; csite++)
     {
         if(cancelComputation)
         {
-            if (m_pMosaicVPyr) free(m_pMosaicVPyr);
-            if (m_pMosaicUPyr) free(m_pMosaicUPyr);
-            if (m_pMosaicYPyr) free(m_pMosaicYPyr);
+            delete labels;
             return BLEND_RET_CANCELLED;
         }
 
@@ -430,175 +740,253 @@ int Blend::DoMergeAndBlend(MosaicFrame **frames, int nsite,
         mb->vcrect = mb->brect;
         ClipBlendRect(csite, mb->vcrect);
 
-        ComputeMask(csite, mb->vcrect, mb->brect, rect, imgMos, site_idx);
+        ComputeMask(csite, mb->vcrect, mb->brect, rect, *labels, site_idx);
 
         site_idx++;
     }
 
-    ////////// imgMos.Y, imgMos.V, imgMos.U are used as follows //////////////
-    ////////////////////// THIN STRIP MODE ///////////////////////////////////
+    TrimSpans(*labels, nsite);
 
-    // imgMos.Y is used to store the index of the image from which each pixel
-    // in the output mosaic can be read out for the thin-strip mode. Thus,
-    // there is no special handling for pixels around the seam. Also, imgMos.Y
-    // is set to 255 wherever we can't get its value from any input image e.g.
-    // in the gray border areas. imgMos.V and imgMos.U are set to 128 for the
-    // thin-strip mode.
+    // For WIDE mode, set the pixel masks to guide the blender to cross-fade
+    // between the images on either side of each seam
+    if (m_wb.stripType == STRIP_TYPE_WIDE)
+        ComputeCrossFade(*labels);
+
+    // Now perform the actual blending using the frame assignment determined above.
+    // The mosaic is blended one tile at a time along its longer side, see
+    // setTileSize. Within a tile the frames are decomposed into Laplacian
+    // pyramids by up to nthreads threads, each owning a set of frame
+    // pyramids. The calling thread uses m_pFrame*Pyr, the additional threads
+    // allocate their own.
+    int nthreads = m_numThreads;
+    if (nthreads <= 0)
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > nsite)
+        nthreads = nsite;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    FramePyramids *fpyr = new FramePyramids[nthreads];
+    MergeThreadArgs *args = new MergeThreadArgs[nthreads];
+    pthread_t *threads = new pthread_t[nthreads];
+    bool *started = new bool[nthreads];
+
+    fpyr[0].Y = m_pFrameYPyr;
+    fpyr[0].U = m_pFrameUPyr;
+    fpyr[0].V = m_pFrameVPyr;
+    fpyr[0].x0 = fpyr[0].y0 = 0;
+    while ((int) m_workspaces.size() < nthreads)
+        m_workspaces.push_back(new PyramidWorkspace());
+    for (int k = 1; k < nthreads; k++)
+    {
+        if (AllocateFramePyramids(fpyr[k]) != BLEND_RET_OK)
+        {
+            // Fall back to the threads we could allocate pyramids for
+            LOGE("Error: Could not allocate pyramids for blending thread %d", k);
+            nthreads = k;
+            break;
+        }
+    }
 
-    ////////////////////// WIDE STRIP MODE ///////////////////////////////////
+    // Tiles are aligned to the coarsest pyramid level so that every level of
+    // a tile pyramid lines up with the mosaic pyramid. Each tile pyramid
+    // extends 2^nlevs pixels into its neighbors, enough for the collapse to
+    // reproduce the whole-mosaic result over the tile itself.
+    int align = 1 << (m_wb.nlevs - 1);
+    int margin = 1 << m_wb.nlevs;
+    bool columns = (Mwidth >= Mheight);
+    int length = columns ? Mwidth : Mheight;
+    int tileSize = length;
+    if (m_tileSize > 0 && m_tileSize < length)
+    {
+        tileSize = (m_tileSize + align - 1) & ~(align - 1);
+        if (tileSize < 2 * margin)
+            tileSize = 2 * margin;
+    }
+    int ntiles = (length + tileSize - 1) / tileSize;
 
-    // imgMos.Y is used the same way as the thin-strip mode.
-    // imgMos.V is used to store the index of the neighboring image which
-    // should contribute to the color of an output pixel in a band around
-    // the seam. Thus, in this band, we will crossfade between the color values
-    // from the image index imgMos.Y and image index imgMos.V. imgMos.U is
-    // used to store the weight (multiplied by 100) that each image will
-    // contribute to the blending process. Thus, we start at 99% contribution
-    // from the first image, then go to 50% contribution from each image at
-    // the seam. Then, the contribution from the second image goes up to 99%.
+    MosaicRect *footprint = new MosaicRect[nsite];
+    m_mergeDone = new bool[nsite];
+    m_mergeFootprint = new MosaicRect[nsite];
+    m_mergeSites = new int[nsite];
 
-    // For WIDE mode, set the pixel masks to guide the blender to cross-fade
-    // between the images on either side of each seam:
-    if (m_wb.stripType == STRIP_TYPE_WIDE)
+    site_idx = 0;
+    for(CSite *csite = m_AllSites; csite < esite; csite++, site_idx++)
+    {
+        mb = csite->getMb();
+        if (m_engine == BLEND_ENGINE_WARP_ONCE)
+            ComputeWarpRegion(mb->vcrect, rect, NULL, footprint[site_idx]);
+        else
+            ComputeFootprint(mb->vcrect, mb->brect, rect, footprint[site_idx]);
+    }
+
+    // A frame is warped into every tile its footprint reaches. Its pyramids
+    // are rebuilt for each of them rather than kept, as holding the
+    // pyramids of the frames straddling a tile edge costs more than the
+    // mosaic pyramids tiling saves.
+    int nitems = 0;
+    for (int n = 0; n < ntiles; n++)
     {
-        if(m_wb.horizontal)
+        MosaicRect tile, mask, out;
+        ComputeTile(rect, columns, tileSize, margin, n, tile, mask, out);
+        for (site_idx = 0; site_idx < nsite; site_idx++)
         {
-            // Set the number of pixels around the seam to cross-fade between
-            // the two component images,
-            int tw = STRIP_CROSS_FADE_WIDTH_PXLS;
+            if (TileOverlaps(rect, tile, footprint[site_idx]))
+                nitems++;
+        }
+    }
+
+    // Rows (horizontal mosaics) or columns (vertical mosaics) of the output
+    // that contain gray border pixels, used to crop the final mosaic
+    bool *gray = new bool[m_wb.horizontal ? Mheight : Mwidth];
+    memset(gray, 0, sizeof(bool) * (m_wb.horizontal ? Mheight : Mwidth));
+
+    // The 4:2:0 V and U planes of the output
+    ImageType chroma = imgMos.V.ptr[0];
+
+    pthread_mutex_init(&m_mergeMutex, NULL);
+    pthread_cond_init(&m_mergeCond, NULL);
+    m_mergeRet = BLEND_RET_OK;
+    m_mergeRect = &rect;
+    m_mergeProgress = &progress;
+    m_mergeProgressStep = (nitems > 0) ? TIME_PERCENT_BLEND / nitems : 0.0f;
+    m_mergeCancel = &cancelComputation;
+
+    // The warp changes the frame assignment (LabelMap::NONE where a frame
+    // turns out not to cover a pixel) and is order dependent, so when there
+    // are several tiles each works on a private copy of the assignment.
+    LabelMap *mask = NULL;
+    MosaicRect tile, maskRect, out;
+
+    int ret = BLEND_RET_OK;
+    for (int n = 0; n < ntiles && ret == BLEND_RET_OK && !cancelComputation; n++)
+    {
+        ComputeTile(rect, columns, tileSize, margin, n, tile, maskRect, out);
 
-            // Proceed with the image index calculation for cross-fading
-            // only if the cross-fading width is larger than 0
-            if (tw > 0)
+        if (ntiles > 1)
+        {
+            mask = CopyMask(*labels, maskRect);
+            if (mask == NULL)
             {
-                for(int y = 0; y < imgMos.Y.height; y++)
-                {
-                    // Since we compare two adjecant pixels to determine
-                    // whether there is a seam, the termination condition of x
-                    // is set to imgMos.Y.width - tw, so that x+1 below
-                    // won't exceed the imgMos' boundary.
-                    for(int x = tw; x < imgMos.Y.width - tw; )
-                    {
-                        // Determine where the seam is...
-                        if (imgMos.Y.ptr[y][x] != imgMos.Y.ptr[y][x+1] &&
-                                imgMos.Y.ptr[y][x] != 255 &&
-                                imgMos.Y.ptr[y][x+1] != 255)
-                        {
-                            // Find the image indices on both sides of the seam
-                            unsigned char idx1 = imgMos.Y.ptr[y][x];
-                            unsigned char idx2 = imgMos.Y.ptr[y][x+1];
-
-                            for (int o = tw; o >= 0; o--)
-                            {
-                                // Set the image index to use for cross-fading
-                                imgMos.V.ptr[y][x - o] = idx2;
-                                // Set the intensity weights to use for cross-fading
-                                imgMos.U.ptr[y][x - o] = 50 + (99 - 50) * o / tw;
-                            }
-
-                            for (int o = 1; o <= tw; o++)
-                            {
-                                // Set the image index to use for cross-fading
-                                imgMos.V.ptr[y][x + o] = idx1;
-                                // Set the intensity weights to use for cross-fading
-                                imgMos.U.ptr[y][x + o] = imgMos.U.ptr[y][x - o];
-                            }
-
-                            x += (tw + 1);
-                        }
-                        else
-                        {
-                            x++;
-                        }
-                    }
-                }
+                LOGE("Error: Could not allocate the mask of tile %d", n);
+                ret = BLEND_RET_ERROR_MEMORY;
+                break;
             }
         }
-        else
+
+        m_pMosaicYPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevs,tile.Width(),tile.Height(),BORDER,m_pool);
+        m_pMosaicUPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC,tile.Width()>>1,tile.Height()>>1,BORDER,m_pool);
+        m_pMosaicVPyr = PyramidShort::allocatePyramidPacked(m_wb.nlevsC,tile.Width()>>1,tile.Height()>>1,BORDER,m_pool);
+
+        // The warp-once engine sums the frames up before filling the pyramids
+        int *acc = NULL;
+        if (m_engine == BLEND_ENGINE_WARP_ONCE)
         {
-            // Set the number of pixels around the seam to cross-fade between
-            // the two component images,
-            int tw = STRIP_CROSS_FADE_WIDTH_PXLS;
+            int lines;
+            size_t ny = PyramidShort::calcStorage(tile.Width(), tile.Height(), 2 * BORDER, m_wb.nlevs, &lines);
+            size_t nc = PyramidShort::calcStorage(tile.Width() >> 1, tile.Height() >> 1, 2 * BORDER, m_wb.nlevsC, &lines);
+            size_t bytes = sizeof(int) * 2 * (ny + nc);
+            acc = (int *) (m_pool ? m_pool->allocate(bytes) : calloc(bytes, 1));
+            m_accY = acc;
+            m_accW = acc + ny;
+            m_accU = acc + 2 * ny;
+            m_accV = acc + 2 * ny + nc;
+        }
 
-            // Proceed with the image index calculation for cross-fading
-            // only if the cross-fading width is larger than 0
-            if (tw > 0)
+        if (!m_pMosaicYPyr || !m_pMosaicUPyr || !m_pMosaicVPyr ||
+                (m_engine == BLEND_ENGINE_WARP_ONCE && acc == NULL))
+        {
+            LOGE("Error: Could not allocate pyramids for blending");
+            ret = BLEND_RET_ERROR_MEMORY;
+        }
+        else
+        {
+            m_mergeWindow = tile;
+            m_mergeLabels = (mask != NULL) ? mask : labels;
+            m_mergeMaskX = (mask != NULL) ? maskRect.left : 0;
+            m_mergeMaskY = (mask != NULL) ? maskRect.top : 0;
+            m_mergeNext = 0;
+            m_mergeCount = 0;
+            for (site_idx = 0; site_idx < nsite; site_idx++)
             {
-                for(int x = 0; x < imgMos.Y.width; x++)
+                if (TileOverlaps(rect, tile, footprint[site_idx]))
                 {
-                    // Since we compare two adjecant pixels to determine
-                    // whether there is a seam, the termination condition of y
-                    // is set to imgMos.Y.height - tw, so that y+1 below
-                    // won't exceed the imgMos' boundary.
-                    for(int y = tw; y < imgMos.Y.height - tw; )
-                    {
-                        // Determine where the seam is...
-                        if (imgMos.Y.ptr[y][x] != imgMos.Y.ptr[y+1][x] &&
-                                imgMos.Y.ptr[y][x] != 255 &&
-                                imgMos.Y.ptr[y+1][x] != 255)
-                        {
-                            // Find the image indices on both sides of the seam
-                            unsigned char idx1 = imgMos.Y.ptr[y][x];
-                            unsigned char idx2 = imgMos.Y.ptr[y+1][x];
-
-                            for (int o = tw; o >= 0; o--)
-                            {
-                                // Set the image index to use for cross-fading
-                                imgMos.V.ptr[y - o][x] = idx2;
-                                // Set the intensity weights to use for cross-fading
-                                imgMos.U.ptr[y - o][x] = 50 + (99 - 50) * o / tw;
-                            }
-
-                            for (int o = 1; o <= tw; o++)
-                            {
-                                // Set the image index to use for cross-fading
-                                imgMos.V.ptr[y + o][x] = idx1;
-                                // Set the intensity weights to use for cross-fading
-                                imgMos.U.ptr[y + o][x] = imgMos.U.ptr[y - o][x];
-                            }
-
-                            y += (tw + 1);
-                        }
-                        else
-                        {
-                            y++;
-                        }
-                    }
+                    m_mergeSites[m_mergeCount] = site_idx;
+                    m_mergeFootprint[m_mergeCount] = footprint[site_idx];
+                    m_mergeDone[m_mergeCount] = false;
+                    m_mergeCount++;
                 }
             }
+
+            int nstart = (nthreads < m_mergeCount) ? nthreads : m_mergeCount;
+            for (int k = 1; k < nstart; k++)
+            {
+                args[k].blend = this;
+                args[k].fpyr = &fpyr[k];
+                args[k].work = m_workspaces[k];
+                started[k] = (pthread_create(&threads[k], NULL, MergeThread, &args[k]) == 0);
+                if (!started[k])
+                    LOGE("Error: Could not start blending thread %d", k);
+            }
+
+            MergeFrames(fpyr[0], *m_workspaces[0]);
+
+            for (int k = 1; k < nstart; k++)
+            {
+                if (started[k])
+                    pthread_join(threads[k], NULL);
+            }
+
+            ret = m_mergeRet;
+
+            if (ret == BLEND_RET_OK && m_engine == BLEND_ENGINE_WARP_ONCE)
+                NormalizeAccumulatedTile();
+
+            if (ret == BLEND_RET_OK && !cancelComputation)
+                ret = PerformFinalBlending(imgMos, chroma, *m_mergeLabels, m_mergeMaskX, m_mergeMaskY, tile, out, cropping_rect, gray);
         }
 
+        PyramidShort::freePyramid(m_pMosaicVPyr, m_pool);
+        PyramidShort::freePyramid(m_pMosaicUPyr, m_pool);
+        PyramidShort::freePyramid(m_pMosaicYPyr, m_pool);
+        m_pMosaicYPyr = m_pMosaicUPyr = m_pMosaicVPyr = NULL;
+
+        if (m_pool)
+            m_pool->release(acc);
+        else
+            free(acc);
+        m_accY = m_accU = m_accV = m_accW = NULL;
+
+        if (mask != NULL)
+            delete mask;
+        mask = NULL;
     }
 
-    // Now perform the actual blending using the frame assignment determined above
-    site_idx = 0;
-    for(CSite *csite = m_AllSites; csite < esite; csite++)
-    {
-        if (cancelComputation)
-        {
-            if (m_pMosaicVPyr) free(m_pMosaicVPyr);
-            if (m_pMosaicUPyr) free(m_pMosaicUPyr);
-            if (m_pMosaicYPyr) free(m_pMosaicYPyr);
-            return BLEND_RET_CANCELLED;
-        }
+    delete labels;
 
-        mb = csite->getMb();
+    for (int k = 1; k < nthreads; k++)
+        FreeFramePyramids(fpyr[k]);
 
-        if (FillFramePyramid(mb)!=BLEND_RET_OK)
-            return BLEND_RET_ERROR;
+    pthread_cond_destroy(&m_mergeCond);
+    pthread_mutex_destroy(&m_mergeMutex);
 
-	if (m_wb.stripType == STRIP_TYPE_WIDE)
-	  ProcessPyramidForThisFrameWide(csite, mb->vcrect, mb->brect, rect, imgMos, mb->trs, site_idx);
-	else
-	  ProcessPyramidForThisFrameNarrow(csite, mb->vcrect, mb->brect, rect, imgMos, mb->trs, site_idx);
-        progress += TIME_PERCENT_BLEND/nsite;
+    delete[] m_mergeSites;
+    delete[] m_mergeFootprint;
+    delete[] m_mergeDone;
+    delete[] footprint;
+    delete[] started;
+    delete[] threads;
+    delete[] args;
+    delete[] fpyr;
 
-        site_idx++;
+    if (cancelComputation || ret != BLEND_RET_OK)
+    {
+        delete[] gray;
+        return cancelComputation ? BLEND_RET_CANCELLED : ret;
     }
 
-
-    // Blend
-    PerformFinalBlending(imgMos, cropping_rect);
+    CropGrayBorder(imgMos, cropping_rect, gray);
+    delete[] gray;
 
     if (cropping_rect.Width() <= 0 || cropping_rect.Height() <= 0)
     {
@@ -607,58 +995,232 @@ int Blend::DoMergeAndBlend(MosaicFrame **frames, int nsite,
         return BLEND_RET_ERROR;
     }
 
-    if (m_pMosaicVPyr) free(m_pMosaicVPyr);
-    if (m_pMosaicUPyr) free(m_pMosaicUPyr);
-    if (m_pMosaicYPyr) free(m_pMosaicYPyr);
-
     progress += TIME_PERCENT_FINAL;
 
     return BLEND_RET_OK;
 }
 
+// Computes tile n of the mosaic: the window of the mosaic pyramid blended
+// for it (tile), the part of the frame assignment its warp reads (mask) and
+// the part of the output it produces (out), all in level-0 mosaic pixels
+// relative to rect. Only the outer edges of the mosaic get pyramid borders.
+void Blend::ComputeTile(MosaicRect &rect, bool columns, int tileSize, int margin, int n, MosaicRect &tile, MosaicRect &mask, MosaicRect &out)
+{
+    int pwidth = rect.Width();
+    int pheight = rect.Height();
+
+    out.left = out.top = 0;
+    out.right = Mwidth;
+    out.bottom = Mheight;
+    if (columns)
+    {
+        out.left = n * tileSize;
+        out.right = (out.left + tileSize < Mwidth) ? out.left + tileSize : Mwidth;
+    }
+    else
+    {
+        out.top = n * tileSize;
+        out.bottom = (out.top + tileSize < Mheight) ? out.top + tileSize : Mheight;
+    }
+
+    tile.left = (out.left - margin > 0) ? out.left - margin : 0;
+    tile.top = (out.top - margin > 0) ? out.top - margin : 0;
+    tile.right = (out.right + margin < pwidth) ? out.right + margin : pwidth;
+    tile.bottom = (out.bottom + margin < pheight) ? out.bottom + margin : pheight;
+
+    // The output can reach past the pyramid into its border, see runBlend
+    mask = tile;
+    if (tile.right == pwidth)
+        mask.right = Mwidth;
+    if (tile.bottom == pheight)
+        mask.bottom = Mheight;
+}
+
+// Returns whether a frame footprint, as computed by ComputeFootprint,
+// reaches into a tile
+bool Blend::TileOverlaps(MosaicRect &rect, MosaicRect &tile, MosaicRect &footprint)
+{
+    if (tile.left > 0 && footprint.right < tile.left)
+        return false;
+    if (tile.right < rect.Width() && footprint.left >= tile.right)
+        return false;
+    if (tile.top > 0 && footprint.bottom < tile.top)
+        return false;
+    if (tile.bottom < rect.Height() && footprint.top >= tile.bottom)
+        return false;
+
+    return true;
+}
+
+// Copies the frame assignment over r out of labels
+LabelMap *Blend::CopyMask(LabelMap &labels, MosaicRect &r)
+{
+    bool crossFade = (labels.fade != NULL);
+    LabelMap *mask = new LabelMap(r.Width(), r.Height(), crossFade);
+    if (mask == NULL || mask->label == NULL ||
+            (crossFade && (mask->fade == NULL || mask->weight == NULL)))
+    {
+        delete mask;
+        return NULL;
+    }
+
+    for (int j = 0; j < r.Height(); j++)
+    {
+        memcpy(mask->labelRow(j), labels.labelRow(r.top + j) + r.left, r.Width() * sizeof(unsigned short));
+        if (crossFade)
+        {
+            memcpy(mask->fadeRow(j), labels.fadeRow(r.top + j) + r.left, r.Width() * sizeof(unsigned short));
+            memcpy(mask->weightRow(j), labels.weightRow(r.top + j) + r.left, r.Width());
+        }
+    }
+
+    return mask;
+}
+
+void *Blend::MergeThread(void *arg)
+{
+    MergeThreadArgs *args = (MergeThreadArgs *) arg;
+    args->blend->MergeFrames(*args->fpyr, *args->work);
+    return NULL;
+}
+
+void Blend::MergeFrames(FramePyramids &fpyr, PyramidWorkspace &work)
+{
+    while (true)
+    {
+        pthread_mutex_lock(&m_mergeMutex);
+        if (m_mergeNext >= m_mergeCount || m_mergeRet != BLEND_RET_OK ||
+                *m_mergeCancel)
+        {
+            pthread_mutex_unlock(&m_mergeMutex);
+            break;
+        }
+        int item = m_mergeNext++;
+        pthread_mutex_unlock(&m_mergeMutex);
+
+        int site_idx = m_mergeSites[item];
+        CSite *csite = m_AllSites + site_idx;
+        MosaicFrame *mb = csite->getMb();
+
+        int ret = BLEND_RET_OK;
+        FramePyramids *pyr = NULL;
+        WarpedFrame wf = WarpedFrame();
+        wf.site = site_idx;
+        if (m_engine == BLEND_ENGINE_WARP_ONCE)
+        {
+            // Only the part of the region the tile needs is warped
+            MosaicRect region;
+            ComputeWarpRegion(mb->vcrect, *m_mergeRect, &m_mergeWindow, region);
+            ret = WarpFrameOnce(csite, region, *m_mergeRect, mb->trs, fpyr, wf, work);
+        }
+        else
+        {
+            // Use the pyramids built by addFrame if there are any
+            pyr = FindPreparedFrame(mb);
+            if (pyr == NULL)
+            {
+                // A thin strip only samples a sliver of the frame
+                MosaicRect window;
+                bool windowed = (m_wb.stripType == STRIP_TYPE_THIN) &&
+                    ComputeSourceWindow(mb->vcrect, mb->brect, *m_mergeRect, mb->trs, window);
+
+                pyr = &fpyr;
+                ret = FillFramePyramid(mb, *pyr, work, windowed ? &window : NULL);
+            }
+        }
+
+        // Wait for the earlier sites this one shares mosaic pixels with
+        MosaicRect &fp = m_mergeFootprint[item];
+        pthread_mutex_lock(&m_mergeMutex);
+        for (int j = 0; j < item; j++)
+        {
+            MosaicRect &fpj = m_mergeFootprint[j];
+            if (fpj.left > fp.right || fpj.right < fp.left ||
+                    fpj.top > fp.bottom || fpj.bottom < fp.top)
+                continue;
+
+            while (!m_mergeDone[j])
+                pthread_cond_wait(&m_mergeCond, &m_mergeMutex);
+        }
+        pthread_mutex_unlock(&m_mergeMutex);
+
+        if (ret == BLEND_RET_OK)
+        {
+            if (m_engine == BLEND_ENGINE_WARP_ONCE)
+                AccumulateWarpedFrame(wf, *m_mergeRect);
+            else if (m_wb.stripType == STRIP_TYPE_WIDE)
+                ProcessPyramidForThisFrameWide(csite, mb->vcrect, mb->brect, *m_mergeRect, *m_mergeLabels, mb->trs, site_idx, *pyr);
+            else
+                ProcessPyramidForThisFrameNarrow(csite, mb->vcrect, mb->brect, *m_mergeRect, *m_mergeLabels, mb->trs, site_idx, *pyr);
+        }
+        FreeWarpedFrame(wf);
+
+        pthread_mutex_lock(&m_mergeMutex);
+        if (ret != BLEND_RET_OK)
+            m_mergeRet = ret;
+        *m_mergeProgress += m_mergeProgressStep;
+        m_mergeDone[item] = true;
+        pthread_cond_broadcast(&m_mergeCond);
+        pthread_mutex_unlock(&m_mergeMutex);
+    }
+}
+
+// Crops the 4:2:0 output left by DoMergeAndBlend in place. The cropping
+// rectangle starts on even rows and columns, see
+// RoundingCroppingSizeToMultipleOf8.
 void Blend::CropFinalMosaic(YUVinfo &imgMos, MosaicRect &cropping_rect)
 {
-    int i, j, k;
+    int i, j;
+    size_t k;
     ImageType yimg;
     ImageType uimg;
     ImageType vimg;
-
+    int cwidth = imgMos.Y.width / 2;
+    int cheight = imgMos.Y.height / 2;
 
     yimg = imgMos.Y.ptr[0];
-    uimg = imgMos.U.ptr[0];
-    vimg = imgMos.V.ptr[0];
+    vimg = yimg + (size_t) imgMos.Y.width * imgMos.Y.height;
+    uimg = vimg + (size_t) cwidth * cheight;
 
     k = 0;
     for (j = cropping_rect.top; j <= cropping_rect.bottom; j++)
     {
         for (i = cropping_rect.left; i <= cropping_rect.right; i++)
         {
-            yimg[k] = yimg[j*imgMos.Y.width+i];
+            yimg[k] = yimg[(size_t) j*imgMos.Y.width+i];
             k++;
         }
     }
-    for (j = cropping_rect.top; j <= cropping_rect.bottom; j++)
+    for (j = cropping_rect.top / 2; j <= cropping_rect.bottom / 2; j++)
     {
-       for (i = cropping_rect.left; i <= cropping_rect.right; i++)
+       for (i = cropping_rect.left / 2; i <= cropping_rect.right / 2; i++)
         {
-            yimg[k] = vimg[j*imgMos.Y.width+i];
+            yimg[k] = vimg[(size_t) j*cwidth+i];
             k++;
         }
     }
-    for (j = cropping_rect.top; j <= cropping_rect.bottom; j++)
+    for (j = cropping_rect.top / 2; j <= cropping_rect.bottom / 2; j++)
     {
-       for (i = cropping_rect.left; i <= cropping_rect.right; i++)
+       for (i = cropping_rect.left / 2; i <= cropping_rect.right / 2; i++)
         {
-            yimg[k] = uimg[j*imgMos.Y.width+i];
+            yimg[k] = uimg[(size_t) j*cwidth+i];
             k++;
         }
     }
 }
 
-int Blend::PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect)
+// Collapses the mosaic pyramids of a tile and writes its part of the output
+// (out) into the Y plane of imgMos and the 4:2:0 V and U planes in chroma,
+// using the frame assignment in mask, which starts at (maskX, maskY). A
+// chroma pixel takes the assignment of the luma pixel it is sited on. Rows
+// (horizontal mosaics) or columns (vertical mosaics) that have gray border
+// pixels within the cropping rectangle are flagged in gray for
+// CropGrayBorder.
+int Blend::PerformFinalBlending(YUVinfo &imgMos, ImageType chroma, LabelMap &mask, int maskX, int maskY, MosaicRect &tile, MosaicRect &out, MosaicRect &cropping_rect, bool *gray)
 {
-    if (!PyramidShort::BorderExpand(m_pMosaicYPyr, m_wb.nlevs, 1) || !PyramidShort::BorderExpand(m_pMosaicUPyr, m_wb.nlevsC, 1) ||
-        !PyramidShort::BorderExpand(m_pMosaicVPyr, m_wb.nlevsC, 1))
+    PyramidWorkspace *work = m_workspaces[0];
+    if (!PyramidShort::BorderExpand(m_pMosaicYPyr, m_wb.nlevs, 1, work) || !PyramidShort::BorderExpand(m_pMosaicUPyr, m_wb.nlevsC, 1, work) ||
+        !PyramidShort::BorderExpand(m_pMosaicVPyr, m_wb.nlevsC, 1, work))
     {
       LOGE("Error: Could not BorderExpand!");
       return BLEND_RET_ERROR;
@@ -670,44 +1232,27 @@ int Blend::PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect)
     ImageType yimg;
     ImageType uimg;
     ImageType vimg;
-
-    int cx = (int)imgMos.Y.width/2;
-    int cy = (int)imgMos.Y.height/2;
-
-    // 2D boolean array that contains true wherever the mosaic image data is
-    // invalid (i.e. in the gray border).
-    bool **b = new bool*[imgMos.Y.height];
-
-    for(int j=0; j<imgMos.Y.height; j++)
-    {
-        b[j] = new bool[imgMos.Y.width];
-    }
+    unsigned short *mimg;
 
     // Copy the resulting image into the full image using the mask
     int i, j;
 
-    yimg = imgMos.Y.ptr[0];
-    uimg = imgMos.U.ptr[0];
-    vimg = imgMos.V.ptr[0];
-
-    for (j = 0; j < imgMos.Y.height; j++)
+    // Tiles start on even rows and columns
+    int cwidth = Mwidth / 2;
+    for (j = out.top / 2; j < out.bottom / 2; j++)
     {
-        myimg = m_pMosaicYPyr->ptr[j];
-        muimg = m_pMosaicUPyr->ptr[j];
-        mvimg = m_pMosaicVPyr->ptr[j];
+        muimg = m_pMosaicUPyr->ptr[j - tile.top / 2] + (out.left - tile.left) / 2;
+        mvimg = m_pMosaicVPyr->ptr[j - tile.top / 2] + (out.left - tile.left) / 2;
+
+        mimg = mask.labelRow(2 * j - maskY) + out.left - maskX;
+        vimg = chroma + (size_t) j * cwidth + out.left / 2;
+        uimg = vimg + (size_t) cwidth * (Mheight / 2);
 
-        for (i = 0; i<imgMos.Y.width; i++)
+        for (i = out.left / 2; i < out.right / 2; i++)
         {
-            // A final mask was set up previously,
-            // if the value is zero skip it, otherwise replace it.
-            if (*yimg <255)
+            if (*mimg != LabelMap::NONE)
             {
-                short value = (short) ((*myimg) >> 3);
-                if (value < 0) value = 0;
-                else if (value > 255) value = 255;
-                *yimg = (unsigned char) value;
-
-                value = (short) ((*muimg) >> 3);
+                short value = (short) ((*muimg) >> 3);
                 if (value < 0) value = 0;
                 else if (value > 255) value = 255;
                 *uimg = (unsigned char) value;
@@ -716,42 +1261,77 @@ int Blend::PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect)
                 if (value < 0) value = 0;
                 else if (value > 255) value = 255;
                 *vimg = (unsigned char) value;
-
-                b[j][i] = false;
-
             }
             else
-            {   // set border color in here
-                *yimg = (unsigned char) 96;
+            {
                 *uimg = (unsigned char) 128;
                 *vimg = (unsigned char) 128;
-
-                b[j][i] = true;
             }
 
-            yimg++;
+            mimg += 2;
             uimg++;
             vimg++;
-            myimg++;
             muimg++;
             mvimg++;
         }
     }
 
-    if(m_wb.horizontal)
+    for (j = out.top; j < out.bottom; j++)
     {
-        //Scan through each row and increment top if the row contains any gray
-        for (j = 0; j < imgMos.Y.height; j++)
+        myimg = m_pMosaicYPyr->ptr[j - tile.top] + out.left - tile.left;
+
+        mimg = mask.labelRow(j - maskY) + out.left - maskX;
+        yimg = imgMos.Y.ptr[j] + out.left;
+
+        for (i = out.left; i < out.right; i++)
         {
-            for (i = cropping_rect.left; i < cropping_rect.right; i++)
+            // A final mask was set up previously,
+            // if the value is zero skip it, otherwise replace it.
+            if (*mimg != LabelMap::NONE)
             {
-                if (b[j][i])
+                short value = (short) ((*myimg) >> 3);
+                if (value < 0) value = 0;
+                else if (value > 255) value = 255;
+                *yimg = (unsigned char) value;
+            }
+            else
+            {   // set border color in here
+                *yimg = (unsigned char) 96;
+
+                if (m_wb.horizontal)
                 {
-                    break; // to next row
+                    if (i >= cropping_rect.left && i < cropping_rect.right)
+                        gray[j] = true;
+                }
+                else
+                {
+                    if (j >= cropping_rect.top && j < cropping_rect.bottom)
+                        gray[i] = true;
                 }
             }
 
-            if (i == cropping_rect.right)   //no gray pixel in this row!
+            mimg++;
+            yimg++;
+            myimg++;
+        }
+    }
+
+    return BLEND_RET_OK;
+}
+
+// Shrinks the cropping rectangle to the rows (horizontal mosaics) or
+// columns (vertical mosaics) free of gray border pixels, as flagged by
+// PerformFinalBlending.
+void Blend::CropGrayBorder(YUVinfo &imgMos, MosaicRect &cropping_rect, bool *gray)
+{
+    int i, j;
+
+    if(m_wb.horizontal)
+    {
+        //Scan through each row and increment top if the row contains any gray
+        for (j = 0; j < imgMos.Y.height; j++)
+        {
+            if (!gray[j])   //no gray pixel in this row!
             {
                 cropping_rect.top = j;
                 break;
@@ -761,15 +1341,7 @@ int Blend::PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect)
         //Scan through each row and decrement bottom if the row contains any gray
         for (j = imgMos.Y.height-1; j >= 0; j--)
         {
-            for (i = cropping_rect.left; i < cropping_rect.right; i++)
-            {
-                if (b[j][i])
-                {
-                    break; // to next row
-                }
-            }
-
-            if (i == cropping_rect.right)   //no gray pixel in this row!
+            if (!gray[j])   //no gray pixel in this row!
             {
                 cropping_rect.bottom = j;
                 break;
@@ -781,15 +1353,7 @@ int Blend::PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect)
         //Scan through each column and increment left if the column contains any gray
         for (i = 0; i < imgMos.Y.width; i++)
         {
-            for (j = cropping_rect.top; j < cropping_rect.bottom; j++)
-            {
-                if (b[j][i])
-                {
-                    break; // to next column
-                }
-            }
-
-            if (j == cropping_rect.bottom)   //no gray pixel in this column!
+            if (!gray[i])   //no gray pixel in this column!
             {
                 cropping_rect.left = i;
                 break;
@@ -799,15 +1363,7 @@ int Blend::PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect)
         //Scan through each column and decrement right if the column contains any gray
         for (i = imgMos.Y.width-1; i >= 0; i--)
         {
-            for (j = cropping_rect.top; j < cropping_rect.bottom; j++)
-            {
-                if (b[j][i])
-                {
-                    break; // to next column
-                }
-            }
-
-            if (j == cropping_rect.bottom)   //no gray pixel in this column!
+            if (!gray[i])   //no gray pixel in this column!
             {
                 cropping_rect.right = i;
                 break;
@@ -817,18 +1373,13 @@ int Blend::PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect)
     }
 
     RoundingCroppingSizeToMultipleOf8(cropping_rect);
-
-    for(int j=0; j<imgMos.Y.height; j++)
-    {
-        delete[] b[j];
-    }
-
-    delete[] b;
-
-    return BLEND_RET_OK;
 }
 
 void Blend::RoundingCroppingSizeToMultipleOf8(MosaicRect &rect) {
+    // Start on a chroma sample of the 4:2:0 output
+    rect.top += rect.top & 1;
+    rect.left += rect.left & 1;
+
     int height = rect.bottom - rect.top + 1;
     int residue = height & 7;
     rect.bottom -= residue;
@@ -838,11 +1389,17 @@ void Blend::RoundingCroppingSizeToMultipleOf8(MosaicRect &rect) {
     rect.right -= residue;
 }
 
-void Blend::ComputeMask(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, int site_idx)
+// Assigns to a site the pixels of its region of interest that are no
+// farther from its center than from those of its Delaunay neighbours. Each
+// bisector bounds the Voronoi cell on one side of a row, so the cell covers
+// a single span of every row. The span is solved for from the bisectors,
+// then settled on the pixels the distance test accepts, which decides ties
+// the way a per-pixel test does. The spans go to m_spans, see TrimSpans.
+void Blend::ComputeMask(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, LabelMap &labels, int site_idx)
 {
-    PyramidShort *dptr = m_pMosaicYPyr;
+    int width = rect.Width();
+    int height = rect.Height();
 
-    int nC = m_wb.nlevsC;
     int l = (int) ((vcrect.lft - rect.left));
     int b = (int) ((vcrect.bot - rect.top));
     int r = (int) ((vcrect.rgt - rect.left));
@@ -859,114 +1416,545 @@ void Blend::ComputeMask(CSite *csite, BlendRect &vcrect, BlendRect &brect, Mosai
         b = -BORDER;
 
     if (vcrect.rgt == brect.rgt)
-        r = (r >= dptr->width) ? dptr->width + BORDER - 1 : r + BORDER;
-    else if (r >= dptr->width + BORDER)
-        r = dptr->width + BORDER - 1;
+        r = (r >= width) ? width + BORDER - 1 : r + BORDER;
+    else if (r >= width + BORDER)
+        r = width + BORDER - 1;
 
     if (vcrect.top == brect.top)
-        t = (t >= dptr->height) ? dptr->height + BORDER - 1 : t + BORDER;
-    else if (t >= dptr->height + BORDER)
-        t = dptr->height + BORDER - 1;
+        t = (t >= height) ? height + BORDER - 1 : t + BORDER;
+    else if (t >= height + BORDER)
+        t = height + BORDER - 1;
+
+    t = t < labels.height ? t : labels.height;
+    r = r < labels.width ? r : labels.width;
+    if (l < 0) l = 0;
+    if (b < 0) b = 0;
 
-    t = t < imgMos.Y.height ? t : imgMos.Y.height;
-    r = r < imgMos.Y.width ? r : imgMos.Y.width;
+    m_spanTop.push_back(b);
 
-    // Walk the Region of interest and populate the pyramid
-    for (int j = b < 0 ? 0 : b; j < t; j++)
+    double cx = csite->getVCenter().x;
+    double cy = csite->getVCenter().y;
+    int nn = csite->getNumNeighbors();
+
+    for (int j = b; j < t; j++)
     {
-        int jj = j;
-        int sj = jj + rect.top;
+        int sj = j + rect.top;
+
+        // Pixel si is no farther from neighbour k than from this site
+        // when 2 * (kx - cx) * si <= |k|^2 - |c|^2 - 2 * (ky - cy) * sj
+        double lo = l + rect.left;
+        double hi = r - 1 + rect.left;
+        SEdgeVector *ce = csite->getNeighbor();
+        for (int k = 0; k < nn; k++, ce++)
+        {
+            double kx = m_AllSites[ce->second].getVCenter().x;
+            double ky = m_AllSites[ce->second].getVCenter().y;
+            double dx = 2.0 * (kx - cx);
+            double c = kx * kx + ky * ky - cx * cx - cy * cy - 2.0 * (ky - cy) * sj;
+            if (dx > 0.0 && c / dx < hi)
+                hi = c / dx;
+            else if (dx < 0.0 && c / dx > lo)
+                lo = c / dx;
+            else if (dx == 0.0 && c < 0.0)
+                hi = lo - 1.0;
+        }
 
-	for (int i = l < 0 ? 0 : l; i < r; i++)
+        int start = (int) ceil(lo) - rect.left;
+        int end = (int) floor(hi) + 1 - rect.left;
+        if (start < l) start = l;
+        if (start > r) start = r;
+        if (end < start) end = start;
+        if (end > r) end = r;
+
+        // Rounding may put the span a pixel off at either end
+        while (start < end && !IsInCell(csite, start + rect.left, sj))
+            start++;
+        while (end > start && !IsInCell(csite, end - 1 + rect.left, sj))
+            end--;
+        while (start > l && IsInCell(csite, start - 1 + rect.left, sj))
+            start--;
+        while (end < r && IsInCell(csite, end + rect.left, sj))
+            end++;
+
+        unsigned short *lab = labels.labelRow(j);
+        for (int i = start; i < end; i++)
+            lab[i] = (unsigned short) site_idx;
+
+        LabelSpan span;
+        span.start = start;
+        span.end = end;
+        m_spans.push_back(span);
+    }
+
+    m_spanIndex.push_back((int) m_spans.size());
+}
+
+// The distance test of ComputeMask: whether mosaic point (si, sj) is no
+// farther from the center of a site than from those of its neighbours
+bool Blend::IsInCell(CSite *csite, int si, int sj)
+{
+    float dself = hypotSq(csite->getVCenter().x - si, csite->getVCenter().y - sj);
+
+    SEdgeVector *ce;
+    int ecnt;
+    for (ce = csite->getNeighbor(), ecnt = csite->getNumNeighbors(); ecnt--; ce++)
+    {
+        float d1 = hypotSq(m_AllSites[ce->second].getVCenter().x - si,
+                m_AllSites[ce->second].getVCenter().y - sj);
+        if (d1 < dself)
+            return false;
+    }
+
+    return true;
+}
+
+// Pixels on the bisector of two sites are assigned by both and end up with
+// the later one. Once every site is assigned, takes them out of the spans
+// of the earlier site, which leaves each span holding exactly the pixels
+// of its row labeled with its site.
+void Blend::TrimSpans(LabelMap &labels, int nsite)
+{
+    for (int site_idx = 0; site_idx < nsite; site_idx++)
+    {
+        int j = m_spanTop[site_idx];
+        for (int n = m_spanIndex[site_idx]; n < m_spanIndex[site_idx + 1]; n++, j++)
         {
-            int ii = i;
-            // project point and then triangulate to neighbors
-            int si = ii + rect.left;
+            LabelSpan &span = m_spans[n];
+            unsigned short *lab = labels.labelRow(j);
+            while (span.start < span.end && lab[span.start] != site_idx)
+                span.start++;
+            while (span.end > span.start && lab[span.end - 1] != site_idx)
+                span.end--;
+        }
+    }
+}
+
+// Gets the columns [is,ie) of a pyramid level assigned to a site in level-0
+// mosaic row jj, that is those whose level-0 pixel is, made relative to
+// column tx of the level. The warp changes some of these pixels to
+// LabelMap::NONE, but none to another site.
+void Blend::GetSiteSpan(int site_idx, int jj, int dscale, int tx, int &is, int &ie)
+{
+    int n = m_spanIndex[site_idx] + jj - m_spanTop[site_idx];
+    if (jj < m_spanTop[site_idx] || n >= m_spanIndex[site_idx + 1] ||
+            m_spans[n].start >= m_spans[n].end)
+    {
+        is = ie = 0;
+        return;
+    }
+
+    int round = (1 << dscale) - 1;
+    is = ((m_spans[n].start + round) >> dscale) - tx;
+    ie = ((m_spans[n].end + round) >> dscale) - tx;
+}
+
+// Sets up the cross-fade of the STRIP_TYPE_WIDE mode. For every pixel in a
+// band around each seam, the fade map stores the index of the neighboring
+// image which should contribute to its color; in this band, we crossfade
+// between the color values from the image of the label map and that of the
+// fade map. The weight map stores the weight (multiplied by 100) that the
+// image of the label map contributes to the blending process. Thus, we
+// start at 99% contribution from the first image, then go to 50%
+// contribution from each image at the seam. Then, the contribution from
+// the second image goes up to 99%.
+void Blend::ComputeCrossFade(LabelMap &labels)
+{
+    if(m_wb.horizontal)
+    {
+        // Set the number of pixels around the seam to cross-fade between
+        // the two component images,
+        int tw = STRIP_CROSS_FADE_WIDTH_PXLS;
+
+        // Proceed with the image index calculation for cross-fading
+        // only if the cross-fading width is larger than 0
+        if (tw > 0)
+        {
+            for(int y = 0; y < labels.height; y++)
+            {
+                // Since we compare two adjecant pixels to determine
+                // whether there is a seam, the termination condition of x
+                // is set to labels.width - tw, so that x+1 below
+                // won't exceed the map's boundary.
+                for(int x = tw; x < labels.width - tw; )
+                {
+                    // Determine where the seam is...
+                    if (labels.labelRow(y)[x] != labels.labelRow(y)[x+1] &&
+                            labels.labelRow(y)[x] != LabelMap::NONE &&
+                            labels.labelRow(y)[x+1] != LabelMap::NONE)
+                    {
+                        // Find the image indices on both sides of the seam
+                        unsigned short idx1 = labels.labelRow(y)[x];
+                        unsigned short idx2 = labels.labelRow(y)[x+1];
 
-            float dself = hypotSq(csite->getVCenter().x - si, csite->getVCenter().y - sj);
+                        for (int o = tw; o >= 0; o--)
+                        {
+                            // Set the image index to use for cross-fading
+                            labels.fadeRow(y)[x - o] = idx2;
+                            // Set the intensity weights to use for cross-fading
+                            labels.weightRow(y)[x - o] = 50 + (99 - 50) * o / tw;
+                        }
 
-            // scan the neighbors to see if this is a valid position
-            SEdgeVector *ce;
-            int ecnt;
-            for (ce = csite->getNeighbor(), ecnt = csite->getNumNeighbors(); ecnt--; ce++)
+                        for (int o = 1; o <= tw; o++)
+                        {
+                            // Set the image index to use for cross-fading
+                            labels.fadeRow(y)[x + o] = idx1;
+                            // Set the intensity weights to use for cross-fading
+                            labels.weightRow(y)[x + o] = labels.weightRow(y)[x - o];
+                        }
+
+                        x += (tw + 1);
+                    }
+                    else
+                    {
+                        x++;
+                    }
+                }
+            }
+        }
+    }
+    else
+    {
+        // Set the number of pixels around the seam to cross-fade between
+        // the two component images,
+        int tw = STRIP_CROSS_FADE_WIDTH_PXLS;
+
+        // Proceed with the image index calculation for cross-fading
+        // only if the cross-fading width is larger than 0
+        if (tw > 0)
+        {
+            for(int x = 0; x < labels.width; x++)
             {
-                float d1 = hypotSq(m_AllSites[ce->second].getVCenter().x - si,
-                        m_AllSites[ce->second].getVCenter().y - sj);
-                if (d1 < dself)
+                // Since we compare two adjecant pixels to determine
+                // whether there is a seam, the termination condition of y
+                // is set to labels.height - tw, so that y+1 below
+                // won't exceed the map's boundary.
+                for(int y = tw; y < labels.height - tw; )
                 {
-                    break;
+                    // Determine where the seam is...
+                    if (labels.labelRow(y)[x] != labels.labelRow(y+1)[x] &&
+                            labels.labelRow(y)[x] != LabelMap::NONE &&
+                            labels.labelRow(y+1)[x] != LabelMap::NONE)
+                    {
+                        // Find the image indices on both sides of the seam
+                        unsigned short idx1 = labels.labelRow(y)[x];
+                        unsigned short idx2 = labels.labelRow(y+1)[x];
+
+                        for (int o = tw; o >= 0; o--)
+                        {
+                            // Set the image index to use for cross-fading
+                            labels.fadeRow(y - o)[x] = idx2;
+                            // Set the intensity weights to use for cross-fading
+                            labels.weightRow(y - o)[x] = 50 + (99 - 50) * o / tw;
+                        }
+
+                        for (int o = 1; o <= tw; o++)
+                        {
+                            // Set the image index to use for cross-fading
+                            labels.fadeRow(y + o)[x] = idx1;
+                            // Set the intensity weights to use for cross-fading
+                            labels.weightRow(y + o)[x] = labels.weightRow(y - o)[x];
+                        }
+
+                        y += (tw + 1);
+                    }
+                    else
+                    {
+                        y++;
+                    }
                 }
             }
+        }
+    }
+}
+
+LabelMap::LabelMap(int width, int height, bool crossFade)
+{
+    this->width = width;
+    this->height = height;
+
+    size_t size = (size_t) width * height;
+    label = (unsigned short *) malloc(size * sizeof(unsigned short));
+    fade = crossFade ? (unsigned short *) malloc(size * sizeof(unsigned short)) : NULL;
+    weight = crossFade ? (unsigned char *) calloc(size, 1) : NULL;
+
+    // 0xffff bytes make NONE entries
+    if (label != NULL)
+        memset(label, 0xff, size * sizeof(unsigned short));
+    if (fade != NULL)
+        memset(fade, 0xff, size * sizeof(unsigned short));
+}
+
+LabelMap::~LabelMap()
+{
+    free(label);
+    free(fade);
+    free(weight);
+}
 
-            if (ecnt >= 0) continue;
+WarpRow::WarpRow(int size)
+{
+    count = 0;
+    dst = new int[size];
+    xi = new int[size];
+    yi = new int[size];
+    xfrac = new float[size];
+    yfrac = new float[size];
+    wt0 = new float[size];
+    wt1 = new float[size];
+    for (int c = 0; c < 3; c++)
+        val[c] = new float[size];
+    px = new float[size + 2 * PROJECTION_SPAN_MAX];
+    py = new float[size + 2 * PROJECTION_SPAN_MAX];
+}
+
+WarpRow::~WarpRow()
+{
+    delete[] py;
+    delete[] px;
+    for (int c = 0; c < 3; c++)
+        delete[] val[c];
+    delete[] wt1;
+    delete[] wt0;
+    delete[] yfrac;
+    delete[] xfrac;
+    delete[] yi;
+    delete[] xi;
+    delete[] dst;
+}
+
+// Computes the region of interest of a frame at one level of the mosaic
+// pyramid, including the border needed by the pyramid filters.
+void Blend::ComputeLevelRect(BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, int dscale, int &l, int &b, int &r, int &t)
+{
+    int width = rect.Width() >> dscale;
+    int height = rect.Height() >> dscale;
+
+    l = (int) ((vcrect.lft - rect.left) / (1 << dscale));
+    b = (int) ((vcrect.bot - rect.top) / (1 << dscale));
+    r = (int) ((vcrect.rgt - rect.left) / (1 << dscale) + .5);
+    t = (int) ((vcrect.top - rect.top) / (1 << dscale) + .5);
+
+    if (vcrect.lft == brect.lft)
+        l = (l <= 0) ? -BORDER : l - BORDER;
+    else if (l < -BORDER)
+        l = -BORDER;
+
+    if (vcrect.bot == brect.bot)
+        b = (b <= 0) ? -BORDER : b - BORDER;
+    else if (b < -BORDER)
+        b = -BORDER;
 
-            imgMos.Y.ptr[jj][ii] = (unsigned char)site_idx;
+    if (vcrect.rgt == brect.rgt)
+        r = (r >= width) ? width + BORDER - 1 : r + BORDER;
+    else if (r >= width + BORDER)
+        r = width + BORDER - 1;
+
+    if (vcrect.top == brect.top)
+        t = (t >= height) ? height + BORDER - 1 : t + BORDER;
+    else if (t >= height + BORDER)
+        t = height + BORDER - 1;
+}
+
+// Restricts the region of interest of a frame at one level of the mosaic
+// pyramid to the tile being blended and makes it relative to the tile. Only
+// the outer edges of the mosaic have pyramid borders.
+void Blend::ClipLevelRectToTile(MosaicRect &rect, PyramidShort *dptr, int dscale, int &l, int &b, int &r, int &t)
+{
+    MosaicRect &tile = m_mergeWindow;
+    int tx = tile.left >> dscale;
+    int ty = tile.top >> dscale;
+
+    if (tile.left > 0 && l < tx)
+        l = tx;
+    if (tile.top > 0 && b < ty)
+        b = ty;
+    if (tile.right < rect.Width() && r >= tx + dptr->width)
+        r = tx + dptr->width - 1;
+    if (tile.bottom < rect.Height() && t >= ty + dptr->height)
+        t = ty + dptr->height - 1;
+
+    l -= tx;
+    r -= tx;
+    b -= ty;
+    t -= ty;
+}
+
+// Computes the bounding box, in level-0 mosaic coordinates, of all the
+// mosaic pixels and mask entries a frame reads or writes while it is warped
+// into the mosaic pyramid.
+void Blend::ComputeFootprint(BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, MosaicRect &footprint)
+{
+    footprint.left = footprint.top = 0x7fffffff;
+    footprint.right = footprint.bottom = -0x7fffffff;
+
+    int dscale = 0;
+    for (int n = m_wb.nlevs; n--; dscale++)
+    {
+        int l, b, r, t;
+        ComputeLevelRect(vcrect, brect, rect, dscale, l, b, r, t);
+
+        if (l * (1 << dscale) < footprint.left) footprint.left = l * (1 << dscale);
+        if (b * (1 << dscale) < footprint.top) footprint.top = b * (1 << dscale);
+        if (r * (1 << dscale) > footprint.right) footprint.right = r * (1 << dscale);
+        if (t * (1 << dscale) > footprint.bottom) footprint.bottom = t * (1 << dscale);
+    }
+}
+
+// Computes the window of a frame, in level-0 frame coordinates, that
+// ProcessPyramidForThisFrameNarrow reads from while it warps the frame into
+// the current tile: the bounding box of the samples at every level, widened
+// by the bicubic taps, the grid projection error and the pixels a pyramid
+// of the window alone gets wrong near its edges (up to 2 on a Gaussian
+// level, 7 on a Laplacian one). The window starts on the sampling grid of
+// the coarsest level, so each level of its pyramids is a crop of that of
+// the whole frame. Returns false if the window is the whole frame.
+bool Blend::ComputeSourceWindow(BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, float trs[3][3], MosaicRect &window)
+{
+    float inv_trs[3][3];
+    inv33d(trs, inv_trs);
+
+    int ext = 2;
+    if (m_projTolerance > 0.0f)
+        ext += (int) ceilf(2 * m_projTolerance);
+
+    window.left = window.top = 0x7fffffff;
+    window.right = window.bottom = -0x7fffffff;
+
+    int dscale = 0;
+    for (int n = m_wb.nlevs; n--; dscale++)
+    {
+        int l, b, r, t;
+        ComputeLevelRect(vcrect, brect, rect, dscale, l, b, r, t);
+        ClipLevelRectToTile(rect, m_pMosaicYPyr + dscale, dscale, l, b, r, t);
+        if (l > r || b > t)
+            continue;
+
+        int tx = m_mergeWindow.left >> dscale;
+        int ty = m_mergeWindow.top >> dscale;
+
+        // The outline of the region bounds its projection
+        float minx = 1e30f, miny = 1e30f, maxx = -1e30f, maxy = -1e30f;
+        for (int j = b; j <= t; j++)
+        {
+            bool edge = (j == b || j == t);
+            for (int i = l; i <= r; i = (edge || i == r) ? i + 1 : r)
+            {
+                float xx, yy;
+                MosaicToFrame(inv_trs, ((i + tx) << dscale) + rect.left,
+                        ((j + ty) << dscale) + rect.top, xx, yy);
+                if (!(xx == xx && yy == yy))
+                    return false;
+                if (xx < minx) minx = xx;
+                if (xx > maxx) maxx = xx;
+                if (yy < miny) miny = yy;
+                if (yy > maxy) maxy = yy;
+            }
         }
+
+        // Samples are clipped to the pyramid border of the frame
+        int lw = width >> dscale;
+        int lh = height >> dscale;
+        int margin = (n > 0) ? BORDER : 3;
+        float lo = -BORDER - margin, hix = lw + BORDER + margin, hiy = lh + BORDER + margin;
+        minx = min(max(floorf(minx / (1 << dscale)) - ext - margin, lo), hix);
+        miny = min(max(floorf(miny / (1 << dscale)) - ext - margin, lo), hiy);
+        maxx = min(max(floorf(maxx / (1 << dscale)) + ext + margin, lo), hix);
+        maxy = min(max(floorf(maxy / (1 << dscale)) + ext + margin, lo), hiy);
+
+        int scale = 1 << dscale;
+        if ((int) minx * scale < window.left) window.left = (int) minx * scale;
+        if ((int) miny * scale < window.top) window.top = (int) miny * scale;
+        if ((int) (maxx + 1) * scale > window.right) window.right = (int) (maxx + 1) * scale;
+        if ((int) (maxy + 1) * scale > window.bottom) window.bottom = (int) (maxy + 1) * scale;
     }
+
+    // Nothing to sample: any small window will do
+    if (window.left > window.right)
+        window.left = window.top = window.right = window.bottom = 0;
+
+    int align = 1 << (m_wb.nlevs - 1);
+    int minSize = 1 << m_wb.nlevs;
+    window.left = (window.left < 0) ? 0 : window.left & ~(align - 1);
+    window.top = (window.top < 0) ? 0 : window.top & ~(align - 1);
+    if (window.right < window.left + minSize) window.right = window.left + minSize;
+    if (window.bottom < window.top + minSize) window.bottom = window.top + minSize;
+    if (window.right > width) window.right = width;
+    if (window.bottom > height) window.bottom = height;
+
+    return (window.left > 0 || window.top > 0 ||
+            window.right < width || window.bottom < height);
 }
 
-void Blend::ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, float trs[3][3], int site_idx)
+void Blend::ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, LabelMap &labels, float trs[3][3], int site_idx, FramePyramids &fpyr)
 {
     // Put the Region of interest (for all levels) into m_pMosaicYPyr
     float inv_trs[3][3];
     inv33d(trs, inv_trs);
 
     // Process each pyramid level
-    PyramidShort *sptr = m_pFrameYPyr;
-    PyramidShort *suptr = m_pFrameUPyr;
-    PyramidShort *svptr = m_pFrameVPyr;
-
+    PyramidShort *sptr = fpyr.Y;
     PyramidShort *dptr = m_pMosaicYPyr;
-    PyramidShort *duptr = m_pMosaicUPyr;
-    PyramidShort *dvptr = m_pMosaicVPyr;
+
+    // Pixels of the current row queued for bicubic interpolation
+    WarpRow row(m_pMosaicYPyr->width + 2 * BORDER);
+    bool gridProject = (m_projTolerance > 0.0f);
 
     int dscale = 0; // distance scale for the current level
-    int nC = m_wb.nlevsC;
-    for (int n = m_wb.nlevs; n--; dscale++, dptr++, sptr++, dvptr++, duptr++, svptr++, suptr++, nC--)
-    {
-        int l = (int) ((vcrect.lft - rect.left) / (1 << dscale));
-        int b = (int) ((vcrect.bot - rect.top) / (1 << dscale));
-        int r = (int) ((vcrect.rgt - rect.left) / (1 << dscale) + .5);
-        int t = (int) ((vcrect.top - rect.top) / (1 << dscale) + .5);
-
-        if (vcrect.lft == brect.lft)
-            l = (l <= 0) ? -BORDER : l - BORDER;
-        else if (l < -BORDER)
-            l = -BORDER;
-
-        if (vcrect.bot == brect.bot)
-            b = (b <= 0) ? -BORDER : b - BORDER;
-        else if (b < -BORDER)
-            b = -BORDER;
-
-        if (vcrect.rgt == brect.rgt)
-            r = (r >= dptr->width) ? dptr->width + BORDER - 1 : r + BORDER;
-        else if (r >= dptr->width + BORDER)
-            r = dptr->width + BORDER - 1;
-
-        if (vcrect.top == brect.top)
-            t = (t >= dptr->height) ? dptr->height + BORDER - 1 : t + BORDER;
-        else if (t >= dptr->height + BORDER)
-            t = dptr->height + BORDER - 1;
+    for (int n = m_wb.nlevs; n--; dscale++, dptr++, sptr++)
+    {
+        int l, b, r, t;
+        ComputeLevelRect(vcrect, brect, rect, dscale, l, b, r, t);
+        int fl = l, fr = r;
+        ClipLevelRectToTile(rect, dptr, dscale, l, b, r, t);
+        int tx = m_mergeWindow.left >> dscale;
+        int ty = m_mergeWindow.top >> dscale;
+
+        // Chroma level dscale - 1 shares the sampling grid of this level
+        int c = dscale - 1;
+        bool chroma = (c >= 0 && c < m_wb.nlevsC);
+        PyramidShort *suptr = chroma ? fpyr.U + c : NULL;
+        PyramidShort *svptr = chroma ? fpyr.V + c : NULL;
+        PyramidShort *duptr = chroma ? m_pMosaicUPyr + c : NULL;
+        PyramidShort *dvptr = chroma ? m_pMosaicVPyr + c : NULL;
+
+        PyramidShort *planes[3] = { sptr, suptr, svptr };
+        int nplanes = chroma ? 3 : 1;
 
         // Walk the Region of interest and populate the pyramid
         for (int j = b; j <= t; j++)
         {
-            int jj = (j << dscale);
+            row.count = 0;
+            int jj = ((j + ty) << dscale);
+            int mj = jj - m_mergeMaskY;
             float sj = jj + rect.top;
 
+            int pa = 0;
+            if (gridProject)
+                pa = ProjectRow(inv_trs, rect.left, (int) sj, 1 << dscale, fl, fr, l + tx, r + tx, row.px, row.py);
+
+            // Columns [is,ie) of the level are assigned to this site
+            int is, ie;
+            GetSiteSpan(site_idx, jj, dscale, tx, is, ie);
+
+            bool rowIn = ((unsigned) jj < (unsigned) Mheight);
+            unsigned short *lab = rowIn ? labels.labelRow(mj) : NULL;
+            unsigned short *fade = rowIn ? labels.fadeRow(mj) : NULL;
+            unsigned char *weight = rowIn ? labels.weightRow(mj) : NULL;
+
             for (int i = l; i <= r; i++)
             {
-                int ii = (i << dscale);
+                int ii = ((i + tx) << dscale);
+                int mi = ii - m_mergeMaskX;
                 // project point and then triangulate to neighbors
                 float si = ii + rect.left;
 
-                int inMask = ((unsigned) ii < imgMos.Y.width &&
-                        (unsigned) jj < imgMos.Y.height) ? 1 : 0;
+                int inMask = ((unsigned) ii < (unsigned) Mwidth &&
+                        (unsigned) jj < (unsigned) Mheight) ? 1 : 0;
 
-                if(inMask && imgMos.Y.ptr[jj][ii] != site_idx &&
-                        imgMos.V.ptr[jj][ii] != site_idx &&
-                        imgMos.Y.ptr[jj][ii] != 255)
+                // Elsewhere, only the pixels no site is assigned to and the
+                // band the site cross-fades into
+                if ((i < is || i >= ie) && inMask && lab[mi] != site_idx &&
+                        fade[mi] != site_idx && lab[mi] != LabelMap::NONE)
                     continue;
 
                 // Setup weights for cross-fading
@@ -977,11 +1965,11 @@ void Blend::ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, Blen
 
                 if (m_wb.stripType == STRIP_TYPE_WIDE)
                 {
-                    if(inMask && imgMos.Y.ptr[jj][ii] != 255)
+                    if(inMask && lab[mi] != LabelMap::NONE)
                     {
                         // If not on a seam OR pyramid level exceeds
                         // maximum level for cross-fading.
-                        if((imgMos.V.ptr[jj][ii] == 128) ||
+                        if((fade[mi] == LabelMap::NONE) ||
                             (dscale > STRIP_CROSS_FADE_MAX_PYR_LEVEL))
                         {
                             wt0 = 0.0;
@@ -990,9 +1978,9 @@ void Blend::ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, Blen
                         else
                         {
                             wt0 = 1.0;
-                            wt1 = ((imgMos.Y.ptr[jj][ii] == site_idx) ?
-                                    (float)imgMos.U.ptr[jj][ii] / 100.0 :
-                                    1.0 - (float)imgMos.U.ptr[jj][ii] / 100.0);
+                            wt1 = ((lab[mi] == site_idx) ?
+                                    (float)weight[mi] / 100.0 :
+                                    1.0 - (float)weight[mi] / 100.0);
                         }
                     }
                 }
@@ -1000,13 +1988,19 @@ void Blend::ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, Blen
                 // Project this mosaic point into the original frame coordinate space
                 float xx, yy;
 
-                MosaicToFrame(inv_trs, si, sj, xx, yy);
+                if (gridProject)
+                {
+                    xx = row.px[i + tx - pa];
+                    yy = row.py[i + tx - pa];
+                }
+                else
+                    MosaicToFrame(inv_trs, si, sj, xx, yy);
 
                 if (xx < 0.0 || yy < 0.0 || xx > width - 1.0 || yy > height - 1.0)
                 {
                     if(inMask)
                     {
-                        imgMos.Y.ptr[jj][ii] = 255;
+                        lab[mi] = LabelMap::NONE;
                         wt0 = 0.0f;
                         wt1 = 1.0f;
                     }
@@ -1024,17 +2018,8 @@ void Blend::ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, Blen
                 if(inSegment(x1, sptr->width, BORDER-1) &&
                         inSegment(y1, sptr->height, BORDER-1))
                 {
-                    float xfrac = xx - x1;
-                    float yfrac = yy - y1;
-                    dptr->ptr[j][i] = (short) (wt0 * dptr->ptr[j][i] + .5 +
-                            wt1 * ciCalc(sptr, x1, y1, xfrac, yfrac));
-                    if (dvptr >= m_pMosaicVPyr && nC > 0)
-                    {
-                        duptr->ptr[j][i] = (short) (wt0 * duptr->ptr[j][i] + .5 +
-                                wt1 * ciCalc(suptr, x1, y1, xfrac, yfrac));
-                        dvptr->ptr[j][i] = (short) (wt0 * dvptr->ptr[j][i] + .5 +
-                                wt1 * ciCalc(svptr, x1, y1, xfrac, yfrac));
-                    }
+                    // Interpolated together with the rest of the row below
+                    row.add(i, x1, y1, xx - x1, yy - y1, wt0, wt1);
                 }
 #else
                 if(inSegment(x1, sptr->width, BORDER) && inSegment(y1, sptr->height, BORDER))
@@ -1049,7 +2034,7 @@ void Blend::ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, Blen
                         (sptr->ptr[y2][x2] - sptr->ptr[y2][x1]) * xfrac;
                     dptr->ptr[j][i] = (short) (y1val + yfrac * (y2val - y1val));
 
-                    if (dvptr >= m_pMosaicVPyr && nC > 0)
+                    if (chroma)
                     {
                         y1val = suptr->ptr[y1][x1] +
                             (suptr->ptr[y1][x2] - suptr->ptr[y1][x1]) * xfrac;
@@ -1074,7 +2059,7 @@ void Blend::ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, Blen
 
                     dptr->ptr[j][i] = (short) (wt0 * dptr->ptr[j][i] + 0.5 +
                             wt1 * sptr->ptr[y1][x1] );
-                    if (dvptr >= m_pMosaicVPyr && nC > 0)
+                    if (chroma)
                     {
                         dvptr->ptr[j][i] = (short) (wt0 * dvptr->ptr[j][i] +
                                 0.5 + wt1 * svptr->ptr[y1][x1] );
@@ -1083,85 +2068,119 @@ void Blend::ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, Blen
                     }
                 }
             }
+
+#ifndef LINEAR_INTERP
+            ciCalcRow(planes, row.val, nplanes, row.xi, row.yi, row.xfrac, row.yfrac, row.count);
+            for (int k = 0; k < row.count; k++)
+            {
+                int i = row.dst[k];
+                float wt0 = row.wt0[k];
+                float wt1 = row.wt1[k];
+                dptr->ptr[j][i] = (short) (wt0 * dptr->ptr[j][i] + .5 +
+                        wt1 * row.val[0][k]);
+                if (nplanes == 3)
+                {
+                    duptr->ptr[j][i] = (short) (wt0 * duptr->ptr[j][i] + .5 +
+                            wt1 * row.val[1][k]);
+                    dvptr->ptr[j][i] = (short) (wt0 * dvptr->ptr[j][i] + .5 +
+                            wt1 * row.val[2][k]);
+                }
+            }
+#endif
         }
     }
 }
 
-void Blend::ProcessPyramidForThisFrameNarrow(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, float trs[3][3], int site_idx)
+void Blend::ProcessPyramidForThisFrameNarrow(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, LabelMap &labels, float trs[3][3], int site_idx, FramePyramids &fpyr)
 {
     // Put the Region of interest (for all levels) into m_pMosaicYPyr
     float inv_trs[3][3];
     inv33d(trs, inv_trs);
 
     // Process each pyramid level
-    PyramidShort *sptr = m_pFrameYPyr;
-    PyramidShort *suptr = m_pFrameUPyr;
-    PyramidShort *svptr = m_pFrameVPyr;
-
+    PyramidShort *sptr = fpyr.Y;
     PyramidShort *dptr = m_pMosaicYPyr;
-    PyramidShort *duptr = m_pMosaicUPyr;
-    PyramidShort *dvptr = m_pMosaicVPyr;
+
+    // Pixels of the current row queued for bicubic interpolation
+    WarpRow row(m_pMosaicYPyr->width + 2 * BORDER);
+    bool gridProject = (m_projTolerance > 0.0f);
 
     int dscale = 0; // distance scale for the current level
-    int nC = m_wb.nlevsC;
-    for (int n = m_wb.nlevs; n--; dscale++, dptr++, sptr++, dvptr++, duptr++, svptr++, suptr++, nC--)
-    {
-        int l = (int) ((vcrect.lft - rect.left) / (1 << dscale));
-        int b = (int) ((vcrect.bot - rect.top) / (1 << dscale));
-        int r = (int) ((vcrect.rgt - rect.left) / (1 << dscale) + .5);
-        int t = (int) ((vcrect.top - rect.top) / (1 << dscale) + .5);
-
-        if (vcrect.lft == brect.lft)
-            l = (l <= 0) ? -BORDER : l - BORDER;
-        else if (l < -BORDER)
-            l = -BORDER;
-
-        if (vcrect.bot == brect.bot)
-            b = (b <= 0) ? -BORDER : b - BORDER;
-        else if (b < -BORDER)
-            b = -BORDER;
-
-        if (vcrect.rgt == brect.rgt)
-            r = (r >= dptr->width) ? dptr->width + BORDER - 1 : r + BORDER;
-        else if (r >= dptr->width + BORDER)
-            r = dptr->width + BORDER - 1;
-
-        if (vcrect.top == brect.top)
-            t = (t >= dptr->height) ? dptr->height + BORDER - 1 : t + BORDER;
-        else if (t >= dptr->height + BORDER)
-            t = dptr->height + BORDER - 1;
+    for (int n = m_wb.nlevs; n--; dscale++, dptr++, sptr++)
+    {
+        int l, b, r, t;
+        ComputeLevelRect(vcrect, brect, rect, dscale, l, b, r, t);
+        int fl = l, fr = r;
+        ClipLevelRectToTile(rect, dptr, dscale, l, b, r, t);
+        int tx = m_mergeWindow.left >> dscale;
+        int ty = m_mergeWindow.top >> dscale;
+
+        // The pyramids may only hold a window of the frame
+        int fw = width >> dscale;
+        int fh = height >> dscale;
+        int ox = fpyr.x0 >> dscale;
+        int oy = fpyr.y0 >> dscale;
+
+        // Chroma level dscale - 1 shares the sampling grid of this level
+        int c = dscale - 1;
+        bool chroma = (c >= 0 && c < m_wb.nlevsC);
+        PyramidShort *suptr = chroma ? fpyr.U + c : NULL;
+        PyramidShort *svptr = chroma ? fpyr.V + c : NULL;
+        PyramidShort *duptr = chroma ? m_pMosaicUPyr + c : NULL;
+        PyramidShort *dvptr = chroma ? m_pMosaicVPyr + c : NULL;
+
+        PyramidShort *planes[3] = { sptr, suptr, svptr };
+        int nplanes = chroma ? 3 : 1;
 
         // Walk the Region of interest and populate the pyramid
         for (int j = b; j <= t; j++)
         {
-            int jj = (j << dscale);
+            row.count = 0;
+            int jj = ((j + ty) << dscale);
+            int mj = jj - m_mergeMaskY;
             int sj = jj + rect.top;
 
+            int pa = 0;
+            if (gridProject)
+                pa = ProjectRow(inv_trs, rect.left, sj, 1 << dscale, fl, fr, l + tx, r + tx, row.px, row.py);
+
+            // Columns [is,ie) of the level are assigned to this site
+            int is, ie;
+            GetSiteSpan(site_idx, jj, dscale, tx, is, ie);
+
+            unsigned short *lab = ((unsigned) jj < (unsigned) Mheight) ? labels.labelRow(mj) : NULL;
+
             for (int i = l; i <= r; i++)
             {
-                int ii = (i << dscale);
+                int ii = ((i + tx) << dscale);
+                int mi = ii - m_mergeMaskX;
 
                 // project point and then triangulate to neighbors
                 int si = ii + rect.left;
 
-                int inMask = ((unsigned) ii < imgMos.Y.width &&
-                        (unsigned) jj < imgMos.Y.height) ? 1 : 0;
+                int inMask = ((unsigned) ii < (unsigned) Mwidth &&
+                        (unsigned) jj < (unsigned) Mheight) ? 1 : 0;
 
-                if (inMask && imgMos.Y.ptr[jj][ii] != site_idx &&
-		    imgMos.V.ptr[jj][ii] != site_idx &&
-		    imgMos.Y.ptr[jj][ii] != 255)
+                // Elsewhere, only the pixels no site is assigned to
+                if ((i < is || i >= ie) && inMask && lab[mi] != LabelMap::NONE)
                     continue;
 
                 // Project this mosaic point into the original frame coordinate space
                 float xx, yy;
 
-                MosaicToFrame(inv_trs, si, sj, xx, yy);
+                if (gridProject)
+                {
+                    xx = row.px[i + tx - pa];
+                    yy = row.py[i + tx - pa];
+                }
+                else
+                    MosaicToFrame(inv_trs, si, sj, xx, yy);
 
                 if (xx < 0.0f || yy < 0.0f || xx > width - 1.0f || yy > height - 1.0f)
                 {
                     if(inMask)
                     {
-                        imgMos.Y.ptr[jj][ii] = 255;
+                        lab[mi] = LabelMap::NONE;
                     }
                 }
 
@@ -1173,32 +2192,30 @@ void Blend::ProcessPyramidForThisFrameNarrow(CSite *csite, BlendRect &vcrect, Bl
 
                 // Final destination in extended pyramid
 #ifndef LINEAR_INTERP
-                if(inSegment(x1, sptr->width, BORDER-1) &&
-                        inSegment(y1, sptr->height, BORDER-1))
+                if(inSegment(x1, fw, BORDER-1) &&
+                        inSegment(y1, fh, BORDER-1))
                 {
                     float xfrac = xx - x1;
                     float yfrac = yy - y1;
-                    dptr->ptr[j][i] = (short) (0.5 + ciCalc(sptr, x1, y1, xfrac, yfrac));
-                    if (dvptr >= m_pMosaicVPyr && nC > 0)
-                    {
-                        duptr->ptr[j][i] = (short) (0.5 + ciCalc(suptr, x1, y1, xfrac, yfrac));
-                        dvptr->ptr[j][i] = (short) (0.5 + ciCalc(svptr, x1, y1, xfrac, yfrac));
-                    }
+                    // Interpolated together with the rest of the row below
+                    row.add(i, x1 - ox, y1 - oy, xfrac, yfrac, 0.0f, 1.0f);
                 }
 #else
-                if(inSegment(x1, sptr->width, BORDER) && inSegment(y1, sptr->height, BORDER))
+                if(inSegment(x1, fw, BORDER) && inSegment(y1, fh, BORDER))
                 {
-                    int x2 = x1 + 1;
-                    int y2 = y1 + 1;
                     float xfrac = xx - x1;
                     float yfrac = yy - y1;
+                    x1 -= ox;
+                    y1 -= oy;
+                    int x2 = x1 + 1;
+                    int y2 = y1 + 1;
                     float y1val = sptr->ptr[y1][x1] +
                         (sptr->ptr[y1][x2] - sptr->ptr[y1][x1]) * xfrac;
                     float y2val = sptr->ptr[y2][x1] +
                         (sptr->ptr[y2][x2] - sptr->ptr[y2][x1]) * xfrac;
                     dptr->ptr[j][i] = (short) (y1val + yfrac * (y2val - y1val));
 
-                    if (dvptr >= m_pMosaicVPyr && nC > 0)
+                    if (chroma)
                     {
                         y1val = suptr->ptr[y1][x1] +
                             (suptr->ptr[y1][x2] - suptr->ptr[y1][x1]) * xfrac;
@@ -1218,20 +2235,556 @@ void Blend::ProcessPyramidForThisFrameNarrow(CSite *csite, BlendRect &vcrect, Bl
 #endif
                 else
                 {
-                    clipToSegment(x1, sptr->width, BORDER);
-                    clipToSegment(y1, sptr->height, BORDER);
+                    clipToSegment(x1, fw, BORDER);
+                    clipToSegment(y1, fh, BORDER);
+                    x1 -= ox;
+                    y1 -= oy;
 
                     dptr->ptr[j][i] = (short) (0.5 + sptr->ptr[y1][x1]);
-                    if (dvptr >= m_pMosaicVPyr && nC > 0) {
+                    if (chroma) {
                         dvptr->ptr[j][i] = (short) (0.5 + svptr->ptr[y1][x1]);
                         duptr->ptr[j][i] = (short) (0.5 + suptr->ptr[y1][x1]);
                     }
                 }
             }
+
+#ifndef LINEAR_INTERP
+            ciCalcRow(planes, row.val, nplanes, row.xi, row.yi, row.xfrac, row.yfrac, row.count);
+            for (int k = 0; k < row.count; k++)
+            {
+                int i = row.dst[k];
+                dptr->ptr[j][i] = (short) (0.5 + row.val[0][k]);
+                if (nplanes == 3)
+                {
+                    duptr->ptr[j][i] = (short) (0.5 + row.val[1][k]);
+                    dvptr->ptr[j][i] = (short) (0.5 + row.val[2][k]);
+                }
+            }
+#endif
         }
     }
 }
 
+// Weight of a fully contributing pixel in the warp-once engine
+static const int WARP_WEIGHT_ONE = 1024;
+
+// Computes the region of the mosaic, in level-0 pixels relative to rect,
+// that the warp-once engine warps a frame into: its Voronoi cell, widened
+// by the feathering of its weight, by how far the weight spreads on the way
+// down the pyramid and by the pixels a pyramid of the region alone gets
+// wrong near its edges, which together stay within 5 pixels of the coarsest
+// level. Given a tile, the region is restricted to what the tile pyramid
+// needs. The region starts and ends on the sampling grid of the coarsest
+// level.
+void Blend::ComputeWarpRegion(BlendRect &vcrect, MosaicRect &rect, MosaicRect *tile, MosaicRect &region)
+{
+    int align = 1 << (m_wb.nlevs - 1);
+    int spread = 5 * align;
+    int ext = (int) ceilf(STRIP_CROSS_FADE_WIDTH_PXLS) + 1 + spread;
+
+    int l = (int) floorf(vcrect.lft - rect.left) - ext;
+    int t = (int) floorf(vcrect.bot - rect.top) - ext;
+    int r = (int) ceilf(vcrect.rgt - rect.left) + ext + 1;
+    int b = (int) ceilf(vcrect.top - rect.top) + ext + 1;
+
+    // The pyramid borders of the mosaic come from those of the region
+    if (l < -BORDER) l = -BORDER;
+    if (t < -BORDER) t = -BORDER;
+    if (r > rect.Width() + BORDER) r = rect.Width() + BORDER;
+    if (b > rect.Height() + BORDER) b = rect.Height() + BORDER;
+
+    if (tile != NULL)
+    {
+        if (l < tile->left - spread) l = tile->left - spread;
+        if (t < tile->top - spread) t = tile->top - spread;
+        if (r > tile->right + spread) r = tile->right + spread;
+        if (b > tile->bottom + spread) b = tile->bottom + spread;
+    }
+
+    region.left = l & ~(align - 1);
+    region.top = t & ~(align - 1);
+    region.right = (r + align - 1) & ~(align - 1);
+    region.bottom = (b + align - 1) & ~(align - 1);
+    if (region.right < region.left) region.right = region.left;
+    if (region.bottom < region.top) region.bottom = region.top;
+}
+
+// The warp-once engine projects its rows in spans on the fixed grid of
+// multiples of PROJECTION_SPAN_MAX, which the regions of all tiles share.
+static inline int SpanGridFloor(int x)
+{
+    return x & ~(PROJECTION_SPAN_MAX - 1);
+}
+
+static inline int SpanGridCeil(int x)
+{
+    return (x + PROJECTION_SPAN_MAX - 1) & ~(PROJECTION_SPAN_MAX - 1);
+}
+
+// Warps a region of the mosaic, computed by ComputeWarpRegion, out of the
+// full resolution frame and decomposes it into the pyramids of wf. The
+// weight of a pixel ramps from 0 to WARP_WEIGHT_ONE across
+// STRIP_CROSS_FADE_WIDTH_PXLS pixels either side of the Voronoi bisectors
+// with the neighbouring sites, and is 0 where the frame does not cover the
+// pixel; as in the pyramid engine such pixels are also taken out of the
+// frame assignment, but only by AccumulateWarpedFrame, as the earlier
+// sites may still be reading it. The pyramids are freed by FreeWarpedFrame.
+int Blend::WarpFrameOnce(CSite *csite, MosaicRect &region, MosaicRect &rect, float trs[3][3], FramePyramids &fpyr, WarpedFrame &wf, PyramidWorkspace &work)
+{
+    int rw = region.Width();
+    int rh = region.Height();
+    if (rw <= 0 || rh <= 0)
+        return BLEND_RET_OK;
+
+    wf.x0 = region.left;
+    wf.y0 = region.top;
+    wf.wl = wf.wt = 0x7fffffff;
+    wf.wr = wf.wb = 0;
+    wf.Y = PyramidShort::allocatePyramidPacked(m_wb.nlevs, rw, rh, BORDER, m_pool);
+    wf.W = PyramidShort::allocatePyramidPacked(m_wb.nlevs, rw, rh, BORDER, m_pool);
+    wf.U = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, rw >> 1, rh >> 1, BORDER, m_pool);
+    wf.V = PyramidShort::allocatePyramidPacked(m_wb.nlevsC, rw >> 1, rh >> 1, BORDER, m_pool);
+    if (!wf.Y || !wf.W || !wf.U || !wf.V)
+    {
+        LOGE("Error: Could not allocate pyramids for blending");
+        return BLEND_RET_ERROR_MEMORY;
+    }
+
+    // The distance of mosaic point (x, y) to the bisector with neighbour k
+    // is a[k] - nx[k] * x - ny[k] * y, positive on the side of this site
+    int nn = csite->getNumNeighbors();
+    float *a = new float[3 * nn];
+    float *nx = a + nn;
+    float *ny = a + 2 * nn;
+    SEdgeVector *ce = csite->getNeighbor();
+    float cx = csite->getVCenter().x;
+    float cy = csite->getVCenter().y;
+    for (int k = 0; k < nn; k++, ce++)
+    {
+        float dx = m_AllSites[ce->second].getVCenter().x - cx;
+        float dy = m_AllSites[ce->second].getVCenter().y - cy;
+        float len = sqrtf(dx * dx + dy * dy);
+        if (len > 0.0f)
+        {
+            nx[k] = dx / len;
+            ny[k] = dy / len;
+            a[k] = nx[k] * (cx + dx / 2) + ny[k] * (cy + dy / 2);
+        }
+        else
+        {
+            nx[k] = ny[k] = 0.0f;
+            a[k] = 1e30f;
+        }
+    }
+
+    float feather = STRIP_CROSS_FADE_WIDTH_PXLS;
+    float wscale = WARP_WEIGHT_ONE / (2 * feather);
+
+    float inv_trs[3][3];
+    inv33d(trs, inv_trs);
+    bool gridProject = (m_projTolerance > 0.0f);
+    WarpRow row(rw);
+
+    // The part of the frame the region samples, spread through the border
+    // for the bicubic taps
+    MosaicRect window;
+    bool windowed = ComputeRegionWindow(region, rect, inv_trs, window);
+    LoadFrame(csite->getMb(), fpyr, windowed ? &window : NULL);
+    PyramidShort::BorderSpread(fpyr.Y, BORDER, BORDER, BORDER, BORDER);
+    PyramidShort::BorderSpread(fpyr.U, BORDER, BORDER, BORDER, BORDER);
+    PyramidShort::BorderSpread(fpyr.V, BORDER, BORDER, BORDER, BORDER);
+    int ox = fpyr.x0;
+    int oy = fpyr.y0;
+    PyramidShort *planes[2];
+
+    // Luma and weights
+    for (int j = 0; j < rh; j++)
+    {
+        int jj = region.top + j;
+        int sj = jj + rect.top;
+        ImageTypeShort yptr = wf.Y->ptr[j];
+        ImageTypeShort wptr = wf.W->ptr[j];
+
+        row.count = 0;
+        int pa = 0;
+        if (gridProject)
+            pa = ProjectRow(inv_trs, rect.left, sj, 1, SpanGridFloor(region.left), SpanGridCeil(region.right - 1),
+                    region.left, region.right - 1, row.px, row.py);
+
+        // Along the row, each bisector bounds the weight on one side; the
+        // weight can only be nonzero in columns [fl,fr)
+        int x0 = region.left + rect.left;
+        float lo = x0, hi = x0 + rw;
+        for (int k = 0; k < nn; k++)
+        {
+            float c = a[k] - ny[k] * sj + feather;
+            if (nx[k] > 0.0f)
+                hi = min(hi, c / nx[k]);
+            else if (nx[k] < 0.0f)
+                lo = max(lo, c / nx[k]);
+            else if (c <= 0.0f)
+                hi = lo;
+        }
+        int fl = (int) floorf(lo) - x0;
+        int fr = (int) ceilf(hi) - x0 + 1;
+
+        for (int i = 0; i < rw; i++)
+        {
+            int ii = region.left + i;
+            int si = ii + rect.left;
+
+            float xx, yy;
+            if (gridProject)
+            {
+                xx = row.px[ii - pa];
+                yy = row.py[ii - pa];
+            }
+            else
+                MosaicToFrame(inv_trs, si, sj, xx, yy);
+
+            if (xx < 0.0f || yy < 0.0f || xx > width - 1.0f || yy > height - 1.0f)
+            {
+                wptr[i] = 0;
+                if (!wf.uncovered.empty() && wf.uncoveredRow.back() == jj &&
+                        wf.uncovered.back().end == ii)
+                {
+                    wf.uncovered.back().end++;
+                }
+                else
+                {
+                    LabelSpan span;
+                    span.start = ii;
+                    span.end = ii + 1;
+                    wf.uncovered.push_back(span);
+                    wf.uncoveredRow.push_back(jj);
+                }
+            }
+            else if (i < fl || i >= fr)
+                wptr[i] = 0;
+            else
+            {
+                float d = feather;
+                for (int k = 0; k < nn && d > -feather; k++)
+                {
+                    float dk = a[k] - nx[k] * si - ny[k] * sj;
+                    if (dk < d)
+                        d = dk;
+                }
+
+                if (d <= -feather)
+                    wptr[i] = 0;
+                else if (d >= feather)
+                    wptr[i] = WARP_WEIGHT_ONE;
+                else
+                    wptr[i] = (short) ((d + feather) * wscale + 0.5f);
+
+                if (wptr[i] != 0)
+                {
+                    if (i < wf.wl) wf.wl = i;
+                    if (i >= wf.wr) wf.wr = i + 1;
+                    if (j < wf.wt) wf.wt = j;
+                    wf.wb = j + 1;
+                }
+            }
+
+            // Pixels outside the frame still get the nearest frame pixel,
+            // for the pyramids of the region to be smooth
+            int x1 = (xx >= 0.0) ? (int) xx : (int) floorf(xx);
+            int y1 = (yy >= 0.0) ? (int) yy : (int) floorf(yy);
+            if (inSegment(x1, width, BORDER-1) && inSegment(y1, height, BORDER-1))
+                row.add(i, x1 - ox, y1 - oy, xx - x1, yy - y1, 0.0f, 1.0f);
+            else
+            {
+                clipToSegment(x1, width, BORDER);
+                clipToSegment(y1, height, BORDER);
+                yptr[i] = fpyr.Y->ptr[y1 - oy][x1 - ox];
+            }
+        }
+
+        planes[0] = fpyr.Y;
+        ciCalcRow(planes, row.val, 1, row.xi, row.yi, row.xfrac, row.yfrac, row.count);
+        for (int k = 0; k < row.count; k++)
+            yptr[row.dst[k]] = (short) (0.5 + row.val[0][k]);
+    }
+
+    delete[] a;
+
+    // Chroma, on the grid of luma level 1
+    int cw = width >> 1;
+    int ch = height >> 1;
+    int cx0 = region.left / 2;
+    int cy0 = region.top / 2;
+    for (int j = 0; j < (rh >> 1); j++)
+    {
+        int sj = (cy0 + j) * 2 + rect.top;
+        ImageTypeShort uptr = wf.U->ptr[j];
+        ImageTypeShort vptr = wf.V->ptr[j];
+
+        row.count = 0;
+        int pa = 0;
+        if (gridProject)
+            pa = ProjectRow(inv_trs, rect.left, sj, 2, SpanGridFloor(cx0), SpanGridCeil(cx0 + (rw >> 1) - 1),
+                    cx0, cx0 + (rw >> 1) - 1, row.px, row.py);
+
+        for (int i = 0; i < (rw >> 1); i++)
+        {
+            float xx, yy;
+            if (gridProject)
+            {
+                xx = row.px[cx0 + i - pa];
+                yy = row.py[cx0 + i - pa];
+            }
+            else
+                MosaicToFrame(inv_trs, (cx0 + i) * 2 + rect.left, sj, xx, yy);
+
+            xx /= 2;
+            yy /= 2;
+
+            int x1 = (xx >= 0.0) ? (int) xx : (int) floorf(xx);
+            int y1 = (yy >= 0.0) ? (int) yy : (int) floorf(yy);
+            if (inSegment(x1, cw, BORDER-1) && inSegment(y1, ch, BORDER-1))
+                row.add(i, x1 - (ox >> 1), y1 - (oy >> 1), xx - x1, yy - y1, 0.0f, 1.0f);
+            else
+            {
+                clipToSegment(x1, cw, BORDER);
+                clipToSegment(y1, ch, BORDER);
+                uptr[i] = fpyr.U->ptr[y1 - (oy >> 1)][x1 - (ox >> 1)];
+                vptr[i] = fpyr.V->ptr[y1 - (oy >> 1)][x1 - (ox >> 1)];
+            }
+        }
+
+        planes[0] = fpyr.U;
+        planes[1] = fpyr.V;
+        ciCalcRow(planes, row.val, 2, row.xi, row.yi, row.xfrac, row.yfrac, row.count);
+        for (int k = 0; k < row.count; k++)
+        {
+            uptr[row.dst[k]] = (short) (0.5 + row.val[0][k]);
+            vptr[row.dst[k]] = (short) (0.5 + row.val[1][k]);
+        }
+    }
+
+    if (!PyramidShort::BorderReduce(wf.Y, m_wb.nlevs, &work) || !PyramidShort::BorderExpand(wf.Y, m_wb.nlevs, -1, &work) ||
+            !PyramidShort::BorderReduce(wf.U, m_wb.nlevsC, &work) || !PyramidShort::BorderExpand(wf.U, m_wb.nlevsC, -1, &work) ||
+            !PyramidShort::BorderReduce(wf.V, m_wb.nlevsC, &work) || !PyramidShort::BorderExpand(wf.V, m_wb.nlevsC, -1, &work) ||
+            !PyramidShort::BorderReduce(wf.W, m_wb.nlevs, &work))
+    {
+        LOGE("Error: Could not generate Laplacian pyramids");
+        return BLEND_RET_ERROR;
+    }
+
+    return BLEND_RET_OK;
+}
+
+// Computes the window of a frame, in level-0 frame coordinates, that
+// WarpFrameOnce samples while it warps the frame into a region of the
+// mosaic: the bounding box of the projection of the outline of the region,
+// widened by the bicubic taps (of the chroma too) and the grid projection
+// error. The window starts on an even row and column. Returns false if the
+// window is the whole frame.
+bool Blend::ComputeRegionWindow(MosaicRect &region, MosaicRect &rect, float inv_trs[3][3], MosaicRect &window)
+{
+    float minx = 1e30f, miny = 1e30f, maxx = -1e30f, maxy = -1e30f;
+    for (int j = region.top; j < region.bottom; j++)
+    {
+        bool edge = (j == region.top || j == region.bottom - 1);
+        for (int i = region.left; i < region.right;
+                i = (edge || i == region.right - 1) ? i + 1 : region.right - 1)
+        {
+            float xx, yy;
+            MosaicToFrame(inv_trs, i + rect.left, j + rect.top, xx, yy);
+            if (!(xx == xx && yy == yy))
+                return false;
+            if (xx < minx) minx = xx;
+            if (xx > maxx) maxx = xx;
+            if (yy < miny) miny = yy;
+            if (yy > maxy) maxy = yy;
+        }
+    }
+
+    int ext = 6;
+    if (m_projTolerance > 0.0f)
+        ext += (int) ceilf(2 * m_projTolerance);
+
+    minx = min(max(floorf(minx) - ext, 0.0f), (float) width);
+    miny = min(max(floorf(miny) - ext, 0.0f), (float) height);
+    maxx = min(max(floorf(maxx) + ext + 1, 0.0f), (float) width);
+    maxy = min(max(floorf(maxy) + ext + 1, 0.0f), (float) height);
+
+    window.left = (int) minx & ~1;
+    window.top = (int) miny & ~1;
+    window.right = (int) maxx;
+    window.bottom = (int) maxy;
+    if (window.right - window.left < 2 || window.bottom - window.top < 2)
+        return false;
+
+    return (window.left > 0 || window.top > 0 ||
+            window.right < width || window.bottom < height);
+}
+
+// Takes the pixels a warped frame does not cover out of its frame
+// assignment and adds its pyramids, times its weights, to the sums of the
+// tile. The borders of the region only contribute past the edges of the
+// mosaic, so that a frame writes no sums outside of its footprint.
+void Blend::AccumulateWarpedFrame(WarpedFrame &wf, MosaicRect &rect)
+{
+    LabelMap &labels = *m_mergeLabels;
+    for (size_t n = 0; n < wf.uncovered.size(); n++)
+    {
+        int mj = wf.uncoveredRow[n] - m_mergeMaskY;
+        if ((unsigned) mj >= (unsigned) labels.height)
+            continue;
+
+        unsigned short *lab = labels.labelRow(mj);
+        for (int ii = wf.uncovered[n].start; ii < wf.uncovered[n].end; ii++)
+        {
+            int mi = ii - m_mergeMaskX;
+            if ((unsigned) mi < (unsigned) labels.width && lab[mi] == wf.site)
+                lab[mi] = LabelMap::NONE;
+        }
+    }
+
+    if (wf.Y == NULL || wf.wl >= wf.wr)
+        return;
+
+    MosaicRect &tile = m_mergeWindow;
+    ImageTypeShort ybase = m_pMosaicYPyr->ptr[-BORDER] - BORDER;
+    ImageTypeShort cbase = m_pMosaicUPyr->ptr[-BORDER] - BORDER;
+
+    // Nonzero weights of the level, which spread by 2 pixels of the level
+    // above on the way down
+    int wl = wf.wl, wt = wf.wt, wr = wf.wr, wb = wf.wb;
+
+    int dscale = 0;
+    for (int n = m_wb.nlevs; n--; dscale++)
+    {
+        PyramidShort *dptr = m_pMosaicYPyr + dscale;
+        PyramidShort *sptr = wf.Y + dscale;
+        PyramidShort *wptr = wf.W + dscale;
+
+        if (dscale > 0)
+        {
+            wl = (wl - 2) >> 1;
+            wt = (wt - 2) >> 1;
+            wr = (wr + 3) >> 1;
+            wb = (wb + 3) >> 1;
+        }
+
+        // Chroma level dscale - 1 shares the sampling grid of this level
+        int c = dscale - 1;
+        bool chroma = (c >= 0 && c < m_wb.nlevsC);
+
+        // Origin of the region in the tile pyramid
+        int ox = (wf.x0 >> dscale) - (tile.left >> dscale);
+        int oy = (wf.y0 >> dscale) - (tile.top >> dscale);
+
+        int l = (tile.left > 0) ? 0 : -BORDER;
+        int b = (tile.top > 0) ? 0 : -BORDER;
+        int r = (tile.right < rect.Width()) ? dptr->width : dptr->width + BORDER;
+        int t = (tile.bottom < rect.Height()) ? dptr->height : dptr->height + BORDER;
+
+        // The weights spread through the border where they reach it
+        int rl = ox + ((wl > 0) ? wl : (wf.x0 <= -BORDER) ? -BORDER : 0);
+        int rb = oy + ((wt > 0) ? wt : (wf.y0 <= -BORDER) ? -BORDER : 0);
+        int rr = ox + ((wr < sptr->width) ? wr : sptr->width);
+        int rt = oy + ((wb < sptr->height) ? wb : sptr->height);
+        if (wr >= sptr->width && wf.x0 + (sptr->width << dscale) >= rect.Width() + BORDER) rr += BORDER;
+        if (wb >= sptr->height && wf.y0 + (sptr->height << dscale) >= rect.Height() + BORDER) rt += BORDER;
+
+        if (l < rl) l = rl;
+        if (b < rb) b = rb;
+        if (r > rr) r = rr;
+        if (t > rt) t = rt;
+
+        for (int j = b; j < t; j++)
+        {
+            ImageTypeShort wrow = wptr->ptr[j - oy] - ox;
+            ImageTypeShort yrow = sptr->ptr[j - oy] - ox;
+            int *ay = m_accY + (dptr->ptr[j] - ybase);
+            int *aw = m_accW + (dptr->ptr[j] - ybase);
+
+            for (int i = l; i < r; i++)
+            {
+                int w = wrow[i];
+                ay[i] += w * yrow[i];
+                aw[i] += w;
+            }
+
+            if (chroma)
+            {
+                ImageTypeShort urow = wf.U[c].ptr[j - oy] - ox;
+                ImageTypeShort vrow = wf.V[c].ptr[j - oy] - ox;
+                int *au = m_accU + (m_pMosaicUPyr[c].ptr[j] - cbase);
+                int *av = m_accV + (m_pMosaicUPyr[c].ptr[j] - cbase);
+
+                for (int i = l; i < r; i++)
+                {
+                    int w = wrow[i];
+                    au[i] += w * urow[i];
+                    av[i] += w * vrow[i];
+                }
+            }
+        }
+    }
+}
+
+// Weighted mean of the warped frames, rounded to nearest
+static inline short WeightedMean(int sum, int weight)
+{
+    if (weight <= 0)
+        return 0;
+
+    return (short) ((sum >= 0 ? sum + weight / 2 : sum - weight / 2) / weight);
+}
+
+// Fills the tile pyramids with the weighted means of the warped frames. The
+// chroma is weighted like the luma level it shares its grid with.
+void Blend::NormalizeAccumulatedTile()
+{
+    ImageTypeShort ybase = m_pMosaicYPyr->ptr[-BORDER] - BORDER;
+    ImageTypeShort cbase = m_pMosaicUPyr->ptr[-BORDER] - BORDER;
+
+    int dscale = 0;
+    for (int n = m_wb.nlevs; n--; dscale++)
+    {
+        PyramidShort *dptr = m_pMosaicYPyr + dscale;
+        int c = dscale - 1;
+        bool chroma = (c >= 0 && c < m_wb.nlevsC);
+
+        for (int j = -BORDER; j < dptr->height + BORDER; j++)
+        {
+            ImageTypeShort yrow = dptr->ptr[j];
+            int *ay = m_accY + (yrow - ybase);
+            int *aw = m_accW + (yrow - ybase);
+
+            for (int i = -BORDER; i < dptr->width + BORDER; i++)
+                yrow[i] = WeightedMean(ay[i], aw[i]);
+
+            if (chroma)
+            {
+                ImageTypeShort urow = m_pMosaicUPyr[c].ptr[j];
+                ImageTypeShort vrow = m_pMosaicVPyr[c].ptr[j];
+                int *au = m_accU + (urow - cbase);
+                int *av = m_accV + (urow - cbase);
+
+                for (int i = -BORDER; i < dptr->width + BORDER; i++)
+                {
+                    urow[i] = WeightedMean(au[i], aw[i]);
+                    vrow[i] = WeightedMean(av[i], aw[i]);
+                }
+            }
+        }
+    }
+}
+
+void Blend::FreeWarpedFrame(WarpedFrame &wf)
+{
+    PyramidShort::freePyramid(wf.W, m_pool);
+    PyramidShort::freePyramid(wf.V, m_pool);
+    PyramidShort::freePyramid(wf.U, m_pool);
+    PyramidShort::freePyramid(wf.Y, m_pool);
+    wf.Y = wf.U = wf.V = wf.W = NULL;
+}
+
 void Blend::MosaicToFrame(float trs[3][3], int x, int y, float &wx, float &wy)
 {
     float X, Y, z;
@@ -1266,6 +2819,82 @@ void Blend::MosaicToFrame(float trs[3][3], int x, int y, float &wx, float &wy)
     wy = ProjY(trs, X, Y, z, 1.0);
 }
 
+// Projects the pixels l to r of row y of a pyramid level into the frame,
+// pixel i being at x0 + i * step in the mosaic, for first <= l and r <= last.
+// Exact projections are taken every PROJECTION_SPAN_MAX pixels from first
+// and at last, and refined by ProjectSpan wherever a straight line between
+// them is off by more than the projection tolerance, scaled to the level.
+// As the spans only depend on first and last, so do the results, whatever
+// part of [first,last] is projected. wx[k] and wy[k] receive pixel k + the
+// returned index.
+int Blend::ProjectRow(float trs[3][3], int x0, int y, int step, int first, int last, int l, int r, float *wx, float *wy)
+{
+    int a0 = first + (l - first) / PROJECTION_SPAN_MAX * PROJECTION_SPAN_MAX;
+    int b0 = first + (r - first + PROJECTION_SPAN_MAX - 1) / PROJECTION_SPAN_MAX * PROJECTION_SPAN_MAX;
+    if (b0 > last)
+        b0 = last;
+
+    if (l > r)
+        return a0;
+
+    x0 += a0 * step;
+    MosaicToFrame(trs, x0, y, wx[0], wy[0]);
+
+    float tol = m_projTolerance * step;
+    for (int a = 0; a < b0 - a0; )
+    {
+        int b = a + PROJECTION_SPAN_MAX;
+        if (b > b0 - a0)
+            b = b0 - a0;
+
+        MosaicToFrame(trs, x0 + b * step, y, wx[b], wy[b]);
+        ProjectSpan(trs, x0, y, step, a, b, tol, wx, wy);
+        a = b;
+    }
+
+    return a0;
+}
+
+// Fills in the projections strictly between a and b, both already exact.
+// The midpoint is projected exactly; if the chord from a to b misses it by
+// no more than tol, each half is filled linearly. For a smooth projection
+// the error on the halves is then about a quarter of the one measured.
+void Blend::ProjectSpan(float trs[3][3], int x0, int y, int step, int a, int b, float tol, float *wx, float *wy)
+{
+    if (b - a < 2)
+        return;
+
+    int m = (a + b) >> 1;
+    MosaicToFrame(trs, x0 + m * step, y, wx[m], wy[m]);
+
+    float f = (float) (m - a) / (b - a);
+    float ex = wx[a] + (wx[b] - wx[a]) * f - wx[m];
+    float ey = wy[a] + (wy[b] - wy[a]) * f - wy[m];
+
+    if (fabsf(ex) > tol || fabsf(ey) > tol)
+    {
+        ProjectSpan(trs, x0, y, step, a, m, tol, wx, wy);
+        ProjectSpan(trs, x0, y, step, m, b, tol, wx, wy);
+        return;
+    }
+
+    float dx = (wx[m] - wx[a]) / (m - a);
+    float dy = (wy[m] - wy[a]) / (m - a);
+    for (int k = a + 1; k < m; k++)
+    {
+        wx[k] = wx[a] + dx * (k - a);
+        wy[k] = wy[a] + dy * (k - a);
+    }
+
+    dx = (wx[b] - wx[m]) / (b - m);
+    dy = (wy[b] - wy[m]) / (b - m);
+    for (int k = m + 1; k < b; k++)
+    {
+        wx[k] = wx[m] + dx * (k - m);
+        wy[k] = wy[m] + dy * (k - m);
+    }
+}
+
 void Blend::FrameToMosaic(float trs[3][3], float x, float y, float &wx, float &wy)
 {
     // Project into the intermediate Mosaic coordinate system
@@ -21,12 +21,17 @@
 #ifndef BLEND_H
 #define BLEND_H
 
+#include <pthread.h>
+#include <vector>
+
 #include "MosaicTypes.h"
 #include "Pyramid.h"
 #include "Delaunay.h"
+#include "FramePool.h"
 
 #define BLEND_RANGE_DEFAULT 6
 #define BORDER 8
+#define PROJECTION_TOLERANCE_DEFAULT 0.0625f
 
 // Percent of total mosaicing time spent on each of the following operations
 const float TIME_PERCENT_ALIGN = 20.0;
@@ -47,6 +52,110 @@ const float STRIP_CROSS_FADE_WIDTH_PXLS = 2;
 // the blending algorithm.
 const int STRIP_CROSS_FADE_MAX_PYR_LEVEL = 2;
 
+/**
+ *  Laplacian pyramids of the frame currently being blended. Each blending
+ *  thread owns one set so frames can be decomposed concurrently. In thin
+ *  strip mode they may only hold a window of the frame, (x0,y0) being its
+ *  level-0 origin in the frame.
+ */
+typedef struct {
+  PyramidShort *Y;
+  PyramidShort *U;
+  PyramidShort *V;
+  int x0, y0;
+} FramePyramids;
+
+/**
+ *  Columns [start,end) of a row of the mosaic.
+ */
+typedef struct {
+  int start, end;
+} LabelSpan;
+
+/**
+ *  A frame warped by the warp-once engine: the Laplacian pyramids of the
+ *  region of the mosaic it is warped into and the Gaussian pyramid of its
+ *  feathered weight over that region, (x0,y0) being the level-0 origin of
+ *  the region relative to the mosaic. Chroma level k is weighted by luma
+ *  level k + 1, which shares its sampling grid. The level-0 weights are 0
+ *  outside columns [wl,wr) and rows [wt,wb) of the region. The spans of
+ *  mosaic rows uncoveredRow[n] in uncovered, relative to the mosaic, are
+ *  not covered by the frame of site; they are taken out of its frame
+ *  assignment once the earlier sites are done with it.
+ */
+typedef struct {
+  PyramidShort *Y;
+  PyramidShort *U;
+  PyramidShort *V;
+  PyramidShort *W;
+  int x0, y0;
+  int wl, wt, wr, wb;
+  int site;
+  std::vector<LabelSpan> uncovered;
+  std::vector<int> uncoveredRow;
+} WarpedFrame;
+
+/**
+ *  Frame assignment of the mosaic pixels: for every pixel, the index of the
+ *  site it is taken from, or NONE where no frame covers it. In
+ *  STRIP_TYPE_WIDE mode, pixels in the band around a seam also hold the
+ *  site on the other side of the seam (fade) and the weight, times 100, of
+ *  their own site in the cross-fade; fade is NONE elsewhere.
+ */
+class LabelMap {
+public:
+  static const unsigned short NONE = 0xffff;
+
+  LabelMap(int width, int height, bool crossFade);
+  ~LabelMap();
+
+  inline unsigned short *labelRow(int j) { return label + (size_t) j * width; }
+  inline unsigned short *fadeRow(int j) { return fade + (size_t) j * width; }
+  inline unsigned char *weightRow(int j) { return weight + (size_t) j * width; }
+
+  int width, height;
+  unsigned short *label;
+  unsigned short *fade;   // NULL unless cross-fading
+  unsigned char *weight;  // NULL unless cross-fading
+};
+
+// Largest distance, in pixels of a pyramid level, between two exact inverse
+// projections of a row of the mosaic; see Blend::ProjectRow.
+const int PROJECTION_SPAN_MAX = 32;
+
+/**
+ *  Scratch buffers of the row-oriented warp: the pixels of one row of a
+ *  mosaic pyramid level that are bicubically interpolated, their source
+ *  positions and cross-fade weights, and the interpolated Y, U and V values.
+ */
+class WarpRow {
+public:
+  WarpRow(int size);
+  ~WarpRow();
+
+  inline void add(int i, int x, int y, float xf, float yf, float w0, float w1)
+  {
+    dst[count] = i;
+    xi[count] = x;
+    yi[count] = y;
+    xfrac[count] = xf;
+    yfrac[count] = yf;
+    wt0[count] = w0;
+    wt1[count] = w1;
+    count++;
+  }
+
+  int count;
+  int *dst;
+  int *xi, *yi;
+  float *xfrac, *yfrac;
+  float *wt0, *wt1;
+  float *val[3];
+
+  // Frame coordinates of every pixel of the row, see Blend::ProjectRow
+  float *px, *py;
+};
+
 /**
  *  Class for pyramid blending a mosaic.
  */
@@ -63,15 +172,93 @@ public:
   static const int STRIP_TYPE_THIN      = 0;
   static const int STRIP_TYPE_WIDE      = 1;
 
+  static const int BLEND_ENGINE_PYRAMID   = 0;
+  static const int BLEND_ENGINE_WARP_ONCE = 1;
+
   static const int BLEND_RET_ERROR        = -1;
   static const int BLEND_RET_OK           = 0;
   static const int BLEND_RET_ERROR_MEMORY = 1;
   static const int BLEND_RET_CANCELLED    = -2;
 
-  Blend();
+  /**
+   *  \param pool  Where the frame and mosaic pyramids and the triangulation
+   *               storage come from, so that they are recycled across frames
+   *               and panoramas; it must outlive the blender. Without one
+   *               they come from the heap.
+   */
+  Blend(FramePool *pool = NULL);
   ~Blend();
 
-  int initialize(int blendingType, int stripType, int frame_width, int frame_height);
+  /**
+   *  \param engine  How the frames are blended. BLEND_ENGINE_PYRAMID
+   *                 (default) decomposes each frame into Laplacian pyramids
+   *                 and warps every level into the mosaic pyramids.
+   *                 BLEND_ENGINE_WARP_ONCE warps each frame once at full
+   *                 resolution, together with a mask feathered across its
+   *                 seams, and decomposes the warped region in mosaic space
+   *                 instead; the blended pyramids are the weighted means of
+   *                 those of the frames. The output differs slightly.
+   */
+  int initialize(int blendingType, int stripType, int frame_width, int frame_height, int engine = BLEND_ENGINE_PYRAMID);
+
+  /**
+   *  Sets the number of threads used to merge and blend the frames.
+   *  1 (default) blends on the calling thread, 0 uses one thread per
+   *  online CPU. The output does not depend on the number of threads.
+   */
+  void setNumThreads(int numThreads);
+
+  /**
+   *  Sets the largest error, in pixels of the pyramid level being filled,
+   *  allowed when warping a row of the mosaic with inverse projections
+   *  interpolated between exact ones. 0 projects every pixel exactly.
+   *  Defaults to PROJECTION_TOLERANCE_DEFAULT.
+   */
+  void setProjectionTolerance(float tolerance);
+
+  /**
+   *  Enables blending while the frames are still being captured. Each frame
+   *  handed to addFrame is then decomposed into its Laplacian pyramids by a
+   *  background thread, so runBlend is left with warping and collapsing
+   *  them. This costs framePyramidBytes(), about 4 bytes per frame pixel,
+   *  for every frame that takes part in the blend, held until runBlend has
+   *  blended the mosaic; see setIncrementalBudget. Disabled by default.
+   *  Has no effect with BLEND_ENGINE_WARP_ONCE, which does not decompose
+   *  the frames themselves.
+   */
+  void setIncremental(bool incremental);
+
+  /**
+   *  Sets the most memory, in bytes, held by the pyramids of the frames
+   *  decomposed ahead of runBlend. Frames past the budget are decomposed by
+   *  runBlend as when incremental blending is disabled; the output is the
+   *  same either way. 0 (default) sets no limit.
+   */
+  void setIncrementalBudget(size_t bytes);
+
+  /**
+   *  Memory taken by the Y, U and V pyramids of one frame.
+   */
+  size_t framePyramidBytes();
+
+  /**
+   *  Sets the size, in mosaic pixels along its longer side, of the tiles the
+   *  mosaic is blended in. Only the mosaic pyramids of one tile, plus a
+   *  margin of 2^BLEND_RANGE_DEFAULT pixels on either side, are held at a
+   *  time, which bounds the memory needed by long panoramas at the cost of
+   *  warping the margins twice. The size is rounded up to a multiple of the
+   *  coarsest pyramid level. The output does not depend on it, and tiled
+   *  mosaics are not limited to LIMIT_SIZE_MULTIPLIER times the frame area.
+   *  0 (default) blends the whole mosaic at once.
+   */
+  void setTileSize(int size);
+
+  /**
+   *  Notifies the blender of a frame accepted for the mosaic, in capture
+   *  order. Does nothing unless incremental blending is enabled. The frame
+   *  is read by the background thread until runBlend or the destructor.
+   */
+  int addFrame(MosaicFrame *mb);
 
   int runBlend(MosaicFrame **frames, MosaicFrame **rframes, int frames_size, ImageType &imageMosaicYVU,
         int &mosaicWidth, int &mosaicHeight, float &progress, bool &cancelComputation);
@@ -89,34 +276,74 @@ protected:
   CDelaunay m_Triangulator;
   CSite *m_AllSites;
 
+  // Storage of the pyramids, see Blend()
+  FramePool *m_pool;
+
   BlendParams m_wb;
 
   // Height and width of individual frames
   int width, height;
 
    // Height and width of mosaic
-  unsigned short Mwidth, Mheight;
+  int Mwidth, Mheight;
 
   // Helper functions
   void FrameToMosaic(float trs[3][3], float x, float y, float &wx, float &wy);
   void MosaicToFrame(float trs[3][3], int x, int y, float &wx, float &wy);
+  int  ProjectRow(float trs[3][3], int x0, int y, int step, int first, int last, int l, int r, float *wx, float *wy);
+  void ProjectSpan(float trs[3][3], int x0, int y, int step, int a, int b, float tol, float *wx, float *wy);
   void FrameToMosaicRect(int width, int height, float trs[3][3], BlendRect &brect);
   void ClipBlendRect(CSite *csite, BlendRect &brect);
   void AlignToMiddleFrame(MosaicFrame **frames, int frames_size);
 
   int  DoMergeAndBlend(MosaicFrame **frames, int nsite,  int width, int height, YUVinfo &imgMos, MosaicRect &rect, MosaicRect &cropping_rect, float &progress, bool &cancelComputation);
-  void ComputeMask(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, int site_idx);
-  void ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, float trs[3][3], int site_idx);
-  void ProcessPyramidForThisFrameNarrow(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, YUVinfo &imgMos, float trs[3][3], int site_idx);
+  void ComputeMask(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, LabelMap &labels, int site_idx);
+  bool IsInCell(CSite *csite, int si, int sj);
+  void TrimSpans(LabelMap &labels, int nsite);
+  void GetSiteSpan(int site_idx, int jj, int dscale, int tx, int &is, int &ie);
+  void ComputeCrossFade(LabelMap &labels);
+  void ComputeLevelRect(BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, int dscale, int &l, int &b, int &r, int &t);
+  void ClipLevelRectToTile(MosaicRect &rect, PyramidShort *dptr, int dscale, int &l, int &b, int &r, int &t);
+  void ComputeFootprint(BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, MosaicRect &footprint);
+  bool ComputeSourceWindow(BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, float trs[3][3], MosaicRect &window);
+  void ProcessPyramidForThisFrameWide(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, LabelMap &labels, float trs[3][3], int site_idx, FramePyramids &fpyr);
+  void ProcessPyramidForThisFrameNarrow(CSite *csite, BlendRect &vcrect, BlendRect &brect, MosaicRect &rect, LabelMap &labels, float trs[3][3], int site_idx, FramePyramids &fpyr);
+
+  void LoadFrame(MosaicFrame *mb, FramePyramids &fpyr, MosaicRect *window);
+  int  FillFramePyramid(MosaicFrame *mb, FramePyramids &fpyr, PyramidWorkspace &work, MosaicRect *window = NULL);
+  FramePyramids *FindPreparedFrame(MosaicFrame *mb);
+  int  AllocateFramePyramids(FramePyramids &fpyr);
+  void FreeFramePyramids(FramePyramids &fpyr);
+  void ReleasePreparedFrames();
+  void WaitForPreparedFrames();
+  void StopPreparing();
+  void PrepareFrames();
+  static void *PrepareThread(void *arg);
 
-  int  FillFramePyramid(MosaicFrame *mb);
+  // Warp-once engine, see initialize
+  void ComputeWarpRegion(BlendRect &vcrect, MosaicRect &rect, MosaicRect *tile, MosaicRect &region);
+  bool ComputeRegionWindow(MosaicRect &region, MosaicRect &rect, float inv_trs[3][3], MosaicRect &window);
+  int  WarpFrameOnce(CSite *csite, MosaicRect &region, MosaicRect &rect, float trs[3][3], FramePyramids &fpyr, WarpedFrame &wf, PyramidWorkspace &work);
+  void AccumulateWarpedFrame(WarpedFrame &wf, MosaicRect &rect);
+  void NormalizeAccumulatedTile();
+  void FreeWarpedFrame(WarpedFrame &wf);
+
+  // Blends the frames handed out by the merge scheduler, see DoMergeAndBlend
+  void MergeFrames(FramePyramids &fpyr, PyramidWorkspace &work);
+  static void *MergeThread(void *arg);
+
+  // Tiling of the mosaic, see setTileSize and DoMergeAndBlend
+  void ComputeTile(MosaicRect &rect, bool columns, int tileSize, int margin, int n, MosaicRect &tile, MosaicRect &mask, MosaicRect &out);
+  bool TileOverlaps(MosaicRect &rect, MosaicRect &tile, MosaicRect &footprint);
+  LabelMap *CopyMask(LabelMap &labels, MosaicRect &r);
 
   // TODO: need to add documentation about the parameters
   void ComputeBlendParameters(MosaicFrame **frames, int frames_size, int is360);
   void SelectRelevantFrames(MosaicFrame **frames, int frames_size,
         MosaicFrame **relevant_frames, int &relevant_frames_size);
 
-  int  PerformFinalBlending(YUVinfo &imgMos, MosaicRect &cropping_rect);
+  int  PerformFinalBlending(YUVinfo &imgMos, ImageType chroma, LabelMap &mask, int maskX, int maskY, MosaicRect &tile, MosaicRect &out, MosaicRect &cropping_rect, bool *gray);
+  void CropGrayBorder(YUVinfo &imgMos, MosaicRect &cropping_rect, bool *gray);
   void CropFinalMosaic(YUVinfo &imgMos, MosaicRect &cropping_rect);
 
 private:
@@ -126,6 +353,83 @@ private:
    void RoundingCroppingSizeToMultipleOf8(MosaicRect& rect);
 
    YUVinfo *imgMos;
+
+   // Blending engine chosen in initialize()
+   int m_engine;
+
+   // Number of blending threads requested through setNumThreads()
+   int m_numThreads;
+
+   // Error allowed for the interpolated inverse projection, see ProjectRow
+   float m_projTolerance;
+
+   // Frames decomposed ahead of runBlend by addFrame, with their pyramids.
+   // In STRIP_TYPE_WIDE mode only the frames SelectRelevantFrames is going to
+   // pick are prepared; m_lastRelevant* is the center of the last of them.
+   bool m_incremental;
+   std::vector<MosaicFrame *> m_preparedFrames;
+   std::vector<FramePyramids> m_preparedPyr;
+   bool m_haveRelevant;
+   float m_lastRelevantX, m_lastRelevantY;
+
+   // Background decomposition of the frames handed to addFrame. Frames from
+   // m_pendingNext on in m_pendingFrames are waiting for m_prepareThread,
+   // which moves them to m_preparedFrames. m_preparedBytes counts the
+   // pyramids of both, against m_prepareBudget. runBlend waits for the
+   // thread to be idle before touching any of them.
+   size_t m_prepareBudget;
+   size_t m_preparedBytes;
+   std::vector<MosaicFrame *> m_pendingFrames;
+   int m_pendingNext;
+   bool m_prepareBusy;
+   bool m_prepareQuit;
+   bool m_prepareStarted;
+   pthread_t m_prepareThread;
+   pthread_mutex_t m_prepareMutex;
+   pthread_cond_t m_prepareCond;
+
+   // Pyramid scratch of the background thread and of each blending thread,
+   // the calling thread first; kept across frames and panoramas
+   PyramidWorkspace m_prepareWorkspace;
+   std::vector<PyramidWorkspace *> m_workspaces;
+
+   // Tile size requested through setTileSize()
+   int m_tileSize;
+
+   // The columns of each mosaic row assigned to a site by ComputeMask, see
+   // GetSiteSpan. Site s has the spans of rows m_spanTop[s] on, from
+   // m_spans[m_spanIndex[s]] up to m_spans[m_spanIndex[s + 1]].
+   std::vector<LabelSpan> m_spans;
+   std::vector<int> m_spanIndex;
+   std::vector<int> m_spanTop;
+
+   // State shared by the blending threads during DoMergeAndBlend. The sites
+   // reaching into the current tile (m_mergeSites) are handed out in order;
+   // a site is warped into the mosaic only once all the earlier sites with
+   // an overlapping footprint are done, so pixels shared between sites are
+   // written in the same order as a serial blend. m_mergeWindow is the part
+   // of the mosaic pyramid held by m_pMosaic*Pyr and m_mergeLabels the frame
+   // assignment of the tile, starting at (m_mergeMaskX, m_mergeMaskY).
+   pthread_mutex_t m_mergeMutex;
+   pthread_cond_t m_mergeCond;
+   int m_mergeNext;
+   int m_mergeCount;
+   int m_mergeRet;
+   int *m_mergeSites;
+   bool *m_mergeDone;
+   MosaicRect *m_mergeFootprint;
+   MosaicRect *m_mergeRect;
+   MosaicRect m_mergeWindow;
+   LabelMap *m_mergeLabels;
+   int m_mergeMaskX, m_mergeMaskY;
+   float *m_mergeProgress;
+   float m_mergeProgressStep;
+   bool *m_mergeCancel;
+
+   // Sums, over the frames warped into the current tile by the warp-once
+   // engine, of their Laplacian pyramids times their weights, one entry per
+   // pixel of m_pMosaic*Pyr, and of the weights over the luma pyramid
+   int *m_accY, *m_accU, *m_accV, *m_accW;
 };
 
 #endif
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <memory.h>
 #include "Delaunay.h"
+#include "FramePool.h"
 
 #define QQ 9   // Optimal value as determined by testing
 #define DM 38  // 2^(1+DM/2) element sort capability. DM=38 for >10^6 elements
@@ -43,10 +44,13 @@
 
 CDelaunay::CDelaunay()
 {
+  sa = (CSite*)NULL;
+  pool = (FramePool*)NULL;
 }
 
 CDelaunay::~CDelaunay()
 {
+  freeMemory();
 }
 
 // Allocate storage, construct triangulation, compute voronoi corners
@@ -207,7 +211,8 @@ CSite *CDelaunay::allocMemory(int n)
   size = ((sizeof(CSite) + sizeof(SitePointer)) * n +
           (sizeof(SitePointer) + sizeof(EdgePointer)) * 12
           ) * n;
-  if (!(sa = (CSite*) malloc(size))) {
+  freeMemory();
+  if (!(sa = (CSite*) (pool ? pool->allocate(size) : malloc(size)))) {
     return NULL;
   }
   sp = (SitePointer *) (sa + n);
@@ -220,7 +225,10 @@ CSite *CDelaunay::allocMemory(int n)
 void CDelaunay::freeMemory()
 {
   if (sa) {
-    free(sa);
+    if (pool)
+      pool->release(sa);
+    else
+      free(sa);
     sa = (CSite*)NULL;
   }
 }
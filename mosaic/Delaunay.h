@@ -45,6 +45,8 @@
 typedef short SitePointer;
 typedef short TrianglePointer;
 
+class FramePool;
+
 class CDelaunay
 {
 private:
@@ -60,6 +62,8 @@ private:
   EdgePointer nextEdge;
   EdgePointer availEdge;
 
+  FramePool *pool;
+
 private:
   void build(int lo, int hi, EdgePointer *le, EdgePointer *re, int rows);
   void buildTriangulation(int size);
@@ -103,6 +107,8 @@ public:
   CDelaunay();
   ~CDelaunay();
 
+  // Storage comes from the pool when there is one, see setPool
+  void setPool(FramePool *p) { pool = p; }
   CSite *allocMemory(int nsite);
   void freeMemory();
   int triangulate(SEdgeVector **edge, int nsite, int width, int height);
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+///////////////////////////////////////////////////
+// FramePool.cpp
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "FramePool.h"
+
+// Every block starts with its capacity, padded so that the memory handed
+// out keeps the alignment of malloc
+typedef union {
+    size_t capacity;
+    double align[2];
+} BlockHeader;
+
+FramePool::FramePool()
+{
+    m_cached = 0;
+    m_limit = DEFAULT_LIMIT;
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+FramePool::~FramePool()
+{
+    trim();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void *FramePool::allocate(size_t bytes)
+{
+    BlockHeader *header = NULL;
+
+    // Take the smallest kept block that fits, unless it would waste more
+    // than the request itself
+    pthread_mutex_lock(&m_mutex);
+    BlockMap::iterator it = m_blocks.lower_bound(bytes);
+    if (it != m_blocks.end() && it->first / 2 <= bytes)
+    {
+        header = (BlockHeader *) it->second;
+        m_cached -= it->first;
+        m_blocks.erase(it);
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if (header != NULL)
+    {
+        memset(&header[1], 0, bytes);
+        return &header[1];
+    }
+
+    header = (BlockHeader *) calloc(sizeof(BlockHeader) + bytes, 1);
+    if (header == NULL)
+        return NULL;
+
+    header->capacity = bytes;
+    return &header[1];
+}
+
+void FramePool::release(void *block)
+{
+    if (block == NULL)
+        return;
+
+    BlockHeader *header = (BlockHeader *) block - 1;
+
+    pthread_mutex_lock(&m_mutex);
+    if (m_cached + header->capacity <= m_limit)
+    {
+        m_blocks.insert(std::make_pair(header->capacity, (void *) header));
+        m_cached += header->capacity;
+        header = NULL;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if (header != NULL)
+        free(header);
+}
+
+void FramePool::setLimit(size_t bytes)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_limit = bytes;
+
+    // Drop the largest blocks first, they are the cheapest to allocate again
+    while (m_cached > m_limit)
+    {
+        BlockMap::iterator it = m_blocks.end();
+        --it;
+        m_cached -= it->first;
+        free(it->second);
+        m_blocks.erase(it);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void FramePool::trim()
+{
+    pthread_mutex_lock(&m_mutex);
+    for (BlockMap::iterator it = m_blocks.begin(); it != m_blocks.end(); ++it)
+        free(it->second);
+    m_blocks.clear();
+    m_cached = 0;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+size_t FramePool::cachedBytes()
+{
+    pthread_mutex_lock(&m_mutex);
+    size_t bytes = m_cached;
+    pthread_mutex_unlock(&m_mutex);
+
+    return bytes;
+}
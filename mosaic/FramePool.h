@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+///////////////////////////////////////////////////
+// FramePool.h
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <map>
+
+/**
+ *  Recycles the large blocks a mosaic goes through for every frame and
+ *  every panorama: frame buffers, frame and mosaic pyramids and the
+ *  triangulation storage. Released blocks are kept, up to a limit, and
+ *  handed out again for later requests of about the same size instead of
+ *  going back to the heap. Safe to use from several threads.
+ */
+class FramePool
+{
+public:
+    FramePool();
+    ~FramePool();
+
+    /**
+     *  Returns a zero-filled block of at least the given size, like calloc,
+     *  or NULL when out of memory.
+     */
+    void *allocate(size_t bytes);
+
+    /**
+     *  Gives back a block returned by allocate. NULL is ignored.
+     */
+    void release(void *block);
+
+    /**
+     *  Sets how many bytes of released blocks may be kept. Blocks released
+     *  past the limit are freed; 0 keeps none.
+     */
+    void setLimit(size_t bytes);
+
+    /**
+     *  Frees every block kept.
+     */
+    void trim();
+
+    /**
+     *  Bytes of released blocks currently kept.
+     */
+    size_t cachedBytes();
+
+    /**
+     *  Default limit of setLimit.
+     */
+    static const size_t DEFAULT_LIMIT = 128 << 20;
+
+protected:
+    /*Not copyable*/
+    FramePool(const FramePool&);
+    FramePool& operator=(const FramePool&);
+
+    // Released blocks by capacity
+    typedef std::multimap<size_t, void *> BlockMap;
+
+    BlockMap m_blocks;
+    size_t m_cached;
+    size_t m_limit;
+    pthread_mutex_t m_mutex;
+};
+
+#endif
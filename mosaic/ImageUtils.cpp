@@ -23,15 +23,23 @@
 #include "ImageUtils.h"
 
 ImageType *ImageUtils::imageTypeToRowPointers(ImageType in, int width, int height)
+{
+  return imageTypeToRowPointers(in, width, height, width);
+}
+
+ImageType *ImageUtils::imageTypeToRowPointers(ImageType in, int width, int height, int stride)
 {
   int i;
   int m_h = height;
-  int m_w = width;
+
+  // Rows can not overlap
+  if (stride < width)
+    return NULL;
 
   ImageType *m_rows = new ImageType[m_h];
 
   for (i=0;i<m_h;i++) {
-    m_rows[i] = &in[(m_w)*i];
+    m_rows[i] = &in[(size_t) stride*i];
   }
   return m_rows;
 }
@@ -39,17 +47,21 @@ ImageType *ImageUtils::imageTypeToRowPointers(ImageType in, int width, int heigh
 void ImageUtils::yvu2rgb(ImageType out, ImageType in, int width, int height)
 {
   int y,v,u, r, g, b;
+  int cwidth = width / 2;
   unsigned char *yimg = in;
-  unsigned char *vimg = yimg + width*height;
-  unsigned char *uimg = vimg + width*height;
+  unsigned char *vplane = yimg + (size_t) width * height;
+  unsigned char *uplane = vplane + (size_t) cwidth * (height / 2);
   unsigned char *image = out;
 
   for (int i = 0; i < height; i++) {
+    unsigned char *vimg = vplane + (size_t) cwidth * (i / 2);
+    unsigned char *uimg = uplane + (size_t) cwidth * (i / 2);
+
     for (int j = 0; j < width; j++) {
 
       y = (*yimg);
-      v = (*vimg);
-      u = (*uimg);
+      v = vimg[j / 2];
+      u = uimg[j / 2];
 
       if (y < 0) y = 0;
       if (y > 255) y = 255;
@@ -74,8 +86,6 @@ void ImageUtils::yvu2rgb(ImageType out, ImageType in, int width, int height)
       *(image++) = b;
 
       yimg++;
-      uimg++;
-      vimg++;
 
     }
   }
@@ -83,7 +93,7 @@ void ImageUtils::yvu2rgb(ImageType out, ImageType in, int width, int height)
 
 ImageType ImageUtils::allocateImage(int width, int height, int numChannels)
 {
- return (ImageType) calloc(width*height*numChannels, sizeof(ImageTypeBase));
+ return (ImageType) calloc((size_t) width * height * numChannels, sizeof(ImageTypeBase));
 }
 
 
@@ -96,22 +106,23 @@ YUVinfo::YUVinfo(int width, int height) {
   Y.width = V.width = U.width = width;
   Y.height = V.height = U.height = height;
 
-  data = new unsigned char[width * height * 3];
+  size_t size = (size_t) width * height;
+  data = new unsigned char[size * 3];
 
   // Set the Y image to 255 so we can distinguish when frame idx are written to it
-  memset(data, 255, width * height * sizeof(unsigned char));
+  memset(data, 255, size * sizeof(unsigned char));
 
   // Set the v and u images to black
-  memset(&data[width * height], 128, width * height * 2 * sizeof(unsigned char));
+  memset(&data[size], 128, size * 2 * sizeof(unsigned char));
 
   Y.ptr = new unsigned char *[height];
   V.ptr = new unsigned char *[height];
   U.ptr = new unsigned char *[height];
 
   for (int x = 0; x < height; x++) {
-    Y.ptr[x] = &data[x * width];
-    V.ptr[x] = &data[width*height + x*width];
-    U.ptr[x] = &data[width*height*2 + x*width];
+    Y.ptr[x] = &data[(size_t) x * width];
+    V.ptr[x] = &data[size + (size_t) x * width];
+    U.ptr[x] = &data[size * 2 + (size_t) x * width];
   }
 }
 
@@ -46,7 +46,8 @@ public:
   static const int IMAGE_TYPE_NOIMAGE = 0;
 
   /**
-   *  Convert image from YVU (non-interlaced) to BGR (interlaced)
+   *  Convert image from planar 4:2:0 YVU (the Y plane followed by the
+   *  half resolution V and U planes) to RGB (interlaced)
    *
    *  Arguments:
    *    out: Resulting image (note must be preallocated before
@@ -68,6 +69,7 @@ public:
   static void freeImage(ImageType image);
 
   static ImageType *imageTypeToRowPointers(ImageType out, int width, int height);
+  static ImageType *imageTypeToRowPointers(ImageType out, int width, int height, int stride);
   /**
    *  Get time.
    */
@@ -96,8 +98,8 @@ protected:
  */
 typedef struct {
   unsigned char **ptr;
-  unsigned short width;
-  unsigned short height;
+  int width;
+  int height;
 } BimageInfo;
 
 /**
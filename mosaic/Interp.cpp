@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+///////////////////////////////////////////////////////////
+// Interp.cpp
+
+#include "Interp.h"
+
+// The vector versions rely on the scalar code doing its float arithmetic in
+// SSE registers, which is only the default ABI on x86-64.
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define INTERP_X86_SIMD
+#endif
+
+static void ciCalcRow_C(PyramidShort **img, float **out, int nimg,
+        const int *xi, const int *yi, const float *xfrac, const float *yfrac,
+        int k, int n)
+{
+    for (; k < n; k++)
+        for (int c = 0; c < nimg; c++)
+            out[c][k] = ciCalc(img[c], xi[k], yi[k], xfrac[k], yfrac[k]);
+}
+
+#ifdef INTERP_X86_SIMD
+
+// Four points at a time. Each point loads its 4x4 neighbourhood one row at
+// a time and the rows of four points are transposed, so that every vector
+// holds the same tap for the four points.
+__attribute__((target("sse2")))
+static void ciCalcRow_SSE2(PyramidShort **img, float **out, int nimg,
+        const int *xi, const int *yi, const float *xfrac, const float *yfrac,
+        int k, int n)
+{
+    for (; k + 4 <= n; k += 4)
+    {
+        int offx[4], offy[4];
+        for (int p = 0; p < 4; p++)
+        {
+            offx[p] = (int)(xfrac[k + p] * CTAPS);
+            offy[p] = (int)(yfrac[k + p] * CTAPS);
+        }
+
+        __m128 wx[4], wy[4];
+#define CI_WEIGHTS(w, off) \
+        w[0] = _mm_setr_ps(ciTable[off[0] + 40], ciTable[off[1] + 40], ciTable[off[2] + 40], ciTable[off[3] + 40]); \
+        w[1] = _mm_setr_ps(ciTable[off[0]], ciTable[off[1]], ciTable[off[2]], ciTable[off[3]]); \
+        w[2] = _mm_setr_ps(ciTable[40 - off[0]], ciTable[40 - off[1]], ciTable[40 - off[2]], ciTable[40 - off[3]]); \
+        w[3] = _mm_setr_ps(ciTable[80 - off[0]], ciTable[80 - off[1]], ciTable[80 - off[2]], ciTable[80 - off[3]]);
+        CI_WEIGHTS(wx, offx)
+        CI_WEIGHTS(wy, offy)
+#undef CI_WEIGHTS
+
+        for (int c = 0; c < nimg; c++)
+        {
+            const ImageTypeShortBase *in[4];
+            for (int p = 0; p < 4; p++)
+                in[p] = img[c]->ptr[yi[k + p] - 1] + xi[k + p] - 1;
+
+            __m128 tmpf[4];
+            for (int row = 0; row < 4; row++)
+            {
+                __m128 t[4];
+                for (int p = 0; p < 4; p++)
+                {
+                    __m128i v = _mm_loadl_epi64((const __m128i *) in[p]);
+                    t[p] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+                    in[p] += img[c]->pitch;
+                }
+                _MM_TRANSPOSE4_PS(t[0], t[1], t[2], t[3]);
+
+                __m128 sum = _mm_mul_ps(t[0], wx[0]);
+                sum = _mm_add_ps(sum, _mm_mul_ps(t[1], wx[1]));
+                sum = _mm_add_ps(sum, _mm_mul_ps(t[2], wx[2]));
+                tmpf[row] = _mm_add_ps(sum, _mm_mul_ps(t[3], wx[3]));
+            }
+
+            __m128 sum = _mm_mul_ps(wy[0], tmpf[0]);
+            sum = _mm_add_ps(sum, _mm_mul_ps(wy[1], tmpf[1]));
+            sum = _mm_add_ps(sum, _mm_mul_ps(wy[2], tmpf[2]));
+            sum = _mm_add_ps(sum, _mm_mul_ps(wy[3], tmpf[3]));
+            _mm_storeu_ps(out[c] + k, sum);
+        }
+    }
+
+    ciCalcRow_C(img, out, nimg, xi, yi, xfrac, yfrac, k, n);
+}
+
+// Eight points at a time. The taps are fetched with 32-bit gathers, each
+// returning two horizontally adjacent pixels of one point.
+__attribute__((target("avx2")))
+static void ciCalcRow_AVX2(PyramidShort **img, float **out, int nimg,
+        const int *xi, const int *yi, const float *xfrac, const float *yfrac,
+        int k, int n)
+{
+    const __m256 ctaps = _mm256_set1_ps((float) CTAPS);
+    const __m256i c40 = _mm256_set1_epi32(40);
+    const __m256i c80 = _mm256_set1_epi32(80);
+    const __m256i one = _mm256_set1_epi32(1);
+
+    for (; k + 8 <= n; k += 8)
+    {
+        __m256i offx = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_loadu_ps(xfrac + k), ctaps));
+        __m256i offy = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_loadu_ps(yfrac + k), ctaps));
+
+        __m256 wx[4], wy[4];
+        wx[0] = _mm256_i32gather_ps(ciTable, _mm256_add_epi32(offx, c40), 4);
+        wx[1] = _mm256_i32gather_ps(ciTable, offx, 4);
+        wx[2] = _mm256_i32gather_ps(ciTable, _mm256_sub_epi32(c40, offx), 4);
+        wx[3] = _mm256_i32gather_ps(ciTable, _mm256_sub_epi32(c80, offx), 4);
+        wy[0] = _mm256_i32gather_ps(ciTable, _mm256_add_epi32(offy, c40), 4);
+        wy[1] = _mm256_i32gather_ps(ciTable, offy, 4);
+        wy[2] = _mm256_i32gather_ps(ciTable, _mm256_sub_epi32(c40, offy), 4);
+        wy[3] = _mm256_i32gather_ps(ciTable, _mm256_sub_epi32(c80, offy), 4);
+
+        __m256i x = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) (xi + k)), one);
+        __m256i y = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *) (yi + k)), one);
+
+        for (int c = 0; c < nimg; c++)
+        {
+            // Offsets in shorts from the level origin; rows of a packed
+            // pyramid level are contiguous, pitch shorts apart. The gather
+            // offsets are 32-bit, which frame pyramids comfortably fit.
+            const int *base = (const int *) img[c]->ptr[0];
+            __m256i pitch = _mm256_set1_epi32((int) img[c]->pitch);
+            __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32(y, pitch), x);
+
+            __m256 tmpf[4];
+            for (int row = 0; row < 4; row++)
+            {
+                __m256i p01 = _mm256_i32gather_epi32(base, idx, 2);
+                __m256i p23 = _mm256_i32gather_epi32(base, _mm256_add_epi32(idx, _mm256_set1_epi32(2)), 2);
+
+                __m256 t0 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(p01, 16), 16));
+                __m256 t1 = _mm256_cvtepi32_ps(_mm256_srai_epi32(p01, 16));
+                __m256 t2 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(p23, 16), 16));
+                __m256 t3 = _mm256_cvtepi32_ps(_mm256_srai_epi32(p23, 16));
+
+                __m256 sum = _mm256_mul_ps(t0, wx[0]);
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(t1, wx[1]));
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(t2, wx[2]));
+                tmpf[row] = _mm256_add_ps(sum, _mm256_mul_ps(t3, wx[3]));
+
+                idx = _mm256_add_epi32(idx, pitch);
+            }
+
+            __m256 sum = _mm256_mul_ps(wy[0], tmpf[0]);
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(wy[1], tmpf[1]));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(wy[2], tmpf[2]));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(wy[3], tmpf[3]));
+            _mm256_storeu_ps(out[c] + k, sum);
+        }
+    }
+
+    // See Pyramid.cpp; avoid the AVX to SSE transition penalty
+    _mm256_zeroupper();
+    ciCalcRow_SSE2(img, out, nimg, xi, yi, xfrac, yfrac, k, n);
+}
+
+#endif // INTERP_X86_SIMD
+
+void ciCalcRow(PyramidShort **img, float **out, int nimg, const int *xi,
+        const int *yi, const float *xfrac, const float *yfrac, int n)
+{
+#ifdef INTERP_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+    {
+        ciCalcRow_AVX2(img, out, nimg, xi, yi, xfrac, yfrac, 0, n);
+        return;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        ciCalcRow_SSE2(img, out, nimg, xi, yi, xfrac, yfrac, 0, n);
+        return;
+    }
+#endif
+    ciCalcRow_C(img, out, nimg, xi, yi, xfrac, yfrac, 0, n);
+}
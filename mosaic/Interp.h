@@ -24,7 +24,7 @@
 #include "Pyramid.h"
 
 #define CTAPS 40
-static float ciTable[81] = {
+static const float ciTable[81] = {
         1.0f, 0.998461f, 0.993938f, 0.98657f, 0.9765f,
         0.963867f, 0.948813f, 0.931477f, 0.912f, 0.890523f,
         0.867188f, 0.842133f, 0.8155f, 0.78743f, 0.758062f,
@@ -77,4 +77,12 @@ inline float ciCalc(PyramidShort *img, int xi, int yi, float xfrac, float yfrac)
           ciTable[40 - off] * tmpf[2] + ciTable[80 - off] * tmpf[3]);
 }
 
+// Row version of ciCalc: interpolates the n points (xi[k] + xfrac[k],
+// yi[k] + yfrac[k]) in each of the nimg images, which must be packed
+// pyramid levels, and stores the results in out[0..nimg-1][k]. The taps are
+// evaluated several points at a time with SIMD when the CPU supports it, in
+// the same order as ciCalc, so the results are identical.
+void ciCalcRow(PyramidShort **img, float **out, int nimg, const int *xi,
+        const int *yi, const float *xfrac, const float *yfrac, int n);
+
 #endif
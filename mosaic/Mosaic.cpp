@@ -31,34 +31,43 @@
 
 Mosaic::Mosaic()
 {
+    aligner = NULL;
     blender = 0;
     initialized = false;
     imageMosaicYVU = NULL;
+    frames = NULL;
+    rframes = NULL;
     frames_size = 0;
     max_frames = 200;
 }
 
 Mosaic::~Mosaic()
 {
-    for (int i = 0; i < frames_size; i++)
+    // The blender may still be reading the frames
+    if (blender != NULL)
+        delete blender;
+    blender = NULL;
+
+    if (frames != NULL)
     {
-        if (frames[i])
-            delete frames[i];
+        for (int i = 0; i < max_frames; i++)
+        {
+            if (frames[i])
+                delete frames[i];
+        }
     }
     delete[] frames;
     delete[] rframes;
 
-    for (int j = 0; j < owned_frames.size(); j++)
-        delete owned_frames[j];
+    for (int j = 0; j < (int) owned_frames.size(); j++)
+        pool.release(owned_frames[j]);
     owned_frames.clear();
 
     if (aligner != NULL)
         delete aligner;
-    if (blender != NULL)
-        delete blender;
 }
 
-int Mosaic::initialize(int blendingType, int stripType, int width, int height, int nframes, bool quarter_res, float thresh_still)
+int Mosaic::initialize(int blendingType, int stripType, int width, int height, int nframes, bool quarter_res, float thresh_still, int blendEngine)
 {
     this->blendingType = blendingType;
 
@@ -76,36 +85,57 @@ int Mosaic::initialize(int blendingType, int stripType, int width, int height, i
 
     mosaicWidth = mosaicHeight = 0;
     imageMosaicYVU = NULL;
+    frames_size = 0;
+
+    // Frames of the previous panorama go back to the pool
+    for (int j = 0; j < (int) owned_frames.size(); j++)
+        pool.release(owned_frames[j]);
+    owned_frames.clear();
 
-    if (nframes > 0) {
-      max_frames = nframes;
+    // Keep the frame slots of the previous panorama if there are as many
+    int nslots = (nframes > 0) ? nframes : max_frames;
+    if (frames != NULL && nslots != max_frames)
+    {
+        for (int i = 0; i < max_frames; i++)
+        {
+            if (frames[i])
+                delete frames[i];
+        }
+        delete[] frames;
+        delete[] rframes;
+        frames = rframes = NULL;
     }
+    max_frames = nslots;
 
-    frames = new MosaicFrame *[max_frames];
-    rframes = new MosaicFrame *[max_frames];
+    if (frames == NULL)
+    {
+        frames = new MosaicFrame *[max_frames];
+        rframes = new MosaicFrame *[max_frames];
 
-    for(int i=0; i<max_frames; i++) {
-      frames[i] = NULL;
+        for(int i=0; i<max_frames; i++) {
+          frames[i] = NULL;
+        }
     }
 
-    owned_frames.reserve(max_frames);
-
     LOGV("Initialize %d %d", width, height);
     LOGV("Frame width %d,%d", width, height);
     LOGV("Max num frames %d", max_frames);
 
+    if (aligner != NULL)
+        delete aligner;
     aligner = new Align();
     aligner->initialize(width, height,quarter_res,thresh_still);
 
-    if (blender) delete blender;
-
     if (blendingType == Blend::BLEND_TYPE_FULL ||
             blendingType == Blend::BLEND_TYPE_PAN ||
             blendingType == Blend::BLEND_TYPE_CYLPAN ||
             blendingType == Blend::BLEND_TYPE_HORZ) {
-        blender = new Blend();
-        blender->initialize(blendingType, stripType, width, height);
+        // The blender keeps its settings for the next panorama
+        if (blender == NULL)
+            blender = new Blend(&pool);
+        blender->initialize(blendingType, stripType, width, height, blendEngine);
     } else {
+        if (blender) delete blender;
         blender = NULL;
         LOGE("Error: Unknown blending type %d",blendingType);
         return MOSAIC_RET_ERROR;
@@ -117,13 +147,24 @@ int Mosaic::initialize(int blendingType, int stripType, int width, int height, i
 }
 
 int Mosaic::addFrame(ImageType imageYVU)
+{
+    FrameDescriptor desc;
+    desc.set(FrameDescriptor::FORMAT_I420, imageYVU, this->height, this->width);
+
+    return addFrame(desc);
+}
+
+int Mosaic::addFrame(const FrameDescriptor &desc)
 {
     if(frames[frames_size]==NULL)
         frames[frames_size] = new MosaicFrame(this->width,this->height,false);
 
     MosaicFrame *frame = frames[frames_size];
+    frame->width = this->width;
+    frame->height = this->height;
 
-    frame->image = imageYVU;
+    frame->desc = desc;
+    frame->image = desc.y;
 
     // Add frame to aligner
     int ret = MOSAIC_RET_ERROR;
@@ -131,7 +172,7 @@ int Mosaic::addFrame(ImageType imageYVU)
     {
         // Note aligner takes in RGB images
         int align_flag = Align::ALIGN_RET_OK;
-        align_flag = aligner->addFrame(frame->image);
+        align_flag = aligner->addFrame(desc.y, desc.yStride);
         aligner->getLastTRS(frame->trs);
 
         if (frames_size >= max_frames)
@@ -160,11 +201,24 @@ int Mosaic::addFrame(ImageType imageYVU)
             default:
                 break;
         }
+
+        // Let the blender start on the accepted frame while capture goes on
+        if (blender != NULL &&
+                (ret == MOSAIC_RET_OK || ret == MOSAIC_RET_FEW_INLIERS))
+            blender->addFrame(frame);
     }
 
     return ret;
 }
 
+ImageType Mosaic::allocateFrame()
+{
+    ImageType frame = (ImageType) pool.allocate((size_t) width * height * 3 / 2);
+    if (frame != NULL)
+        owned_frames.push_back(frame);
+
+    return frame;
+}
 
 int Mosaic::createMosaic(float &progress, bool &cancelComputation)
 {
@@ -27,6 +27,7 @@
 #include "AlignFeatures.h"
 #include "Blend.h"
 #include "MosaicTypes.h"
+#include "FramePool.h"
 #include <vector>
 
 /*! \mainpage Mosaic
@@ -84,7 +85,9 @@ public:
   ~Mosaic();
 
    /*!
-    *   Creates the aligner and blender and initializes state.
+    *   Creates the aligner and blender and initializes state. May be called
+    *   again to start the next panorama; the frame slots, the blender and
+    *   the memory kept by the pool (see getPool) are then reused.
     *   \param blendingType Type of blending to perform
     *   \param stripType    Type of strip to use. 0: thin, 1: wide. stripType
     *                       is effective only when blendingType is CylPan or
@@ -94,17 +97,37 @@ public:
     *   \param nframes      Number of frames to pre-allocate; default value -1 will allocate each frame as it comes
     *   \param quarter_res  Whether to compute alignment at quarter the input resolution (default = false)
     *   \param thresh_still Minimum number of pixels of translation detected between the new frame and the last frame before this frame is added to be mosaiced. For the low-res processing at 320x180 resolution input, we set this to 5 pixels. To reject no frames, set this to 0.0 (default value).
+    *   \param blendEngine  How the frames are blended: Blend::BLEND_ENGINE_PYRAMID (default) or Blend::BLEND_ENGINE_WARP_ONCE, see Blend::initialize
     *   \return             Return code signifying success or failure.
     */
-  int initialize(int blendingType, int stripType, int width, int height, int nframes = -1, bool quarter_res = false, float thresh_still = 0.0);
+  int initialize(int blendingType, int stripType, int width, int height, int nframes = -1, bool quarter_res = false, float thresh_still = 0.0, int blendEngine = Blend::BLEND_ENGINE_PYRAMID);
 
    /*!
-    *   Adds a YVU frame to the mosaic.
-    *   \param imageYVU     Pointer to a YVU image.
+    *   Adds a frame to the mosaic.
+    *   \param imageYVU     Pointer to an image whose planes follow each other
+    *                       with no padding, read as FrameDescriptor::FORMAT_I420.
     *   \return             Return code signifying success or failure.
     */
   int addFrame(ImageType imageYVU);
 
+   /*!
+    *   Adds a frame to the mosaic without copying it. The planes are read in
+    *   place, by the aligner (luma only) and the blender, and must stay valid
+    *   until the mosaic has been created.
+    *   \param frame        Layout of the frame.
+    *   \return             Return code signifying success or failure.
+    */
+  int addFrame(const FrameDescriptor &frame);
+
+   /*!
+    *   Allocates a frame buffer of width*height*3/2 bytes for callers that
+    *   need to copy their frames before passing them to addFrame. It stays
+    *   valid until the mosaic is initialized again or destroyed, and is then
+    *   recycled for the next panorama.
+    *   \return             Pointer to the buffer, NULL when out of memory.
+    */
+  ImageType allocateFrame();
+
    /*!
     *   After adding all frames, call this function to perform the final blending.
     *   \param progress     Variable to set the current progress in.
@@ -113,7 +136,9 @@ public:
   int createMosaic(float &progress, bool &cancelComputation);
 
     /*!
-    *   Obtains the resulting mosaic and its dimensions.
+    *   Obtains the resulting mosaic and its dimensions. The image is
+    *   planar 4:2:0 YVU: the Y plane is followed by the V and U planes,
+    *   each of width/2 x height/2 pixels. Both dimensions are even.
     *   \param width        Width of the resulting mosaic (returned)
     *   \param height       Height of the resulting mosaic (returned)
     *   \return             Pointer to image.
@@ -126,6 +151,19 @@ public:
     */
   Align* getAligner() { return aligner; }
 
+    /*!
+    *   Provides access to the internal blender object pointer.
+    *   \return             Pointer to the blender object.
+    */
+  Blend* getBlender() { return blender; }
+    /*!
+    *   Provides access to the pool recycling the frame buffers, pyramids and
+    *   triangulation storage across frames and panoramas, e.g. to bound the
+    *   memory it keeps with FramePool::setLimit.
+    *   \return             Pointer to the pool.
+    */
+  FramePool* getPool() { return &pool; }
+
     /*!
     *   Obtain initialization state.
     *
@@ -176,10 +214,16 @@ protected:
   int max_frames;
 
   /**
-    * Implicitly created frames, should be freed by Mosaic.
+    * Frames handed out by allocateFrame, given back to the pool by Mosaic.
     */
   std::vector<ImageType> owned_frames;
 
+  /**
+   * Recycled storage of the frames and of the blender. The destructor
+   * deletes the blender before the pool goes away.
+   */
+  FramePool pool;
+
   /**
    * Initialization state.
    */
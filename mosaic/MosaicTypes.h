@@ -60,14 +60,85 @@ class BlendRect
 };
 
 /**
- *  A frame making up the mosaic.
- *  Note: Currently assumes a YVU image
- *  containing separate Y,V, and U planes
- *  in contiguous memory (in that order).
+ *  Layout of a 4:2:0 frame, so that camera buffers can be handed to
+ *  Mosaic::addFrame as they are. Row j of the luma starts at
+ *  y + j*yStride; the chroma samples of row j, column i (in chroma pixels)
+ *  are at u[j*uvStride + i*uvStep] and v[j*uvStride + i*uvStep], uvStep
+ *  being 2 for the formats that interleave U and V.
+ */
+class FrameDescriptor
+{
+    public:
+        static const int FORMAT_I420 = 0;   // Y, U and V planes
+        static const int FORMAT_YV12 = 1;   // Y, V and U planes
+        static const int FORMAT_NV12 = 2;   // Y plane, interleaved U and V
+        static const int FORMAT_NV21 = 3;   // Y plane, interleaved V and U
+
+        FrameDescriptor()
+        {
+            format = FORMAT_I420;
+            y = u = v = NULL;
+            yStride = uvStride = uvStep = 0;
+        }
+
+        /**
+         *  Describes a frame whose planes are given separately. c1 and c2
+         *  are the chroma planes in the order of the format; the formats
+         *  that interleave U and V only use c1. cStride is the stride of
+         *  the chroma rows, in bytes.
+         */
+        void set(int format, ImageType y, int yStride, ImageType c1, ImageType c2, int cStride)
+        {
+            this->format = format;
+            this->y = y;
+            this->yStride = yStride;
+            this->uvStride = cStride;
+
+            switch (format)
+            {
+                case FORMAT_YV12:
+                    v = c1; u = c2; uvStep = 1;
+                    break;
+                case FORMAT_NV12:
+                    u = c1; v = c1 + 1; uvStep = 2;
+                    break;
+                case FORMAT_NV21:
+                    v = c1; u = c1 + 1; uvStep = 2;
+                    break;
+                default:
+                    this->format = FORMAT_I420;
+                    u = c1; v = c2; uvStep = 1;
+                    break;
+            }
+        }
+
+        /**
+         *  Describes a frame whose planes follow each other in one buffer,
+         *  with luma rows of stride bytes. The planar formats have chroma
+         *  rows of stride/2 bytes.
+         */
+        void set(int format, ImageType data, int height, int stride)
+        {
+            ImageType c1 = data + (size_t) stride * height;
+            bool planar = (format != FORMAT_NV12 && format != FORMAT_NV21);
+            int cStride = planar ? stride / 2 : stride;
+
+            set(format, data, stride, c1, c1 + (size_t) cStride * (height / 2), cStride);
+        }
+
+        int format;
+        ImageType y, u, v;
+        int yStride, uvStride, uvStep;
+};
+
+/**
+ *  A frame making up the mosaic. The pixels are not copied: desc describes
+ *  where they are, image being the start of the luma.
  */
 class MosaicFrame {
 public:
   ImageType image;
+  FrameDescriptor desc;
   float trs[3][3];
   int width, height;
   BlendRect brect;  // This frame warped to the Mosaic coordinate system
@@ -93,19 +164,19 @@ public:
   }
 
   /**
-  *  Get the V plane of the image.
+  *  Get the V plane of the image, see desc for its layout.
   */
   inline ImageType getV()
   {
-    return (image + ((width*height) + (width/2*height/2)));
+    return desc.v;
   }
 
   /**
-  *  Get the U plane of the image.
+  *  Get the U plane of the image, see desc for its layout.
   */
   inline ImageType getU()
   {
-    return (image + (width*height));
+    return desc.u;
   }
 
   /**
@@ -143,6 +214,7 @@ typedef struct {
   int blendRange;
   int blendRangeUV;
   int nlevs;
+  // Levels of the chroma pyramids, which are half resolution
   int nlevsC;
   int blendingType;
   int stripType;
@@ -20,66 +20,480 @@
 #include <string.h>
 
 #include "Pyramid.h"
+#include "FramePool.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define PYRAMID_X86_SIMD
+#endif
+
+// Row kernels of the 1-4-6-4-1 reduce and of the expand filters. The C
+// versions are the reference; the SIMD versions below compute every tap in
+// 32 bits exactly like them, so their output is bit-exact.
+
+// s[k] = (p[2k-2] + 4 p[2k-1] + 6 p[2k] + 4 p[2k+1] + p[2k+2] + 8) >> 4
+static void ReduceRowH_C(short *s, const short *p, int n)
+{
+    for (; n--; s++, p += 2) {
+        *s = (short)((((int) p[-2]) + ((int) p[2]) + 8 +    // 1
+                    ((((int) p[-1]) + ((int) p[1])) << 2) + // 4
+                    ((int) *p) * 6) >> 4);          // 6
+    }
+}
+
+// Same filter as ReduceRowH_C, applied across rows pitch shorts apart.
+static void ReduceRowV_C(short *s, const short *p, ptrdiff_t pitch, int n)
+{
+    ptrdiff_t pitch2 = pitch << 1;
+    for (; n--; s++, p++) {
+        *s = (short)((((int) p[-pitch2]) + ((int) p[pitch2]) + 8 + // 1
+                    ((((int) p[-pitch]) + ((int) p[pitch])) << 2) + // 4
+                    ((int) *p) * 6) >> 4);              // 6
+    }
+}
+
+// Expands input row p (with neighbours pitch shorts apart) into the
+// even output row s0 and the odd output row s1.
+static void ExpandRowV_C(short *s0, short *s1, const short *p, ptrdiff_t pitch, int n)
+{
+    for (; n--; s0++, s1++, p++) {
+        int t1 = p[0];
+        int t2 = p[pitch];
+        *s0 = (short) ((6 * t1 + (p[-pitch] + t2) + 4) >> 3);
+        *s1 = (short) ((t1 + t2 + 1) >> 1);
+    }
+}
+
+// Expands row s horizontally and adds (mode > 0) or subtracts (mode < 0)
+// the result to/from the interleaved output row out.
+static void ExpandRowH_C(short *out, const short *s, int n, int mode)
+{
+    for (; n--; out += 2, s++) {
+        int t1 = s[0];
+        int t2 = s[1];
+        out[0] = (short) (out[0] + (mode * ((6 * t1 + s[-1] + t2 + 4) >> 3)));
+        out[1] = (short) (out[1] + (mode * ((t1 + t2 + 1) >> 1)));
+    }
+}
+
+#ifdef PYRAMID_X86_SIMD
+
+// The filters are evaluated with pmaddwd on pairs of taps, which yields
+// exact 32-bit sums. Each result fits in a short again (the weights of a
+// filter add up to its divisor), so the saturating packs never clip.
+
+__attribute__((target("sse2")))
+static void ReduceRowH_SSE2(short *s, const short *p, int n)
+{
+    const __m128i w14 = _mm_set1_epi32(0x00040001);   // (1, 4)
+    const __m128i w64 = _mm_set1_epi32(0x00040006);   // (6, 4)
+    const __m128i w10 = _mm_set1_epi32(0x00000001);   // (1, 0)
+    const __m128i round = _mm_set1_epi32(8);
+
+    // The last tap of a block reads one short past what the C loop reads for
+    // the same outputs, so leave at least one output for the C tail.
+    for (; n > 8; n -= 8, s += 8, p += 16) {
+        __m128i r[2];
+        for (int h = 0; h < 2; h++) {
+            const short *q = p + 8 * h;
+            __m128i a = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (q - 2)), w14);
+            __m128i b = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) q), w64);
+            __m128i c = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (q + 2)), w10);
+            r[h] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(a, b),
+                            _mm_add_epi32(c, round)), 4);
+        }
+        _mm_storeu_si128((__m128i *) s, _mm_packs_epi32(r[0], r[1]));
+    }
+
+    ReduceRowH_C(s, p, n);
+}
+
+__attribute__((target("sse2")))
+static void ReduceRowV_SSE2(short *s, const short *p, ptrdiff_t pitch, int n)
+{
+    const __m128i w14 = _mm_set1_epi32(0x00040001);   // (1, 4)
+    const __m128i w61 = _mm_set1_epi32(0x00010006);   // (6, 1)
+    const __m128i w41 = _mm_set1_epi32(0x00010004);   // (4, 1)
+    const __m128i c8 = _mm_set1_epi16(8);
+    ptrdiff_t pitch2 = pitch << 1;
+
+    for (; n >= 8; n -= 8, s += 8, p += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (p - pitch2));
+        __m128i b = _mm_loadu_si128((const __m128i *) (p - pitch));
+        __m128i c = _mm_loadu_si128((const __m128i *) p);
+        __m128i d = _mm_loadu_si128((const __m128i *) (p + pitch));
+        __m128i e = _mm_loadu_si128((const __m128i *) (p + pitch2));
+
+        __m128i lo = _mm_add_epi32(_mm_add_epi32(
+                    _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w14),
+                    _mm_madd_epi16(_mm_unpacklo_epi16(c, c8), w61)),
+                _mm_madd_epi16(_mm_unpacklo_epi16(d, e), w41));
+        __m128i hi = _mm_add_epi32(_mm_add_epi32(
+                    _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w14),
+                    _mm_madd_epi16(_mm_unpackhi_epi16(c, c8), w61)),
+                _mm_madd_epi16(_mm_unpackhi_epi16(d, e), w41));
+
+        _mm_storeu_si128((__m128i *) s, _mm_packs_epi32(
+                    _mm_srai_epi32(lo, 4), _mm_srai_epi32(hi, 4)));
+    }
+
+    ReduceRowV_C(s, p, pitch, n);
+}
+
+__attribute__((target("sse2")))
+static void ExpandRowV_SSE2(short *s0, short *s1, const short *p, ptrdiff_t pitch, int n)
+{
+    const __m128i w16 = _mm_set1_epi32(0x00060001);   // (1, 6)
+    const __m128i w11 = _mm_set1_epi32(0x00010001);   // (1, 1)
+    const __m128i c4 = _mm_set1_epi16(4);
+    const __m128i one = _mm_set1_epi32(1);
+
+    for (; n >= 8; n -= 8, s0 += 8, s1 += 8, p += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (p - pitch));
+        __m128i b = _mm_loadu_si128((const __m128i *) p);
+        __m128i c = _mm_loadu_si128((const __m128i *) (p + pitch));
+
+        // (a + 6 b) + (c + 4)
+        __m128i elo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), w16),
+                _mm_madd_epi16(_mm_unpacklo_epi16(c, c4), w11));
+        __m128i ehi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), w16),
+                _mm_madd_epi16(_mm_unpackhi_epi16(c, c4), w11));
+        // (b + c) + 1
+        __m128i olo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(b, c), w11), one);
+        __m128i ohi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(b, c), w11), one);
+
+        _mm_storeu_si128((__m128i *) s0, _mm_packs_epi32(
+                    _mm_srai_epi32(elo, 3), _mm_srai_epi32(ehi, 3)));
+        _mm_storeu_si128((__m128i *) s1, _mm_packs_epi32(
+                    _mm_srai_epi32(olo, 1), _mm_srai_epi32(ohi, 1)));
+    }
+
+    ExpandRowV_C(s0, s1, p, pitch, n);
+}
+
+__attribute__((target("sse2")))
+static void ExpandRowH_SSE2(short *out, const short *s, int n, int mode)
+{
+    const __m128i w16 = _mm_set1_epi32(0x00060001);   // (1, 6)
+    const __m128i w11 = _mm_set1_epi32(0x00010001);   // (1, 1)
+    const __m128i c4 = _mm_set1_epi16(4);
+    const __m128i one = _mm_set1_epi32(1);
+
+    if (mode != 1 && mode != -1) {
+        ExpandRowH_C(out, s, n, mode);
+        return;
+    }
+
+    for (; n >= 8; n -= 8, out += 16, s += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (s - 1));
+        __m128i b = _mm_loadu_si128((const __m128i *) s);
+        __m128i c = _mm_loadu_si128((const __m128i *) (s + 1));
+
+        __m128i elo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), w16),
+                _mm_madd_epi16(_mm_unpacklo_epi16(c, c4), w11));
+        __m128i ehi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), w16),
+                _mm_madd_epi16(_mm_unpackhi_epi16(c, c4), w11));
+        __m128i olo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(b, c), w11), one);
+        __m128i ohi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(b, c), w11), one);
+
+        __m128i e = _mm_packs_epi32(_mm_srai_epi32(elo, 3), _mm_srai_epi32(ehi, 3));
+        __m128i o = _mm_packs_epi32(_mm_srai_epi32(olo, 1), _mm_srai_epi32(ohi, 1));
+
+        // The C version truncates the int sum to a short, i.e. wraps
+        __m128i *d = (__m128i *) out;
+        __m128i d0 = _mm_loadu_si128(d);
+        __m128i d1 = _mm_loadu_si128(d + 1);
+        if (mode > 0) {
+            d0 = _mm_add_epi16(d0, _mm_unpacklo_epi16(e, o));
+            d1 = _mm_add_epi16(d1, _mm_unpackhi_epi16(e, o));
+        } else {
+            d0 = _mm_sub_epi16(d0, _mm_unpacklo_epi16(e, o));
+            d1 = _mm_sub_epi16(d1, _mm_unpackhi_epi16(e, o));
+        }
+        _mm_storeu_si128(d, d0);
+        _mm_storeu_si128(d + 1, d1);
+    }
+
+    ExpandRowH_C(out, s, n, mode);
+}
+
+// The AVX2 versions process 16 outputs at a time. The 256-bit unpack, madd
+// and pack instructions work within 128-bit lanes; where that changes the
+// order of the results it is restored with a permute. The rest of the
+// library is built without AVX, so the upper halves of the ymm registers
+// are cleared before handing the tail to the SSE2 code; gcc does not always
+// insert the vzeroupper itself for target("avx2") functions and the
+// transition penalty then lands on every later SSE instruction.
+
+__attribute__((target("avx2")))
+static void ReduceRowH_AVX2(short *s, const short *p, int n)
+{
+    const __m256i w14 = _mm256_set1_epi32(0x00040001);   // (1, 4)
+    const __m256i w64 = _mm256_set1_epi32(0x00040006);   // (6, 4)
+    const __m256i w10 = _mm256_set1_epi32(0x00000001);   // (1, 0)
+    const __m256i round = _mm256_set1_epi32(8);
+
+    // See ReduceRowH_SSE2 for the extra output left to the tail
+    for (; n > 16; n -= 16, s += 16, p += 32) {
+        __m256i r[2];
+        for (int h = 0; h < 2; h++) {
+            const short *q = p + 16 * h;
+            __m256i a = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *) (q - 2)), w14);
+            __m256i b = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *) q), w64);
+            __m256i c = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *) (q + 2)), w10);
+            r[h] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(a, b),
+                            _mm256_add_epi32(c, round)), 4);
+        }
+        _mm256_storeu_si256((__m256i *) s, _mm256_permute4x64_epi64(
+                    _mm256_packs_epi32(r[0], r[1]), 0xd8));
+    }
+
+    _mm256_zeroupper();
+    ReduceRowH_SSE2(s, p, n);
+}
+
+__attribute__((target("avx2")))
+static void ReduceRowV_AVX2(short *s, const short *p, ptrdiff_t pitch, int n)
+{
+    const __m256i w14 = _mm256_set1_epi32(0x00040001);   // (1, 4)
+    const __m256i w61 = _mm256_set1_epi32(0x00010006);   // (6, 1)
+    const __m256i w41 = _mm256_set1_epi32(0x00010004);   // (4, 1)
+    const __m256i c8 = _mm256_set1_epi16(8);
+    ptrdiff_t pitch2 = pitch << 1;
+
+    for (; n >= 16; n -= 16, s += 16, p += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (p - pitch2));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (p - pitch));
+        __m256i c = _mm256_loadu_si256((const __m256i *) p);
+        __m256i d = _mm256_loadu_si256((const __m256i *) (p + pitch));
+        __m256i e = _mm256_loadu_si256((const __m256i *) (p + pitch2));
+
+        __m256i lo = _mm256_add_epi32(_mm256_add_epi32(
+                    _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w14),
+                    _mm256_madd_epi16(_mm256_unpacklo_epi16(c, c8), w61)),
+                _mm256_madd_epi16(_mm256_unpacklo_epi16(d, e), w41));
+        __m256i hi = _mm256_add_epi32(_mm256_add_epi32(
+                    _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w14),
+                    _mm256_madd_epi16(_mm256_unpackhi_epi16(c, c8), w61)),
+                _mm256_madd_epi16(_mm256_unpackhi_epi16(d, e), w41));
+
+        // unpack and pack are both per lane, so the order is preserved
+        _mm256_storeu_si256((__m256i *) s, _mm256_packs_epi32(
+                    _mm256_srai_epi32(lo, 4), _mm256_srai_epi32(hi, 4)));
+    }
+
+    _mm256_zeroupper();
+    ReduceRowV_SSE2(s, p, pitch, n);
+}
+
+__attribute__((target("avx2")))
+static void ExpandRowV_AVX2(short *s0, short *s1, const short *p, ptrdiff_t pitch, int n)
+{
+    const __m256i w16 = _mm256_set1_epi32(0x00060001);   // (1, 6)
+    const __m256i w11 = _mm256_set1_epi32(0x00010001);   // (1, 1)
+    const __m256i c4 = _mm256_set1_epi16(4);
+    const __m256i one = _mm256_set1_epi32(1);
+
+    for (; n >= 16; n -= 16, s0 += 16, s1 += 16, p += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (p - pitch));
+        __m256i b = _mm256_loadu_si256((const __m256i *) p);
+        __m256i c = _mm256_loadu_si256((const __m256i *) (p + pitch));
+
+        __m256i elo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w16),
+                _mm256_madd_epi16(_mm256_unpacklo_epi16(c, c4), w11));
+        __m256i ehi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w16),
+                _mm256_madd_epi16(_mm256_unpackhi_epi16(c, c4), w11));
+        __m256i olo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(b, c), w11), one);
+        __m256i ohi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(b, c), w11), one);
+
+        _mm256_storeu_si256((__m256i *) s0, _mm256_packs_epi32(
+                    _mm256_srai_epi32(elo, 3), _mm256_srai_epi32(ehi, 3)));
+        _mm256_storeu_si256((__m256i *) s1, _mm256_packs_epi32(
+                    _mm256_srai_epi32(olo, 1), _mm256_srai_epi32(ohi, 1)));
+    }
+
+    _mm256_zeroupper();
+    ExpandRowV_SSE2(s0, s1, p, pitch, n);
+}
+
+__attribute__((target("avx2")))
+static void ExpandRowH_AVX2(short *out, const short *s, int n, int mode)
+{
+    const __m256i w16 = _mm256_set1_epi32(0x00060001);   // (1, 6)
+    const __m256i w11 = _mm256_set1_epi32(0x00010001);   // (1, 1)
+    const __m256i c4 = _mm256_set1_epi16(4);
+    const __m256i one = _mm256_set1_epi32(1);
+
+    if (mode != 1 && mode != -1) {
+        ExpandRowH_C(out, s, n, mode);
+        return;
+    }
+
+    for (; n >= 16; n -= 16, out += 32, s += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (s - 1));
+        __m256i b = _mm256_loadu_si256((const __m256i *) s);
+        __m256i c = _mm256_loadu_si256((const __m256i *) (s + 1));
+
+        __m256i elo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w16),
+                _mm256_madd_epi16(_mm256_unpacklo_epi16(c, c4), w11));
+        __m256i ehi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w16),
+                _mm256_madd_epi16(_mm256_unpackhi_epi16(c, c4), w11));
+        __m256i olo = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(b, c), w11), one);
+        __m256i ohi = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(b, c), w11), one);
+
+        __m256i e = _mm256_packs_epi32(_mm256_srai_epi32(elo, 3), _mm256_srai_epi32(ehi, 3));
+        __m256i o = _mm256_packs_epi32(_mm256_srai_epi32(olo, 1), _mm256_srai_epi32(ohi, 1));
+
+        // Interleave even and odd outputs, fixing up the lane order
+        __m256i lo = _mm256_unpacklo_epi16(e, o);
+        __m256i hi = _mm256_unpackhi_epi16(e, o);
+        __m256i v0 = _mm256_permute2x128_si256(lo, hi, 0x20);
+        __m256i v1 = _mm256_permute2x128_si256(lo, hi, 0x31);
+
+        __m256i *d = (__m256i *) out;
+        __m256i d0 = _mm256_loadu_si256(d);
+        __m256i d1 = _mm256_loadu_si256(d + 1);
+        if (mode > 0) {
+            d0 = _mm256_add_epi16(d0, v0);
+            d1 = _mm256_add_epi16(d1, v1);
+        } else {
+            d0 = _mm256_sub_epi16(d0, v0);
+            d1 = _mm256_sub_epi16(d1, v1);
+        }
+        _mm256_storeu_si256(d, d0);
+        _mm256_storeu_si256(d + 1, d1);
+    }
+
+    _mm256_zeroupper();
+    ExpandRowH_SSE2(out, s, n, mode);
+}
+
+#endif // PYRAMID_X86_SIMD
+
+// Row kernels used by the pyramid filters, selected by CPU features.
+typedef struct {
+    void (*reduceRowH)(short *s, const short *p, int n);
+    void (*reduceRowV)(short *s, const short *p, ptrdiff_t pitch, int n);
+    void (*expandRowV)(short *s0, short *s1, const short *p, ptrdiff_t pitch, int n);
+    void (*expandRowH)(short *out, const short *s, int n, int mode);
+} PyramidKernels;
+
+static const PyramidKernels kernelsC =
+    { ReduceRowH_C, ReduceRowV_C, ExpandRowV_C, ExpandRowH_C };
+#ifdef PYRAMID_X86_SIMD
+static const PyramidKernels kernelsSSE2 =
+    { ReduceRowH_SSE2, ReduceRowV_SSE2, ExpandRowV_SSE2, ExpandRowH_SSE2 };
+static const PyramidKernels kernelsAVX2 =
+    { ReduceRowH_AVX2, ReduceRowV_AVX2, ExpandRowV_AVX2, ExpandRowH_AVX2 };
+#endif
+
+static const PyramidKernels *selectKernels()
+{
+#ifdef PYRAMID_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        return &kernelsAVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return &kernelsSSE2;
+#endif
+    return &kernelsC;
+}
 
 // We allocate the entire pyramid into one contiguous storage. This makes
 // cleanup easier than fragmented stuff. In addition, we added a "pitch"
 // field, so pointer manipulation is much simpler when it would be faster.
 PyramidShort *PyramidShort::allocatePyramidPacked(real levels,
+        real width, real height, real border, FramePool *pool)
+{
+    size_t bytes = packedSize(levels, width, height, border);
+    void *storage = pool ? pool->allocate(bytes) : calloc(bytes, 1);
+    if (storage == NULL)
+        return NULL;
+
+    return layoutPyramidPacked(storage, levels, width, height, border);
+}
+
+PyramidShort *PyramidShort::layoutPyramidPacked(void *storage, real levels,
         real width, real height, real border)
 {
     real border2 = (real) (border << 1);
-    int lines, size = calcStorage(width, height, border2, levels, &lines);
-
-    PyramidShort *img = (PyramidShort *) calloc(sizeof(PyramidShort) * levels
-            + sizeof(short *) * lines +
-            + sizeof(short) * size, 1);
-
-    if (img) {
-        PyramidShort *curr, *last;
-        ImageTypeShort *y = (ImageTypeShort *) &img[levels];
-        ImageTypeShort position = (ImageTypeShort) &y[lines];
-        for (last = (curr = img) + levels; curr < last; curr++) {
-            curr->width = width;
-            curr->height = height;
-            curr->border = border;
-            curr->pitch = (real) (width + border2);
-            curr->ptr = y + border;
-
-            // Assign row pointers
-            for (int j = height + border2; j--; y++, position += curr->pitch) {
-                *y = position + border;
-            }
-
-            width >>= 1;
-            height >>= 1;
+    int lines;
+    calcStorage(width, height, border2, levels, &lines);
+
+    PyramidShort *img = (PyramidShort *) storage;
+    PyramidShort *curr, *last;
+    ImageTypeShort *y = (ImageTypeShort *) &img[levels];
+    ImageTypeShort position = (ImageTypeShort) &y[lines];
+    for (last = (curr = img) + levels; curr < last; curr++) {
+        curr->width = width;
+        curr->height = height;
+        curr->border = border;
+        curr->pitch = (size_t) (width + border2);
+        curr->ptr = y + border;
+
+        // Assign row pointers
+        for (int j = height + border2; j--; y++, position += curr->pitch) {
+            *y = position + border;
         }
+
+        width >>= 1;
+        height >>= 1;
     }
 
     return img;
 }
 
+void PyramidShort::freePyramid(PyramidShort *pyramid, FramePool *pool)
+{
+    if (pool)
+        pool->release(pyramid);
+    else if (pyramid)
+        free(pyramid);
+}
+
+size_t PyramidShort::packedSize(real levels, real width, real height, real border)
+{
+    int lines;
+    size_t size = calcStorage(width, height, (real) (border << 1), levels, &lines);
+
+    return sizeof(PyramidShort) * levels + sizeof(short *) * lines +
+            sizeof(short) * size;
+}
+
 // Allocate an image of type short
 PyramidShort *PyramidShort::allocateImage(real width, real height, real border)
+{
+    void *storage = calloc(imageSize(width, height, border), 1);
+    if (storage == NULL)
+        return NULL;
+
+    return layoutImage(storage, width, height, border);
+}
+
+size_t PyramidShort::imageSize(real width, real height, real border)
 {
     real border2 = (real) (border << 1);
-    PyramidShort *img = (PyramidShort *)
-        calloc(sizeof(PyramidShort) + sizeof(short *) * (height + border2) +
-                sizeof(short) * (width + border2) * (height + border2), 1);
-
-    if (img) {
-        short **y = (short **) &img[1];
-        short *position = (short *) &y[height + border2];
-        img->width = width;
-        img->height = height;
-        img->border = border;
-        img->pitch = (real) (width + border2);
-        img->ptr = y + border;
-        position += border; // Move position down to origin of real image
 
-        // Assign row pointers
-        for (int j = height + border2; j--; y++, position += img->pitch) {
-            *y = position;
-        }
+    return sizeof(PyramidShort) + sizeof(short *) * (height + border2) +
+            sizeof(short) * (size_t) (width + border2) * (height + border2);
+}
+
+PyramidShort *PyramidShort::layoutImage(void *storage, real width, real height, real border)
+{
+    real border2 = (real) (border << 1);
+    PyramidShort *img = (PyramidShort *) storage;
+    short **y = (short **) &img[1];
+    short *position = (short *) &y[height + border2];
+
+    img->width = width;
+    img->height = height;
+    img->border = border;
+    img->pitch = (size_t) (width + border2);
+    img->ptr = y + border;
+    position += border; // Move position down to origin of real image
+
+    // Assign row pointers
+    for (int j = height + border2; j--; y++, position += img->pitch) {
+        *y = position;
     }
 
     return img;
@@ -93,14 +507,14 @@ void PyramidShort::freeImage(PyramidShort *image)
 }
 
 // Calculate amount of storage needed taking into account the borders, etc.
-unsigned int PyramidShort::calcStorage(real width, real height, real border2,   int levels, int *lines)
+size_t PyramidShort::calcStorage(real width, real height, real border2,   int levels, int *lines)
 {
-    int size;
+    size_t size;
 
     *lines = size = 0;
 
     while(levels--) {
-        size += (width + border2) * (height + border2);
+        size += (size_t) (width + border2) * (height + border2);
         *lines += height + border2;
         width >>= 1;
         height >>= 1;
@@ -148,20 +562,16 @@ void PyramidShort::BorderSpread(PyramidShort *pyr, int left, int right,
 void PyramidShort::BorderExpandOdd(PyramidShort *in, PyramidShort *out, PyramidShort *scr,
         int mode)
 {
-    int i,j;
+    const PyramidKernels *k = selectKernels();
+    int j;
     int off = in->border >> 1;
 
     // Vertical Filter
     for (j = -off; j < in->height + off; j++) {
         int j2 = j * 2;
-        int limit = scr->width + scr->border;
-        for (i = -scr->border; i < limit; i++) {
-            int t1 = in->ptr[j][i];
-            int t2 = in->ptr[j+1][i];
-            scr->ptr[j2][i] = (short)
-                ((6 * t1 + (in->ptr[j-1][i] + t2) + 4) >> 3);
-            scr->ptr[j2+1][i] = (short)((t1 + t2 + 1) >> 1);
-        }
+        k->expandRowV(scr->ptr[j2] - scr->border, scr->ptr[j2+1] - scr->border,
+                in->ptr[j] - scr->border, in->pitch,
+                scr->width + (scr->border << 1));
     }
 
     BorderSpread(scr, 0, 0, 3, 3);
@@ -169,24 +579,17 @@ void PyramidShort::BorderExpandOdd(PyramidShort *in, PyramidShort *out, PyramidS
     // Horizontal Filter
     int limit = out->height + out->border;
     for (j = -out->border; j < limit; j++) {
-        for (i = -off; i < scr->width + off; i++) {
-            int i2 = i * 2;
-            int t1 = scr->ptr[j][i];
-            int t2 = scr->ptr[j][i+1];
-            out->ptr[j][i2] = (short) (out->ptr[j][i2] +
-                    (mode * ((6 * t1 +
-                              scr->ptr[j][i-1] + t2 + 4) >> 3)));
-            out->ptr[j][i2+1] = (short) (out->ptr[j][i2+1] +
-                    (mode * ((t1 + t2 + 1) >> 1)));
-        }
+        k->expandRowH(out->ptr[j] - (off << 1), scr->ptr[j] - off,
+                scr->width + (off << 1), mode);
     }
 
 }
 
-int PyramidShort::BorderExpand(PyramidShort *pyr, int nlev, int mode)
+int PyramidShort::BorderExpand(PyramidShort *pyr, int nlev, int mode, PyramidWorkspace *work)
 {
     PyramidShort *tpyr = pyr + nlev - 1;
-    PyramidShort *scr = allocateImage(pyr[1].width, pyr[0].height, pyr->border);
+    PyramidShort *scr = work ? work->scratch(pyr) :
+        allocateImage(pyr[1].width, pyr[0].height, pyr->border);
     if (scr == NULL) return 0;
 
     if (mode > 0) {
@@ -206,54 +609,45 @@ int PyramidShort::BorderExpand(PyramidShort *pyr, int nlev, int mode)
         }
     }
 
-    freeImage(scr);
+    if (!work)
+        freeImage(scr);
     return 1;
 }
 
 void PyramidShort::BorderReduceOdd(PyramidShort *in, PyramidShort *out, PyramidShort *scr)
 {
-    ImageTypeShortBase *s, *ns, *ls, *p, *np;
+    const PyramidKernels *k = selectKernels();
+    ImageTypeShortBase *s, *ls, *p;
 
     int off = scr->border - 2;
     s = scr->ptr[-scr->border] - (off >> 1);
-    ns = s + scr->pitch;
     ls = scr->ptr[scr->height + scr->border - 1] + scr->pitch - (off >> 1);
     int width = scr->width + scr->border;
     p = in->ptr[-scr->border] - off;
-    np = p + in->pitch;
 
     // treat it as if the whole thing were the image
-    for (; s < ls; s = ns, ns += scr->pitch, p = np, np += in->pitch) {
-        for (int w = width; w--; s++, p += 2) {
-            *s = (short)((((int) p[-2]) + ((int) p[2]) + 8 +    // 1
-                        ((((int) p[-1]) + ((int) p[1])) << 2) + // 4
-                        ((int) *p) * 6) >> 4);          // 6
-        }
+    for (; s < ls; s += scr->pitch, p += in->pitch) {
+        k->reduceRowH(s, p, width);
     }
 
     BorderSpread(scr, 5, 4 + ((in->width ^ 1) & 1), 0, 0); //
 
     s = out->ptr[-(off >> 1)] - out->border;
-    ns = s + out->pitch;
     ls = s + out->pitch * (out->height + off);
     p = scr->ptr[-off] - out->border;
-    int pitch = scr->pitch;
-    int pitch2 = pitch << 1;
-    np = p + pitch2;
-    for (; s < ls; s = ns, ns += out->pitch, p = np, np += pitch2) {
-        for (int w = out->pitch; w--; s++, p++) {
-            *s = (short)((((int) p[-pitch2]) + ((int) p[pitch2]) + 8 + // 1
-                        ((((int) p[-pitch]) + ((int) p[pitch])) << 2) + // 4
-                        ((int) *p) * 6) >> 4);              // 6
-        }
+    ptrdiff_t pitch = scr->pitch;
+    ptrdiff_t pitch2 = pitch << 1;
+    for (; s < ls; s += out->pitch, p += pitch2) {
+        k->reduceRowV(s, p, pitch, (int) out->pitch);
     }
     BorderSpread(out, 0, 0, 5, 5);
 
 }
 
-int PyramidShort::BorderReduce(PyramidShort *pyr, int nlev)
+int PyramidShort::BorderReduce(PyramidShort *pyr, int nlev, PyramidWorkspace *work)
 {
-    PyramidShort *scr = allocateImage(pyr[1].width, pyr[0].height, pyr->border);
+    PyramidShort *scr = work ? work->scratch(pyr) :
+        allocateImage(pyr[1].width, pyr[0].height, pyr->border);
     if (scr == NULL)
         return 0;
 
@@ -265,6 +659,64 @@ int PyramidShort::BorderReduce(PyramidShort *pyr, int nlev)
         scr->height = pyr[0].height;
     }
 
-    freeImage(scr);
+    if (!work)
+        freeImage(scr);
     return 1;
 }
+
+PyramidWorkspace::PyramidWorkspace()
+{
+    m_buffer = NULL;
+    m_size = 0;
+    m_owned = false;
+}
+
+PyramidWorkspace::~PyramidWorkspace()
+{
+    release();
+}
+
+void PyramidWorkspace::release()
+{
+    if (m_owned)
+        free(m_buffer);
+    m_buffer = NULL;
+    m_size = 0;
+    m_owned = false;
+}
+
+size_t PyramidWorkspace::requiredSize(real width, real height, real border)
+{
+    return PyramidShort::imageSize(width >> 1, height, border);
+}
+
+bool PyramidWorkspace::reserve(real width, real height, real border)
+{
+    size_t size = requiredSize(width, height, border);
+    if (size <= m_size)
+        return true;
+
+    release();
+    m_buffer = calloc(size, 1);
+    if (m_buffer == NULL)
+        return false;
+
+    m_size = size;
+    m_owned = true;
+    return true;
+}
+
+void PyramidWorkspace::setBuffer(void *buffer, size_t bytes)
+{
+    release();
+    m_buffer = buffer;
+    m_size = bytes;
+}
+
+PyramidShort *PyramidWorkspace::scratch(PyramidShort *pyr)
+{
+    if (!reserve(pyr[0].width, pyr[0].height, pyr->border))
+        return NULL;
+
+    return PyramidShort::layoutImage(m_buffer, pyr[1].width, pyr[0].height, pyr->border);
+}
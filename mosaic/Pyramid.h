@@ -21,7 +21,12 @@
 
 #include "ImageUtils.h"
 
-typedef unsigned short int real;
+#include <stddef.h>
+
+typedef int real;
+
+class FramePool;
+class PyramidWorkspace;
 
 //  Structure containing a packed pyramid of type ImageTypeShort.  Used for pyramid
 //  blending, among other things.
@@ -35,20 +40,71 @@ public:
   real width, height;               // Width and height of input images
   real numChannels;                 // Number of channels in input images
   real border;                      // border size
-  real pitch;                       // Pitch.  Used for moving through image efficiently.
+  size_t pitch;                     // Pitch.  Used for moving through image efficiently.
 
-  static PyramidShort *allocatePyramidPacked(real width, real height, real levels, real border = 0);
+  // The storage comes from pool when one is given, see freePyramid
+  static PyramidShort *allocatePyramidPacked(real levels, real width, real height, real border = 0, FramePool *pool = NULL);
+  static void freePyramid(PyramidShort *pyramid, FramePool *pool = NULL);
+  // Lays a pyramid out in storage of at least packedSize bytes, e.g. to
+  // reuse a pyramid for a smaller image
+  static PyramidShort *layoutPyramidPacked(void *storage, real levels, real width, real height, real border);
   static PyramidShort *allocateImage(real width, real height, real border);
+  // Bytes taken by an image of allocateImage, and its layout in such storage
+  static size_t imageSize(real width, real height, real border);
+  static PyramidShort *layoutImage(void *storage, real width, real height, real border);
   static void createPyramid(ImageType image, PyramidShort *pyramid, int last = 3 );
   static void freeImage(PyramidShort *image);
 
-  static unsigned int calcStorage(real width, real height, real border2, int levels, int *lines);
+  static size_t calcStorage(real width, real height, real border2, int levels, int *lines);
+  // Bytes allocated by allocatePyramidPacked
+  static size_t packedSize(real levels, real width, real height, real border);
 
   static void BorderSpread(PyramidShort *pyr, int left, int right, int top, int bot);
   static void BorderExpandOdd(PyramidShort *in, PyramidShort *out, PyramidShort *scr, int mode);
-  static int BorderExpand(PyramidShort *pyr, int nlev, int mode);
-  static int BorderReduce(PyramidShort *pyr, int nlev);
+  // Without a workspace these allocate their scratch image on every call
+  static int BorderExpand(PyramidShort *pyr, int nlev, int mode, PyramidWorkspace *work = NULL);
+  static int BorderReduce(PyramidShort *pyr, int nlev, PyramidWorkspace *work = NULL);
   static void BorderReduceOdd(PyramidShort *in, PyramidShort *out, PyramidShort *scr);
 };
 
+//  Scratch image of BorderReduce and BorderExpand, kept from one call to the
+//  next so that building and collapsing pyramids allocates nothing once the
+//  workspace is large enough. The storage is its own, grown as needed, or a
+//  buffer supplied by the caller. A workspace is used by one thread at a time.
+
+class PyramidWorkspace
+{
+
+public:
+
+  PyramidWorkspace();
+  ~PyramidWorkspace();
+
+  // Bytes of scratch needed for pyramids whose level 0 is width x height
+  static size_t requiredSize(real width, real height, real border);
+
+  // Makes room for pyramids up to width x height, keeping the storage if it
+  // is large enough already. Returns false when out of memory.
+  bool reserve(real width, real height, real border);
+
+  // Uses buffer, of the given size, as storage from now on. The caller keeps
+  // it valid while the workspace is in use and frees it afterwards; it is
+  // only replaced if a pyramid needs more than requiredSize allows for.
+  void setBuffer(void *buffer, size_t bytes);
+
+  // Scratch image for pyramid pyr, NULL when out of memory
+  PyramidShort *scratch(PyramidShort *pyr);
+
+protected:
+  /*Not copyable*/
+  PyramidWorkspace(const PyramidWorkspace&);
+  PyramidWorkspace& operator=(const PyramidWorkspace&);
+
+  void release();
+
+  void *m_buffer;
+  size_t m_size;
+  bool m_owned;
+};
+
 #endif
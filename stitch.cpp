@@ -6,13 +6,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include "mosaic/Mosaic.h"
 #include "mosaic/ImageUtils.h"
+#include "framesource.h"
+#include "stitchutil.h"
 #include <vector>
 #include <stdint.h>
-#include <sys/time.h>
 #include <numeric>
-#include <png.h>
 #include <sys/param.h>
 
 extern int opterr;
@@ -20,72 +21,8 @@ extern int opterr;
 int blendingType = Blend::BLEND_TYPE_HORZ;
 
 static const char *strips[] = {"Thin", "Wide"};
-
-static bool write_png(const char *out, ImageType rgb, int width, int height) {
-  FILE *fp = NULL;
-  png_structp png_ptr;
-  png_infop info_ptr;
-  png_bytep row;
-
-  fp = fopen(out, "w");
-  if (!fp) {
-    perror("fopen");
-    return false;
-  }
-
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png_ptr) {
-    std::cerr << "Could not allocate write struct" << std::endl;
-    fclose(fp);
-    return false;
-  }
-
-  info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr) {
-    std::cerr << "Could not allocate info struct" << std::endl;
-    fclose(fp);
-    return false;
-  }
-
-  if (setjmp(png_jmpbuf(png_ptr))) {
-    std::cerr << "Error during png creation" << std::endl;
-    fclose(fp);
-    return false;
-  }
-
-  png_init_io(png_ptr, fp);
-  png_set_IHDR(png_ptr, info_ptr, width, height,
-	       8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
-	       PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-
-  png_write_info(png_ptr, info_ptr);
-
-  for (int x = 0; x < height; x++) {
-    png_write_row(png_ptr, &rgb[width * x * 3]);
-  }
-
-  png_write_end(png_ptr, NULL);
-  fclose(fp);
-
-  png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-  png_destroy_write_struct(&png_ptr, NULL);
-
-  return true;
-}
-
-static uint64_t timeNow() {
-  struct timeval tv;
-
-  if (gettimeofday(&tv, NULL) == -1) {
-    return -1;
-  }
-
-  uint64_t ret = tv.tv_usec;
-  ret /= 1000;
-  ret += (tv.tv_sec * 1000);
-
-  return ret;
-}
+static const char *formats[] = {"i420", "yv12", "nv12", "nv21"};
+static const char *engines[] = {"Pyramid", "Warp once"};
 
 static void usage() {
   std::cout << "This application continuously reads frames from an input file, runs" << std::endl
@@ -96,18 +33,17 @@ static void usage() {
 	    << "  --out, -o output" << std::endl
 	    << "  --strip, -s strip type" << std::endl
 	    << "  --max, -m maximum frames to process" << std::endl
+	    << "  --threads, -j number of alignment and blending threads (0 uses all CPUs, default 1)" << std::endl
+	    << "  --tolerance, -p projection error allowed while warping, in pixels (0 is exact)" << std::endl
+	    << "  --incremental, -b (Use to start blending while frames are added)" << std::endl
+	    << "  --budget, -B megabytes of frame pyramids kept by --incremental (0 is unlimited)" << std::endl
+	    << "  --tile, -T size of the tiles the mosaic is blended in (0 blends it at once)" << std::endl
+	    << "  --format, -f layout of the input frames: i420 (default), yv12, nv12 or nv21" << std::endl
+	    << "  --stride, -S bytes per row of the input luma (default width)" << std::endl
+	    << "  --engine, -e blend engine" << std::endl
 	    << "  --time, -t (Use to print times for operations)" << std::endl
-	    << " Supported strip types:\n  0 is thin (default)\n  1 is wide " << std::endl;
-}
-
-int count_frames(int fd, int size) {
-  struct stat buf;
-  if (fstat(fd, &buf) != 0) {
-    perror("fstat");
-    return -1;
-  }
-
-  return buf.st_size / size;
+	    << " Supported strip types:\n  0 is thin (default)\n  1 is wide " << std::endl
+	    << " Supported blend engines:\n  0 warps the frame pyramids level by level (default)\n  1 warps the frames once" << std::endl;
 }
 
 int main(int argc, char *argv[]) {
@@ -116,10 +52,18 @@ int main(int argc, char *argv[]) {
   int width = -1;
   int height = -1;
   int max_frames = -1;
+  int threads = 1;
+  float tolerance = PROJECTION_TOLERANCE_DEFAULT;
   const char *in = NULL;
   const char *out = NULL;
   bool time = false;
+  bool incremental = false;
+  int budget = 0;
+  int tileSize = 0;
+  int format = FrameDescriptor::FORMAT_I420;
+  int stride = 0;
   int stripType = Blend::STRIP_TYPE_THIN;
+  int engine = Blend::BLEND_ENGINE_PYRAMID;
 
   const struct option long_options[] = {
     {"width",  required_argument, 0, 'w'},
@@ -128,6 +72,14 @@ int main(int argc, char *argv[]) {
     {"out",    required_argument, 0, 'o'},
     {"strip",  required_argument, 0, 's'},
     {"max",    required_argument, 0, 'm'},
+    {"threads", required_argument, 0, 'j'},
+    {"tolerance", required_argument, 0, 'p'},
+    {"incremental", no_argument    , 0, 'b'},
+    {"budget", required_argument, 0, 'B'},
+    {"tile",   required_argument, 0, 'T'},
+    {"format", required_argument, 0, 'f'},
+    {"stride", required_argument, 0, 'S'},
+    {"engine", required_argument, 0, 'e'},
     {"time",   no_argument      , 0, 't'},
     {0,        0,                 0, 0}
   };
@@ -140,7 +92,7 @@ int main(int argc, char *argv[]) {
   }
 
   while (1) {
-    c = getopt_long(argc, argv, "w:h:i:o:s:m:t", long_options, NULL);
+    c = getopt_long(argc, argv, "w:h:i:o:s:m:j:p:bB:T:f:S:e:t", long_options, NULL);
     if (c == -1) {
       break;
     }
@@ -174,6 +126,43 @@ int main(int argc, char *argv[]) {
       max_frames = atoi(optarg);
       break;
 
+    case 'j':
+      threads = atoi(optarg);
+      break;
+
+    case 'p':
+      tolerance = atof(optarg);
+      break;
+
+    case 'b':
+      incremental = true;
+      break;
+
+    case 'B':
+      budget = atoi(optarg);
+      break;
+
+    case 'T':
+      tileSize = atoi(optarg);
+      break;
+
+    case 'f':
+      format = -1;
+      for (int k = 0; k < 4; k++) {
+	if (!strcmp(optarg, formats[k])) {
+	  format = k;
+	}
+      }
+      break;
+
+    case 'S':
+      stride = atoi(optarg);
+      break;
+
+    case 'e':
+      engine = atoi(optarg);
+      break;
+
     case '?':
       usage();
       return 0;
@@ -201,30 +190,63 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  if (threads < 0) {
+    std::cerr << "invalid number of threads " << threads << std::endl;
+    return 1;
+  }
+
+  if (tolerance < 0.0f) {
+    std::cerr << "invalid projection tolerance " << tolerance << std::endl;
+    return 1;
+  }
+
+  if (budget < 0) {
+    std::cerr << "invalid budget " << budget << std::endl;
+    return 1;
+  }
+
+  if (tileSize < 0) {
+    std::cerr << "invalid tile size " << tileSize << std::endl;
+    return 1;
+  }
+
+  if (format < 0) {
+    std::cerr << "invalid format" << std::endl;
+    return 1;
+  }
+
+  if (stride == 0) {
+    stride = width;
+  }
+
+  if (stride < width || (stride & 1)) {
+    std::cerr << "invalid stride " << stride << std::endl;
+    return 1;
+  }
+
   if (stripType < 0 || stripType > 1) {
     std::cerr << "invalid strip type " << stripType << std::endl;
     return 1;
   }
 
-  // input
-  int fd = open(in, O_RDONLY);
-  if (fd == -1) {
-    perror("open");
+  if (engine < 0 || engine > 1) {
+    std::cerr << "invalid blend engine " << engine << std::endl;
     return 1;
   }
 
+  // input
+  int size = (stride * height * 12) / 8;
 
-  int size = (width * height * 12) / 8;
+  FrameSource source;
+  if (!source.open(in, size)) {
+    return 1;
+  }
 
   std::cout << "input width = " << width << ", height = " << height << std::endl;
   std::cout << "strip type: " << stripType << " (" << strips[stripType] << ")" << std::endl;
+  std::cout << "blend engine: " << engine << " (" << engines[engine] << ")" << std::endl;
 
-  int frames = count_frames(fd, size);
-
-  if (frames == -1) {
-    close(fd);
-    return 1;
-  }
+  int frames = source.frames();
 
   if (max_frames > 0) {
     frames = MIN(frames, max_frames);
@@ -232,46 +254,42 @@ int main(int argc, char *argv[]) {
 
   // initialize our mosaicer
   Mosaic m;
-  if (!m.initialize(blendingType, stripType, width, height, frames, true, 5.0f)) {
+  if (!m.initialize(blendingType, stripType, width, height, frames, true, 5.0f, engine)) {
     std::cerr << "Failed to initialize mosaicer" << std::endl;
-    close(fd);
     return 1;
   }
 
+  m.getAligner()->setNumThreads(threads);
+  m.getBlender()->setNumThreads(threads);
+  m.getBlender()->setProjectionTolerance(tolerance);
+  m.getBlender()->setIncremental(incremental);
+  m.getBlender()->setIncrementalBudget((size_t) budget << 20);
+  m.getBlender()->setTileSize(tileSize);
+
   std::vector<int> times;
-  std::vector<unsigned char *> mosaic_frames;
-  unsigned char *in_data = NULL;
+  int used = 0;
 
   for (int x = 0; x < frames; x++) {
-    // allocate:
-    if (!in_data) {
-      in_data = new unsigned char[size];
-    }
+    // The frame is used in place, from the mapped input
+    unsigned char *in_data = source.frame(x);
 
-    if (read(fd, in_data, size) == size) {
-      // process
-      int time = timeNow();
-      int ret = m.addFrame(in_data);
-      time = timeNow() - time;
+    // process
+    int time = timeNow();
+    FrameDescriptor desc;
+    desc.set(format, in_data, height, stride);
+    int ret = m.addFrame(desc);
+    time = timeNow() - time;
 
-      times.push_back(time);
+    times.push_back(time);
 
-      if (ret == Mosaic::MOSAIC_RET_OK || ret == Mosaic::MOSAIC_RET_FEW_INLIERS) {
-	mosaic_frames.push_back(in_data);
-	in_data = NULL;
-      }
+    if (ret == Mosaic::MOSAIC_RET_OK || ret == Mosaic::MOSAIC_RET_FEW_INLIERS) {
+      used++;
     } else {
-      break;
+      source.release(x);
     }
   }
 
-  if (in_data) {
-    delete[] in_data;
-  }
-
-  close(fd);
-
-  std::cout << "Used " << mosaic_frames.size() << " frames" << std::endl;
+  std::cout << "Used " << used << " frames" << std::endl;
 
   // output
   // TODO: what are those?
@@ -291,12 +309,6 @@ int main(int argc, char *argv[]) {
   ImageType rgb = ImageUtils::allocateImage(width, height, 3);
   ImageUtils::yvu2rgb(rgb, yuv, width, height);
 
-  for (int x = 0; x < mosaic_frames.size(); x++) {
-    delete[] mosaic_frames[x];
-  }
-
-  mosaic_frames.clear();
-
   bool res = write_png(out, rgb, width, height);
   ImageUtils::freeImage(rgb);
   if (!res) {
@@ -14,6 +14,7 @@
 #include <sys/param.h>
 #include "stitcher/tracker.h"
 #include "stitcher/stitcher.h"
+#include "framesource.h"
 extern "C" {
 #include <libswscale/swscale.h>
 };
@@ -62,7 +63,7 @@ static bool write_png(const char *out, const unsigned char *rgb, int width, int
   png_write_info(png_ptr, info_ptr);
 
   for (int x = 0; x < height; x++) {
-    png_bytep row = const_cast<unsigned char *>(&rgb[width * x * 3]);
+    png_bytep row = const_cast<unsigned char *>(&rgb[(size_t) width * x * 3]);
     png_write_row(png_ptr, row);
   }
 
@@ -89,6 +90,25 @@ static uint64_t timeNow() {
   return ret;
 }
 
+// Results of the frames submitted to the tracker or the stitcher, filled in
+// on the alignment thread in submission order
+typedef struct {
+  std::vector<int> frames;
+  std::vector<int> results;
+} Submitted;
+
+static void tracked(void *user, unsigned char * /* frame */, Tracker::Return ret,
+		    float /* xTranslation */, float /* yTranslation */) {
+  Submitted *s = static_cast<Submitted *>(user);
+  s->results.push_back(ret);
+}
+
+static void stitched(void *user, unsigned char * /* data */, Stitcher::Return ret,
+		     const float /* trs */[3][3]) {
+  Submitted *s = static_cast<Submitted *>(user);
+  s->results.push_back(ret);
+}
+
 static void usage() {
   std::cout << "This application continuously reads frames from an input file, runs" << std::endl
 	    << "them through mosaic and stitches the final result" << std::endl << std::endl
@@ -98,20 +118,13 @@ static void usage() {
 	    << "  --out, -o output" << std::endl
 	    << "  --strip, -s strip type" << std::endl
 	    << "  --max, -m maximum frames to process" << std::endl
+	    << "  --threads, -j number of blending threads (0 uses all CPUs, default 1)" << std::endl
+	    << "  --queue, -q frames: align on a worker thread through submitFrame, with" << std::endl
+	    << "    that many frames queued (0 aligns them in addFrame, default)" << std::endl
 	    << "  --time, -t (Use to print times for operations)" << std::endl
 	    << " Supported strip types:\n  0 is thin (default)\n  1 is wide " << std::endl;
 }
 
-int count_frames(int fd, int size) {
-  struct stat buf;
-  if (fstat(fd, &buf) != 0) {
-    perror("fstat");
-    return -1;
-  }
-
-  return buf.st_size / size;
-}
-
 int main(int argc, char *argv[]) {
   opterr = 0;
 
@@ -119,6 +132,8 @@ int main(int argc, char *argv[]) {
   int tracker_width, tracker_height;
   int src_size, tracker_size;
   int max_frames = -1;
+  int threads = 1;
+  int queue = 0;
 
   const char *in = NULL;
   const char *out = NULL;
@@ -132,6 +147,8 @@ int main(int argc, char *argv[]) {
     {"out",    required_argument, 0, 'o'},
     {"strip",  required_argument, 0, 's'},
     {"max",    required_argument, 0, 'm'},
+    {"threads", required_argument, 0, 'j'},
+    {"queue",  required_argument, 0, 'q'},
     {"time",   no_argument      , 0, 't'},
     {0,        0,                 0, 0}
   };
@@ -144,7 +161,7 @@ int main(int argc, char *argv[]) {
   }
 
   while (1) {
-    c = getopt_long(argc, argv, "w:h:i:o:s:m:t", long_options, NULL);
+    c = getopt_long(argc, argv, "w:h:i:o:s:m:j:q:t", long_options, NULL);
     if (c == -1) {
       break;
     }
@@ -178,6 +195,14 @@ int main(int argc, char *argv[]) {
       max_frames = atoi(optarg);
       break;
 
+    case 'j':
+      threads = atoi(optarg);
+      break;
+
+    case 'q':
+      queue = atoi(optarg);
+      break;
+
     case '?':
       usage();
       return 0;
@@ -205,20 +230,29 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  if (threads < 0) {
+    std::cerr << "invalid number of threads " << threads << std::endl;
+    return 1;
+  }
+
+  if (queue < 0) {
+    std::cerr << "invalid queue size " << queue << std::endl;
+    return 1;
+  }
+
   if (stripType < 0 || stripType > 1) {
     std::cerr << "invalid strip type " << stripType << std::endl;
     return 1;
   }
 
   // input
-  int fd = open(in, O_RDONLY);
-  if (fd == -1) {
-    perror("open");
+  src_size = (src_width * src_height * 12) / 8;
+
+  FrameSource source;
+  if (!source.open(in, src_size)) {
     return 1;
   }
 
-  src_size = (src_width * src_height * 12) / 8;
-
   tracker_width = src_width > 720 ? src_width / 8 : src_width / 4;
   tracker_height = src_width > 720 ? src_height / 8 : src_height / 4;
   tracker_size = tracker_width * tracker_height;
@@ -226,12 +260,7 @@ int main(int argc, char *argv[]) {
   std::cout << "input width = " << src_width << ", height = " << src_height << std::endl;
   std::cout << "strip type: " << stripType << " (" << strips[stripType] << ")" << std::endl;
   std::cout << "tracker width = " << tracker_width << ", height = " << tracker_height << std::endl;
-  int frames = count_frames(fd, src_size);
-
-  if (frames == -1) {
-    close(fd);
-    return 1;
-  }
+  int frames = source.frames();
 
   if (max_frames > 0) {
     frames = MIN(frames, max_frames);
@@ -240,7 +269,6 @@ int main(int argc, char *argv[]) {
   // create tracker
   Tracker tracker(frames);
   if (!tracker.initialize(tracker_width, tracker_height)) {
-    close(fd);
     return 1;
   }
 
@@ -260,24 +288,26 @@ int main(int argc, char *argv[]) {
   }
 
   std::vector<unsigned char *> full_frames, scaled_frames;
-  unsigned char *full_frame = 0;
   unsigned char *scaled_frame = 0;
 
   std::vector<int> tracker_times, full_times;
 
+  // With a queue every submitted frame needs its own buffer until aligned
+  Submitted tracker_frames;
+  std::vector<unsigned char *> submitted_frames;
+  if (queue) {
+    tracker.setQueueSize(queue);
+    tracker.setFrameCallback(tracked, &tracker_frames);
+  }
+
   for (int x = 0; x < frames; x++) {
-    if (!full_frame) {
-      full_frame = new unsigned char[src_size];
-    }
+    // The full frame is used in place, from the mapped input
+    unsigned char *full_frame = source.frame(x);
 
     if (!scaled_frame) {
       scaled_frame = new unsigned char[tracker_size];
     }
 
-    if (read(fd, full_frame, src_size) != src_size) {
-      break;
-    }
-
     // our input is I420 so we scale the Y frame only
     const uint8_t *const srcSlice[] = {full_frame, NULL, NULL};
     const int srcStride[] = {src_width, 0, 0};
@@ -288,6 +318,23 @@ int main(int argc, char *argv[]) {
       abort();
     }
 
+    if (queue) {
+      uint64_t t = timeNow();
+      Tracker::Return ret = tracker.submitFrame(scaled_frame);
+      t = timeNow() - t;
+      tracker_times.push_back(t);
+
+      if (ret == Tracker::Dropped) {
+	source.release(x);
+      } else {
+	tracker_frames.frames.push_back(x);
+	submitted_frames.push_back(scaled_frame);
+	scaled_frame = 0;
+      }
+
+      continue;
+    }
+
     uint64_t t = timeNow();
     Tracker::Return ret = tracker.addFrame(scaled_frame);
     t = timeNow() - t;
@@ -298,23 +345,65 @@ int main(int argc, char *argv[]) {
       scaled_frame = 0;
 
       full_frames.push_back(full_frame);
-      full_frame = 0;
+    } else {
+      source.release(x);
+    }
+  }
+
+  if (queue) {
+    tracker.flush();
+
+    int dropped = frames - tracker_frames.frames.size();
+    for (size_t n = 0; n < tracker_frames.frames.size(); n++) {
+      int x = tracker_frames.frames[n];
+
+      if (tracker_frames.results[n] >= 0) {
+	scaled_frames.push_back(submitted_frames[n]);
+	full_frames.push_back(source.frame(x));
+      } else {
+	delete[] submitted_frames[n];
+	source.release(x);
+      }
+    }
+
+    if (dropped) {
+      std::cout << "Tracker dropped " << dropped << " frames while the camera was still" << std::endl;
     }
   }
 
   // Now that we are done, let's try to stitch
   Stitcher stitcher(src_width, src_height, full_frames.size(), (Stitcher::StripType)stripType);
+  stitcher.setThreads(threads);
+
+  Submitted stitcher_frames;
+  if (queue) {
+    stitcher.setQueueSize(queue);
+    stitcher.setFrameCallback(stitched, &stitcher_frames);
+  }
+
   for (int x = 0; x < full_frames.size(); x++) {
     uint64_t t = timeNow();
-    Stitcher::Return ret = stitcher.addFrame(full_frames[x]);
+    Stitcher::Return ret = queue ? stitcher.submitFrame(full_frames[x]) : stitcher.addFrame(full_frames[x]);
     t = timeNow() - t;
     full_times.push_back(t);
 
-    if (ret < Stitcher::Ok) {
+    if (queue && ret != Stitcher::Dropped) {
+      stitcher_frames.frames.push_back(x);
+    } else if (ret < Stitcher::Ok) {
       std::cerr << "Weird! Stitcher did not return Ok for frame " << x << std::endl;
     }
   }
 
+  if (queue) {
+    stitcher.flush();
+
+    for (size_t n = 0; n < stitcher_frames.frames.size(); n++) {
+      if (stitcher_frames.results[n] < Stitcher::Ok) {
+	std::cerr << "Weird! Stitcher did not return Ok for frame " << stitcher_frames.frames[n] << std::endl;
+      }
+    }
+  }
+
   uint64_t stitchingTime = timeNow();
   Stitcher::Return ret = stitcher.stitch();
   stitchingTime = timeNow() - stitchingTime;
@@ -0,0 +1,452 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "mosaic/Mosaic.h"
+#include "mosaic/ImageUtils.h"
+#include "db_vlvm/db_utilities_threads.h"
+#include "framesource.h"
+#include "stitchutil.h"
+
+extern int opterr;
+
+static const char *formats[] = {"i420", "yv12", "nv12", "nv21"};
+
+// One line of the manifest, and what became of it
+typedef struct {
+  std::string in;
+  std::string out;
+  int width;
+  int height;
+  int stripType;
+  int format;
+  int stride;
+  int engine;
+  bool incremental;
+  int budget;
+  int tileSize;
+  // Keep the YVU mosaic in mosaic instead of writing it out
+  bool keep;
+
+  const char *error;
+  int frames;
+  int used;
+  int mosaicWidth;
+  int mosaicHeight;
+  uint64_t alignTime;
+  uint64_t blendTime;
+  uint64_t totalTime;
+  std::vector<unsigned char> mosaic;
+} Job;
+
+
+static void usage() {
+  std::cout << "This application stitches every capture listed in a manifest, running" << std::endl
+	    << "several of them at once" << std::endl << std::endl
+	    << "  --manifest, -i manifest" << std::endl
+	    << "  --jobs, -j number of panoramas stitched at once (0 uses all CPUs, default 1)" << std::endl
+	    << "  --incremental, -b (Use to start blending while frames are added)" << std::endl
+	    << "  --engine, -e blend engine: 0 warps the frame pyramids level by level" << std::endl
+	    << "    (default), 1 warps the frames once" << std::endl
+	    << "  --budget, -B megabytes every job may keep: the frame pyramids decomposed" << std::endl
+	    << "    ahead by --incremental and the buffers its pool recycles (0 leaves" << std::endl
+	    << "    the pyramids unlimited and the pool at its default)" << std::endl
+	    << "  --tile, -T size of the tiles the mosaics are blended in (0 blends them at once)" << std::endl
+	    << "  --check, -c copies: stitch every job alone, then that many copies of" << std::endl
+	    << "    every job at once, and compare the mosaics instead of writing them" << std::endl
+	    << "    (-j then defaults to one thread per copy)" << std::endl
+	    << "  --time, -t (Use to print times for every job)" << std::endl << std::endl
+	    << "Every line of the manifest is a job: input output width height, followed" << std::endl
+	    << "by any of strip=0|1, format=i420|yv12|nv12|nv21, stride=bytes," << std::endl
+	    << "engine=0|1, incremental=0|1, budget=megabytes and tile=size to override" << std::endl
+	    << "the defaults for that job." << std::endl
+	    << "Empty lines and lines starting with # are skipped." << std::endl;
+}
+
+// Parses one line of the manifest into job, returns false if it is invalid
+static bool parse_job(const std::string& line, Job& job) {
+  std::istringstream in(line);
+
+  if (!(in >> job.in >> job.out >> job.width >> job.height)) {
+    return false;
+  }
+
+  if (job.width <= 0 || job.height <= 0) {
+    return false;
+  }
+
+  std::string opt;
+  while (in >> opt) {
+    std::string::size_type eq = opt.find('=');
+    if (eq == std::string::npos) {
+      return false;
+    }
+
+    std::string key = opt.substr(0, eq);
+    const char *value = opt.c_str() + eq + 1;
+
+    if (key == "strip") {
+      job.stripType = atoi(value);
+    } else if (key == "stride") {
+      job.stride = atoi(value);
+    } else if (key == "engine") {
+      if (strcmp(value, "0") && strcmp(value, "1")) {
+	return false;
+      }
+      job.engine = atoi(value);
+    } else if (key == "incremental") {
+      if (strcmp(value, "0") && strcmp(value, "1")) {
+	return false;
+      }
+      job.incremental = (atoi(value) != 0);
+    } else if (key == "budget") {
+      job.budget = atoi(value);
+    } else if (key == "tile") {
+      job.tileSize = atoi(value);
+    } else if (key == "format") {
+      job.format = -1;
+      for (int k = 0; k < 4; k++) {
+	if (!strcmp(value, formats[k])) {
+	  job.format = k;
+	}
+      }
+    } else {
+      return false;
+    }
+  }
+
+  if (job.stride == 0) {
+    job.stride = job.width;
+  }
+
+  return job.stripType >= 0 && job.stripType <= 1 && job.format >= 0 &&
+    job.stride >= job.width && !(job.stride & 1) && job.budget >= 0 && job.tileSize >= 0;
+}
+
+// Stitches one job. Every job has its own Mosaic and input mapping and
+// nothing else is shared, so jobs run on any thread of the pool.
+static void run_job(void *arg, int task, int /* thread */) {
+  Job& job = (*(std::vector<Job> *) arg)[task];
+  uint64_t start = timeNow();
+
+  FrameSource source;
+  if (!source.open(job.in.c_str(), ((size_t) job.stride * job.height * 12) / 8)) {
+    job.error = "could not read input";
+    return;
+  }
+
+  job.frames = source.frames();
+
+  Mosaic m;
+  if (m.initialize(Blend::BLEND_TYPE_HORZ, job.stripType, job.width, job.height,
+		   job.frames, true, 5.0f, job.engine) != Mosaic::MOSAIC_RET_OK) {
+    job.error = "could not initialize mosaic";
+    return;
+  }
+
+  m.getBlender()->setIncremental(job.incremental);
+  m.getBlender()->setIncrementalBudget((size_t) job.budget << 20);
+  if (job.budget) {
+    m.getPool()->setLimit((size_t) job.budget << 20);
+  }
+  m.getBlender()->setTileSize(job.tileSize);
+
+  for (int x = 0; x < job.frames; x++) {
+    FrameDescriptor desc;
+    desc.set(job.format, source.frame(x), job.height, job.stride);
+
+    int ret = m.addFrame(desc);
+    if (ret == Mosaic::MOSAIC_RET_OK || ret == Mosaic::MOSAIC_RET_FEW_INLIERS) {
+      job.used++;
+    } else {
+      source.release(x);
+    }
+  }
+
+  job.alignTime = timeNow() - start;
+
+  float progress = 0;
+  bool cancel = false;
+
+  uint64_t blend = timeNow();
+  if (m.createMosaic(progress, cancel) != Mosaic::MOSAIC_RET_OK) {
+    job.error = "stitching failed";
+    return;
+  }
+  job.blendTime = timeNow() - blend;
+
+  ImageType yuv = m.getMosaic(job.mosaicWidth, job.mosaicHeight);
+  if (job.keep) {
+    job.mosaic.assign(yuv, yuv + (size_t) job.mosaicWidth * job.mosaicHeight * 3 / 2);
+    job.totalTime = timeNow() - start;
+    return;
+  }
+
+  ImageType rgb = ImageUtils::allocateImage(job.mosaicWidth, job.mosaicHeight, 3);
+  ImageUtils::yvu2rgb(rgb, yuv, job.mosaicWidth, job.mosaicHeight);
+
+  bool res = write_png(job.out.c_str(), rgb, job.mosaicWidth, job.mosaicHeight);
+  ImageUtils::freeImage(rgb);
+  if (!res) {
+    job.error = "could not write output";
+    return;
+  }
+
+  job.totalTime = timeNow() - start;
+}
+
+// Stitches copies of every job of list at once on pool and compares them
+// with a run of that job on its own. Prints what differs and returns the
+// number of jobs that failed or did not match.
+static int check_jobs(std::vector<Job>& list, int copies, db_ThreadPool& pool, bool time) {
+  for (size_t x = 0; x < list.size(); x++) {
+    list[x].keep = true;
+    run_job(&list, (int) x, 0);
+  }
+
+  std::vector<Job> runs;
+  for (int k = 0; k < copies; k++) {
+    runs.insert(runs.end(), list.begin(), list.end());
+  }
+  for (size_t x = 0; x < runs.size(); x++) {
+    runs[x].error = NULL;
+    runs[x].mosaic.clear();
+  }
+
+  uint64_t start = timeNow();
+  pool.Run((int) runs.size(), run_job, &runs);
+  uint64_t total = timeNow() - start;
+
+  int failed = 0;
+  for (size_t x = 0; x < list.size(); x++) {
+    Job& job = list[x];
+
+    if (job.error) {
+      std::cout << job.in << ": " << job.error << std::endl;
+      failed++;
+      continue;
+    }
+
+    int matches = 0;
+    for (int k = 0; k < copies; k++) {
+      Job& run = runs[k * list.size() + x];
+
+      if (run.error) {
+	std::cout << job.in << ": copy " << k << ": " << run.error << std::endl;
+      } else if (run.mosaicWidth != job.mosaicWidth || run.mosaicHeight != job.mosaicHeight ||
+		 run.mosaic != job.mosaic) {
+	std::cout << job.in << ": copy " << k << " differs from the serial mosaic" << std::endl;
+      } else {
+	matches++;
+      }
+    }
+
+    std::cout << job.in << ": " << matches << " of " << copies
+	      << " concurrent copies match the serial " << job.mosaicWidth << "x"
+	      << job.mosaicHeight << " mosaic" << std::endl;
+
+    if (matches != copies) {
+      failed++;
+    }
+  }
+
+  std::cout << list.size() - failed << " of " << list.size() << " panoramas reproduced";
+  if (time) {
+    std::cout << " by " << runs.size() << " concurrent stitches in " << total << "ms";
+  }
+  std::cout << std::endl;
+
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+  opterr = 0;
+
+  const char *manifest = NULL;
+  int jobs = 1;
+  int engine = Blend::BLEND_ENGINE_PYRAMID;
+  bool incremental = false;
+  int budget = 0;
+  int tileSize = 0;
+  int copies = 0;
+  bool time = false;
+
+  const struct option long_options[] = {
+    {"manifest", required_argument, 0, 'i'},
+    {"jobs",   required_argument, 0, 'j'},
+    {"engine", required_argument, 0, 'e'},
+    {"incremental", no_argument, 0, 'b'},
+    {"budget", required_argument, 0, 'B'},
+    {"tile",   required_argument, 0, 'T'},
+    {"check",  required_argument, 0, 'c'},
+    {"time",   no_argument      , 0, 't'},
+    {0,        0,                 0, 0}
+  };
+
+  int c;
+  bool jobsSet = false;
+
+  if (argc == 1) {
+    usage();
+    return 0;
+  }
+
+  while (1) {
+    c = getopt_long(argc, argv, "i:j:e:bB:T:c:t", long_options, NULL);
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+    case 'i':
+      manifest = optarg;
+      break;
+
+    case 'j':
+      jobs = atoi(optarg);
+      jobsSet = true;
+      break;
+
+    case 'e':
+      engine = atoi(optarg);
+      break;
+
+    case 'b':
+      incremental = true;
+      break;
+
+    case 'B':
+      budget = atoi(optarg);
+      break;
+
+    case 'T':
+      tileSize = atoi(optarg);
+      break;
+
+    case 'c':
+      copies = atoi(optarg);
+      if (copies <= 0) {
+	std::cerr << "invalid number of copies " << optarg << std::endl;
+	return 1;
+      }
+      break;
+
+    case 't':
+      time = true;
+      break;
+
+    case '?':
+      usage();
+      return 0;
+    }
+  }
+
+  // validate
+  if (!manifest) {
+    std::cerr << "manifest not provided" << std::endl;
+    return 1;
+  }
+
+  if (jobs < 0) {
+    std::cerr << "invalid number of jobs " << jobs << std::endl;
+    return 1;
+  }
+
+  if (engine < 0 || engine > 1) {
+    std::cerr << "invalid blend engine " << engine << std::endl;
+    return 1;
+  }
+
+  if (budget < 0) {
+    std::cerr << "invalid budget " << budget << std::endl;
+    return 1;
+  }
+
+  if (tileSize < 0) {
+    std::cerr << "invalid tile size " << tileSize << std::endl;
+    return 1;
+  }
+
+  std::ifstream file(manifest);
+  if (!file) {
+    std::cerr << "could not open manifest " << manifest << std::endl;
+    return 1;
+  }
+
+  std::vector<Job> list;
+  std::string line;
+  for (int n = 1; std::getline(file, line); n++) {
+    std::string::size_type first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#') {
+      continue;
+    }
+
+    Job job;
+    job.stripType = 0;
+    job.format = FrameDescriptor::FORMAT_I420;
+    job.stride = 0;
+    job.engine = engine;
+    job.incremental = incremental;
+    job.budget = budget;
+    job.tileSize = tileSize;
+    job.keep = false;
+    job.error = NULL;
+    job.frames = job.used = 0;
+    job.mosaicWidth = job.mosaicHeight = 0;
+    job.alignTime = job.blendTime = job.totalTime = 0;
+
+    if (!parse_job(line, job)) {
+      std::cerr << manifest << ":" << n << ": invalid job" << std::endl;
+      return 1;
+    }
+
+    list.push_back(job);
+  }
+
+  db_ThreadPool pool;
+
+  if (copies) {
+    pool.SetNrThreads(jobsSet ? jobs : (int) list.size() * copies);
+    return check_jobs(list, copies, pool, time) ? 1 : 0;
+  }
+
+  pool.SetNrThreads(jobs);
+
+  uint64_t start = timeNow();
+  pool.Run((int) list.size(), run_job, &list);
+  uint64_t total = timeNow() - start;
+
+  int failed = 0;
+  for (size_t x = 0; x < list.size(); x++) {
+    Job& job = list[x];
+
+    if (job.error) {
+      std::cout << job.in << ": " << job.error << std::endl;
+      failed++;
+      continue;
+    }
+
+    std::cout << job.in << ": used " << job.used << " of " << job.frames
+	      << " frames, wrote " << job.mosaicWidth << "x" << job.mosaicHeight
+	      << " mosaic to " << job.out << std::endl;
+
+    if (time) {
+      std::cout << "  alignment time = " << job.alignTime << "ms, final stitching time = "
+		<< job.blendTime << "ms, total = " << job.totalTime << "ms" << std::endl;
+    }
+  }
+
+  std::cout << list.size() - failed << " of " << list.size() << " panoramas stitched";
+  if (time) {
+    std::cout << " in " << total << "ms";
+  }
+  std::cout << std::endl;
+
+  return failed ? 1 : 0;
+}
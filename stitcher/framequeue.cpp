@@ -0,0 +1,139 @@
+#include "framequeue.h"
+
+FrameQueue::FrameQueue(Process process, void *arg, int size) :
+  m_process(process),
+  m_arg(arg),
+  m_frames(new unsigned char *[size > 0 ? size : 1]),
+  m_size(size > 0 ? size : 1),
+  m_head(0),
+  m_count(0),
+  m_busy(false),
+  m_still(false),
+  m_quit(false),
+  m_dropped(0),
+  m_started(false),
+  m_synchronous(false) {
+
+  pthread_mutex_init(&m_mutex, NULL);
+  pthread_cond_init(&m_notEmpty, NULL);
+  pthread_cond_init(&m_notFull, NULL);
+  pthread_cond_init(&m_idle, NULL);
+}
+
+FrameQueue::~FrameQueue() {
+  if (m_started) {
+    pthread_mutex_lock(&m_mutex);
+    m_quit = true;
+    pthread_cond_signal(&m_notEmpty);
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_join(m_thread, NULL);
+  }
+
+  pthread_cond_destroy(&m_idle);
+  pthread_cond_destroy(&m_notFull);
+  pthread_cond_destroy(&m_notEmpty);
+  pthread_mutex_destroy(&m_mutex);
+
+  delete[] m_frames;
+}
+
+bool FrameQueue::push(unsigned char *frame) {
+  pthread_mutex_lock(&m_mutex);
+
+  if (!m_started && !m_synchronous) {
+    // Without a worker, this and every later frame are processed on the
+    // calling thread. Nothing has been queued yet, so the order holds.
+    if (pthread_create(&m_thread, NULL, worker, this) == 0) {
+      m_started = true;
+    } else {
+      m_synchronous = true;
+    }
+  }
+
+  if (m_synchronous) {
+    pthread_mutex_unlock(&m_mutex);
+    bool still = m_process(m_arg, frame);
+    pthread_mutex_lock(&m_mutex);
+    m_still = still;
+    pthread_mutex_unlock(&m_mutex);
+    return true;
+  }
+
+  if (m_count == m_size && m_still) {
+    // The camera has not been moving: the frame most likely would have
+    // been dropped anyway and waiting would only stall the capture.
+    m_dropped++;
+    pthread_mutex_unlock(&m_mutex);
+    return false;
+  }
+
+  while (m_count == m_size) {
+    pthread_cond_wait(&m_notFull, &m_mutex);
+  }
+
+  m_frames[(m_head + m_count) % m_size] = frame;
+  m_count++;
+  pthread_cond_signal(&m_notEmpty);
+
+  pthread_mutex_unlock(&m_mutex);
+
+  return true;
+}
+
+void FrameQueue::flush() {
+  pthread_mutex_lock(&m_mutex);
+
+  while (m_count > 0 || m_busy) {
+    pthread_cond_wait(&m_idle, &m_mutex);
+  }
+
+  pthread_mutex_unlock(&m_mutex);
+}
+
+int FrameQueue::dropped() {
+  pthread_mutex_lock(&m_mutex);
+  int dropped = m_dropped;
+  pthread_mutex_unlock(&m_mutex);
+
+  return dropped;
+}
+
+void *FrameQueue::worker(void *arg) {
+  static_cast<FrameQueue *>(arg)->run();
+
+  return NULL;
+}
+
+void FrameQueue::run() {
+  pthread_mutex_lock(&m_mutex);
+
+  for (;;) {
+    while (m_count == 0 && !m_quit) {
+      pthread_cond_wait(&m_notEmpty, &m_mutex);
+    }
+
+    if (m_count == 0) {
+      // Quitting and nothing left to do.
+      break;
+    }
+
+    unsigned char *frame = m_frames[m_head];
+    m_head = (m_head + 1) % m_size;
+    m_count--;
+    m_busy = true;
+    pthread_cond_signal(&m_notFull);
+    pthread_mutex_unlock(&m_mutex);
+
+    bool still = m_process(m_arg, frame);
+
+    pthread_mutex_lock(&m_mutex);
+    m_still = still;
+    m_busy = false;
+    if (m_count == 0) {
+      pthread_cond_broadcast(&m_idle);
+    }
+  }
+
+  pthread_mutex_unlock(&m_mutex);
+}
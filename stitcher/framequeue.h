@@ -0,0 +1,59 @@
+#ifndef FRAME_QUEUE_H
+#define FRAME_QUEUE_H
+
+#include <pthread.h>
+
+// Bounded queue of frames aligned one at a time, in submission order, on a
+// worker thread. The caller keeps ownership of a frame and must keep it
+// alive until it has been processed.
+class FrameQueue {
+public:
+  // Called on the worker thread for every frame. Returns true if the frame
+  // was dropped for the camera being still.
+  typedef bool (*Process)(void *arg, unsigned char *frame);
+
+  FrameQueue(Process process, void *arg, int size);
+  // Processes the frames still queued before returning.
+  ~FrameQueue();
+
+  // Queues a frame. When the queue is full the frame is dropped, and false
+  // returned, if the last processed frame was still; otherwise this waits
+  // for the worker to make room.
+  bool push(unsigned char *frame);
+
+  // Waits until all the queued frames have been processed.
+  void flush();
+
+  // Number of frames dropped by push().
+  int dropped();
+
+private:
+  FrameQueue(const FrameQueue&);
+  FrameQueue& operator=(const FrameQueue&);
+
+  static void *worker(void *arg);
+  void run();
+
+  Process m_process;
+  void *m_arg;
+
+  unsigned char **m_frames;
+  int m_size;
+  int m_head;
+  int m_count;
+  bool m_busy;
+  bool m_still;
+  bool m_quit;
+  int m_dropped;
+
+  bool m_started;
+  // The worker could not be started; push() processes the frames itself
+  bool m_synchronous;
+  pthread_t m_thread;
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_notEmpty;
+  pthread_cond_t m_notFull;
+  pthread_cond_t m_idle;
+};
+
+#endif /* FRAME_QUEUE_H */
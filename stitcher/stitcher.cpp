@@ -1,4 +1,5 @@
 #include "stitcher.h"
+#include "framequeue.h"
 #include "mosaic/Mosaic.h"
 //#include <iostream>
 
@@ -6,6 +7,10 @@ Stitcher::Stitcher(int width, int height, int maxFrames,
 		   const StripType& stripType,
 		   float stillCameraTranslationThreshold) :
   m_mosaic(new Mosaic),
+  m_queue(0),
+  m_queueSize(4),
+  m_callback(0),
+  m_user(0),
   m_progress(0.0),
   m_cancel(false),
   m_rgb(0) {
@@ -15,6 +20,11 @@ Stitcher::Stitcher(int width, int height, int maxFrames,
 }
 
 Stitcher::~Stitcher() {
+  if (m_queue) {
+    delete m_queue;
+    m_queue = 0;
+  }
+
   if (m_mosaic) {
     delete m_mosaic;
     m_mosaic = 0;
@@ -26,10 +36,66 @@ Stitcher::~Stitcher() {
 }
 
 Stitcher::Return Stitcher::addFrame(unsigned char * data) {
+  flush();
+
   return (Stitcher::Return) m_mosaic->addFrame(data);
 }
 
+Stitcher::Return Stitcher::addFrame(const FrameDescriptor& frame) {
+  flush();
+
+  return (Stitcher::Return) m_mosaic->addFrame(frame);
+}
+
+bool Stitcher::alignFrame(void *arg, unsigned char *data) {
+  Stitcher *s = static_cast<Stitcher *>(arg);
+  Return ret = (Stitcher::Return) s->m_mosaic->addFrame(data);
+
+  if (s->m_callback) {
+    float trs[3][3];
+    s->m_mosaic->getAligner()->getLastTRS(trs);
+    s->m_callback(s->m_user, data, ret, trs);
+  }
+
+  return s->m_mosaic->getAligner()->isStill();
+}
+
+Stitcher::Return Stitcher::submitFrame(unsigned char *data) {
+  if (!m_queue) {
+    m_queue = new FrameQueue(alignFrame, this, m_queueSize);
+  }
+
+  return m_queue->push(data) ? Ok : Dropped;
+}
+
+void Stitcher::setFrameCallback(FrameCallback callback, void *user) {
+  flush();
+
+  m_callback = callback;
+  m_user = user;
+}
+
+void Stitcher::setQueueSize(int frames) {
+  m_queueSize = frames;
+}
+
+void Stitcher::flush() {
+  if (m_queue) {
+    m_queue->flush();
+  }
+}
+
+void Stitcher::setThreads(int threads) {
+  flush();
+
+  if (m_mosaic->getBlender()) {
+    m_mosaic->getBlender()->setNumThreads(threads);
+  }
+}
+
 Stitcher::Return Stitcher::stitch() {
+  flush();
+
   return (Stitcher::Return) m_mosaic->createMosaic(m_progress, m_cancel);
 }
 
@@ -44,7 +110,7 @@ float Stitcher::progress() {
 const unsigned char *Stitcher::image(int& width, int& height) {
   unsigned char *yuv = m_mosaic->getMosaic(width, height);
   if (!m_rgb) {
-    m_rgb = new unsigned char[width * height * 3];
+    m_rgb = new unsigned char[(size_t) width * height * 3];
   }
 
   ImageUtils::yvu2rgb(m_rgb, yuv, width, height);
@@ -2,6 +2,8 @@
 #define STITCHER_H
 
 class Mosaic;
+class FrameDescriptor;
+class FrameQueue;
 
 class Stitcher {
 public:
@@ -11,6 +13,7 @@ public:
   } StripType;
 
   typedef enum {
+    Dropped = -4,
     LowTexture = -3,
     Cancelled = -2,
     Error = -1,
@@ -24,6 +27,27 @@ public:
   virtual ~Stitcher();
 
   Return addFrame(unsigned char * data);
+  // Adds a frame laid out as described, without copying it
+  Return addFrame(const FrameDescriptor& frame);
+
+  // Called on the alignment thread once a submitted frame has been aligned,
+  // with what addFrame() would have returned and the TRS of the frame.
+  typedef void (*FrameCallback)(void *user, unsigned char *data, Return ret,
+				const float trs[3][3]);
+
+  // Queues a frame for alignment on a worker thread, in submission order.
+  // Returns Ok once queued, or Dropped if the queue was full while the camera
+  // was still. Otherwise waits for room when the queue is full.
+  Return submitFrame(unsigned char *data);
+  void setFrameCallback(FrameCallback callback, void *user = 0);
+  // Number of frames waiting for alignment before submitFrame() drops or
+  // waits. Only used before the first submitFrame().
+  void setQueueSize(int frames);
+  // Waits for all the submitted frames to be aligned.
+  void flush();
+
+  // Number of threads used for blending. 0 uses one thread per CPU.
+  void setThreads(int threads);
 
   Return stitch();
   void cancel();
@@ -32,7 +56,13 @@ public:
   const unsigned char *image(int& width, int& height);
 
 private:
+  static bool alignFrame(void *arg, unsigned char *data);
+
   Mosaic *m_mosaic;
+  FrameQueue *m_queue;
+  int m_queueSize;
+  FrameCallback m_callback;
+  void *m_user;
   float m_progress;
   bool m_cancel;
   unsigned char *m_rgb;
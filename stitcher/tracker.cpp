@@ -1,14 +1,24 @@
 #include "tracker.h"
+#include "framequeue.h"
 #include "mosaic/AlignFeatures.h"
 #include <iostream>
 
 Tracker::Tracker(int maxFrames) :
-  m_aligner(0) {
+  m_aligner(0),
+  m_queue(0),
+  m_queueSize(4),
+  m_callback(0),
+  m_user(0) {
 
   m_frames.reserve(maxFrames);
 }
 
 Tracker::~Tracker() {
+  if (m_queue) {
+    delete m_queue;
+    m_queue = 0;
+  }
+
   if (m_aligner) {
     delete m_aligner;
     m_aligner = 0;
@@ -37,6 +47,12 @@ bool Tracker::initialize(int width, int height, float stillCameraTranslationThre
 }
 
 Tracker::Return Tracker::addFrame(unsigned char *frame, float *xTranslation, float *yTranslation) {
+  flush();
+
+  return align(frame, xTranslation, yTranslation);
+}
+
+Tracker::Return Tracker::align(unsigned char *frame, float *xTranslation, float *yTranslation) {
   Tracker::Return ret = (Tracker::Return) m_aligner->addFrame(frame);
   if (ret >= 0) {
     m_frames.push_back(frame);
@@ -59,6 +75,43 @@ Tracker::Return Tracker::addFrame(unsigned char *frame, float *xTranslation, flo
   return ret;
 }
 
+bool Tracker::alignFrame(void *arg, unsigned char *frame) {
+  Tracker *t = static_cast<Tracker *>(arg);
+  float xTranslation, yTranslation;
+  Return ret = t->align(frame, &xTranslation, &yTranslation);
+
+  if (t->m_callback) {
+    t->m_callback(t->m_user, frame, ret, xTranslation, yTranslation);
+  }
+
+  return t->m_aligner->isStill();
+}
+
+Tracker::Return Tracker::submitFrame(unsigned char *frame) {
+  if (!m_queue) {
+    m_queue = new FrameQueue(alignFrame, this, m_queueSize);
+  }
+
+  return m_queue->push(frame) ? Ok : Dropped;
+}
+
+void Tracker::setFrameCallback(FrameCallback callback, void *user) {
+  flush();
+
+  m_callback = callback;
+  m_user = user;
+}
+
+void Tracker::setQueueSize(int frames) {
+  m_queueSize = frames;
+}
+
+void Tracker::flush() {
+  if (m_queue) {
+    m_queue->flush();
+  }
+}
+
 bool Tracker::isInitialized() const {
   return m_aligner != 0;
 }
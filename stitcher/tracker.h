@@ -4,10 +4,12 @@
 #include <vector>
 
 class Align;
+class FrameQueue;
 
 class Tracker {
 public:
   typedef enum {
+    Dropped = -3,
     LowTexture = -2,
     Error = -1,
     Ok = 0,
@@ -21,9 +23,32 @@ public:
   bool initialize(int width, int height, float stillCameraTranslationThreshold = 5.0f);
   Return addFrame(unsigned char *frame, float *xTranslation = 0, float *yTranslation = 0);
 
+  // Called on the alignment thread once a submitted frame has been aligned,
+  // with what addFrame() would have returned and the translations.
+  typedef void (*FrameCallback)(void *user, unsigned char *frame, Return ret,
+				float xTranslation, float yTranslation);
+
+  // Queues a frame for alignment on a worker thread, in submission order.
+  // Returns Ok once queued, or Dropped if the queue was full while the camera
+  // was still. Otherwise waits for room when the queue is full.
+  Return submitFrame(unsigned char *frame);
+  void setFrameCallback(FrameCallback callback, void *user = 0);
+  // Number of frames waiting for alignment before submitFrame() drops or
+  // waits. Only used before the first submitFrame().
+  void setQueueSize(int frames);
+  // Waits for all the submitted frames to be aligned.
+  void flush();
+
 private:
+  Return align(unsigned char *frame, float *xTranslation, float *yTranslation);
+  static bool alignFrame(void *arg, unsigned char *frame);
+
   Align *m_aligner;
   std::vector<unsigned char *> m_frames;
+  FrameQueue *m_queue;
+  int m_queueSize;
+  FrameCallback m_callback;
+  void *m_user;
 };
 
 #endif /* TRACKER_H */
@@ -0,0 +1,70 @@
+#include "stitchutil.h"
+#include <iostream>
+#include <stdio.h>
+#include <sys/time.h>
+#include <png.h>
+
+bool write_png(const char *out, ImageType rgb, int width, int height) {
+  FILE *fp = NULL;
+  png_structp png_ptr;
+  png_infop info_ptr;
+
+  fp = fopen(out, "w");
+  if (!fp) {
+    perror("fopen");
+    return false;
+  }
+
+  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png_ptr) {
+    std::cerr << "Could not allocate write struct" << std::endl;
+    fclose(fp);
+    return false;
+  }
+
+  info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    std::cerr << "Could not allocate info struct" << std::endl;
+    fclose(fp);
+    return false;
+  }
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    std::cerr << "Error during png creation" << std::endl;
+    fclose(fp);
+    return false;
+  }
+
+  png_init_io(png_ptr, fp);
+  png_set_IHDR(png_ptr, info_ptr, width, height,
+	       8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+	       PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+  png_write_info(png_ptr, info_ptr);
+
+  for (int x = 0; x < height; x++) {
+    png_write_row(png_ptr, &rgb[(size_t) width * x * 3]);
+  }
+
+  png_write_end(png_ptr, NULL);
+  fclose(fp);
+
+  png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
+  png_destroy_write_struct(&png_ptr, NULL);
+
+  return true;
+}
+
+uint64_t timeNow() {
+  struct timeval tv;
+
+  if (gettimeofday(&tv, NULL) == -1) {
+    return -1;
+  }
+
+  uint64_t ret = tv.tv_usec;
+  ret /= 1000;
+  ret += (tv.tv_sec * 1000);
+
+  return ret;
+}
@@ -0,0 +1,15 @@
+#ifndef STITCH_UTIL_H
+#define STITCH_UTIL_H
+
+#include <stdint.h>
+#include "mosaic/ImageUtils.h"
+
+// Helpers shared by the stitch and stitch-batch tools.
+
+// Writes a packed 8-bit RGB image to out as a PNG.
+bool write_png(const char *out, ImageType rgb, int width, int height);
+
+// Wall clock time, in milliseconds.
+uint64_t timeNow();
+
+#endif /* STITCH_UTIL_H */